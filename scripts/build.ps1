@@ -1 +1 @@
-g++ -O2 -std=c++17 -municode src/DirPie4.cpp -o DirPie.exe -mwindows -lcomctl32 -lole32 -luxtheme -lgdi32 -lgdiplus -luser32 -lshell32 -luuid
\ No newline at end of file
+g++ -O2 -std=c++17 -municode src/DirPie4.cpp -o DirPie.exe -mwindows -lcomctl32 -lole32 -luxtheme -lgdi32 -lgdiplus -luser32 -lshell32 -luuid -lws2_32 -lpsapi
\ No newline at end of file
@@ -0,0 +1,19 @@
+# Builds and runs the unit tests with the SSE2 scanners, with the scalar fallbacks, and with
+# the heap allocation counter. The SSE2 build runs a second time on the path-based walker
+# (DIRPIE_WALK=find).
+$libs = "-lcomctl32 -lole32 -luxtheme -lgdi32 -lgdiplus -luser32 -lshell32 -luuid -lws2_32 -lpsapi".Split(" ")
+foreach ($variant in @("", "-DDIRPIE_NO_SSE2", "-DDIRPIE_ALLOC_STATS")) {
+  $flags = @("-O2", "-std=c++17", "-municode")
+  if ($variant) { $flags += $variant }
+  g++ @flags tests/DirPie4_tests.cpp -o DirPie4_tests.exe @libs
+  if ($LASTEXITCODE -ne 0) { exit $LASTEXITCODE }
+  ./DirPie4_tests.exe
+  if ($LASTEXITCODE -ne 0) { exit $LASTEXITCODE }
+  if (-not $variant) {
+    $env:DIRPIE_WALK = "find"
+    ./DirPie4_tests.exe
+    $code = $LASTEXITCODE
+    Remove-Item Env:DIRPIE_WALK
+    if ($code -ne 0) { exit $code }
+  }
+}
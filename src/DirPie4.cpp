@@ -9,44 +9,75 @@
 #define _UNICODE
 #endif
 
+#include <winsock2.h>
 #include <windows.h>
 #include <windowsx.h>
 #include <commctrl.h>
 #include <shellapi.h>
 #include <shobjidl.h>
 #include <uxtheme.h>
+#include <winternl.h>
+#include <psapi.h>
+#include <afunix.h>
 #include <gdiplus.h>
 
 #include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include <condition_variable>
 #include <cstdint>
+#include <cwctype>
 #include <deque>
+#include <memory>
 #include <mutex>
+#include <new>
+#include <random>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
+// DIRPIE_NO_SSE2 builds the scalar fallbacks only (the tests build both ways).
+#if !defined(DIRPIE_NO_SSE2) && (defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64))
+#include <emmintrin.h>
+#define DIRPIE_SSE2 1
+#endif
 
 using std::wstring;
 
 static const wchar_t* kAppClass = L"DirPie4Main";
 static const wchar_t* kPieClass = L"DirPie4Pie";
 static const UINT WM_APP_REFRESH = WM_APP + 1;
+static const UINT WM_APP_INDEX_CHANGED = WM_APP + 2;
+static const UINT WM_APP_LISTING = WM_APP + 3;
+static const UINT_PTR REFRESH_TIMER_ID = 1;
 
 static HINSTANCE g_hInst = nullptr;
-static HWND g_hwndMain = nullptr;
-static HWND g_hwndList = nullptr;
-static HWND g_hwndPie = nullptr;
-static HWND g_hwndEdit = nullptr;
-static HWND g_hwndUp = nullptr;
-static HWND g_hwndStatus = nullptr;
 
 static const int IDM_OPEN_FOLDER = 2001;
 static const int IDM_NEW_WINDOW_BLANK = 2002;
 static const int IDM_NEW_WINDOW_PICK = 2003;
 static const int IDM_EXIT_APP = 2004;
+static const int IDM_SAVE_SNAPSHOT = 2005;
+static const int IDM_COMPARE_SNAPSHOT = 2006;
+static const int IDM_OPEN_SNAPSHOT = 2007;
+static const int IDM_IMPORT_LISTING = 2008;
+static const int IDM_NAV_BACK = 2009;
+static const int IDM_NAV_FORWARD = 2010;
+
+static const int IDM_PIE_BY_SIZE = 2101;
+static const int IDM_PIE_BY_COLD = 2102;
+static const int IDM_PIE_BY_FILES = 2103;
+static const int IDM_PIE_BY_ALLOCATED = 2104;
+static const int IDM_COLD_30D = 2111;
+static const int IDM_COLD_90D = 2112;
+static const int IDM_COLD_365D = 2113;
+static const int IDM_AGE_BY_MODIFIED = 2121;
+static const int IDM_AGE_BY_ACCESSED = 2122;
 
 static std::wstring PickFolder(HWND owner) {
   std::wstring out;
@@ -76,54 +107,186 @@ static std::wstring PickFolder(HWND owner) {
   return out;
 }
 
-static void LaunchNewInstance(const std::wstring& folderOrEmpty) {
-  wchar_t exePath[MAX_PATH]{};
-  GetModuleFileNameW(nullptr, exePath, MAX_PATH);
+static std::vector<std::wstring> PickFolders(HWND owner) {
+  std::vector<std::wstring> out;
+  IFileOpenDialog* pfd = nullptr;
+  HRESULT hr = CoCreateInstance(CLSID_FileOpenDialog, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&pfd));
+  if (FAILED(hr) || !pfd) return out;
 
-  std::wstring cmd = L"\"";
-  cmd += exePath;
-  cmd += L"\"";
-  if (!folderOrEmpty.empty()) {
-    cmd += L" \"";
-    cmd += folderOrEmpty;
-    cmd += L"\"";
+  DWORD opts = 0;
+  if (SUCCEEDED(pfd->GetOptions(&opts))) {
+    pfd->SetOptions(opts | FOS_PICKFOLDERS | FOS_FORCEFILESYSTEM | FOS_PATHMUSTEXIST | FOS_ALLOWMULTISELECT);
   }
+  pfd->SetTitle(L"Select Folders");
 
-  STARTUPINFOW si{};
-  si.cb = sizeof(si);
-  PROCESS_INFORMATION pi{};
-  std::wstring cmdMutable = cmd;
-  if (CreateProcessW(nullptr, cmdMutable.data(), nullptr, nullptr, FALSE, 0, nullptr, nullptr, &si, &pi)) {
-    CloseHandle(pi.hThread);
-    CloseHandle(pi.hProcess);
-    return;
+  hr = pfd->Show(owner);
+  if (SUCCEEDED(hr)) {
+    IShellItemArray* items = nullptr;
+    if (SUCCEEDED(pfd->GetResults(&items)) && items) {
+      DWORD count = 0;
+      items->GetCount(&count);
+      for (DWORD i = 0; i < count; ++i) {
+        IShellItem* psi = nullptr;
+        if (FAILED(items->GetItemAt(i, &psi)) || !psi) continue;
+        PWSTR psz = nullptr;
+        if (SUCCEEDED(psi->GetDisplayName(SIGDN_FILESYSPATH, &psz)) && psz) {
+          out.push_back(psz);
+          CoTaskMemFree(psz);
+        }
+        psi->Release();
+      }
+      items->Release();
+    }
+  }
+  pfd->Release();
+  return out;
+}
+
+static std::wstring PickFile(HWND owner, bool save, const wchar_t* title, const COMDLG_FILTERSPEC* types,
+                             UINT typeCount, const wchar_t* defaultExt) {
+  std::wstring out;
+  IFileDialog* pfd = nullptr;
+  HRESULT hr = CoCreateInstance(save ? CLSID_FileSaveDialog : CLSID_FileOpenDialog, nullptr, CLSCTX_INPROC_SERVER,
+                                IID_PPV_ARGS(&pfd));
+  if (FAILED(hr) || !pfd) return out;
+
+  DWORD opts = 0;
+  if (SUCCEEDED(pfd->GetOptions(&opts))) {
+    pfd->SetOptions(opts | FOS_FORCEFILESYSTEM | (save ? FOS_OVERWRITEPROMPT : FOS_FILEMUSTEXIST));
+  }
+  pfd->SetFileTypes(typeCount, types);
+  if (defaultExt) pfd->SetDefaultExtension(defaultExt);
+  pfd->SetTitle(title);
+
+  hr = pfd->Show(owner);
+  if (SUCCEEDED(hr)) {
+    IShellItem* psi = nullptr;
+    if (SUCCEEDED(pfd->GetResult(&psi)) && psi) {
+      PWSTR psz = nullptr;
+      if (SUCCEEDED(psi->GetDisplayName(SIGDN_FILESYSPATH, &psz)) && psz) {
+        out = psz;
+        CoTaskMemFree(psz);
+      }
+      psi->Release();
+    }
   }
-  ShellExecuteW(nullptr, L"open", exePath, folderOrEmpty.empty() ? nullptr : folderOrEmpty.c_str(), nullptr, SW_SHOWNORMAL);
+  pfd->Release();
+  return out;
+}
+
+static std::wstring PickSnapshotFile(HWND owner, bool save, const wchar_t* title) {
+  const COMDLG_FILTERSPEC types[] = {{L"DirPie Snapshot (*.dps)", L"*.dps"}, {L"All Files (*.*)", L"*.*"}};
+  return PickFile(owner, save, title, types, 2, L"dps");
+}
+
+#ifdef DIRPIE_ALLOC_STATS
+// Build with -DDIRPIE_ALLOC_STATS to count heap allocations; --scan reports them.
+static std::atomic<uint64_t> g_allocCalls{0};
+static std::atomic<uint64_t> g_allocBytes{0};
+
+void* operator new(size_t n) {
+  g_allocCalls.fetch_add(1, std::memory_order_relaxed);
+  g_allocBytes.fetch_add(n, std::memory_order_relaxed);
+  if (void* p = std::malloc(n ? n : 1)) return p;
+  throw std::bad_alloc();
 }
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+#endif
 
 static ULONG_PTR g_gdiplusToken = 0;
 
-static std::atomic<uint64_t> g_generation{1};
 static std::atomic<bool> g_quit{false};
 
 static const uint64_t CAP_BYTES = 5ULL * 1024 * 1024 * 1024;
+// Memory budget for the process (DIRPIE_MEMORY_MB; unset = unlimited). Cached trees
+// may use what the rest of the resident set leaves of it. Above SPILL_AT of that,
+// trees outside the current view go to the spill segment until use is back under
+// SPILL_TO, and subtrees smaller than the collapse threshold are kept
+// as a single aggregate node. The threshold starts at COLLAPSE_MIN_BYTES once a
+// spill pass fails to get back under SPILL_TO, grows 4x when a later failing pass
+// finds another COLLAPSE_RAISE_STEP of the budget in use, and falls 4x per
+// COLLAPSE_DECAY_MS while use stays below half of SPILL_TO.
+static const double SPILL_AT = 0.8;
+static const double SPILL_TO = 0.6;
+static const double COLLAPSE_RAISE_STEP = 0.125;
+static const uint64_t COLLAPSE_MIN_BYTES = 1ULL << 20;
+static const uint64_t COLLAPSE_MAX_BYTES = 1ULL << 40;
+static const uint64_t COLLAPSE_DECAY_MS = 10ULL * 1000;
 static const uint64_t REFRESH_INTERVAL_MS = 30ULL * 1000;
-static const int WORKER_COUNT = 2;
+static const uint64_t REFRESH_FRAME_MS = 50;  // at most one list/pie rebuild per window per frame
+// Each window keeps up to VIEW_CACHE_MAX recently shown folders (VIEW_CACHE_MAX_ENTRIES
+// entries in all) ready to redraw, and HISTORY_MAX folders each way for Back/Forward.
+static const size_t VIEW_CACHE_MAX = 16;
+static const size_t VIEW_CACHE_MAX_ENTRIES = 200000;
+static const size_t HISTORY_MAX = 64;
+// Upper bound on scan threads, which are started as queued jobs find no idle worker
+// (see EnsureWorkers). How many of them touch a given device at once is decided by
+// that device's limit, which starts at DEVICE_LIMIT_* and is then tuned from
+// measured throughput (see TuneDevices).
+static const int WORKER_COUNT = 48;
+static const int DEVICE_LIMIT_SSD = 8;
+static const int DEVICE_LIMIT_HDD = 2;
+static const int DEVICE_LIMIT_NETWORK = 8;
+static const int DEVICE_LIMIT_UNKNOWN = 2;
+// Concurrency tuner: sampling period, the relative throughput change that counts as
+// better/worse, the latency growth that counts as queueing in the device, and how
+// many flat samples pass before probing one step up again.
+static const uint64_t TUNE_INTERVAL_MS = 500;
+static const double TUNE_GAIN = 0.05;
+static const double TUNE_LATENCY_RATIO = 1.5;
+static const int TUNE_PROBE_EVERY = 6;
 
 struct WalkStats {
   uint32_t skipped_access = 0;
   uint32_t skipped_path = 0;
   uint32_t skipped_other = 0;
   uint32_t skipped_reparse = 0;
+  uint32_t skipped_loop = 0;      // followed links whose target the walk already covers
+  uint32_t skipped_excluded = 0;  // directories pruned by exclusion rules; not an error
+  uint32_t skipped_stalled = 0;   // directories whose reads hung past DIR_STALL_MS
+  uint32_t dup_links = 0;         // further names of hard-linked files; on disk once
+  uint32_t followed = 0;          // directory links walked into (DIRPIE_FOLLOW)
   bool incomplete = false;
   bool reached_cap = false;
 };
 
+// File age buckets by days since last modified/accessed: <30, 30-90, 90-365, >=365.
+static const int AGE_BUCKETS = 4;
+static const uint64_t AGE_BUCKET_DAYS[AGE_BUCKETS - 1] = {30, 90, 365};
+static const uint64_t FILETIME_TICKS_PER_DAY = 24ULL * 60 * 60 * 10000000;
+
+struct AgeHistogram {
+  uint64_t bytes[AGE_BUCKETS] = {};
+  uint32_t files[AGE_BUCKETS] = {};
+};
+
+struct AgeStats {
+  AgeHistogram modified{};
+  AgeHistogram accessed{};
+};
+
+// Log2 file-size buckets: [0] holds empty files, [k] holds sizes in [2^(k-1), 2^k).
+// The last bucket absorbs everything from 2^(SIZE_BUCKETS-2) bytes (1 TB) up.
+static const int SIZE_BUCKETS = 42;
+
+struct ContentStats {
+  uint64_t files = 0;
+  uint64_t dirs = 0;
+  uint64_t allocated = 0;   // on-disk bytes
+  bool physical = false;    // allocated was measured by a walk (not an estimate or the index)
+  uint32_t sizeLog2[SIZE_BUCKETS] = {};
+  AgeStats ages{};
+};
+
 struct SizeInfo {
   uint64_t bytes = 0;
   bool exact = false;
   bool incomplete = false;
+  bool estimate = false;   // extrapolated from a sample; a walk follows
+  uint64_t margin = 0;     // estimate only: half-width of the 95% interval on bytes
   WalkStats stats{};
+  ContentStats content{};
   uint64_t tick = 0;
 };
 
@@ -134,29 +297,191 @@ struct Entry {
   bool has_value = false;
   bool exact = false;
   bool incomplete = false;
+  bool estimate = false;
+  uint64_t margin = 0;
   WalkStats stats{};
+  ContentStats content{};
+  int64_t delta = 0;   // diff view only; bytes holds |delta|
+  uint32_t snapNode = 0;  // snapshot browse view only
+};
+
+// Per-directory record of a finished walk. Nodes are appended as directories are
+// discovered, so a parent always precedes its children and a single reverse pass
+// turns per-directory counts into subtree totals.
+struct TreeNode {
+  uint32_t parent = 0;       // the root points at itself
+  uint32_t nameOff = 0;      // into ScanTree::names
+  uint32_t nameLen = 0;
+  uint16_t depth = 0;
+  uint16_t flags = 0;        // TREE_NODE_*
+  uint64_t bytes = 0;
+  uint64_t files = 0;
+  uint64_t dirs = 0;
+  uint64_t newestWrite = 0;  // FILETIME of the newest file in the subtree
+};
+
+// The node stands for its whole subtree; its descendants were folded into it.
+static const uint16_t TREE_NODE_COLLAPSED = 1;
+
+struct ScanTree {
+  wstring rootPath;
+  std::vector<TreeNode> nodes;
+  std::vector<wchar_t> names;
 };
 
+enum class PieMetric { Bytes, ColdBytes, Files, Allocated };
+
 static std::mutex g_mu;
 static std::unordered_map<wstring, SizeInfo> g_cache;
-static std::vector<Entry> g_entries;
+static std::unordered_map<wstring, std::shared_ptr<const ScanTree>> g_trees;  // by job path
+static uint64_t g_treesVersion = 0;
+static uint64_t g_treeBytes = 0;                    // memory held by g_trees
+static std::atomic<uint64_t> g_collapseBelow{0};    // 0 = never collapse
+static uint64_t g_collapseRaisedAt = 0;             // g_treeBytes at the last raise; guarded by g_mu
+static uint64_t g_collapseTick = 0;                 // when the threshold last moved; guarded by g_mu
+static wstring g_hotDir;                            // not spilled; guarded by g_mu
+
+// A tree paged out to the spill segment.
+struct SpillRef {
+  uint64_t offset = 0;
+  uint64_t rootLen = 0;
+  uint64_t nodes = 0;
+  uint64_t names = 0;
+};
+static std::unordered_map<wstring, SpillRef> g_spilled;  // by job path; guarded by g_mu
+// Spill passes and page-ins take g_spillIoMu for their whole run and g_mu only to
+// pick trees and to swap them in or out, never across the file I/O.
+static std::mutex g_spillIoMu;
+static HANDLE g_spillFile = INVALID_HANDLE_VALUE;  // guarded by g_spillIoMu
+static uint64_t g_spillEnd = 0;                     // guarded by g_spillIoMu
+
+// What a view's list and pie currently show: the children of currentDir, the scan
+// roots of a multi-root session, the results of a query run below currentDir, the
+// ranked changes against a snapshot, or a folder inside a loaded snapshot.
+enum class ViewMode { Directory, Roots, Query, Diff, Snapshot };
+
+// A queued or running walk and the number of views waiting for it. A view asking
+// for a path already in flight joins the walk; it is abandoned only once the last
+// of its views has navigated away.
+struct JobTicket {
+  wstring path;
+  std::atomic<int> refs{0};           // changed under g_jobMu
+  std::atomic<bool> cancelled{false};
+  std::atomic<bool> done{false};
+  std::atomic<bool> speculative{false};  // queued by prefetch; no view has asked for it yet
+};
+
+// A folder listing the lister thread streams into a view. Children arrive in batches
+// in pending; the view takes each batch and queues size jobs for it.
+struct Listing {
+  wstring dir;
+  HWND hwnd = nullptr;                // the view to notify
+  int device = 0;                     // device the children's walks are queued on
+  std::atomic<bool> cancelled{false};
+  std::atomic<bool> posted{false};    // a WM_APP_LISTING is already queued
+  std::vector<Entry> pending;         // guarded by g_mu, like done and error
+  bool done = false;
+  DWORD error = 0;                    // the folder could not be opened
+  bool replace = false;               // revalidating a restored view: taken whole, once done
+};
+
+struct Snapshot;
+struct PieFrame;
+
+// Formatted list columns of one entry; the name column is the entry's name.
+struct ListRow { wstring size, pct, files, dirs, cold; };
+
+// A folder view as it was last shown, so going Back, Forward or Up to it paints at once.
+struct CachedView {
+  wstring dir;
+  std::vector<Entry> entries;  // in display order
+  std::vector<ListRow> rows;
+  std::shared_ptr<const PieFrame> frame;
+  wstring status;
+  uint64_t version = 0;        // g_cacheVersion the rows were built from
+  PieMetric pieMetric = PieMetric::Bytes;
+  int coldBucket = 0;
+  bool coldByAccess = false;
+};
 
-static wstring g_currentDir = L"C:\\";
-static int g_hoverIndex = -1;
+// Per-window state. All windows share the workers, g_cache and g_trees.
+struct View {
+  HWND hwndMain = nullptr;
+  HWND hwndList = nullptr;
+  HWND hwndPie = nullptr;
+  HWND hwndEdit = nullptr;
+  HWND hwndUp = nullptr;
+  HWND hwndStatus = nullptr;
+
+  std::vector<Entry> entries;
+  wstring currentDir = L"C:\\";
+  ViewMode mode = ViewMode::Directory;
+  wstring queryText;
+  wstring diffLabel;
+  std::vector<wstring> roots;   // more than one entry: a multi-root session
+  int hoverIndex = -1;
+
+  std::shared_ptr<const Snapshot> browse;  // snapshot browse view: the loaded snapshot
+  std::vector<uint32_t> browsePath;        // and the chain of nodes from its root
+
+  PieMetric pieMetric = PieMetric::Bytes;
+  int coldBucket = 2;          // first AGE_BUCKETS index counted as "cold" (90 days)
+  bool coldByAccess = false;   // age basis: last write (default) or last access
+
+  std::shared_ptr<Listing> listing;                 // currentDir's children still streaming in
+  bool prefetched = false;                          // prefetch ran for prefetchedFor
+  wstring prefetchedFor;
+  std::vector<std::shared_ptr<JobTicket>> tickets;  // walks the current listing waits for
+  std::vector<wstring> remoteWatched;               // entries sized by the index service
+  std::unordered_set<wstring> remoteWaiting;        // ...still without a final size; guarded by g_mu
+
+  std::shared_ptr<const PieFrame> frame;   // what the pie draws; replaced whole via std::atomic_store
+  std::vector<ListRow> rows;               // formatted columns of entries, as last shown
+  wstring statusLine;                      // status text of the last rebuild
+  std::vector<CachedView> recent;          // most recent first
+  std::vector<wstring> backDirs;           // navigation history, most recent last
+  std::vector<wstring> forwardDirs;
+  std::atomic<bool> refreshPosted{false};  // a WM_APP_REFRESH is already queued
+  bool refreshTimer = false;               // ...or a rebuild is waiting for the next frame slot
+  uint64_t shownVersion = 0;               // g_cacheVersion the list was last built from
+  uint64_t lastRefresh = 0;
+};
+
+static std::vector<std::unique_ptr<View>> g_views;  // guarded by g_mu
+
+static View* ViewFromWindow(HWND hwnd) {
+  return hwnd ? (View*)GetWindowLongPtrW(hwnd, GWLP_USERDATA) : nullptr;
+}
 
+// Engine-wide job counters (all windows, the CLI and the index service).
 static std::atomic<uint32_t> g_jobs_total{0};
 static std::atomic<uint32_t> g_jobs_done{0};
 static std::atomic<uint32_t> g_jobs_active{0};
 static std::atomic<uint32_t> g_jobs_queued{0};
-static std::atomic<uint32_t> g_jobs_exact_total{0};
-static std::atomic<uint32_t> g_jobs_exact_done{0};
-
-// Progress is tracked per "epoch" to avoid counter corruption when a new scan starts
-// while worker threads are still finishing old jobs.
-static std::atomic<uint64_t> g_progressEpoch{1};
 
 static uint64_t NowTick() { return GetTickCount64(); }
 
+static uint64_t NowMicros() {
+  static const uint64_t freq = [] {
+    LARGE_INTEGER f{};
+    QueryPerformanceFrequency(&f);
+    return f.QuadPart > 0 ? (uint64_t)f.QuadPart : 1;
+  }();
+  LARGE_INTEGER c{};
+  QueryPerformanceCounter(&c);
+  return (uint64_t)c.QuadPart / freq * 1000000 + (uint64_t)c.QuadPart % freq * 1000000 / freq;
+}
+
+// Reads a DIRPIE_* knob; unset reads as empty.
+static wstring EnvString(const wchar_t* name) {
+  const DWORD need = GetEnvironmentVariableW(name, nullptr, 0);
+  if (need == 0) return wstring();
+  wstring v((size_t)need, L'\0');
+  const DWORD n = GetEnvironmentVariableW(name, &v[0], need);
+  v.resize(n < need ? n : 0);
+  return v;
+}
+
 static bool IsDots(const wchar_t* n) {
   return (n[0] == L'.' && n[1] == 0) || (n[0] == L'.' && n[1] == L'.' && n[2] == 0);
 }
@@ -215,378 +540,5045 @@ static wstring FormatBytes(uint64_t b) {
   return buf;
 }
 
-static void SetStatusText(const wstring& s) {
-  if (!g_hwndStatus) return;
-  SendMessageW(g_hwndStatus, SB_SETTEXTW, 0, (LPARAM)s.c_str());
+static uint64_t FileTimeToU64(const FILETIME& ft) {
+  return ((uint64_t)ft.dwHighDateTime << 32) | (uint64_t)ft.dwLowDateTime;
 }
 
-static void AddSkipFromError(DWORD err, WalkStats& st) {
-  st.incomplete = true;
-  if (err == ERROR_ACCESS_DENIED) st.skipped_access++;
-  else if (err == ERROR_FILENAME_EXCED_RANGE || err == ERROR_BUFFER_OVERFLOW ||
-           err == ERROR_PATH_NOT_FOUND || err == ERROR_BAD_PATHNAME) st.skipped_path++;
-  else st.skipped_other++;
+// Bucket boundaries as absolute FILETIME values, computed once per walk so the
+// per-file cost is a few integer compares.
+struct AgeEdges {
+  uint64_t olderThan[AGE_BUCKETS - 1] = {};
+};
+
+static AgeEdges MakeAgeEdges() {
+  FILETIME ft{};
+  GetSystemTimeAsFileTime(&ft);
+  const uint64_t now = FileTimeToU64(ft);
+
+  AgeEdges e{};
+  for (int i = 0; i < AGE_BUCKETS - 1; ++i) {
+    const uint64_t span = AGE_BUCKET_DAYS[i] * FILETIME_TICKS_PER_DAY;
+    e.olderThan[i] = (now > span) ? now - span : 0;
+  }
+  return e;
 }
 
-static uint64_t WalkDirLogicalSize(const wstring& rootAbs,
-                                  uint64_t capBytes,
-                                  uint64_t gen,
-                                  WalkStats& st) {
-  uint64_t total = 0;
+static int AgeBucket(const AgeEdges& e, uint64_t t) {
+  int b = 0;
+  while (b < AGE_BUCKETS - 1 && t < e.olderThan[b]) ++b;
+  return b;
+}
 
-  std::vector<wstring> stack;
-  stack.reserve(256);
-  stack.push_back(TrimTrailingSlash(rootAbs));
+static void AddFileAge(const AgeEdges& e, uint64_t writeTime, uint64_t accessTime, uint64_t sz, AgeStats& ages) {
+  const int bm = AgeBucket(e, writeTime);
+  const int ba = AgeBucket(e, accessTime);
+  ages.modified.bytes[bm] += sz;
+  ages.modified.files[bm]++;
+  ages.accessed.bytes[ba] += sz;
+  ages.accessed.files[ba]++;
+}
 
-  while (!stack.empty()) {
-    if (g_quit.load() || g_generation.load() != gen) return total;
+static int SizeBucket(uint64_t sz) {
+  if (sz == 0) return 0;
+#if defined(_MSC_VER)
+  unsigned long hi = 0;
+  _BitScanReverse64(&hi, sz);
+  const int b = (int)hi + 1;
+#else
+  const int b = 64 - __builtin_clzll(sz);
+#endif
+  return b < SIZE_BUCKETS ? b : SIZE_BUCKETS - 1;
+}
 
-    const wstring dir = stack.back();
-    stack.pop_back();
+static void AddFileSize(uint64_t sz, ContentStats& cs) {
+  cs.files++;
+  cs.sizeLog2[SizeBucket(sz)]++;
+}
 
-    const wstring pattern = EnsureBackslash(dir) + L"*";
-    const wstring patternLong = ToLongPath(pattern);
-
-    WIN32_FIND_DATAW fdat{};
-    HANDLE h = FindFirstFileExW(patternLong.c_str(),
-                               FindExInfoBasic,
-                               &fdat,
-                               FindExSearchNameMatch,
-                               nullptr,
-                               FIND_FIRST_EX_LARGE_FETCH);
-    if (h == INVALID_HANDLE_VALUE) {
-      AddSkipFromError(GetLastError(), st);
-      continue;
-    }
+static void AddContent(ContentStats& dst, const ContentStats& src) {
+  dst.files += src.files;
+  dst.dirs += src.dirs;
+  dst.allocated += src.allocated;
+  dst.physical = dst.physical || src.physical;
+  for (int i = 0; i < SIZE_BUCKETS; ++i) dst.sizeLog2[i] += src.sizeLog2[i];
+  for (int i = 0; i < AGE_BUCKETS; ++i) {
+    dst.ages.modified.bytes[i] += src.ages.modified.bytes[i];
+    dst.ages.modified.files[i] += src.ages.modified.files[i];
+    dst.ages.accessed.bytes[i] += src.ages.accessed.bytes[i];
+    dst.ages.accessed.files[i] += src.ages.accessed.files[i];
+  }
+}
 
-    for (;;) {
-      if (g_quit.load() || g_generation.load() != gen) { FindClose(h); return total; }
-
-      const wchar_t* name = fdat.cFileName;
-      if (!IsDots(name)) {
-        const bool isDir = (fdat.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
-        const bool isReparse = (fdat.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0;
-
-        if (isDir) {
-          if (isReparse) {
-            st.incomplete = true;
-            st.skipped_reparse++;
-          } else {
-            stack.push_back(JoinPath(dir, name));
-          }
-        } else {
-          const uint64_t sz = ((uint64_t)fdat.nFileSizeHigh << 32) | (uint64_t)fdat.nFileSizeLow;
-          total += sz;
+static uint64_t ColdBytes(const View& v, const AgeStats& a) {
+  const AgeHistogram& h = v.coldByAccess ? a.accessed : a.modified;
+  uint64_t cold = 0;
+  for (int i = v.coldBucket; i < AGE_BUCKETS; ++i) cold += h.bytes[i];
+  return cold;
+}
 
-          if (capBytes > 0 && total >= capBytes) {
-            st.reached_cap = true;
-            FindClose(h);
-            return total;
-          }
-        }
-      }
+static uint64_t PieValue(const View& v, const Entry& e) {
+  if (v.mode == ViewMode::Diff) return e.bytes;
+  switch (v.pieMetric) {
+    case PieMetric::ColdBytes: return ColdBytes(v, e.content.ages);
+    case PieMetric::Files: return e.content.files;
+    case PieMetric::Allocated: return e.content.physical ? e.content.allocated : e.bytes;
+    case PieMetric::Bytes: break;
+  }
+  return e.bytes;
+}
 
-      if (!FindNextFileW(h, &fdat)) {
-        const DWORD ec = GetLastError();
-        if (ec != ERROR_NO_MORE_FILES) AddSkipFromError(ec, st);
-        break;
-      }
-    }
-    FindClose(h);
+static wstring FormatCount(uint64_t n) {
+  wchar_t buf[64];
+  if (n < 10000) swprintf(buf, 64, L"%llu", (unsigned long long)n);
+  else if (n < 10000000) swprintf(buf, 64, L"%.1fK", (double)n / 1000.0);
+  else swprintf(buf, 64, L"%.1fM", (double)n / 1000000.0);
+  return buf;
+}
+
+// One-line summary of the log2 size histogram, folded into 1024x ranges.
+static wstring SizeHistogramText(const ContentStats& cs) {
+  static const wchar_t* ranges[] = {L"<1K", L"<1M", L"<1G", L"<1T", L">=1T"};
+  uint64_t folded[5] = {};
+  for (int i = 0; i < SIZE_BUCKETS; ++i) {
+    int r = (i <= 10) ? 0 : (i - 1) / 10;
+    if (r > 4) r = 4;
+    folded[r] += cs.sizeLog2[i];
   }
 
-  return total;
+  wstring out = L"files " + FormatCount(cs.files) + L"  dirs " + FormatCount(cs.dirs) + L"  |";
+  for (int r = 0; r < 5; ++r) {
+    if (folded[r] == 0) continue;
+    out += L"  ";
+    out += ranges[r];
+    out += L":";
+    out += FormatCount(folded[r]);
+  }
+  return out;
 }
 
-enum class JobKind { Capped, Exact };
+static wstring ColdLabel(const View& v) {
+  wchar_t buf[64];
+  swprintf(buf, 64, L"cold>%llud %s",
+           (unsigned long long)AGE_BUCKET_DAYS[v.coldBucket - 1],
+           v.coldByAccess ? L"accessed" : L"modified");
+  return buf;
+}
 
-struct Job {
-  uint64_t gen = 0;
-  uint64_t epoch = 0;
-  wstring path;
-  JobKind kind = JobKind::Capped;
-};
+static void SetStatusText(View& v, const wstring& s) {
+  if (!v.hwndStatus) return;
+  SendMessageW(v.hwndStatus, SB_SETTEXTW, 0, (LPARAM)s.c_str());
+}
 
-static std::mutex g_jobMu;
-static std::condition_variable g_jobCv;
-static std::deque<Job> g_jobs;
+static void AddSkipFromError(DWORD err, WalkStats& st) {
+  st.incomplete = true;
+  if (err == ERROR_ACCESS_DENIED) st.skipped_access++;
+  else if (err == ERROR_TIMEOUT) st.skipped_stalled++;
+  else if (err == ERROR_FILENAME_EXCED_RANGE || err == ERROR_BUFFER_OVERFLOW ||
+           err == ERROR_PATH_NOT_FOUND || err == ERROR_BAD_PATHNAME) st.skipped_path++;
+  else st.skipped_other++;
+}
 
-static bool IsFresh(const SizeInfo& si) {
-  return (NowTick() - si.tick) < REFRESH_INTERVAL_MS;
+static uint32_t AddTreeNode(ScanTree& t, uint32_t parent, const wchar_t* name, size_t len) {
+  TreeNode n{};
+  n.parent = parent;
+  n.depth = t.nodes.empty() ? 0 : t.nodes[parent].depth + 1;
+  n.nameOff = (uint32_t)t.names.size();
+  n.nameLen = (uint32_t)len;
+  t.names.insert(t.names.end(), name, name + len);
+  t.nodes.push_back(n);
+  return (uint32_t)(t.nodes.size() - 1);
 }
 
-static void ResetProgressCounters() {
-  g_jobs_total.store(0);
-  g_jobs_done.store(0);
-  g_jobs_active.store(0);
-  g_jobs_queued.store(0);
-  g_jobs_exact_total.store(0);
-  g_jobs_exact_done.store(0);
+static uint32_t AddTreeNode(ScanTree& t, uint32_t parent, const wchar_t* name) {
+  return AddTreeNode(t, parent, name, wcslen(name));
 }
 
-static void EnqueueJob(const Job& j) {
-  // Only count jobs belonging to the current epoch.
-  if (j.epoch == g_progressEpoch.load()) {
-    g_jobs_total.fetch_add(1);
-    if (j.kind == JobKind::Exact) g_jobs_exact_total.fetch_add(1);
-    g_jobs_queued.fetch_add(1);
+static uint64_t TreeBytes(const ScanTree& t) {
+  return sizeof(ScanTree) + t.rootPath.size() * sizeof(wchar_t) + t.nodes.size() * sizeof(TreeNode) +
+         t.names.size() * sizeof(wchar_t);
+}
+
+// Folds the subtree under node k into k itself. Only valid while the walk is still
+// building the tree in DFS order, when k's descendants are exactly the nodes after it.
+// Returns false (and leaves the tree alone) when the subtree holds minBytes or more.
+static bool CollapseSubtree(ScanTree& t, uint32_t k, uint64_t minBytes) {
+  if (k + 1 >= t.nodes.size()) return false;
+  uint64_t bytes = t.nodes[k].bytes;
+  for (size_t i = k + 1; i < t.nodes.size(); ++i) bytes += t.nodes[i].bytes;
+  if (bytes >= minBytes) return false;
+
+  TreeNode& n = t.nodes[k];
+  for (size_t i = k + 1; i < t.nodes.size(); ++i) {
+    const TreeNode& c = t.nodes[i];
+    n.files += c.files;
+    n.dirs += c.dirs + 1;
+    if (c.newestWrite > n.newestWrite) n.newestWrite = c.newestWrite;
   }
+  n.bytes = bytes;
+  n.flags |= TREE_NODE_COLLAPSED;
+  t.nodes.resize(k + 1);
+  t.names.resize(n.nameOff + n.nameLen);
+  return true;
+}
 
-  { std::lock_guard<std::mutex> lk(g_jobMu); g_jobs.push_back(j); }
-  g_jobCv.notify_one();
+static void AggregateTree(ScanTree& t) {
+  for (size_t i = t.nodes.size(); i-- > 1;) {
+    const TreeNode& c = t.nodes[i];
+    TreeNode& p = t.nodes[c.parent];
+    p.bytes += c.bytes;
+    p.files += c.files;
+    p.dirs += c.dirs + 1;
+    if (c.newestWrite > p.newestWrite) p.newestWrite = c.newestWrite;
+  }
 }
 
-static void ClearJobs() {
-  std::lock_guard<std::mutex> lk(g_jobMu);
-  g_jobs.clear();
+static wstring TreeNodeName(const ScanTree& t, uint32_t idx) {
+  const TreeNode& n = t.nodes[idx];
+  return wstring(t.names.data() + n.nameOff, n.nameLen);
 }
 
-static void UpdateWindowTitleProgress() {
-  if (!g_hwndMain) return;
+static wstring TreeNodePath(const ScanTree& t, uint32_t idx) {
+  std::vector<uint32_t> chain;
+  while (idx != 0) { chain.push_back(idx); idx = t.nodes[idx].parent; }
 
-  const uint32_t total = g_jobs_total.load();
-  const uint32_t done = g_jobs_done.load();
-  const uint32_t active = g_jobs_active.load();
-  const uint32_t queued = g_jobs_queued.load();
+  wstring p = t.rootPath;
+  for (size_t i = chain.size(); i-- > 0;) p = JoinPath(p, TreeNodeName(t, chain[i]));
+  return p;
+}
 
-  const uint32_t doneClamped = (total > 0 && done > total) ? total : done;
+// Live I/O counters of one device, fed by the walkers and read by the tuner.
+struct IoCounters {
+  std::atomic<uint64_t> entries{0};
+  std::atomic<uint64_t> dirReads{0};
+  std::atomic<uint64_t> readMicros{0};  // summed time spent opening and reading directories
+  std::atomic<uint64_t> follows{0};     // directory links checked before walking into them
+  std::atomic<uint64_t> followMicros{0};
+};
 
-  bool scanning = (active + queued) > 0 && total > 0 && doneClamped < total;
+// Role of the calling thread on the timeline and in the metrics; set before either
+// hears from it.
+static thread_local const char* t_threadName = "thread";
 
-  wchar_t title[256];
-  if (scanning) {
-    swprintf(title, 256, L"DirPie4  (Scanning %u/%u)", doneClamped, total);
-  } else {
-    swprintf(title, 256, L"DirPie4");
-  }
-  SetWindowTextW(g_hwndMain, title);
+static void NameThread(const char* name) {
+  t_threadName = name;
 }
 
-static void WorkerThreadMain() {
-  while (!g_quit.load()) {
-    Job job{};
-    {
-      std::unique_lock<std::mutex> lk(g_jobMu);
-      g_jobCv.wait(lk, [] { return g_quit.load() || !g_jobs.empty(); });
-      if (g_quit.load()) break;
-      job = g_jobs.front();
-      g_jobs.pop_front();
-    }
+// Scan counters of one thread, for the metrics exporter. Only the owning thread
+// writes them, with a plain load and store, so counting needs no locked instruction
+// and no cache line is shared between threads; the exporter sums them all.
+static const int SKIP_REASONS = 7;
+static const char* const SKIP_REASON_NAMES[SKIP_REASONS] = {"access", "path", "other", "reparse",
+                                                            "loop", "excluded", "stalled"};
+
+struct alignas(64) ThreadMetrics {
+  const char* thread = nullptr;
+  DWORD tid = 0;
+  std::atomic<uint64_t> entries{0};
+  std::atomic<uint64_t> dirs{0};
+  std::atomic<uint64_t> bytes{0};
+  std::atomic<uint64_t> skipped[SKIP_REASONS] = {};
+
+  std::mutex jobMu;
+  const char* job = nullptr;  // what the thread is doing; null when idle
+  wstring path;
+  uint64_t since = 0;         // tick the job started
+};
 
-    const uint64_t curEpoch = g_progressEpoch.load();
-    const bool track = (job.epoch == curEpoch);
-    if (track) {
-      g_jobs_queued.fetch_sub(1);
-      g_jobs_active.fetch_add(1);
-    }
+static std::mutex g_metricsMu;
+static std::vector<std::unique_ptr<ThreadMetrics>> g_threadMetrics;  // guarded by g_metricsMu
+static thread_local ThreadMetrics* t_metrics = nullptr;
+
+static ThreadMetrics& ThisThreadMetrics() {
+  if (!t_metrics) {
+    std::unique_ptr<ThreadMetrics> m(new ThreadMetrics());
+    m->thread = t_threadName;
+    m->tid = GetCurrentThreadId();
+    t_metrics = m.get();
+    std::lock_guard<std::mutex> lk(g_metricsMu);
+    g_threadMetrics.push_back(std::move(m));
+  }
+  return *t_metrics;
+}
 
-    if (g_generation.load() != job.gen) {
-      if (track) {
-        g_jobs_active.fetch_sub(1);
-        g_jobs_done.fetch_add(1);
-      }
-      PostMessageW(g_hwndMain, WM_APP_REFRESH, (WPARAM)job.gen, 0);
-      continue;
-    }
+static void Bump(std::atomic<uint64_t>& counter, uint64_t n) {
+  counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
 
-    WalkStats st{};
-    const uint64_t cap = (job.kind == JobKind::Capped) ? CAP_BYTES : 0;
-    const uint64_t bytes = WalkDirLogicalSize(job.path, cap, job.gen, st);
+// Shows what the calling thread works on; job null marks it idle.
+static void SetThreadJob(const char* job, const wstring& path) {
+  ThreadMetrics& m = ThisThreadMetrics();
+  std::lock_guard<std::mutex> lk(m.jobMu);
+  m.job = job;
+  if (job) m.path = path;
+  else m.path.clear();
+  m.since = NowTick();
+}
 
-    if (g_generation.load() != job.gen) {
-      if (track) {
-        g_jobs_active.fetch_sub(1);
-        g_jobs_done.fetch_add(1);
-      }
-      PostMessageW(g_hwndMain, WM_APP_REFRESH, (WPARAM)job.gen, 0);
-      continue;
-    }
+// Identity of a directory: volume serial and file index.
+struct DirId {
+  DWORD volume = 0;
+  uint64_t file = 0;
+  bool operator==(const DirId& o) const { return volume == o.volume && file == o.file; }
+};
 
-    SizeInfo si{};
-    si.bytes = bytes;
-    si.exact = (job.kind == JobKind::Exact) && !st.reached_cap;
-    si.incomplete = st.incomplete;
-    si.stats = st;
-    si.tick = NowTick();
+struct DirIdHash {
+  size_t operator()(const DirId& d) const { return std::hash<uint64_t>()(d.file * 0x9E3779B97F4A7C15ULL ^ d.volume); }
+};
 
-    {
-      std::lock_guard<std::mutex> lk(g_mu);
-      auto it = g_cache.find(job.path);
-      if (it != g_cache.end()) {
-        const SizeInfo& old = it->second;
-        if (old.exact && !old.incomplete) {
-          if (si.incomplete && !si.exact) {
-          } else {
-            g_cache[job.path] = si;
-          }
-        } else {
-          g_cache[job.path] = si;
-        }
-      } else {
-        g_cache[job.path] = si;
-      }
-    }
+// Directories a walk has entered through links, and the root it started from.
+struct FollowedDirs {
+  std::unordered_set<DirId, DirIdHash> ids;
+  std::vector<wstring> paths;  // final paths, folded
+};
 
-    if (track) {
-      g_jobs_active.fetch_sub(1);
-      g_jobs_done.fetch_add(1);
-      if (job.kind == JobKind::Exact) g_jobs_exact_done.fetch_add(1);
-    }
+// State shared by both directory-reader backends of one walk.
+struct WalkContext {
+  uint64_t capBytes = 0;
+  const JobTicket* ticket = nullptr;  // null: the walk cannot be cancelled
+  WalkStats& st;
+  ContentStats& cs;
+  ScanTree* tree = nullptr;
+  IoCounters* io = nullptr;
+  AgeEdges edges;
+  uint64_t total = 0;
+  uint64_t collapseBelow = 0;
+  uint64_t clusterBytes = 4096;  // path-based backend: file sizes round up to this on disk
+  bool links = false;            // NTFS volume: hard links take disk space once
+  uint32_t volume = 0;           // serial number
+  uint32_t linkWalk = 0;         // this walk, and its root, in CountLinkOnDisk
+  uint32_t linkRoot = 0;
+  std::unique_ptr<FollowedDirs> followed;  // created at the first link the walk meets
+  WalkStats reported;            // counts already added to this thread's metrics
+  uint64_t reportedBytes = 0;
+};
 
-    PostMessageW(g_hwndMain, WM_APP_REFRESH, (WPARAM)job.gen, 0);
+static bool WalkCancelled(const WalkContext& w) {
+  return g_quit.load() || (w.ticket && w.ticket->cancelled.load());
+}
 
-    if (job.kind == JobKind::Capped) {
-      if (st.reached_cap || st.incomplete) EnqueueJob(Job{job.gen, job.epoch, job.path, JobKind::Exact});
-    }
+// Adds one file to the walk totals and to its directory's node. Returns true once
+// the byte cap has been reached.
+static bool AccountFile(WalkContext& w, uint32_t node, uint64_t sz, uint64_t alloc, uint64_t writeTime,
+                        uint64_t accessTime) {
+  w.total += sz;
+  w.cs.allocated += alloc;
+  AddFileSize(sz, w.cs);
+  AddFileAge(w.edges, writeTime, accessTime, sz, w.cs.ages);
+  if (w.tree) {
+    TreeNode& n = w.tree->nodes[node];
+    n.bytes += sz;
+    n.files++;
+    if (writeTime > n.newestWrite) n.newestWrite = writeTime;
   }
+  if (w.capBytes > 0 && w.total >= w.capBytes) {
+    w.st.reached_cap = true;
+    return true;
+  }
+  return false;
 }
 
-static void EnsureListColumns(HWND lv) {
-  if (ListView_GetColumnWidth(lv, 0) > 0) return;
-  while (ListView_DeleteColumn(lv, 0)) {}
+static void SkipCounts(const WalkStats& st, uint32_t out[SKIP_REASONS]) {
+  const uint32_t counts[SKIP_REASONS] = {st.skipped_access,  st.skipped_path,     st.skipped_other,  st.skipped_reparse,
+                                         st.skipped_loop,    st.skipped_excluded, st.skipped_stalled};
+  std::copy(counts, counts + SKIP_REASONS, out);
+}
 
-  LVCOLUMNW col{};
-  col.mask = LVCF_TEXT | LVCF_WIDTH | LVCF_SUBITEM;
+// Adds what the walk did since the last call to this thread's metrics.
+static void ReportWalk(WalkContext& w, uint64_t seen, uint64_t dirs) {
+  ThreadMetrics& m = ThisThreadMetrics();
+  if (seen) Bump(m.entries, seen);
+  if (dirs) Bump(m.dirs, dirs);
+  if (w.total != w.reportedBytes) Bump(m.bytes, w.total - w.reportedBytes);
+  w.reportedBytes = w.total;
+
+  uint32_t now[SKIP_REASONS], before[SKIP_REASONS];
+  SkipCounts(w.st, now);
+  SkipCounts(w.reported, before);
+  for (int i = 0; i < SKIP_REASONS; ++i) {
+    if (now[i] != before[i]) Bump(m.skipped[i], now[i] - before[i]);
+  }
+  w.reported = w.st;
+}
 
-  col.pszText = (LPWSTR)L"Name"; col.cx = 260; col.iSubItem = 0; ListView_InsertColumn(lv, 0, &col);
-  col.pszText = (LPWSTR)L"Size"; col.cx = 170; col.iSubItem = 1; ListView_InsertColumn(lv, 1, &col);
-  col.pszText = (LPWSTR)L"%";    col.cx =  70; col.iSubItem = 2; ListView_InsertColumn(lv, 2, &col);
+static void AddReadTime(WalkContext& w, uint64_t seen, uint64_t micros) {
+  ReportWalk(w, seen, 1);
+  if (!w.io) return;
+  w.io->entries.fetch_add(seen, std::memory_order_relaxed);
+  w.io->dirReads.fetch_add(1, std::memory_order_relaxed);
+  w.io->readMicros.fetch_add(micros, std::memory_order_relaxed);
 }
 
-static void RefreshUIFromCache(uint64_t gen) {
-  if (g_generation.load() != gen) return;
+// Exclusion rules from DIRPIE_EXCLUDE: ';'-separated path globs (or "@file", one per
+// line), '!' re-including; excluded directories are never opened (skipped_excluded).
+
+static bool GlobMatchNoCase(const wchar_t* s, size_t sn, const wchar_t* g) {
+  size_t si = 0;
+  const wchar_t* star = nullptr;
+  size_t starS = 0;
+  while (si < sn) {
+    if (*g == L'*') { star = g++; starS = si; continue; }
+    if (*g && (*g == L'?' || towlower(*g) == towlower(s[si]))) { ++g; ++si; continue; }
+    if (!star) return false;
+    g = star + 1;
+    si = ++starS;
+  }
+  while (*g == L'*') ++g;
+  return *g == 0;
+}
 
-  uint64_t sum = 0;
-  WalkStats totals{};
-  int totalEntries = 0;
-  int knownEntries = 0;
-  int exactEntries = 0;
-  int incompleteEntries = 0;
+struct GlobPart {
+  wstring text;
+  bool literal = true;     // no '*' or '?'
+  bool anyDepth = false;   // "**"
+};
 
-  {
-    std::lock_guard<std::mutex> lk(g_mu);
-    totalEntries = (int)g_entries.size();
-    for (auto& e : g_entries) {
-      auto it = g_cache.find(e.path);
-      if (it != g_cache.end()) {
-        const SizeInfo& si = it->second;
-        e.bytes = si.bytes;
-        e.has_value = true;
-        e.exact = si.exact;
-        e.incomplete = si.incomplete;
-        e.stats = si.stats;
-      }
+struct ExcludeRule {
+  std::vector<GlobPart> parts;
+  bool anchored = false;
+  bool include = false;
+};
 
-      if (e.has_value) {
-        sum += e.bytes;
-        knownEntries++;
-        if (e.exact && !e.incomplete) exactEntries++;
-        if (e.incomplete || !e.exact) incompleteEntries++;
-      } else {
-        incompleteEntries++;
-      }
+// Compiled once. Unanchored one-component literals, the common case, live in an
+// open-addressed table keyed by a case-folded hash, so most names cost one probe;
+// the rest are tried in turn. Partial matches of multi-component rules travel down
+// the walk as states (rule << 8 | next part).
+struct ExcludeRules {
+  std::vector<ExcludeRule> rules;
+  std::vector<uint32_t> literalSlots;   // rule index + 1; 0 = empty
+  std::vector<uint32_t> literalHashes;
+  std::vector<uint32_t> globs;          // unanchored one-component globs
+  std::vector<uint32_t> multi;          // unanchored multi-component rules
+  std::vector<uint32_t> anchored;       // states seeded at the start of a path
+
+  bool Empty() const { return rules.empty(); }
+};
 
-      totals.skipped_access += e.stats.skipped_access;
-      totals.skipped_path   += e.stats.skipped_path;
-      totals.skipped_other  += e.stats.skipped_other;
-      totals.skipped_reparse+= e.stats.skipped_reparse;
-      totals.incomplete = totals.incomplete || e.stats.incomplete;
-    }
+static const size_t EXCLUDE_MAX_PARTS = 255;
+
+static uint32_t FoldHash(const wchar_t* s, size_t n) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < n; ++i) {
+    h ^= (uint32_t)towlower(s[i]);
+    h *= 16777619u;
   }
+  return h;
+}
 
-  std::stable_sort(g_entries.begin(), g_entries.end(),
-                   [](const Entry& a, const Entry& b) {
-                     const uint64_t ax = a.has_value ? a.bytes : 0;
-                     const uint64_t bx = b.has_value ? b.bytes : 0;
-                     return ax > bx;
-                   });
+static bool PartMatches(const GlobPart& g, const wchar_t* s, size_t n) {
+  if (g.literal) return g.text.size() == n && _wcsnicmp(g.text.c_str(), s, n) == 0;
+  return GlobMatchNoCase(s, n, g.text.c_str());
+}
 
-  SendMessageW(g_hwndList, WM_SETREDRAW, FALSE, 0);
-  ListView_DeleteAllItems(g_hwndList);
+static bool ParseExcludeRule(wstring pat, ExcludeRule& r) {
+  while (!pat.empty() && iswspace(pat.back())) pat.pop_back();
+  size_t b = 0;
+  while (b < pat.size() && iswspace(pat[b])) ++b;
+  pat.erase(0, b);
+  if (pat.empty() || pat[0] == L'#') return false;
+
+  if (pat[0] == L'!') { r.include = true; pat.erase(0, 1); }
+  for (wchar_t& c : pat) if (c == L'\\') c = L'/';
+  r.anchored = pat.rfind(L"//", 0) == 0 || (pat.size() >= 2 && pat[1] == L':');
+
+  size_t i = 0;
+  while (i < pat.size()) {
+    size_t j = pat.find(L'/', i);
+    if (j == wstring::npos) j = pat.size();
+    if (j > i) {
+      GlobPart g;
+      g.text = pat.substr(i, j - i);
+      g.anyDepth = g.text == L"**";
+      g.literal = g.text.find_first_of(L"*?") == wstring::npos;
+      r.parts.push_back(std::move(g));
+    }
+    i = j + 1;
+  }
+  return !r.parts.empty() && r.parts.size() <= EXCLUDE_MAX_PARTS;
+}
 
-  LVITEMW it{};
-  it.mask = LVIF_TEXT | LVIF_PARAM;
+static wstring ReadExcludeFile(const wstring& path) {
+  HANDLE h = CreateFileW(ToLongPath(path).c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                         FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (h == INVALID_HANDLE_VALUE) return wstring();
+  std::string bytes;
+  char buf[4096];
+  DWORD n = 0;
+  while (ReadFile(h, buf, sizeof(buf), &n, nullptr) && n > 0) bytes.append(buf, n);
+  CloseHandle(h);
+  if (bytes.empty()) return wstring();
+
+  const int len = MultiByteToWideChar(CP_UTF8, 0, bytes.data(), (int)bytes.size(), nullptr, 0);
+  if (len <= 0) return wstring();
+  wstring text((size_t)len, L'\0');
+  MultiByteToWideChar(CP_UTF8, 0, bytes.data(), (int)bytes.size(), &text[0], len);
+  return text;
+}
 
-  for (int i = 0; i < (int)g_entries.size(); ++i) {
-    it.iItem = i;
-    it.iSubItem = 0;
-    it.pszText = (LPWSTR)g_entries[i].name.c_str();
-    it.lParam = (LPARAM)i;
-    ListView_InsertItem(g_hwndList, &it);
+// A pattern starting with a drive or "//" is anchored there, others match at any depth;
+// '*' and '?' stay within a component, "**" spans components, and the last match wins.
+static ExcludeRules CompileExcludes(const wstring& spec) {
+  ExcludeRules x;
+  size_t i = 0;
+  while (i <= spec.size()) {
+    size_t j = spec.find_first_of(L";\r\n", i);
+    if (j == wstring::npos) j = spec.size();
+    ExcludeRule r;
+    if (ParseExcludeRule(spec.substr(i, j - i), r)) x.rules.push_back(std::move(r));
+    i = j + 1;
   }
 
-  for (int i = 0; i < (int)g_entries.size(); ++i) {
-    const Entry& e = g_entries[i];
-    wstring sSize, sPct;
-
-    if (!e.has_value) {
-      sSize = L"...";
+  size_t literals = 0;
+  for (const ExcludeRule& r : x.rules) literals += (!r.anchored && r.parts.size() == 1 && r.parts[0].literal) ? 1 : 0;
+  size_t cap = 16;
+  while (cap < literals * 2) cap *= 2;
+  x.literalSlots.assign(cap, 0);
+  x.literalHashes.assign(cap, 0);
+
+  for (uint32_t k = 0; k < (uint32_t)x.rules.size(); ++k) {
+    const ExcludeRule& r = x.rules[k];
+    if (r.anchored) {
+      x.anchored.push_back(k << 8);
+    } else if (r.parts.size() > 1 || r.parts[0].anyDepth) {
+      x.multi.push_back(k);
+    } else if (!r.parts[0].literal) {
+      x.globs.push_back(k);
     } else {
-      bool approx = (!e.exact) || e.incomplete;
-      sSize = (approx ? L"~ " : L"") + FormatBytes(e.bytes);
-      if (e.incomplete) sSize += L"  +";
-      if (sum > 0) {
-        const double pct = (double)e.bytes * 100.0 / (double)sum;
-        wchar_t buf[32];
-        swprintf(buf, 32, L"%.1f", pct);
-        sPct = buf;
-      }
+      const uint32_t h = FoldHash(r.parts[0].text.c_str(), r.parts[0].text.size());
+      size_t slot = h & (cap - 1);
+      while (x.literalSlots[slot]) slot = (slot + 1) & (cap - 1);
+      x.literalSlots[slot] = k + 1;
+      x.literalHashes[slot] = h;
     }
-
-    ListView_SetItemText(g_hwndList, i, 1, (LPWSTR)sSize.c_str());
-    ListView_SetItemText(g_hwndList, i, 2, (LPWSTR)sPct.c_str());
   }
+  return x;
+}
+
+static const ExcludeRules& ConfiguredExcludes() {
+  static const ExcludeRules rules = [] {
+    wstring spec = EnvString(L"DIRPIE_EXCLUDE");
+    if (!spec.empty() && spec[0] == L'@') spec = ReadExcludeFile(spec.substr(1));
+    return CompileExcludes(spec);
+  }();
+  return rules;
+}
+
+// Advances rule r from part pos over one name: a completed rule raises last, a partial
+// one leaves a state for the children in states (past from, which is deduplicated).
+static void StepExcludeRule(const ExcludeRules& x, uint32_t r, uint32_t pos, const wchar_t* name, size_t len,
+                            std::vector<uint32_t>& states, size_t from, int& last) {
+  const ExcludeRule& rule = x.rules[r];
+  const GlobPart& g = rule.parts[pos];
+  auto keep = [&](uint32_t st) {
+    if (std::find(states.begin() + from, states.end(), st) == states.end()) states.push_back(st);
+  };
+  if (g.anyDepth) {
+    keep(r << 8 | pos);
+    if (pos + 1 == rule.parts.size()) last = std::max(last, (int)r);
+    else StepExcludeRule(x, r, pos + 1, name, len, states, from, last);
+    return;
+  }
+  if (!PartMatches(g, name, len)) return;
+  if (pos + 1 == rule.parts.size()) last = std::max(last, (int)r);
+  else keep(r << 8 | (pos + 1));
+}
+
+// Matches one directory name whose parent's states are states[parentOff, +parentLen).
+// The directory's own states are appended to states. Returns true when it is excluded.
+static bool MatchExcluded(const ExcludeRules& x, std::vector<uint32_t>& states, size_t parentOff, size_t parentLen,
+                          const wchar_t* name, size_t len) {
+  int last = -1;
+  const size_t from = states.size();
+
+  const size_t mask = x.literalSlots.size() - 1;
+  const uint32_t h = FoldHash(name, len);
+  for (size_t slot = h & mask; x.literalSlots[slot]; slot = (slot + 1) & mask) {
+    const uint32_t r = x.literalSlots[slot] - 1;
+    if (x.literalHashes[slot] == h && PartMatches(x.rules[r].parts[0], name, len)) last = std::max(last, (int)r);
+  }
+  for (uint32_t r : x.globs) {
+    if ((int)r > last && PartMatches(x.rules[r].parts[0], name, len)) last = (int)r;
+  }
+  for (size_t i = 0; i < parentLen; ++i) {
+    const uint32_t st = states[parentOff + i];
+    StepExcludeRule(x, st >> 8, st & 0xff, name, len, states, from, last);
+  }
+  for (uint32_t r : x.multi) StepExcludeRule(x, r, 0, name, len, states, from, last);
+
+  return last >= 0 && !x.rules[last].include;
+}
+
+// Feeds the components of a walk root through the rules, leaving the root's states
+// in states. Ancestors the user navigated into explicitly are not held against it;
+// only the root itself can be excluded.
+static bool MatchExcludedRoot(const ExcludeRules& x, const wstring& root, std::vector<uint32_t>& states) {
+  states.assign(x.anchored.begin(), x.anchored.end());
+  size_t off = 0;
+  size_t len = states.size();
+  bool excluded = false;
+
+  size_t i = root.rfind(L"\\\\?\\", 0) == 0 ? 4 : 0;
+  if (i == 4 && root.compare(4, 4, L"UNC\\") == 0) i = 8;
+  while (i < root.size()) {
+    size_t j = root.find_first_of(L"\\/", i);
+    if (j == wstring::npos) j = root.size();
+    if (j > i) {
+      const size_t next = states.size();
+      excluded = MatchExcluded(x, states, off, len, root.c_str() + i, j - i);
+      off = next;
+      len = states.size() - next;
+    }
+    i = j + 1;
+  }
+  states.erase(states.begin(), states.begin() + off);
+  return excluded;
+}
+
+// Hard links: every name of a hard-linked NTFS file has the same 64-bit file ID, and
+// a file with more than one link takes disk space once per process (see CountLinkOnDisk).
+
+// What a walk needs to know about its volume, probed once per volume.
+struct LinkVolume {
+  uint64_t clusterBytes = 4096;
+  uint32_t serial = 0;
+  bool links = false;  // NTFS: files can have hard links
+};
+
+static std::mutex g_linkMu;
+static std::unordered_map<wstring, LinkVolume> g_linkVolumes;  // by volume root
+
+struct LinkKey {
+  uint32_t volume;
+  uint64_t fileId;  // record and sequence number, so a reused record is another file
+  bool operator==(const LinkKey& o) const { return volume == o.volume && fileId == o.fileId; }
+};
+
+struct LinkKeyHash {
+  size_t operator()(const LinkKey& k) const {
+    return (size_t)((k.fileId ^ ((uint64_t)k.volume << 32)) * 0x9E3779B97F4A7C15ULL >> 16);
+  }
+};
+
+// The walk that counted a linked file on disk, and the root it walked.
+struct LinkOwner {
+  uint32_t walk;
+  uint32_t root;  // index into g_linkRoots
+};
+
+static const size_t LINK_SHARDS = 64;
+
+struct LinkShard {
+  std::mutex mu;
+  std::unordered_map<LinkKey, LinkOwner, LinkKeyHash> owners;
+};
+
+static LinkShard g_linkShards[LINK_SHARDS];
+static std::vector<wstring> g_linkRoots;                   // folded walk roots; guarded by g_linkMu
+static std::unordered_map<wstring, uint32_t> g_linkRootIds;  // guarded by g_linkMu
+static std::atomic<uint32_t> g_linkWalks{0};
+
+static wstring FoldPath(const wstring& p) {
+  wstring k = TrimTrailingSlash(p);
+  for (wchar_t& c : k) c = c == L'/' ? L'\\' : (wchar_t)towlower(c);
+  return k;
+}
+
+static LinkVolume ProbeLinkVolume(const wstring& root) {
+  wchar_t vol[MAX_PATH]{};
+  if (!GetVolumePathNameW(root.c_str(), vol, MAX_PATH)) return LinkVolume{};
+  {
+    std::lock_guard<std::mutex> lk(g_linkMu);
+    auto it = g_linkVolumes.find(vol);
+    if (it != g_linkVolumes.end()) return it->second;
+  }
+
+  LinkVolume lv;
+  DWORD sectorsPerCluster = 0, bytesPerSector = 0, freeClusters = 0, totalClusters = 0;
+  if (GetDiskFreeSpaceW(vol, &sectorsPerCluster, &bytesPerSector, &freeClusters, &totalClusters) &&
+      sectorsPerCluster && bytesPerSector) {
+    lv.clusterBytes = (uint64_t)sectorsPerCluster * bytesPerSector;
+  }
+  wchar_t fs[16]{};
+  DWORD serial = 0;
+  lv.links = GetVolumeInformationW(vol, nullptr, 0, &serial, nullptr, nullptr, fs, 16) && _wcsicmp(fs, L"NTFS") == 0;
+  lv.serial = serial;
+
+  std::lock_guard<std::mutex> lk(g_linkMu);
+  g_linkVolumes[vol] = lv;
+  return lv;
+}
+
+static bool PathWithin(const wstring& path, const wstring& dir) {
+  return path.size() >= dir.size() && path.compare(0, dir.size(), dir) == 0 &&
+         (path.size() == dir.size() || path[dir.size()] == L'\\' || dir.back() == L'\\');
+}
+
+static uint32_t LinkRootId(const wstring& root) {
+  const wstring key = FoldPath(root);
+  std::lock_guard<std::mutex> lk(g_linkMu);
+  auto it = g_linkRootIds.emplace(key, (uint32_t)g_linkRoots.size());
+  if (it.second) g_linkRoots.push_back(key);
+  return it.first->second;
+}
+
+// Whether a walk counts a file with more than one link on disk. The first walk to meet
+// the file does. A walk of the same folder again, or of a folder above or below it,
+// takes the file over and counts it too, so each of those views stands on its own; a
+// walk of an unrelated tree, such as a sibling backup folder, and further names met
+// by the owning walk itself count nothing on disk.
+static bool CountLinkOnDisk(const WalkContext& w, uint64_t fileId) {
+  const LinkKey key{w.volume, fileId};
+  LinkShard& shard = g_linkShards[LinkKeyHash()(key) % LINK_SHARDS];
+  std::lock_guard<std::mutex> lk(shard.mu);
+  auto it = shard.owners.emplace(key, LinkOwner{w.linkWalk, w.linkRoot});
+  if (it.second) return true;
+  LinkOwner& owner = it.first->second;
+  if (owner.walk == w.linkWalk) return false;
+  if (owner.root != w.linkRoot) {
+    std::lock_guard<std::mutex> rootsLock(g_linkMu);
+    const wstring& a = g_linkRoots[owner.root];
+    const wstring& b = g_linkRoots[w.linkRoot];
+    if (!PathWithin(a, b) && !PathWithin(b, a)) return false;
+  }
+  owner = LinkOwner{w.linkWalk, w.linkRoot};
+  return true;
+}
+
+struct PendingDir {
+  wstring path;
+  uint32_t node = 0;
+  uint32_t matchOff = 0;   // this directory's exclusion states in WalkScratch::match
+  uint32_t matchLen = 0;
+  bool viaLink = false;    // reached through a followed link, maybe on another volume
+};
+
+static const DWORD DIR_READ_BUFFER_BYTES = 64 * 1024;
+static const size_t SCRATCH_KEEP_BYTES = 32ULL * 1024 * 1024;
+
+struct DirFrame {
+  HANDLE handle = nullptr;
+  uint32_t node = 0;
+  uint32_t next = 0;        // offset of the next unread entry in this level's buffer
+  bool buffered = false;    // buffer holds unread entries
+  uint64_t seen = 0;
+  uint64_t micros = 0;
+  uint32_t matchOff = 0;
+  uint32_t matchLen = 0;
+  bool viaLink = false;     // reached through a followed link, maybe on another volume
+};
+
+// Per-worker walk state. Its vectors keep their capacity from job to job, so a
+// worker in steady state walks without touching the shared heap; the tree is built
+// here and copied out once, at its final size. Release() frees everything at once
+// when the generation it was used for is abandoned or it grew past
+// SCRATCH_KEEP_BYTES.
+struct WalkScratch {
+  std::vector<PendingDir> stack;
+  std::vector<DirFrame> frames;
+  std::vector<std::vector<uint64_t>> buffers;  // one directory read buffer per depth
+  std::vector<uint32_t> match;                 // exclusion states along the pending directories
+  ScanTree tree;
+
+  size_t Bytes() const {
+    return stack.capacity() * sizeof(PendingDir) + frames.capacity() * sizeof(DirFrame) +
+           buffers.size() * DIR_READ_BUFFER_BYTES + match.capacity() * sizeof(uint32_t) +
+           tree.nodes.capacity() * sizeof(TreeNode) +
+           tree.names.capacity() * sizeof(wchar_t);
+  }
+
+  void Release() {
+    std::vector<PendingDir>().swap(stack);
+    std::vector<DirFrame>().swap(frames);
+    std::vector<std::vector<uint64_t>>().swap(buffers);
+    std::vector<uint32_t>().swap(match);
+    std::vector<TreeNode>().swap(tree.nodes);
+    std::vector<wchar_t>().swap(tree.names);
+  }
+};
+
+// Timeline: DIRPIE_TIMELINE=<file.json> keeps each thread's last TIMELINE_RING_EVENTS spans
+// in a lock-free ring and writes them at exit as Chrome trace-event JSON (Perfetto).
+
+static const size_t TIMELINE_RING_EVENTS = 8192;
+static const size_t TIMELINE_ARG_CHARS = 48;     // the end of the path, where the folder names are
+static const uint64_t TIMELINE_INSTANT = UINT64_MAX;
+
+struct TimelineEvent {
+  uint64_t start = 0;  // micros since the timeline started
+  uint64_t dur = 0;    // TIMELINE_INSTANT for a mark
+  const char* name = nullptr;
+  uint32_t argLen = 0;
+  wchar_t arg[TIMELINE_ARG_CHARS];
+};
+
+struct TimelineRing {
+  const char* thread = nullptr;
+  DWORD tid = 0;
+  std::unique_ptr<TimelineEvent[]> events{new TimelineEvent[TIMELINE_RING_EVENTS]};
+  std::atomic<uint64_t> written{0};
+};
+
+static std::mutex g_timelineMu;
+static std::vector<std::unique_ptr<TimelineRing>> g_timelineRings;  // guarded by g_timelineMu
+static thread_local TimelineRing* t_timelineRing = nullptr;
+
+static uint64_t TimelineStart() {
+  static const uint64_t start = NowMicros();
+  return start;
+}
+
+static bool TimelineOn() {
+  static const bool on = [] {
+    const bool set = !EnvString(L"DIRPIE_TIMELINE").empty();
+    if (set) TimelineStart();
+    return set;
+  }();
+  return on;
+}
+
+static void TimelineRecord(const char* name, uint64_t start, uint64_t dur, const wstring& arg) {
+  TimelineRing* ring = t_timelineRing;
+  if (!ring) {
+    std::unique_ptr<TimelineRing> r(new TimelineRing());
+    r->thread = t_threadName;
+    r->tid = GetCurrentThreadId();
+    ring = t_timelineRing = r.get();
+    std::lock_guard<std::mutex> lk(g_timelineMu);
+    g_timelineRings.push_back(std::move(r));
+  }
+  const uint64_t n = ring->written.load(std::memory_order_relaxed);
+  TimelineEvent& e = ring->events[n % TIMELINE_RING_EVENTS];
+  e.start = start - TimelineStart();
+  e.dur = dur;
+  e.name = name;
+  e.argLen = (uint32_t)std::min(arg.size(), TIMELINE_ARG_CHARS);
+  wmemcpy(e.arg, arg.data() + arg.size() - e.argLen, e.argLen);
+  ring->written.store(n + 1, std::memory_order_release);
+}
+
+static void TimelineMark(const char* name, const wstring& arg) {
+  if (TimelineOn()) TimelineRecord(name, NowMicros(), TIMELINE_INSTANT, arg);
+}
+
+// Records the enclosing scope as one span. arg must outlive the span.
+struct TimelineSpan {
+  const char* name;
+  const wstring& arg;
+  const bool on;
+  uint64_t start = 0;
+
+  TimelineSpan(const char* name, const wstring& arg) : name(name), arg(arg), on(TimelineOn()) {
+    if (on) start = NowMicros();
+  }
+  ~TimelineSpan() {
+    if (on) TimelineRecord(name, start, NowMicros() - start, arg);
+  }
+  TimelineSpan(const TimelineSpan&) = delete;
+  TimelineSpan& operator=(const TimelineSpan&) = delete;
+};
+
+// Filesystem traces: DIRPIE_TRACE_RECORD saves every listing DirReader reads, and
+// DIRPIE_TRACE_REPLAY serves them back instead of the disk, to benchmark without I/O.
+
+struct TraceEntry {
+  uint32_t nameOff = 0;   // into FsTrace::names
+  uint32_t nameLen = 0;
+  uint32_t attributes = 0;
+  uint64_t size = 0;
+  uint64_t writeTime = 0;
+  uint64_t accessTime = 0;
+};
+
+struct TraceDir {
+  DWORD error = 0;          // what ended the listing; 0 at a clean end
+  bool openFailed = false;  // the directory could not be opened at all
+  uint32_t micros = 0;
+  uint32_t first = 0;       // into FsTrace::entries
+  uint32_t count = 0;
+};
+
+struct FsTrace {
+  std::unordered_map<wstring, TraceDir> dirs;  // keyed by TraceKey
+  std::vector<TraceEntry> entries;
+  std::vector<wchar_t> names;
+};
+
+static wstring TraceKey(const wstring& dir) {
+  wstring k = TrimTrailingSlash(dir);
+  for (wchar_t& c : k) c = (wchar_t)towlower(c);
+  return k;
+}
+
+static const FsTrace* ReplayTrace();  // null unless replaying
+
+static bool TraceRecording() {
+  static const bool on = !EnvString(L"DIRPIE_TRACE_RECORD").empty();
+  return on;
+}
+
+static bool ReplayLatency() {
+  static const bool on = _wcsicmp(EnvString(L"DIRPIE_TRACE_LATENCY").c_str(), L"on") == 0;
+  return on;
+}
+
+static FsTrace g_traceRecord;  // guarded by g_traceMu
+static std::mutex g_traceMu;
+
+static bool TraceRecorded(const wstring& key) {
+  std::lock_guard<std::mutex> lk(g_traceMu);
+  return g_traceRecord.dirs.count(key) != 0;
+}
+
+// The first complete listing of a directory is kept; later reads of it are not recorded.
+static void RecordTraceDir(const wstring& key, const TraceDir& d, const std::vector<TraceEntry>& entries,
+                           const std::vector<wchar_t>& names) {
+  std::lock_guard<std::mutex> lk(g_traceMu);
+  if (g_traceRecord.dirs.count(key)) return;
+  TraceDir rec = d;
+  rec.first = (uint32_t)g_traceRecord.entries.size();
+  rec.count = (uint32_t)entries.size();
+  const uint32_t base = (uint32_t)g_traceRecord.names.size();
+  for (TraceEntry e : entries) {
+    e.nameOff += base;
+    g_traceRecord.entries.push_back(e);
+  }
+  g_traceRecord.names.insert(g_traceRecord.names.end(), names.begin(), names.end());
+  g_traceRecord.dirs.emplace(key, rec);
+}
+
+// Stall guard: a directory read that hangs past DIR_STALL_MS (a dead network mount) is
+// cancelled and its folder parked; a worker stuck twice as long is replaced (CheckStalls).
+
+static const uint64_t DIR_STALL_MS = 15000;
+static const uint64_t STALL_PARK_MS = 10 * 60 * 1000;
+static const int MAX_SPARE_WORKERS = 8;
+
+enum class SlotJob : int { Idle, Running, Lost };
+
+struct StallSlot {
+  HANDLE thread = nullptr;
+  std::thread::id id;
+  bool worker = false;
+  int device = 0;                              // workers: device of the running job
+  bool replaced = false;                       // written off and dropped from the pool; guarded by g_slotMu
+  std::atomic<int> job{(int)SlotJob::Idle};    // workers only
+  std::atomic<uint64_t> since{0};              // start tick of the current operation; 0 = none
+  std::atomic<bool> cancelled{false};          // the current operation was cut short
+};
+
+static std::mutex g_slotMu;
+static std::vector<std::unique_ptr<StallSlot>> g_slots;  // guarded by g_slotMu
+static int g_lostWorkers = 0;                            // written off and not back yet; guarded by g_slotMu
+static thread_local StallSlot* t_slot = nullptr;
+
+static StallSlot* RegisterStallSlot(bool worker) {
+  std::unique_ptr<StallSlot> slot(new StallSlot());
+  slot->thread = OpenThread(THREAD_TERMINATE, FALSE, GetCurrentThreadId());
+  slot->id = std::this_thread::get_id();
+  slot->worker = worker;
+  t_slot = slot.get();
+  std::lock_guard<std::mutex> lk(g_slotMu);
+  g_slots.push_back(std::move(slot));
+  return t_slot;
+}
+
+struct StallScope {
+  StallScope() {
+    if (!t_slot) return;
+    t_slot->cancelled.store(false);
+    t_slot->since.store(NowTick());
+  }
+  ~StallScope() {
+    if (t_slot) t_slot->since.store(0);
+  }
+  bool Stalled() const { return t_slot && t_slot->cancelled.load(); }
+};
+
+// Sleeps in short slices so the guard can cut it short; false when it did.
+static bool StallableSleep(uint64_t micros) {
+  const uint64_t end = NowMicros() + micros;
+  for (;;) {
+    if (t_slot && t_slot->cancelled.load()) return false;
+    const uint64_t now = NowMicros();
+    if (now >= end) return true;
+    std::this_thread::sleep_for(std::chrono::microseconds(std::min<uint64_t>(end - now, 10000)));
+  }
+}
+
+static std::mutex g_parkMu;
+static std::unordered_map<wstring, uint64_t> g_parked;  // TraceKey -> tick parked; guarded by g_parkMu
+static std::atomic<uint32_t> g_parkedCount{0};
+
+static void ParkDir(const wstring& dir) {
+  if (dir.empty()) return;
+  TimelineMark("stalled", dir);
+  std::lock_guard<std::mutex> lk(g_parkMu);
+  g_parked[TraceKey(dir)] = NowTick();
+  g_parkedCount.store((uint32_t)g_parked.size());
+}
+
+static bool IsParked(const wstring& dir) {
+  if (g_parkedCount.load() == 0) return false;
+  std::lock_guard<std::mutex> lk(g_parkMu);
+  auto it = g_parked.find(TraceKey(dir));
+  if (it == g_parked.end()) return false;
+  if (NowTick() - it->second < STALL_PARK_MS) return true;
+  g_parked.erase(it);
+  g_parkedCount.store((uint32_t)g_parked.size());
+  return false;
+}
+
+static void WorkerThreadMain();
+static void ReleaseDevice(int device);
+static void DropLostWorkers(int n);
+
+// Called by the tuner thread every TUNE_INTERVAL_MS.
+static void CheckStalls() {
+  const uint64_t now = NowTick();
+  std::vector<int> released;
+  int replaced = 0;
+  {
+    std::lock_guard<std::mutex> lk(g_slotMu);
+    for (const auto& slot : g_slots) {
+      const uint64_t since = slot->since.load();
+      if (since == 0 || now - since < DIR_STALL_MS) continue;
+      if (!slot->cancelled.exchange(true)) {
+        if (slot->thread) CancelSynchronousIo(slot->thread);
+        continue;
+      }
+      if (!slot->worker || now - since < 2 * DIR_STALL_MS) continue;
+      int running = (int)SlotJob::Running;
+      if (!slot->job.compare_exchange_strong(running, (int)SlotJob::Lost)) continue;
+      released.push_back(slot->device);
+      g_lostWorkers++;
+      slot->replaced = g_lostWorkers <= MAX_SPARE_WORKERS;
+      replaced += slot->replaced ? 1 : 0;
+    }
+  }
+  for (int device : released) ReleaseDevice(device);
+  if (replaced) DropLostWorkers(replaced);
+}
+
+// At exit: cuts short every read still in flight and returns the threads whose read has
+// already outlasted the guard, which StopWorkers leaves behind rather than joins.
+static std::vector<std::thread::id> CancelReadsForExit() {
+  const uint64_t now = NowTick();
+  std::vector<std::thread::id> stuck;
+  std::lock_guard<std::mutex> lk(g_slotMu);
+  for (const auto& slot : g_slots) {
+    const uint64_t since = slot->since.load();
+    if (since == 0) continue;
+    slot->cancelled.store(true);
+    if (slot->thread) CancelSynchronousIo(slot->thread);
+    if (now - since >= DIR_STALL_MS) stuck.push_back(slot->id);
+  }
+  return stuck;
+}
+
+// Test hook for the replay backend: DIRPIE_TRACE_STALL=<glob> makes replayed
+// directories with a matching name hang until the guard cancels them.
+static bool ReplayStalls(const wstring& dir) {
+  static const wstring glob = EnvString(L"DIRPIE_TRACE_STALL");
+  if (glob.empty()) return false;
+  const wstring trimmed = TrimTrailingSlash(dir);
+  const size_t cut = trimmed.find_last_of(L"\\/");
+  const size_t start = cut == wstring::npos ? 0 : cut + 1;
+  return GlobMatchNoCase(trimmed.c_str() + start, trimmed.size() - start, glob.c_str());
+}
+
+// One directory's entries ("." and ".." left out), from the disk or from the replayed
+// trace. The path-based walk, the folder listing and the estimator all read through it.
+struct DirReader {
+  DWORD error = 0;       // after Open fails or Next returns false: why; 0 at a clean end
+  uint64_t micros = 0;   // set once the listing has ended
+
+  const wchar_t* name = nullptr;  // the current entry; not null-terminated when replaying
+  size_t nameLen = 0;
+  uint32_t attributes = 0;
+  uint32_t reparseTag = 0;        // for reparse points; 0 when replaying
+  uint64_t size = 0;
+  uint64_t writeTime = 0;
+  uint64_t accessTime = 0;
+
+  HANDLE h = INVALID_HANDLE_VALUE;
+  WIN32_FIND_DATAW fd{};
+  bool pending = false;   // fd holds an entry not yet returned
+  bool ended = false;
+  uint64_t t0 = 0;
+
+  const FsTrace* replay = nullptr;
+  const TraceDir* rdir = nullptr;
+  uint32_t next = 0;
+
+  const wstring* dir = nullptr;
+  wstring key;            // recording only
+  bool record = false;
+  std::vector<TraceEntry> recEntries;
+  std::vector<wchar_t> recNames;
+
+  bool Open(const wstring& path) {
+    t0 = NowMicros();
+    dir = &path;
+    if (IsParked(path)) return Fail(ERROR_TIMEOUT);
+
+    replay = ReplayTrace();
+    if (replay) {
+      auto it = replay->dirs.find(TraceKey(path));
+      if (it == replay->dirs.end()) return Fail(ERROR_PATH_NOT_FOUND);
+      rdir = &it->second;
+      StallScope guard;
+      if (ReplayStalls(path) && !StallableSleep(UINT64_MAX / 2)) return Stall();
+      if (ReplayLatency() && rdir->micros && !StallableSleep(rdir->micros)) return Stall();
+      return rdir->openFailed ? Fail(rdir->error) : true;
+    }
+
+    if (TraceRecording()) {
+      key = TraceKey(path);
+      record = !TraceRecorded(key);
+    }
+    StallScope guard;
+    h = FindFirstFileExW(ToLongPath(EnsureBackslash(path) + L"*").c_str(), FindExInfoBasic, &fd,
+                         FindExSearchNameMatch, nullptr, FIND_FIRST_EX_LARGE_FETCH);
+    if (guard.Stalled()) return Stall();
+    if (h == INVALID_HANDLE_VALUE) return Fail(GetLastError());
+    pending = true;
+    return true;
+  }
+
+  bool Next() {
+    for (;;) {
+      if (ended) return false;
+      if (replay) {
+        if (next >= rdir->count) return End(rdir->error);
+        const TraceEntry& e = replay->entries[rdir->first + next++];
+        name = replay->names.data() + e.nameOff;
+        nameLen = e.nameLen;
+        attributes = e.attributes;
+        reparseTag = 0;
+        size = e.size;
+        writeTime = e.writeTime;
+        accessTime = e.accessTime;
+        return true;
+      }
+
+      if (!pending) {
+        StallScope guard;
+        const BOOL ok = FindNextFileW(h, &fd);
+        if (guard.Stalled()) return Stall();
+        if (!ok) {
+          const DWORD ec = GetLastError();
+          return End(ec == ERROR_NO_MORE_FILES ? 0 : ec);
+        }
+      }
+      pending = false;
+      if (IsDots(fd.cFileName)) continue;
+      name = fd.cFileName;
+      nameLen = wcslen(fd.cFileName);
+      attributes = fd.dwFileAttributes;
+      reparseTag = fd.dwReserved0;
+      size = ((uint64_t)fd.nFileSizeHigh << 32) | (uint64_t)fd.nFileSizeLow;
+      writeTime = FileTimeToU64(fd.ftLastWriteTime);
+      accessTime = FileTimeToU64(fd.ftLastAccessTime);
+      if (record) {
+        TraceEntry e{ (uint32_t)recNames.size(), (uint32_t)nameLen, attributes, size, writeTime, accessTime };
+        recEntries.push_back(e);
+        recNames.insert(recNames.end(), name, name + nameLen);
+      }
+      return true;
+    }
+  }
+
+  bool Fail(DWORD ec) { return End(ec); }
+
+  bool Stall() {
+    ParkDir(*dir);
+    return End(ERROR_TIMEOUT);
+  }
+
+  bool End(DWORD ec) {
+    ended = true;
+    error = ec;
+    micros = NowMicros() - t0;
+    if (record) {
+      TraceDir d;
+      d.error = ec;
+      d.openFailed = h == INVALID_HANDLE_VALUE;
+      d.micros = (uint32_t)std::min<uint64_t>(micros, UINT32_MAX);
+      RecordTraceDir(key, d, recEntries, recNames);
+      record = false;
+    }
+    return false;
+  }
+
+  ~DirReader() {
+    if (h != INVALID_HANDLE_VALUE) FindClose(h);
+  }
+};
+
+// Directory links: DIRPIE_FOLLOW=symlinks (or junctions, which adds mount points) walks
+// into them, entering a target only if that can neither loop nor count a tree twice.
+
+enum class FollowPolicy { Off, Symlinks, Junctions };
+
+static FollowPolicy ConfiguredFollow() {
+  static const FollowPolicy policy = [] {
+    const wstring v = EnvString(L"DIRPIE_FOLLOW");
+    if (_wcsicmp(v.c_str(), L"symlinks") == 0) return FollowPolicy::Symlinks;
+    if (_wcsicmp(v.c_str(), L"junctions") == 0) return FollowPolicy::Junctions;
+    return FollowPolicy::Off;
+  }();
+  return policy;
+}
+
+static bool FollowsTag(DWORD tag) {
+  const FollowPolicy p = ConfiguredFollow();
+  if (p == FollowPolicy::Off) return false;
+  return tag == IO_REPARSE_TAG_SYMLINK || (p == FollowPolicy::Junctions && tag == IO_REPARSE_TAG_MOUNT_POINT);
+}
+
+static bool IdentifyDir(HANDLE h, DirId& id, wstring& path) {
+  BY_HANDLE_FILE_INFORMATION fi{};
+  if (!GetFileInformationByHandle(h, &fi)) return false;
+  id.volume = fi.dwVolumeSerialNumber;
+  id.file = ((uint64_t)fi.nFileIndexHigh << 32) | fi.nFileIndexLow;
+
+  // Volume GUID paths name a directory the same way whichever drive letter or mount
+  // point it was reached through; network shares have none.
+  path.clear();
+  for (DWORD flags : {FILE_NAME_NORMALIZED | VOLUME_NAME_GUID, FILE_NAME_NORMALIZED | VOLUME_NAME_DOS}) {
+    wchar_t buf[MAX_PATH];
+    DWORD n = GetFinalPathNameByHandleW(h, buf, MAX_PATH, flags);
+    if (n > 0 && n < MAX_PATH) {
+      path.assign(buf, n);
+    } else if (n >= MAX_PATH) {
+      path.resize(n);
+      n = GetFinalPathNameByHandleW(h, &path[0], n, flags);
+      path.resize(n < path.size() ? n : 0);
+    }
+    if (!path.empty()) break;
+  }
+  if (!path.empty()) path = FoldPath(path);
+  return true;
+}
+
+// Records a link target the walk enters: one not entered before and neither inside nor
+// around the root or another target. path is folded, or empty when the volume has none.
+static bool AdmitLinkTarget(FollowedDirs& f, const DirId& id, wstring path) {
+  if (!f.ids.insert(id).second) return false;
+  if (path.empty()) return true;
+  for (const wstring& p : f.paths) {
+    if (PathWithin(path, p) || PathWithin(p, path)) return false;
+  }
+  f.paths.push_back(std::move(path));
+  return true;
+}
+
+// Called with a handle opened through a link the policy follows; true when the walk
+// should enter it.
+static bool EnterLink(WalkContext& w, const wstring& root, HANDLE target) {
+  const uint64_t t0 = w.io ? NowMicros() : 0;
+  StallScope guard;
+  if (!w.followed) {
+    w.followed.reset(new FollowedDirs());
+    HANDLE h = CreateFileW(ToLongPath(root).c_str(), FILE_READ_ATTRIBUTES,
+                           FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+                           FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+    if (h != INVALID_HANDLE_VALUE) {
+      DirId id;
+      wstring path;
+      if (IdentifyDir(h, id, path)) {
+        w.followed->ids.insert(id);
+        if (!path.empty()) w.followed->paths.push_back(std::move(path));
+      }
+      CloseHandle(h);
+    }
+  }
+
+  DirId id;
+  wstring path;
+  const bool known = IdentifyDir(target, id, path);
+  bool enter = known && AdmitLinkTarget(*w.followed, id, std::move(path));
+
+  if (guard.Stalled()) {
+    enter = false;
+    AddSkipFromError(ERROR_TIMEOUT, w.st);
+  } else if (!known) {
+    w.st.incomplete = true;
+    w.st.skipped_reparse++;
+  } else if (enter) {
+    w.st.followed++;
+  } else {
+    w.st.skipped_loop++;
+  }
+  if (w.io) {
+    w.io->follows.fetch_add(1, std::memory_order_relaxed);
+    w.io->followMicros.fetch_add(NowMicros() - t0, std::memory_order_relaxed);
+  }
+  return enter;
+}
+
+// EnterLink for the path-based backend, which holds no handle to the link.
+static bool EnterLinkAt(WalkContext& w, const wstring& root, const wstring& link) {
+  HANDLE h = INVALID_HANDLE_VALUE;
+  {
+    StallScope guard;
+    h = CreateFileW(ToLongPath(link).c_str(), FILE_READ_ATTRIBUTES,
+                    FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+                    FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+    if (guard.Stalled()) {
+      if (h != INVALID_HANDLE_VALUE) CloseHandle(h);
+      ParkDir(link);
+      AddSkipFromError(ERROR_TIMEOUT, w.st);
+      return false;
+    }
+  }
+  if (h == INVALID_HANDLE_VALUE) {
+    AddSkipFromError(GetLastError(), w.st);
+    return false;
+  }
+  const bool enter = EnterLink(w, root, h);
+  CloseHandle(h);
+  return enter;
+}
+
+static const ULONG NT_OBJ_CASE_INSENSITIVE = 0x00000040;
+static const ULONG NT_FILE_OPEN = 0x00000001;
+static const ULONG NT_FILE_DIRECTORY_FILE = 0x00000001;
+static const ULONG NT_FILE_SYNCHRONOUS_IO_NONALERT = 0x00000020;
+static const ULONG NT_FILE_OPEN_FOR_BACKUP_INTENT = 0x00004000;
+
+typedef NTSTATUS (NTAPI* NtCreateFileFn)(PHANDLE, ACCESS_MASK, POBJECT_ATTRIBUTES, PIO_STATUS_BLOCK, PLARGE_INTEGER,
+                                         ULONG, ULONG, ULONG, ULONG, PVOID, ULONG);
+typedef ULONG (NTAPI* RtlNtStatusToDosErrorFn)(NTSTATUS);
+typedef NTSTATUS (NTAPI* NtQueryInformationByNameFn)(POBJECT_ATTRIBUTES, PIO_STATUS_BLOCK, PVOID, ULONG, int);
+
+static const int NT_FILE_STAT_INFORMATION = 68;
+
+// FILE_STAT_INFORMATION, which only the driver kit headers declare.
+struct NtFileStat {
+  LARGE_INTEGER fileId;
+  LARGE_INTEGER creationTime;
+  LARGE_INTEGER lastAccessTime;
+  LARGE_INTEGER lastWriteTime;
+  LARGE_INTEGER changeTime;
+  LARGE_INTEGER allocationSize;
+  LARGE_INTEGER endOfFile;
+  ULONG fileAttributes;
+  ULONG reparseTag;
+  ULONG numberOfLinks;
+  ACCESS_MASK effectiveAccess;
+};
+
+struct NtApi {
+  NtCreateFileFn createFile = nullptr;
+  RtlNtStatusToDosErrorFn toDosError = nullptr;
+  NtQueryInformationByNameFn queryByName = nullptr;  // Windows 10 1709 and later
+};
+
+static const NtApi& GetNtApi() {
+  static const NtApi api = [] {
+    NtApi a{};
+    HMODULE ntdll = GetModuleHandleW(L"ntdll.dll");
+    if (ntdll) {
+      a.createFile = (NtCreateFileFn)(void*)GetProcAddress(ntdll, "NtCreateFile");
+      a.toDosError = (RtlNtStatusToDosErrorFn)(void*)GetProcAddress(ntdll, "RtlNtStatusToDosError");
+      a.queryByName = (NtQueryInformationByNameFn)(void*)GetProcAddress(ntdll, "NtQueryInformationByName");
+    }
+    return a;
+  }();
+  return api;
+}
+
+// A file's ID and link count without opening it: name is relative to the open
+// directory dir, or a full path when dir is null.
+static bool StatFileLinks(HANDLE dir, const wchar_t* name, size_t len, uint64_t& fileId, uint32_t& links) {
+  const NtApi& nt = GetNtApi();
+  if (!nt.queryByName) return false;
+  UNICODE_STRING us{};
+  us.Buffer = const_cast<PWSTR>(name);
+  us.Length = (USHORT)(len * sizeof(wchar_t));
+  us.MaximumLength = us.Length;
+
+  OBJECT_ATTRIBUTES oa{};
+  oa.Length = sizeof(oa);
+  oa.RootDirectory = dir;
+  oa.ObjectName = &us;
+  oa.Attributes = NT_OBJ_CASE_INSENSITIVE;
+
+  IO_STATUS_BLOCK iosb{};
+  NtFileStat fs{};
+  if (nt.queryByName(&oa, &iosb, &fs, sizeof(fs), NT_FILE_STAT_INFORMATION) < 0) return false;
+  fileId = (uint64_t)fs.fileId.QuadPart;
+  links = fs.numberOfLinks;
+  return true;
+}
+
+// A file's on-disk bytes, or 0 when it has another name that has already been
+// counted. Only files that take clusters and have more than one link are looked up.
+static uint64_t LinkedAllocation(WalkContext& w, HANDLE dir, const wchar_t* name, size_t len, uint64_t alloc) {
+  uint64_t fileId = 0;
+  uint32_t links = 0;
+  if (!w.links || alloc == 0 || !StatFileLinks(dir, name, len, fileId, links) || links < 2) return alloc;
+  if (CountLinkOnDisk(w, fileId)) return alloc;
+  w.st.dup_links++;
+  return 0;
+}
+
+// The path-based backend sees no allocation sizes: sparse and compressed files ask the
+// file system, everything else is rounded up to whole clusters.
+static uint64_t AllocatedSize(const WalkContext& w, const wstring& dir, const DirReader& rd) {
+  if ((rd.attributes & (FILE_ATTRIBUTE_SPARSE_FILE | FILE_ATTRIBUTE_COMPRESSED)) && !ReplayTrace()) {
+    DWORD hi = 0;
+    const DWORD lo = GetCompressedFileSizeW(ToLongPath(JoinPath(dir, wstring(rd.name, rd.nameLen))).c_str(), &hi);
+    if (lo != INVALID_FILE_SIZE || GetLastError() == NO_ERROR) return ((uint64_t)hi << 32) | lo;
+  }
+  return (rd.size + w.clusterBytes - 1) / w.clusterBytes * w.clusterBytes;
+}
+
+// Path-based backend: FindFirstFileExW on a full search pattern per directory,
+// through DirReader.
+static void WalkFindFile(WalkContext& w, WalkScratch& scratch, const wstring& root) {
+  const ExcludeRules& excludes = ConfiguredExcludes();
+  std::vector<uint32_t>& match = scratch.match;
+  std::vector<PendingDir>& stack = scratch.stack;
+  stack.clear();
+  stack.push_back(PendingDir{root, 0, 0, (uint32_t)match.size()});
+
+  while (!stack.empty()) {
+    if (WalkCancelled(w)) return;
+
+    const PendingDir cur = std::move(stack.back());
+    stack.pop_back();
+    const wstring& dir = cur.path;
+    match.resize(cur.matchOff + cur.matchLen);  // states past ours belong to finished directories
+
+    uint64_t seen = 0;
+    DirReader rd;
+    if (!rd.Open(dir)) {
+      AddSkipFromError(rd.error, w.st);
+      continue;
+    }
+
+    while (rd.Next()) {
+      if (WalkCancelled(w)) return;
+
+      const wchar_t* name = rd.name;
+      const size_t len = rd.nameLen;
+      seen++;
+      const bool isDir = (rd.attributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+      const bool isReparse = (rd.attributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0;
+
+      const size_t matchOff = match.size();
+      if (isDir && !excludes.Empty() && MatchExcluded(excludes, match, cur.matchOff, cur.matchLen, name, len)) {
+        match.resize(matchOff);
+        w.st.skipped_excluded++;
+      } else if (isDir) {
+        if (isReparse && !FollowsTag(rd.reparseTag)) {
+          w.st.incomplete = true;
+          w.st.skipped_reparse++;
+        } else {
+          wstring path = JoinPath(dir, wstring(name, len));
+          if (!isReparse || EnterLinkAt(w, root, path)) {
+            const uint32_t child = w.tree ? AddTreeNode(*w.tree, cur.node, name, len) : 0;
+            stack.push_back(PendingDir{std::move(path), child, (uint32_t)matchOff, (uint32_t)(match.size() - matchOff),
+                                       cur.viaLink || isReparse});
+            w.cs.dirs++;
+          }
+        }
+      } else {
+        uint64_t alloc = AllocatedSize(w, dir, rd);
+        if (w.links && !cur.viaLink && alloc > 0) {
+          const wstring nt = L"\\??\\" + ToLongPath(JoinPath(dir, wstring(name, len))).substr(4);
+          alloc = LinkedAllocation(w, nullptr, nt.c_str(), nt.size(), alloc);
+        }
+        if (AccountFile(w, cur.node, rd.size, alloc, rd.writeTime, rd.accessTime)) return;
+      }
+    }
+    if (rd.error) AddSkipFromError(rd.error, w.st);
+    AddReadTime(w, seen, rd.micros);
+  }
+}
+
+static uint64_t MemoryBudget() {
+  static const uint64_t budget = (uint64_t)wcstoull(EnvString(L"DIRPIE_MEMORY_MB").c_str(), nullptr, 10) * 1024 * 1024;
+  return budget;
+}
+
+enum class WalkBackend { FindFile, HandleRelative };
+
+// DIRPIE_WALK=find forces the path-based backend, e.g. to compare the two.
+static WalkBackend ConfiguredWalkBackend() {
+  static const WalkBackend backend = [] {
+    if (_wcsicmp(EnvString(L"DIRPIE_WALK").c_str(), L"find") == 0) return WalkBackend::FindFile;
+    if (TraceRecording() || ReplayTrace()) return WalkBackend::FindFile;
+    return GetNtApi().createFile ? WalkBackend::HandleRelative : WalkBackend::FindFile;
+  }();
+  return backend;
+}
+
+// Handle-relative backend: each subdirectory is opened with NtCreateFile relative to
+// its parent's open handle, and entries are read in batches with
+// GetFileInformationByHandleEx. No path strings are built; the walk holds one handle
+// and one reused read buffer per level of the current DFS path, and full paths come
+// from the ScanTree only when something needs to display them.
+static HANDLE OpenDirRelative(HANDLE parent, const wchar_t* name, size_t len, DWORD& err) {
+  UNICODE_STRING us{};
+  us.Buffer = const_cast<PWSTR>(name);
+  us.Length = (USHORT)(len * sizeof(wchar_t));
+  us.MaximumLength = us.Length;
+
+  OBJECT_ATTRIBUTES oa{};
+  oa.Length = sizeof(oa);
+  oa.RootDirectory = parent;
+  oa.ObjectName = &us;
+  oa.Attributes = NT_OBJ_CASE_INSENSITIVE;
+
+  IO_STATUS_BLOCK iosb{};
+  HANDLE h = nullptr;
+  const NtApi& nt = GetNtApi();
+  const NTSTATUS status = nt.createFile(&h, FILE_LIST_DIRECTORY | SYNCHRONIZE, &oa, &iosb, nullptr, 0,
+                                        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NT_FILE_OPEN,
+                                        NT_FILE_DIRECTORY_FILE | NT_FILE_SYNCHRONOUS_IO_NONALERT |
+                                            NT_FILE_OPEN_FOR_BACKUP_INTENT,
+                                        nullptr, 0);
+  if (status < 0) {
+    err = nt.toDosError ? nt.toDosError(status) : ERROR_GEN_FAILURE;
+    return nullptr;
+  }
+  return h;
+}
+
+// Returns false when the root cannot be opened this way; the caller then falls back
+// to the path-based backend.
+static bool WalkHandleRelative(WalkContext& w, WalkScratch& scratch, const wstring& root) {
+  if (IsParked(root)) {
+    AddSkipFromError(ERROR_TIMEOUT, w.st);
+    return true;
+  }
+  HANDLE rootHandle = INVALID_HANDLE_VALUE;
+  {
+    StallScope guard;
+    rootHandle = CreateFileW(ToLongPath(root).c_str(), FILE_LIST_DIRECTORY | SYNCHRONIZE,
+                             FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+                             FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+    if (guard.Stalled()) {
+      if (rootHandle != INVALID_HANDLE_VALUE) CloseHandle(rootHandle);
+      ParkDir(root);
+      AddSkipFromError(ERROR_TIMEOUT, w.st);
+      return true;
+    }
+  }
+  if (rootHandle == INVALID_HANDLE_VALUE) return false;
+
+  // Paths are only built when something is parked or has just stalled, and only
+  // walks that build a tree know them.
+  auto nodePath = [&](uint32_t node) { return w.tree ? TreeNodePath(*w.tree, node) : wstring(); };
+
+  // One buffer per depth, reused for every directory at that depth.
+  std::vector<std::vector<uint64_t>>& buffers = scratch.buffers;
+  std::vector<DirFrame>& frames = scratch.frames;
+  frames.clear();
+  frames.push_back(DirFrame{rootHandle, 0});
+  frames.back().matchLen = (uint32_t)scratch.match.size();
+  const ExcludeRules& excludes = ConfiguredExcludes();
+  std::vector<uint32_t>& match = scratch.match;
+
+  // A finished subtree below the collapse threshold becomes one aggregate node. When
+  // this tree alone outgrows half the memory budget, the threshold is raised for the
+  // rest of this walk and for later ones, and again each time the tree has grown by
+  // another COLLAPSE_RAISE_STEP of the budget despite it.
+  const uint64_t budget = MemoryBudget();
+  uint64_t raiseAt = budget / 2;
+  auto popFrame = [&] {
+    DirFrame& f = frames.back();
+    CloseHandle(f.handle);
+    AddReadTime(w, f.seen, f.micros);
+    if (w.tree && frames.size() > 1) {
+      if (w.collapseBelow > 0) CollapseSubtree(*w.tree, f.node, w.collapseBelow);
+      if (budget > 0 && TreeBytes(*w.tree) > raiseAt) {
+        raiseAt = TreeBytes(*w.tree) + (uint64_t)(budget * COLLAPSE_RAISE_STEP);
+        w.collapseBelow = std::min(COLLAPSE_MAX_BYTES, std::max(COLLAPSE_MIN_BYTES, w.collapseBelow * 4));
+        uint64_t cur = g_collapseBelow.load();
+        while (cur < w.collapseBelow && !g_collapseBelow.compare_exchange_weak(cur, w.collapseBelow)) {}
+      }
+    }
+    frames.pop_back();
+  };
+
+  while (!frames.empty()) {
+    if (WalkCancelled(w)) break;
+
+    const size_t depth = frames.size() - 1;
+    if (buffers.size() <= depth) buffers.emplace_back(DIR_READ_BUFFER_BYTES / sizeof(uint64_t));
+    unsigned char* buf = (unsigned char*)buffers[depth].data();
+
+    if (!frames.back().buffered) {
+      DirFrame& f = frames.back();
+      const uint64_t t0 = w.io ? NowMicros() : 0;
+      StallScope guard;
+      BOOL ok = GetFileInformationByHandleEx(f.handle, FileFullDirectoryInfo, buf, DIR_READ_BUFFER_BYTES);
+      DWORD ec = ok ? 0 : GetLastError();
+      if (guard.Stalled()) {
+        ok = FALSE;
+        ec = ERROR_TIMEOUT;
+        ParkDir(nodePath(f.node));
+      }
+      if (w.io) f.micros += NowMicros() - t0;
+      if (!ok) {
+        if (ec != ERROR_NO_MORE_FILES) AddSkipFromError(ec, w.st);
+        popFrame();
+        continue;
+      }
+      f.buffered = true;
+      f.next = 0;
+    }
+
+    DirFrame& f = frames.back();
+    const FILE_FULL_DIR_INFO* e = (const FILE_FULL_DIR_INFO*)(buf + f.next);
+    if (e->NextEntryOffset == 0) f.buffered = false;
+    else f.next += e->NextEntryOffset;
+    f.seen++;
+
+    const wchar_t* name = e->FileName;
+    const size_t len = e->FileNameLength / sizeof(wchar_t);
+    if ((len == 1 && name[0] == L'.') || (len == 2 && name[0] == L'.' && name[1] == L'.')) continue;
+
+    if (e->FileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+      const size_t matchOff = f.matchOff + f.matchLen;
+      if (!excludes.Empty()) {
+        match.resize(matchOff);
+        if (MatchExcluded(excludes, match, f.matchOff, f.matchLen, name, len)) {
+          match.resize(matchOff);
+          w.st.skipped_excluded++;
+          continue;
+        }
+      }
+      // For reparse points, EaSize holds the reparse tag.
+      const bool reparse = (e->FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0;
+      if (reparse && !FollowsTag(e->EaSize)) {
+        w.st.incomplete = true;
+        w.st.skipped_reparse++;
+        continue;
+      }
+      DWORD err = 0;
+      if (g_parkedCount.load() && w.tree && IsParked(JoinPath(nodePath(f.node), wstring(name, len)))) {
+        AddSkipFromError(ERROR_TIMEOUT, w.st);
+        continue;
+      }
+      const uint64_t t0 = w.io ? NowMicros() : 0;
+      HANDLE child = nullptr;
+      {
+        StallScope guard;
+        child = OpenDirRelative(f.handle, name, len, err);
+        if (guard.Stalled()) {
+          if (child) CloseHandle(child);
+          child = nullptr;
+          err = ERROR_TIMEOUT;
+          ParkDir(JoinPath(nodePath(f.node), wstring(name, len)));
+        }
+      }
+      if (w.io) f.micros += NowMicros() - t0;
+      if (!child) {
+        AddSkipFromError(err, w.st);
+        continue;
+      }
+      if (reparse && !EnterLink(w, root, child)) {
+        CloseHandle(child);
+        continue;
+      }
+      const uint32_t node = w.tree ? AddTreeNode(*w.tree, f.node, name, len) : 0;
+      w.cs.dirs++;
+      DirFrame next{child, node};
+      next.matchOff = (uint32_t)matchOff;
+      next.matchLen = (uint32_t)(match.size() - matchOff);
+      next.viaLink = f.viaLink || reparse;
+      frames.push_back(next);
+    } else {
+      // Past a followed link the volume may differ, and IDs from two volumes could collide.
+      uint64_t alloc = (uint64_t)e->AllocationSize.QuadPart;
+      if (!f.viaLink) alloc = LinkedAllocation(w, f.handle, name, len, alloc);
+      const uint64_t sz = (uint64_t)e->EndOfFile.QuadPart;
+      if (AccountFile(w, f.node, sz, alloc, (uint64_t)e->LastWriteTime.QuadPart,
+                      (uint64_t)e->LastAccessTime.QuadPart)) {
+        break;
+      }
+    }
+  }
+
+  while (!frames.empty()) popFrame();
+  return true;
+}
+
+// When tree is non-null, every traversed directory gets a TreeNode holding its own
+// file totals; call AggregateTree once the walk has completed.
+static uint64_t WalkDirLogicalSize(const wstring& rootAbs,
+                                  uint64_t capBytes,
+                                  const JobTicket* ticket,
+                                  WalkStats& st,
+                                  ContentStats& cs,
+                                  ScanTree* tree,
+                                  IoCounters* io = nullptr,
+                                  WalkScratch* scratch = nullptr) {
+  TimelineSpan span("walk", rootAbs);
+  WalkContext w{capBytes, ticket, st, cs, tree, io, MakeAgeEdges()};
+  w.collapseBelow = g_collapseBelow.load();
+  const wstring root = TrimTrailingSlash(rootAbs);
+
+  WalkScratch local;
+  WalkScratch& sc = scratch ? *scratch : local;
+
+  cs.physical = true;
+  if (!ReplayTrace()) {
+    const LinkVolume lv = ProbeLinkVolume(root);
+    w.clusterBytes = lv.clusterBytes;
+    w.links = lv.links;
+    w.volume = lv.serial;
+    w.linkWalk = ++g_linkWalks;
+    w.linkRoot = LinkRootId(root);
+  }
+
+  if (tree) {
+    tree->rootPath = root;
+    AddTreeNode(*tree, 0, L"");
+  }
+
+  sc.match.clear();
+  const ExcludeRules& excludes = ConfiguredExcludes();
+  if (!excludes.Empty() && MatchExcludedRoot(excludes, root, sc.match)) {
+    st.skipped_excluded++;
+    ReportWalk(w, 0, 0);
+    return 0;
+  }
+
+  if (ConfiguredWalkBackend() != WalkBackend::HandleRelative || !WalkHandleRelative(w, sc, root)) {
+    WalkFindFile(w, sc, root);
+  }
+  ReportWalk(w, 0, 0);  // what came after the last directory read: a cap, a failed root
+  return w.total;
+}
+
+// Sampling estimator: the top of a tree read breadth-first, the rest extrapolated from
+// random descents (Knuth's estimator) whose spread gives a 95% confidence interval.
+
+static const uint32_t ESTIMATE_DIR_READS = 256;
+static const uint32_t ESTIMATE_MAX_DEPTH = 64;
+static const double ESTIMATE_Z95 = 1.96;
+
+struct DirSummary {
+  uint64_t bytes = 0;
+  uint64_t files = 0;
+  std::vector<wstring> subdirs;  // full paths; reparse points and excluded directories left out
+};
+
+static bool ReadDirSummary(const wstring& dir, DirSummary& out) {
+  out.bytes = 0;
+  out.files = 0;
+  out.subdirs.clear();
+
+  DirReader rd;
+  if (!rd.Open(dir)) return false;
+
+  const ExcludeRules& excludes = ConfiguredExcludes();
+  std::vector<uint32_t> states;
+  while (rd.Next()) {
+    if (rd.attributes & FILE_ATTRIBUTE_DIRECTORY) {
+      if (rd.attributes & FILE_ATTRIBUTE_REPARSE_POINT) continue;
+      wstring child = JoinPath(dir, wstring(rd.name, rd.nameLen));
+      if (!excludes.Empty() && MatchExcludedRoot(excludes, child, states)) continue;
+      out.subdirs.push_back(std::move(child));
+    } else {
+      out.bytes += rd.size;
+      out.files++;
+    }
+  }
+  return true;
+}
+
+// Scales the mean of the descents' guesses up to a frontier of the given size; margin
+// receives the half-width of the 95% interval around it. Needs two or more guesses.
+static double FrontierEstimate(const std::vector<double>& guesses, size_t frontier, double& margin) {
+  const double m = (double)guesses.size();
+  double mean = 0;
+  for (double x : guesses) mean += x;
+  mean /= m;
+  double var = 0;
+  for (double x : guesses) var += (x - mean) * (x - mean);
+  var /= (m - 1);
+  margin = ESTIMATE_Z95 * (double)frontier * std::sqrt(var / m);
+  return (double)frontier * mean;
+}
+
+// Fills si with an estimate of root's subtree. Returns false when cancelled.
+static bool EstimateDirSize(const wstring& root, const JobTicket* ticket, SizeInfo& si) {
+  std::mt19937_64 rng(FoldHash(root.c_str(), root.size()) ^ NowTick());
+  auto cancelled = [&] { return g_quit.load() || (ticket && ticket->cancelled.load()); };
+
+  double bytes = 0, files = 0, dirs = 0;
+  uint32_t reads = 0;
+  DirSummary d;
+
+  std::vector<wstring> queue{ TrimTrailingSlash(root) };
+  size_t head = 0;
+  while (head < queue.size() && reads < ESTIMATE_DIR_READS / 2) {
+    if (cancelled()) return false;
+    reads++;
+    if (!ReadDirSummary(queue[head++], d)) continue;
+    bytes += (double)d.bytes;
+    files += (double)d.files;
+    dirs += (double)d.subdirs.size();
+    for (wstring& c : d.subdirs) queue.push_back(std::move(c));
+  }
+
+  const size_t frontier = queue.size() - head;
+  double margin = 0;
+  if (frontier > 0) {
+    std::vector<double> sb, sf, sd;
+    while (reads < ESTIMATE_DIR_READS || sb.size() < 2) {
+      if (cancelled()) return false;
+      wstring path = queue[head + (size_t)(rng() % frontier)];
+      double weight = 1, eb = 0, ef = 0, ed = 0;
+      for (uint32_t depth = 0; depth < ESTIMATE_MAX_DEPTH; ++depth) {
+        reads++;
+        if (!ReadDirSummary(path, d)) break;
+        eb += weight * (double)d.bytes;
+        ef += weight * (double)d.files;
+        ed += weight * (double)d.subdirs.size();
+        if (d.subdirs.empty()) break;
+        weight *= (double)d.subdirs.size();
+        path = d.subdirs[(size_t)(rng() % d.subdirs.size())];
+      }
+      sb.push_back(eb);
+      sf.push_back(ef);
+      sd.push_back(ed);
+    }
+
+    double unused = 0;
+    bytes += FrontierEstimate(sb, frontier, margin);
+    files += FrontierEstimate(sf, frontier, unused);
+    dirs += FrontierEstimate(sd, frontier, unused);
+  }
+
+  si = SizeInfo{};
+  si.bytes = (uint64_t)bytes;
+  si.content.files = (uint64_t)files;
+  si.content.dirs = (uint64_t)dirs;
+  si.estimate = true;
+  si.margin = (uint64_t)margin;
+  si.tick = NowTick();
+  return true;
+}
+
+// DIRPIE_ESTIMATE=off skips the sampling pass and starts with the capped walk.
+static bool EstimateFirst() {
+  static const bool on = _wcsicmp(EnvString(L"DIRPIE_ESTIMATE").c_str(), L"off") != 0;
+  return on;
+}
+
+// Idle-time prefetch (DIRPIE_PREFETCH=off disables it). Once a folder's pie is complete,
+// the children of its PREFETCH_SLICES largest slices and of its parent are sized at the
+// lowest priority, at most PREFETCH_CHILDREN per folder.
+static const int PREFETCH_SLICES = 3;
+static const size_t PREFETCH_CHILDREN = 256;
+
+static bool Prefetching() {
+  static const bool on = _wcsicmp(EnvString(L"DIRPIE_PREFETCH").c_str(), L"off") != 0;
+  return on;
+}
+
+// Prefetch lists a folder and queues speculative Capped walks for its children.
+enum class JobKind { Estimate, Capped, Exact, Prefetch };
+
+struct Job {
+  std::shared_ptr<JobTicket> ticket;  // null for the CLI and the index service
+  wstring path;
+  JobKind kind = JobKind::Capped;
+  int device = 0;
+  wstring skip;  // Prefetch: a child not to walk again (the folder the view shows)
+};
+
+enum class DeviceKind { Unknown, Ssd, Hdd, Network };
+
+// One queue per underlying device (physical disk number, network share, or volume
+// serial as a fallback), each with its own concurrency limit.
+struct Device {
+  wstring key;
+  wstring label;
+  DeviceKind kind = DeviceKind::Unknown;
+  int limit = DEVICE_LIMIT_UNKNOWN;
+  int startLimit = DEVICE_LIMIT_UNKNOWN;
+  int active = 0;
+  std::deque<Job> jobs;
+  std::deque<Job> idleJobs;   // speculative prefetch; started only while jobs is empty
+  std::vector<std::shared_ptr<JobTicket>> speculative;  // prefetch tickets queued or running here
+  IoCounters io;
+
+  // Tuner state; only touched by the tuner thread under g_jobMu.
+  uint64_t lastEntries = 0;
+  uint64_t lastReads = 0;
+  uint64_t lastMicros = 0;
+  double lastRate = 0;       // entries/sec of the previous saturated sample
+  double bestLatency = 0;    // lowest mean directory-read latency seen, in us
+  int step = 1;              // +1 probing up, -1 backing off
+  int lastMove = 0;          // change applied by the previous sample
+  int flatSamples = 0;
+};
+
+static std::mutex g_jobMu;
+static std::condition_variable g_jobCv;
+static std::vector<std::unique_ptr<Device>> g_devices;  // append-only; guarded by g_jobMu
+static size_t g_nextDevice = 0;                         // round-robin start for TakeJob
+static std::unordered_map<wstring, std::shared_ptr<JobTicket>> g_tickets;  // in-flight walks by path; guarded by g_jobMu
+static bool g_memoryDue = false;  // a spill or page-in pass is wanted; guarded by g_jobMu
+static wstring g_pageInDir;       // guarded by g_jobMu
+
+static std::mutex g_deviceMu;
+static std::unordered_map<wstring, int> g_deviceByVolume;  // volume root -> g_devices index
+
+static const wchar_t* DeviceKindName(DeviceKind k) {
+  switch (k) {
+    case DeviceKind::Ssd: return L"ssd";
+    case DeviceKind::Hdd: return L"hdd";
+    case DeviceKind::Network: return L"net";
+    case DeviceKind::Unknown: break;
+  }
+  return L"?";
+}
+
+static DeviceKind ProbeDevice(const wstring& volumeRoot, wstring& key) {
+  const bool unc = StartsWithNoCase(volumeRoot, L"\\\\") && !StartsWithNoCase(volumeRoot, L"\\\\?\\");
+  if (unc || GetDriveTypeW(volumeRoot.c_str()) == DRIVE_REMOTE) {
+    key = L"net:" + volumeRoot;
+    return DeviceKind::Network;
+  }
+
+  DWORD serial = 0;
+  GetVolumeInformationW(volumeRoot.c_str(), nullptr, 0, &serial, nullptr, nullptr, nullptr, 0);
+  wchar_t buf[64];
+  swprintf(buf, 64, L"vol:%08lX", serial);
+  key = buf;
+
+  wchar_t volName[MAX_PATH]{};
+  if (!GetVolumeNameForVolumeMountPointW(volumeRoot.c_str(), volName, MAX_PATH)) return DeviceKind::Unknown;
+  wstring dev = volName;
+  if (!dev.empty() && dev.back() == L'\\') dev.pop_back();
+
+  HANDLE h = CreateFileW(dev.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, 0, nullptr);
+  if (h == INVALID_HANDLE_VALUE) return DeviceKind::Unknown;
+
+  DWORD n = 0;
+  STORAGE_DEVICE_NUMBER sdn{};
+  if (DeviceIoControl(h, IOCTL_STORAGE_GET_DEVICE_NUMBER, nullptr, 0, &sdn, sizeof(sdn), &n, nullptr)) {
+    swprintf(buf, 64, L"disk#%lu", sdn.DeviceNumber);
+    key = buf;
+  }
+
+  DeviceKind kind = DeviceKind::Unknown;
+  STORAGE_PROPERTY_QUERY q{};
+  q.PropertyId = StorageDeviceSeekPenaltyProperty;
+  q.QueryType = PropertyStandardQuery;
+  DEVICE_SEEK_PENALTY_DESCRIPTOR sp{};
+  if (DeviceIoControl(h, IOCTL_STORAGE_QUERY_PROPERTY, &q, sizeof(q), &sp, sizeof(sp), &n, nullptr) &&
+      n >= sizeof(sp)) {
+    kind = sp.IncursSeekPenalty ? DeviceKind::Hdd : DeviceKind::Ssd;
+  }
+  CloseHandle(h);
+  return kind;
+}
+
+// Maps a path to its device queue, probing each volume once.
+static int DeviceForPath(const wstring& path) {
+  wchar_t vol[MAX_PATH]{};
+  wstring volumeRoot = GetVolumePathNameW(path.c_str(), vol, MAX_PATH) ? vol : EnsureBackslash(path);
+  {
+    std::lock_guard<std::mutex> lk(g_deviceMu);
+    auto it = g_deviceByVolume.find(volumeRoot);
+    if (it != g_deviceByVolume.end()) return it->second;
+  }
+
+  wstring key;
+  const DeviceKind kind = ProbeDevice(volumeRoot, key);
+
+  int idx = -1;
+  {
+    std::lock_guard<std::mutex> lk(g_jobMu);
+    for (size_t i = 0; i < g_devices.size(); ++i) {
+      if (g_devices[i]->key == key) { idx = (int)i; break; }
+    }
+    if (idx < 0) {
+      auto d = std::make_unique<Device>();
+      d->key = key;
+      d->label = TrimTrailingSlash(volumeRoot);
+      d->kind = kind;
+      d->limit = (kind == DeviceKind::Ssd) ? DEVICE_LIMIT_SSD
+               : (kind == DeviceKind::Hdd) ? DEVICE_LIMIT_HDD
+               : (kind == DeviceKind::Network) ? DEVICE_LIMIT_NETWORK
+               : DEVICE_LIMIT_UNKNOWN;
+      d->startLimit = d->limit;
+      g_devices.push_back(std::move(d));
+      idx = (int)g_devices.size() - 1;
+    }
+  }
+
+  std::lock_guard<std::mutex> lk(g_deviceMu);
+  g_deviceByVolume[volumeRoot] = idx;
+  return idx;
+}
+
+// Cancels the device's prefetch work, queued and running. g_jobMu must be held.
+static void DropSpeculative(Device& d) {
+  for (const auto& t : d.speculative) {
+    if (!t->speculative.load() || t->done.load()) continue;
+    t->cancelled.store(true);
+    auto it = g_tickets.find(t->path);
+    if (it != g_tickets.end() && it->second == t) g_tickets.erase(it);
+  }
+  d.speculative.clear();
+  const uint32_t dropped = (uint32_t)d.idleJobs.size();
+  d.idleJobs.clear();
+  if (dropped) {
+    g_jobs_queued.fetch_sub(dropped);
+    g_jobs_done.fetch_add(dropped);
+  }
+}
+
+// Pops the next job from a device that still has spare capacity. g_jobMu must be held.
+// Prefetch jobs run only on devices with no real work queued, and real work waiting
+// on a full device cancels the prefetch walks holding its slots.
+static bool TakeJob(Job& out) {
+  const size_t n = g_devices.size();
+  for (size_t k = 0; k < n; ++k) {
+    const size_t i = (g_nextDevice + k) % n;
+    Device& d = *g_devices[i];
+    if (d.jobs.empty()) continue;
+    if (d.active >= d.limit) {
+      if (!d.speculative.empty()) DropSpeculative(d);
+      continue;
+    }
+    out = std::move(d.jobs.front());
+    d.jobs.pop_front();
+    d.active++;
+    g_nextDevice = (i + 1) % n;
+    return true;
+  }
+  for (size_t k = 0; k < n; ++k) {
+    const size_t i = (g_nextDevice + k) % n;
+    Device& d = *g_devices[i];
+    if (d.idleJobs.empty() || !d.jobs.empty() || d.active >= d.limit) continue;
+    out = std::move(d.idleJobs.front());
+    d.idleJobs.pop_front();
+    d.active++;
+    g_nextDevice = (i + 1) % n;
+    return true;
+  }
+  return false;
+}
+
+static void ReleaseDevice(int device) {
+  { std::lock_guard<std::mutex> lk(g_jobMu); g_devices[device]->active--; }
+  g_jobCv.notify_all();
+}
+
+// The worker pool. Threads are started on demand, so a session that only ever has a
+// few jobs ready at once (an HDD, one view) never pays for WORKER_COUNT stacks and
+// scratch buffers; once started, a worker stays until StopWorkers.
+static std::vector<std::thread> g_poolWorkers;  // guarded by g_jobMu
+static int g_poolSize = 0;                      // workers counted against WORKER_COUNT; guarded by g_jobMu
+static int g_busyWorkers = 0;                   // of those, holding a job; guarded by g_jobMu
+
+// Jobs TakeJob could hand out right now. g_jobMu must be held.
+static int ReadyJobs() {
+  int ready = 0;
+  for (const auto& d : g_devices) {
+    const int room = d->limit - d->active;
+    if (room <= 0) continue;
+    const size_t queued = d->jobs.empty() ? d->idleJobs.size() : d->jobs.size();
+    ready += (int)std::min<size_t>(queued, (size_t)room);
+  }
+  return ready;
+}
+
+// Starts workers until every ready job has an idle one. g_jobMu must be held.
+static void EnsureWorkers() {
+  if (g_quit.load()) return;
+  int idle = g_poolSize - g_busyWorkers;
+  int want = ReadyJobs() - idle;
+  while (want-- > 0 && g_poolSize < WORKER_COUNT) {
+    g_poolWorkers.emplace_back(WorkerThreadMain);
+    g_poolSize++;
+  }
+}
+
+// Written-off workers no longer count against the pool, so others can be started.
+static void DropLostWorkers(int n) {
+  std::lock_guard<std::mutex> lk(g_jobMu);
+  g_poolSize -= n;
+  g_busyWorkers -= n;
+  EnsureWorkers();
+}
+
+// Hill-climbs each busy device's limit on entries/sec. Gains keep the current
+// direction; a drop reverses it, backing off multiplicatively when going down (AIMD).
+// On a plateau, an increase that bought nothing is undone, and rising read latency
+// means requests only queue inside the device, so the limit steps down; otherwise
+// it holds and probes one step up now and then.
+// Devices whose queue is empty are not limited by concurrency and are left alone.
+static void TuneDevice(Device& d, uint64_t elapsedMs) {
+  const uint64_t entries = d.io.entries.load(std::memory_order_relaxed);
+  const uint64_t reads = d.io.dirReads.load(std::memory_order_relaxed);
+  const uint64_t micros = d.io.readMicros.load(std::memory_order_relaxed);
+  const uint64_t dEntries = entries - d.lastEntries;
+  const uint64_t dReads = reads - d.lastReads;
+  const uint64_t dMicros = micros - d.lastMicros;
+  d.lastEntries = entries;
+  d.lastReads = reads;
+  d.lastMicros = micros;
+
+  if (d.jobs.empty() || d.active < d.limit || elapsedMs == 0) {
+    d.lastRate = 0;
+    d.lastMove = 0;
+    d.flatSamples = 0;
+    return;
+  }
+
+  const double rate = (double)dEntries * 1000.0 / (double)elapsedMs;
+  const double latency = dReads > 0 ? (double)dMicros / (double)dReads : 0;
+  if (latency > 0 && (d.bestLatency == 0 || latency < d.bestLatency)) d.bestLatency = latency;
+
+  int next = d.limit;
+  if (d.lastRate == 0 || rate > d.lastRate * (1.0 + TUNE_GAIN)) {
+    next += d.step;
+    d.flatSamples = 0;
+  } else if (rate < d.lastRate * (1.0 - TUNE_GAIN)) {
+    d.step = -d.step;
+    next = (d.step < 0) ? d.limit - std::max(1, d.limit / 4) : d.limit + 1;
+    d.flatSamples = 0;
+  } else if (d.lastMove > 0) {
+    d.step = -1;
+    next = d.limit - d.lastMove;
+    d.flatSamples = 0;
+  } else if (d.bestLatency > 0 && latency > d.bestLatency * TUNE_LATENCY_RATIO) {
+    d.step = -1;
+    next = d.limit - 1;
+    d.flatSamples = 0;
+  } else if (++d.flatSamples >= TUNE_PROBE_EVERY) {
+    d.step = 1;
+    next = d.limit + 1;
+    d.flatSamples = 0;
+  }
+
+  next = std::min(WORKER_COUNT, std::max(1, next));
+  d.lastMove = next - d.limit;
+  d.limit = next;
+  d.lastRate = rate;
+}
+
+static void PageInTrees(const wstring& dir);
+static void EnforceMemoryBudget();
+
+// Also runs the memory-budget passes, on each tick and whenever a view asks for one,
+// so they never outlive StopWorkers' join.
+static void TunerThreadMain() {
+  NameThread("tuner");
+  uint64_t last = NowTick();
+  std::unique_lock<std::mutex> lk(g_jobMu);
+  while (!g_quit.load()) {
+    const uint64_t waited = NowTick() - last;
+    const uint64_t left = waited < TUNE_INTERVAL_MS ? TUNE_INTERVAL_MS - waited : 0;
+    g_jobCv.wait_for(lk, std::chrono::milliseconds(left), [] { return g_quit.load() || g_memoryDue; });
+    if (g_quit.load()) break;
+    const uint64_t now = NowTick();
+    const bool tune = now - last >= TUNE_INTERVAL_MS;
+    if (tune) {
+      for (auto& d : g_devices) TuneDevice(*d, now - last);
+      EnsureWorkers();
+      last = now;
+    }
+    const wstring pageIn = std::move(g_pageInDir);
+    g_pageInDir.clear();
+    g_memoryDue = false;
+    lk.unlock();
+    if (tune) {
+      g_jobCv.notify_all();  // a raised limit may let waiting workers take jobs
+      CheckStalls();
+    }
+    if (!pageIn.empty()) PageInTrees(pageIn);
+    EnforceMemoryBudget();
+    lk.lock();
+  }
+}
+
+static void PostToViews(UINT msg) {
+  std::lock_guard<std::mutex> lk(g_mu);
+  for (const auto& v : g_views) {
+    if (v->hwndMain) PostMessageW(v->hwndMain, msg, 0, 0);
+  }
+}
+
+// Bumped after every cache write a window may show; views skip rebuilds when it has not moved.
+static std::atomic<uint64_t> g_cacheVersion{1};
+
+// Every window redraws from the cache; a result may belong to any of them. Each window
+// has at most one refresh message queued, however many jobs finish before it runs.
+static void NotifyRefresh() {
+  g_cacheVersion.fetch_add(1);
+  std::lock_guard<std::mutex> lk(g_mu);
+  for (const auto& v : g_views) {
+    if (v->hwndMain && !v->refreshPosted.exchange(true)) PostMessageW(v->hwndMain, WM_APP_REFRESH, 0, 0);
+  }
+}
+
+static bool IsFresh(const SizeInfo& si) {
+  return !si.estimate && (NowTick() - si.tick) < REFRESH_INTERVAL_MS;
+}
+
+static void EnqueueJob(const Job& j) {
+  g_jobs_total.fetch_add(1);
+  g_jobs_queued.fetch_add(1);
+  {
+    std::lock_guard<std::mutex> lk(g_jobMu);
+    Device& d = *g_devices[j.device];
+    if (j.ticket && j.ticket->speculative.load()) d.idleJobs.push_back(j);
+    else d.jobs.push_back(j);
+    EnsureWorkers();
+  }
+  g_jobCv.notify_one();
+}
+
+// Queues a prefetch job for path unless a walk of it is already in flight.
+static void QueueSpeculative(const wstring& path, JobKind kind, int device, const wstring& skip = wstring()) {
+  auto t = std::make_shared<JobTicket>();
+  t->path = path;
+  t->speculative.store(true);
+  {
+    std::lock_guard<std::mutex> lk(g_jobMu);
+    // Listings are not walks; they never share a ticket with a view's request.
+    if (kind != JobKind::Prefetch) {
+      std::shared_ptr<JobTicket>& slot = g_tickets[path];
+      if (slot) return;
+      slot = t;
+    }
+    g_devices[device]->speculative.push_back(t);
+  }
+  EnqueueJob(Job{t, path, kind, device, skip});
+}
+
+// A view asked for a path prefetch already has in flight: the walk becomes real work
+// and its queued job moves to the normal queue. g_jobMu must be held.
+static void PromoteSpeculative(const std::shared_ptr<JobTicket>& t) {
+  t->speculative.store(false);
+  for (auto& d : g_devices) {
+    for (auto it = d->idleJobs.begin(); it != d->idleJobs.end();) {
+      if (it->ticket != t) { ++it; continue; }
+      d->jobs.push_back(std::move(*it));
+      it = d->idleJobs.erase(it);
+    }
+  }
+  EnsureWorkers();
+}
+
+// Sizes path for a view, joining a walk another view already has in flight.
+static void RequestSize(View& v, const wstring& path, int device) {
+  std::shared_ptr<JobTicket> t;
+  bool queue = false;
+  bool promoted = false;
+  {
+    std::lock_guard<std::mutex> lk(g_jobMu);
+    std::shared_ptr<JobTicket>& slot = g_tickets[path];
+    if (!slot) {
+      slot = std::make_shared<JobTicket>();
+      slot->path = path;
+      queue = true;
+    } else if (slot->speculative.load()) {
+      PromoteSpeculative(slot);
+      promoted = true;
+    }
+    slot->refs.fetch_add(1);
+    t = slot;
+  }
+  v.tickets.push_back(t);
+  if (promoted) g_jobCv.notify_one();
+  if (queue) EnqueueJob(Job{t, path, EstimateFirst() ? JobKind::Estimate : JobKind::Capped, device});
+}
+
+static void FinishTicket(const std::shared_ptr<JobTicket>& t) {
+  std::lock_guard<std::mutex> lk(g_jobMu);
+  t->done.store(true);
+  auto it = g_tickets.find(t->path);
+  if (it != g_tickets.end() && it->second == t) g_tickets.erase(it);
+}
+
+static bool IndexSend(const wstring& line);
+
+// Drops the view's claim on its walks. Walks no other view waits for are cancelled
+// and leave the queues; service watches no other view shares are dropped too.
+static void ReleaseRequests(View& v) {
+  if (v.listing) {
+    v.listing->cancelled.store(true);
+    v.listing.reset();
+  }
+  uint32_t dropped = 0;
+  {
+    std::lock_guard<std::mutex> lk(g_jobMu);
+    for (const auto& t : v.tickets) {
+      if (t->refs.fetch_sub(1) != 1 || t->done.load()) continue;
+      t->cancelled.store(true);
+      auto it = g_tickets.find(t->path);
+      if (it != g_tickets.end() && it->second == t) g_tickets.erase(it);
+    }
+    for (auto& d : g_devices) {
+      const size_t before = d->jobs.size();
+      d->jobs.erase(std::remove_if(d->jobs.begin(), d->jobs.end(),
+                                   [](const Job& j) { return j.ticket && j.ticket->cancelled.load(); }),
+                    d->jobs.end());
+      dropped += (uint32_t)(before - d->jobs.size());
+    }
+  }
+  v.tickets.clear();
+  if (dropped) {
+    g_jobs_queued.fetch_sub(dropped);
+    g_jobs_done.fetch_add(dropped);
+  }
+
+  std::vector<wstring> unwatch;
+  {
+    std::lock_guard<std::mutex> lk(g_mu);
+    for (const wstring& path : v.remoteWatched) {
+      bool shared = false;
+      for (const auto& o : g_views) {
+        if (o.get() == &v) continue;
+        shared = shared || std::find(o->remoteWatched.begin(), o->remoteWatched.end(), path) != o->remoteWatched.end();
+      }
+      if (!shared) unwatch.push_back(path);
+    }
+    v.remoteWatched.clear();
+    v.remoteWaiting.clear();
+  }
+  for (const wstring& path : unwatch) IndexSend(L"UNWATCH " + path);
+}
+
+struct ViewProgress {
+  uint32_t done = 0;
+  uint32_t total = 0;
+  bool listing = false;   // children are still being enumerated
+  bool Scanning() const { return listing || done < total; }
+};
+
+static ViewProgress GetViewProgress(const View& v) {
+  ViewProgress p;
+  p.listing = v.listing != nullptr;
+  p.total = (uint32_t)v.tickets.size();
+  for (const auto& t : v.tickets) p.done += t->done.load() ? 1 : 0;
+  std::lock_guard<std::mutex> lk(g_mu);
+  p.total += (uint32_t)v.remoteWatched.size();
+  p.done += (uint32_t)(v.remoteWatched.size() - v.remoteWaiting.size());
+  return p;
+}
+
+static wstring DeviceSummaryText() {
+  wstring out;
+  std::lock_guard<std::mutex> lk(g_jobMu);
+  for (const auto& d : g_devices) {
+    if (d->active == 0 && d->jobs.empty()) continue;
+    wchar_t buf[160];
+    swprintf(buf, 160, L"%s%s %s %d/%d", out.empty() ? L"" : L", ", d->label.c_str(), DeviceKindName(d->kind),
+             d->active, d->limit);
+    out += buf;
+  }
+  return out;
+}
+
+static void UpdateWindowTitleProgress(View& v) {
+  if (!v.hwndMain) return;
+
+  const ViewProgress p = GetViewProgress(v);
+  wchar_t title[256];
+  if (p.Scanning()) {
+    swprintf(title, 256, L"DirPie4  (Scanning %u/%u)", p.done, p.total);
+  } else {
+    swprintf(title, 256, L"DirPie4");
+  }
+  SetWindowTextW(v.hwndMain, title);
+}
+
+static bool IsAtOrBelow(const wstring& path, const wstring& dir) {
+  if (dir.empty()) return false;
+  return _wcsicmp(path.c_str(), dir.c_str()) == 0 || StartsWithNoCase(path, EnsureBackslash(dir).c_str());
+}
+
+static bool SpillIo(bool write, uint64_t offset, void* p, size_t n) {
+  uint8_t* b = (uint8_t*)p;
+  while (n > 0) {
+    OVERLAPPED ov{};
+    ov.Offset = (DWORD)offset;
+    ov.OffsetHigh = (DWORD)(offset >> 32);
+    const DWORD chunk = (DWORD)std::min<size_t>(n, 1 << 30);
+    DWORD done = 0;
+    const BOOL ok = write ? WriteFile(g_spillFile, b, chunk, &done, &ov) : ReadFile(g_spillFile, b, chunk, &done, &ov);
+    if (!ok || done == 0) return false;
+    b += done;
+    offset += done;
+    n -= done;
+  }
+  return true;
+}
+
+// Appends a tree to the spill segment, a delete-on-close temp file. g_spillIoMu must
+// be held.
+static bool SpillTree(const ScanTree& t, SpillRef& ref) {
+  if (g_spillFile == INVALID_HANDLE_VALUE) {
+    wchar_t dir[MAX_PATH]{};
+    if (!GetTempPathW(MAX_PATH, dir)) return false;
+    wchar_t name[64];
+    swprintf(name, 64, L"DirPie-%lu.spill", GetCurrentProcessId());
+    g_spillFile = CreateFileW((wstring(dir) + name).c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                              FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+    if (g_spillFile == INVALID_HANDLE_VALUE) return false;
+  }
+
+  ref.offset = g_spillEnd;
+  ref.rootLen = t.rootPath.size();
+  ref.nodes = t.nodes.size();
+  ref.names = t.names.size();
+  uint64_t at = ref.offset;
+  if (!SpillIo(true, at, const_cast<wchar_t*>(t.rootPath.data()), ref.rootLen * sizeof(wchar_t))) return false;
+  at += ref.rootLen * sizeof(wchar_t);
+  if (!SpillIo(true, at, const_cast<TreeNode*>(t.nodes.data()), ref.nodes * sizeof(TreeNode))) return false;
+  at += ref.nodes * sizeof(TreeNode);
+  if (!SpillIo(true, at, const_cast<wchar_t*>(t.names.data()), ref.names * sizeof(wchar_t))) return false;
+  at += ref.names * sizeof(wchar_t);
+
+  g_spillEnd = at;
+  return true;
+}
+
+// g_spillIoMu must be held.
+static bool ReadSpilledTree(const SpillRef& ref, ScanTree& t) {
+  t.rootPath.resize(ref.rootLen);
+  t.nodes.resize(ref.nodes);
+  t.names.resize(ref.names);
+  uint64_t at = ref.offset;
+  bool ok = SpillIo(false, at, &t.rootPath[0], ref.rootLen * sizeof(wchar_t));
+  at += ref.rootLen * sizeof(wchar_t);
+  ok = ok && SpillIo(false, at, t.nodes.data(), ref.nodes * sizeof(TreeNode));
+  at += ref.nodes * sizeof(TreeNode);
+  ok = ok && SpillIo(false, at, t.names.data(), ref.names * sizeof(wchar_t));
+  return ok;
+}
+
+// Brings spilled trees at or below dir back into g_trees and keeps them from being
+// spilled again while dir is shown.
+static void PageInTrees(const wstring& dir) {
+  std::lock_guard<std::mutex> io(g_spillIoMu);
+  std::vector<std::pair<wstring, SpillRef>> wanted;
+  {
+    std::lock_guard<std::mutex> lk(g_mu);
+    g_hotDir = dir;
+    for (const auto& kv : g_spilled) {
+      if (IsAtOrBelow(kv.first, dir)) wanted.push_back(kv);
+    }
+  }
+
+  for (const auto& w : wanted) {
+    auto t = std::make_shared<ScanTree>();
+    const bool ok = ReadSpilledTree(w.second, *t);
+
+    std::lock_guard<std::mutex> lk(g_mu);
+    auto it = g_spilled.find(w.first);
+    if (it == g_spilled.end() || it->second.offset != w.second.offset) continue;  // a newer walk replaced it
+    g_spilled.erase(it);
+    if (ok && !g_trees.count(w.first)) {
+      g_treeBytes += TreeBytes(*t);
+      g_trees[w.first] = std::move(t);
+      g_treesVersion++;
+    }
+  }
+}
+
+static uint64_t ProcessResidentBytes() {
+  PROCESS_MEMORY_COUNTERS pmc{};
+  pmc.cb = sizeof(pmc);
+  return GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)) ? (uint64_t)pmc.WorkingSetSize : 0;
+}
+
+// The part of the budget cached trees may use: what the rest of the process leaves
+// of it. g_mu must be held.
+static uint64_t TreeAllowance(uint64_t budget) {
+  const uint64_t rss = ProcessResidentBytes();
+  const uint64_t other = rss > g_treeBytes ? rss - g_treeBytes : 0;
+  return budget > other ? budget - other : 0;
+}
+
+// Whether EnforceMemoryBudget has anything to do. g_mu must be held.
+static bool MemoryBudgetDue(uint64_t allowance) {
+  if (g_treeBytes > (uint64_t)(allowance * SPILL_AT)) return true;
+  return g_collapseBelow.load() > 0 && g_treeBytes < (uint64_t)(allowance * SPILL_TO / 2) &&
+         NowTick() - g_collapseTick >= COLLAPSE_DECAY_MS;
+}
+
+// Keeps cached trees within the memory budget. Trees at or below g_hotDir (the view
+// being shown) stay in memory; the rest are spilled. A pass that cannot get back under
+// SPILL_TO raises the collapse threshold for walks that start afterwards, and the
+// threshold decays again once use has fallen well below it. Runs on the tuner thread.
+static void EnforceMemoryBudget() {
+  const uint64_t budget = MemoryBudget();
+  if (budget == 0) return;
+
+  std::lock_guard<std::mutex> io(g_spillIoMu);
+  uint64_t target = 0;
+  std::vector<std::pair<wstring, std::shared_ptr<const ScanTree>>> victims;
+  {
+    std::lock_guard<std::mutex> lk(g_mu);
+    const uint64_t allowance = TreeAllowance(budget);
+    if (!MemoryBudgetDue(allowance)) return;
+    target = (uint64_t)(allowance * SPILL_TO);
+    if (g_treeBytes <= (uint64_t)(allowance * SPILL_AT)) {
+      const uint64_t cur = g_collapseBelow.load() / 4;
+      g_collapseBelow.store(cur < COLLAPSE_MIN_BYTES ? 0 : cur);
+      g_collapseRaisedAt = g_treeBytes;
+      g_collapseTick = NowTick();
+      return;
+    }
+    uint64_t left = g_treeBytes;
+    for (const auto& kv : g_trees) {
+      if (left <= target) break;
+      if (IsAtOrBelow(kv.first, g_hotDir)) continue;
+      victims.push_back(kv);
+      left -= std::min(left, TreeBytes(*kv.second));
+    }
+  }
+
+  std::vector<SpillRef> refs(victims.size());
+  std::vector<uint8_t> written(victims.size());
+  for (size_t i = 0; i < victims.size(); ++i) written[i] = SpillTree(*victims[i].second, refs[i]);
+
+  std::lock_guard<std::mutex> lk(g_mu);
+  for (size_t i = 0; i < victims.size(); ++i) {
+    auto it = g_trees.find(victims[i].first);
+    if (!written[i] || it == g_trees.end() || it->second != victims[i].second) continue;
+    g_treeBytes -= TreeBytes(*it->second);
+    g_spilled[it->first] = refs[i];
+    g_trees.erase(it);
+    g_treesVersion++;
+  }
+  if (g_treeBytes > target && g_treeBytes >= g_collapseRaisedAt + (uint64_t)(budget * COLLAPSE_RAISE_STEP)) {
+    const uint64_t cur = g_collapseBelow.load();
+    g_collapseBelow.store(std::min(COLLAPSE_MAX_BYTES, std::max(COLLAPSE_MIN_BYTES, cur * 4)));
+    g_collapseRaisedAt = g_treeBytes;
+    g_collapseTick = NowTick();
+  }
+}
+
+// The UI thread's way in: the tuner thread runs the pass, so spilling never holds up
+// a frame and never outlives StopWorkers.
+static void RequestMemoryBudget(const wstring& hotDir) {
+  const uint64_t budget = MemoryBudget();
+  if (budget == 0) return;
+  {
+    std::lock_guard<std::mutex> lk(g_mu);
+    g_hotDir = hotDir;
+    if (!MemoryBudgetDue(TreeAllowance(budget))) return;
+  }
+  std::lock_guard<std::mutex> lk(g_jobMu);
+  g_memoryDue = true;
+  g_jobCv.notify_all();
+}
+
+// Same for page-ins when a view moves to dir; only dir's own trees come back, and
+// a view that finds them still spilled shows sizes from the cache meanwhile.
+static void RequestPageIn(const wstring& dir) {
+  {
+    std::lock_guard<std::mutex> lk(g_mu);
+    g_hotDir = dir;
+    bool any = false;
+    for (const auto& kv : g_spilled) any = any || IsAtOrBelow(kv.first, dir);
+    if (!any) return;
+  }
+  std::lock_guard<std::mutex> lk(g_jobMu);
+  g_pageInDir = dir;
+  g_memoryDue = true;
+  g_jobCv.notify_all();
+}
+
+// Index service: `--serve` owns the scan engine and cache and answers UTF-8 line requests
+// on a Unix domain socket (see IndexReply), so windows started meanwhile share its walks.
+
+static const uint64_t INDEX_IDLE_EXIT_MS = 15ULL * 60 * 1000;
+static const DWORD INDEX_SEND_TIMEOUT_MS = 2000;
+
+static std::string ToUtf8(const wstring& s) {
+  if (s.empty()) return std::string();
+  const int n = WideCharToMultiByte(CP_UTF8, 0, s.c_str(), (int)s.size(), nullptr, 0, nullptr, nullptr);
+  std::string out((size_t)(n > 0 ? n : 0), '\0');
+  if (n > 0) WideCharToMultiByte(CP_UTF8, 0, s.c_str(), (int)s.size(), &out[0], n, nullptr, nullptr);
+  return out;
+}
+
+static wstring FromUtf8(std::string_view s) {
+  if (s.empty()) return wstring();
+  const int n = MultiByteToWideChar(CP_UTF8, 0, s.data(), (int)s.size(), nullptr, 0);
+  wstring out((size_t)(n > 0 ? n : 0), L'\0');
+  if (n > 0) MultiByteToWideChar(CP_UTF8, 0, s.data(), (int)s.size(), &out[0], n);
+  return out;
+}
+
+// DIRPIE_INDEX=off keeps every window on its own engine; any other value names
+// the socket. The default lives under %LOCALAPPDATA%\DirPie.
+static bool IndexDisabled() {
+  return _wcsicmp(EnvString(L"DIRPIE_INDEX").c_str(), L"off") == 0;
+}
+
+static wstring IndexSocketPath() {
+  const wstring named = EnvString(L"DIRPIE_INDEX");
+  if (!named.empty()) return named;
+  wstring base = EnvString(L"LOCALAPPDATA");
+  if (base.empty()) {
+    wchar_t buf[MAX_PATH]{};
+    const DWORD n = GetTempPathW(MAX_PATH, buf);
+    base.assign(buf, n < MAX_PATH ? n : 0);
+  }
+  const wstring dir = JoinPath(TrimTrailingSlash(base), L"DirPie");
+  CreateDirectoryW(dir.c_str(), nullptr);
+  return JoinPath(dir, L"index.sock");
+}
+
+static bool UnixAddress(const wstring& path, sockaddr_un& addr) {
+  const std::string p = ToUtf8(path);
+  if (p.empty() || p.size() >= sizeof(addr.sun_path)) return false;
+  addr = sockaddr_un{};
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, p.c_str(), p.size() + 1);
+  return true;
+}
+
+// Needs WSAStartup.
+static SOCKET ConnectIndex(const wstring& path) {
+  sockaddr_un addr{};
+  if (!UnixAddress(path, addr)) return INVALID_SOCKET;
+  SOCKET s = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (s == INVALID_SOCKET) return s;
+  if (connect(s, (const sockaddr*)&addr, sizeof(addr)) != 0) {
+    closesocket(s);
+    return INVALID_SOCKET;
+  }
+  return s;
+}
+
+static bool SendAll(SOCKET s, const std::string& data) {
+  size_t off = 0;
+  while (off < data.size()) {
+    const int n = send(s, data.data() + off, (int)(data.size() - off), 0);
+    if (n <= 0) return false;
+    off += (size_t)n;
+  }
+  return true;
+}
+
+struct SocketLineReader {
+  SOCKET sock = INVALID_SOCKET;
+  std::string buf;
+  size_t pos = 0;
+
+  bool ReadLine(std::string& line) {
+    for (;;) {
+      const size_t nl = buf.find('\n', pos);
+      if (nl != std::string::npos) {
+        line.assign(buf, pos, nl - pos);
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        pos = nl + 1;
+        return true;
+      }
+      buf.erase(0, pos);
+      pos = 0;
+      char chunk[4096];
+      const int n = recv(sock, chunk, (int)sizeof(chunk), 0);
+      if (n <= 0) return false;
+      buf.append(chunk, (size_t)n);
+    }
+  }
+};
+
+// A capped or failed quick walk is followed by an exact one; anything else is
+// the last word on the folder until it goes stale.
+// Whether si should replace the cached old: exact beats capped beats estimate, and
+// among equals the newer wins. A complete walk counts as exact even when it was only
+// capped, and a capped walk that stopped short of an estimate says too little to
+// replace it before the exact walk. Shared by the workers and the index reader.
+static bool ReplacesCached(const SizeInfo& old, const SizeInfo& si) {
+  if (si.tick < old.tick) return false;
+  if (si.estimate) return old.estimate;
+  if (old.exact && !old.incomplete) return si.exact || !(si.incomplete || si.stats.reached_cap);
+  if (old.estimate && si.stats.reached_cap) return si.bytes >= old.bytes;
+  return true;
+}
+
+static bool IsFinal(const SizeInfo& si) {
+  return !si.estimate && (si.exact || !(si.stats.reached_cap || si.incomplete));
+}
+
+// record: <bytes> TAB <files> TAB <dirs> TAB <flags> TAB <path>, where flags are e (exact),
+// i (incomplete), x (estimate), c (capped), f (final: no walk follows) and p (pending).
+static std::string IndexRecord(const wstring& path, const SizeInfo* si) {
+  char buf[96];
+  if (!si) {
+    snprintf(buf, sizeof(buf), "0\t0\t0\tp\t");
+  } else {
+    char flags[6]{};
+    int k = 0;
+    if (si->exact) flags[k++] = 'e';
+    if (si->incomplete) flags[k++] = 'i';
+    if (si->estimate) flags[k++] = 'x';
+    if (si->stats.reached_cap) flags[k++] = 'c';
+    if (IsFinal(*si)) flags[k++] = 'f';
+    if (k == 0) flags[k++] = '-';
+    snprintf(buf, sizeof(buf), "%llu\t%llu\t%llu\t%s\t", (unsigned long long)si->bytes,
+             (unsigned long long)si->content.files, (unsigned long long)si->content.dirs, flags);
+  }
+  return buf + ToUtf8(path);
+}
+
+static bool ParseIndexRecord(std::string_view rec, wstring& path, SizeInfo& si, bool& final, bool& pending) {
+  uint64_t v[3] = {};
+  for (uint64_t& x : v) {
+    const size_t tab = rec.find('\t');
+    if (tab == std::string_view::npos) return false;
+    x = strtoull(std::string(rec.substr(0, tab)).c_str(), nullptr, 10);
+    rec.remove_prefix(tab + 1);
+  }
+  const size_t tab = rec.find('\t');
+  if (tab == std::string_view::npos) return false;
+  const std::string_view flags = rec.substr(0, tab);
+  path = FromUtf8(rec.substr(tab + 1));
+
+  si = SizeInfo{};
+  si.bytes = v[0];
+  si.content.files = v[1];
+  si.content.dirs = v[2];
+  si.exact = flags.find('e') != std::string_view::npos;
+  si.incomplete = flags.find('i') != std::string_view::npos;
+  si.estimate = flags.find('x') != std::string_view::npos;
+  si.stats.incomplete = si.incomplete;
+  si.stats.reached_cap = flags.find('c') != std::string_view::npos;
+  si.tick = NowTick();
+  final = flags.find('f') != std::string_view::npos;
+  pending = flags.find('p') != std::string_view::npos;
+  return !path.empty();
+}
+
+// Service side: connected clients, what they watch, and the walks it has queued.
+struct IndexClient {
+  SOCKET sock = INVALID_SOCKET;
+  std::mutex sendMu;
+  std::vector<wstring> watches;  // guarded by g_indexMu
+};
+
+static std::mutex g_indexMu;
+static std::vector<std::shared_ptr<IndexClient>> g_indexClients;
+static std::unordered_set<wstring> g_indexQueued;  // walks queued for clients, until final
+static std::atomic<bool> g_serving{false};
+static std::atomic<bool> g_indexStop{false};
+static std::atomic<int> g_indexThreads{0};
+
+static bool IndexSendLine(IndexClient& c, const std::string& line) {
+  std::lock_guard<std::mutex> lk(c.sendMu);
+  return SendAll(c.sock, line + "\n");
+}
+
+static void PublishIndexUpdate(const wstring& path, const SizeInfo& si) {
+  std::vector<std::shared_ptr<IndexClient>> targets;
+  {
+    std::lock_guard<std::mutex> lk(g_indexMu);
+    if (IsFinal(si)) g_indexQueued.erase(path);
+    for (const auto& c : g_indexClients) {
+      for (const wstring& w : c->watches) {
+        if (IsAtOrBelow(path, w)) { targets.push_back(c); break; }
+      }
+    }
+  }
+  const std::string line = "UPDATE " + IndexRecord(path, &si);
+  // A client that cannot keep up is dropped; its reader thread then cleans up.
+  for (const auto& c : targets) {
+    if (!IndexSendLine(*c, line)) shutdown(c->sock, SD_BOTH);
+  }
+}
+
+// Window side: the connection to a running service, if any.
+static std::atomic<SOCKET> g_indexSock{INVALID_SOCKET};
+static std::mutex g_indexSendMu;
+static std::thread g_indexReader;
+
+static bool IndexConnected() { return g_indexSock.load() != INVALID_SOCKET; }
+
+static bool IndexSend(const wstring& line) {
+  std::lock_guard<std::mutex> lk(g_indexSendMu);
+  const SOCKET s = g_indexSock.load();
+  return s != INVALID_SOCKET && SendAll(s, ToUtf8(line) + "\n");
+}
+
+static void IndexReaderMain(SOCKET s) {
+  SocketLineReader r;
+  r.sock = s;
+  std::string line;
+  while (r.ReadLine(line)) {
+    if (line.compare(0, 7, "UPDATE ") != 0) continue;  // WATCH/UNWATCH replies carry nothing
+    wstring path;
+    SizeInfo si{};
+    bool final = false;
+    bool pending = false;
+    if (!ParseIndexRecord(std::string_view(line).substr(7), path, si, final, pending) || pending) continue;
+    {
+      std::lock_guard<std::mutex> lk(g_mu);
+      auto it = g_cache.find(path);
+      if (it == g_cache.end()) g_cache.emplace(path, si);
+      else if (ReplacesCached(it->second, si)) it->second = si;
+      if (final) {
+        for (const auto& v : g_views) v->remoteWaiting.erase(path);
+      }
+    }
+    NotifyRefresh();
+  }
+
+  { std::lock_guard<std::mutex> lk(g_indexSendMu); g_indexSock.store(INVALID_SOCKET); }
+  closesocket(s);
+  if (!g_quit.load()) PostToViews(WM_APP_INDEX_CHANGED);
+}
+
+static bool AttachIndex() {
+  if (IndexConnected() || IndexDisabled()) return IndexConnected();
+  const SOCKET s = ConnectIndex(IndexSocketPath());
+  if (s == INVALID_SOCKET) return false;
+  if (g_indexReader.joinable()) g_indexReader.join();  // a reader left over from a lost connection
+  g_indexSock.store(s);
+  g_indexReader = std::thread(IndexReaderMain, s);
+  return true;
+}
+
+static void DetachIndex() {
+  {
+    std::lock_guard<std::mutex> lk(g_indexSendMu);
+    const SOCKET s = g_indexSock.load();
+    if (s != INVALID_SOCKET) shutdown(s, SD_BOTH);
+  }
+  if (g_indexReader.joinable()) g_indexReader.join();
+}
+
+// Sizes a view entry through the service instead of the local workers.
+static void WatchViaIndex(View& v, const wstring& path) {
+  {
+    std::lock_guard<std::mutex> lk(g_mu);
+    if (!v.remoteWaiting.insert(path).second) return;
+    v.remoteWatched.push_back(path);
+  }
+  IndexSend(L"WATCH " + path);
+}
+
+static bool ListChildDirs(const wstring& dir, std::vector<Entry>& found, DWORD& err,
+                          uint64_t* fileBytes = nullptr);
+
+static void RunJob(const Job& job, WalkScratch& scratch) {
+  g_jobs_queued.fetch_sub(1);
+  g_jobs_active.fetch_add(1);
+
+  if (job.ticket && job.ticket->cancelled.load()) {
+    g_jobs_active.fetch_sub(1);
+    g_jobs_done.fetch_add(1);
+    return;
+  }
+
+  // Prefetch: size the children a click on this folder would ask for, unless cached.
+  if (job.kind == JobKind::Prefetch) {
+    std::vector<Entry> children;
+    DWORD err = 0;
+    if (ListChildDirs(job.path, children, err)) {
+      if (children.size() > PREFETCH_CHILDREN) children.resize(PREFETCH_CHILDREN);
+      for (const Entry& e : children) {
+        if (job.ticket->cancelled.load()) break;
+        if (_wcsicmp(e.path.c_str(), job.skip.c_str()) == 0) continue;
+        bool cached = false;
+        { std::lock_guard<std::mutex> lk(g_mu); cached = g_cache.count(e.path) != 0; }
+        if (!cached) QueueSpeculative(e.path, JobKind::Capped, job.device);
+      }
+    }
+    job.ticket->done.store(true);
+    g_jobs_active.fetch_sub(1);
+    g_jobs_done.fetch_add(1);
+    return;
+  }
+
+  // An estimate goes up only where nothing better is cached; the capped walk follows.
+  if (job.kind == JobKind::Estimate) {
+    SizeInfo est{};
+    const bool ok = EstimateDirSize(job.path, job.ticket.get(), est);
+    if (ok) {
+      std::lock_guard<std::mutex> lk(g_mu);
+      auto it = g_cache.find(job.path);
+      if (it == g_cache.end()) g_cache.emplace(job.path, est);
+      else if (ReplacesCached(it->second, est)) it->second = est;
+      else est = it->second;
+    }
+    if (!job.ticket || !job.ticket->cancelled.load()) EnqueueJob(Job{job.ticket, job.path, JobKind::Capped, job.device});
+    g_jobs_active.fetch_sub(1);
+    g_jobs_done.fetch_add(1);
+    if (!ok) return;
+    NotifyRefresh();
+    if (g_serving.load()) PublishIndexUpdate(job.path, est);
+    return;
+  }
+
+  WalkStats st{};
+  ContentStats cs{};
+  ScanTree& work = scratch.tree;
+  work.nodes.clear();
+  work.names.clear();
+  const uint64_t cap = (job.kind == JobKind::Capped) ? CAP_BYTES : 0;
+  IoCounters* io = nullptr;
+  { std::lock_guard<std::mutex> lk(g_jobMu); io = &g_devices[job.device]->io; }
+  const uint64_t bytes = WalkDirLogicalSize(job.path, cap, job.ticket.get(), st, cs, &work, io, &scratch);
+
+  if (job.ticket && job.ticket->cancelled.load()) {
+    g_jobs_active.fetch_sub(1);
+    g_jobs_done.fetch_add(1);
+    return;
+  }
+
+  std::shared_ptr<ScanTree> tree;
+  if (!st.reached_cap) {
+    AggregateTree(work);
+    tree = std::make_shared<ScanTree>();
+    tree->rootPath = work.rootPath;
+    tree->nodes.assign(work.nodes.begin(), work.nodes.end());
+    tree->names.assign(work.names.begin(), work.names.end());
+  }
+
+  SizeInfo si{};
+  SizeInfo published{};
+  si.bytes = bytes;
+  si.exact = (job.kind == JobKind::Exact) && !st.reached_cap;
+  si.incomplete = st.incomplete;
+  si.stats = st;
+  si.content = cs;
+  si.tick = NowTick();
+
+  {
+    std::lock_guard<std::mutex> lk(g_mu);
+    auto it = g_cache.find(job.path);
+    if (it == g_cache.end()) g_cache.emplace(job.path, si);
+    else if (ReplacesCached(it->second, si)) it->second = si;
+    if (g_serving.load()) published = g_cache.find(job.path)->second;
+
+    if (!st.reached_cap) {
+      std::shared_ptr<const ScanTree>& slot = g_trees[job.path];
+      if (slot) g_treeBytes -= TreeBytes(*slot);
+      g_treeBytes += TreeBytes(*tree);
+      slot = std::move(tree);
+      g_spilled.erase(job.path);
+      g_treesVersion++;
+    }
+  }
+
+  const bool escalate = (job.kind == JobKind::Capped) && (st.reached_cap || st.incomplete);
+  if (escalate) EnqueueJob(Job{job.ticket, job.path, JobKind::Exact, job.device});
+  else if (job.ticket) FinishTicket(job.ticket);
+  g_jobs_active.fetch_sub(1);
+  g_jobs_done.fetch_add(1);
+
+  NotifyRefresh();
+  if (g_serving.load()) PublishIndexUpdate(job.path, published);
+}
+
+static const char* JobKindName(JobKind kind) {
+  switch (kind) {
+    case JobKind::Estimate: return "estimate";
+    case JobKind::Capped: return "capped walk";
+    case JobKind::Exact: return "exact walk";
+    case JobKind::Prefetch: return "prefetch";
+  }
+  return "job";
+}
+
+static void WorkerThreadMain() {
+  NameThread("worker");
+  StallSlot* slot = RegisterStallSlot(true);
+  WalkScratch scratch;
+  bool busy = false;
+  while (!g_quit.load()) {
+    Job job{};
+    {
+      std::unique_lock<std::mutex> lk(g_jobMu);
+      if (busy) g_busyWorkers--;
+      busy = false;
+      if (!TakeJob(job)) {
+        // Nothing to do: hand the scratch memory back before sleeping.
+        TimelineSpan idle("idle", job.path);
+        lk.unlock();
+        scratch.Release();
+        lk.lock();
+        g_jobCv.wait(lk, [&] { return g_quit.load() || TakeJob(job); });
+      }
+      if (g_quit.load()) break;
+      g_busyWorkers++;
+      busy = true;
+    }
+
+    slot->device = job.device;
+    slot->job.store((int)SlotJob::Running);
+    SetThreadJob(JobKindName(job.kind), job.path);
+    {
+      TimelineSpan span(JobKindName(job.kind), job.path);
+      RunJob(job, scratch);
+    }
+    SetThreadJob(nullptr, wstring());
+    // Written off while blocked: the device slot was already released. If the pool
+    // was free to start a worker in our place, leave; otherwise take up the next job.
+    if (slot->job.exchange((int)SlotJob::Idle) == (int)SlotJob::Lost) {
+      std::lock_guard<std::mutex> lk(g_slotMu);
+      g_lostWorkers--;
+      if (slot->replaced) break;
+      continue;
+    }
+    if (scratch.Bytes() > SCRATCH_KEEP_BYTES) scratch.Release();
+    ReleaseDevice(job.device);
+  }
+
+  std::lock_guard<std::mutex> lk(g_slotMu);
+  slot->worker = false;
+  if (slot->thread) CloseHandle(slot->thread);
+  slot->thread = nullptr;
+}
+
+// Query engine: a columnar copy of the cached trees and a small filter language over
+// size, files, dirs, depth, modified and name, evaluated block by block into byte masks.
+
+struct ColumnIndex {
+  std::vector<uint64_t> bytes;
+  std::vector<uint64_t> files;
+  std::vector<uint64_t> dirs;
+  std::vector<uint64_t> newestWrite;
+  std::vector<uint32_t> depth;
+  std::vector<uint32_t> parentRow;   // row of the parent; roots point at themselves
+  std::vector<uint32_t> treeOf;      // index into trees
+  std::vector<std::shared_ptr<const ScanTree>> trees;
+  std::vector<uint32_t> treeBase;    // first row of each tree
+  uint64_t version = 0;
+  wstring scope;
+};
+
+static void AppendTreeColumns(ColumnIndex& ci, const std::shared_ptr<const ScanTree>& t, uint32_t depthBase) {
+  const uint32_t base = (uint32_t)ci.bytes.size();
+  const uint32_t ti = (uint32_t)ci.trees.size();
+  ci.trees.push_back(t);
+  ci.treeBase.push_back(base);
+
+  for (const TreeNode& n : t->nodes) {
+    ci.bytes.push_back(n.bytes);
+    ci.files.push_back(n.files);
+    ci.dirs.push_back(n.dirs);
+    ci.newestWrite.push_back(n.newestWrite);
+    ci.depth.push_back(depthBase + n.depth);
+    ci.parentRow.push_back(base + n.parent);
+    ci.treeOf.push_back(ti);
+  }
+}
+
+static std::shared_ptr<const ColumnIndex> g_columns;
+
+// Columns for every cached tree at or below scopeDir. Rebuilt only when the set of
+// cached trees has changed since the last query.
+static std::shared_ptr<const ColumnIndex> GetColumnIndex(const wstring& scopeDir) {
+  std::vector<std::shared_ptr<const ScanTree>> trees;
+  uint64_t version = 0;
+  {
+    std::lock_guard<std::mutex> lk(g_mu);
+    version = g_treesVersion;
+    if (g_columns && g_columns->version == version && g_columns->scope == scopeDir) return g_columns;
+
+    for (const auto& kv : g_trees) {
+      if (IsAtOrBelow(kv.first, scopeDir)) trees.push_back(kv.second);
+    }
+  }
+
+  // A walk's tree already holds every directory below its root, including those of
+  // walks cached separately further down, so only the outermost trees are indexed;
+  // nested ones would repeat their rows.
+  std::unordered_set<wstring> roots;
+  for (const auto& t : trees) roots.insert(FoldPath(t->rootPath));
+  auto nested = [&roots](const std::shared_ptr<const ScanTree>& t) {
+    const wstring k = FoldPath(t->rootPath);
+    for (size_t cut = k.rfind(L'\\'); cut != wstring::npos && cut > 0; cut = k.rfind(L'\\', cut - 1)) {
+      if (cut + 1 < k.size() && (roots.count(k.substr(0, cut)) || roots.count(k.substr(0, cut + 1)))) return true;
+    }
+    return false;
+  };
+  trees.erase(std::remove_if(trees.begin(), trees.end(), nested), trees.end());
+
+  std::sort(trees.begin(), trees.end(),
+            [](const std::shared_ptr<const ScanTree>& a, const std::shared_ptr<const ScanTree>& b) {
+              return a->rootPath < b->rootPath;
+            });
+
+  auto ci = std::make_shared<ColumnIndex>();
+  size_t rows = 0;
+  for (const auto& t : trees) rows += t->nodes.size();
+  ci->bytes.reserve(rows);
+  ci->files.reserve(rows);
+  ci->dirs.reserve(rows);
+  ci->newestWrite.reserve(rows);
+  ci->depth.reserve(rows);
+  ci->parentRow.reserve(rows);
+  ci->treeOf.reserve(rows);
+
+  const size_t scopeSeps = std::count(scopeDir.begin(), scopeDir.end(), L'\\');
+  for (const auto& t : trees) {
+    const size_t seps = std::count(t->rootPath.begin(), t->rootPath.end(), L'\\');
+    AppendTreeColumns(*ci, t, (uint32_t)(seps > scopeSeps ? seps - scopeSeps : 0));
+  }
+  ci->version = version;
+  ci->scope = scopeDir;
+
+  std::lock_guard<std::mutex> lk(g_mu);
+  g_columns = ci;
+  return ci;
+}
+
+enum class QueryField { Size, Files, Dirs, Depth, Modified, Name };
+enum class QueryOp { Lt, Le, Gt, Ge, Eq, Ne };
+
+struct QueryExpr {
+  enum class Kind { Compare, And, Or, Not };
+  Kind kind = Kind::Compare;
+  QueryField field = QueryField::Size;
+  QueryOp op = QueryOp::Gt;
+  uint64_t value = 0;
+  wstring pattern;
+  int lhs = -1;
+  int rhs = -1;
+};
+
+struct Query {
+  std::vector<QueryExpr> exprs;
+  int root = -1;  // -1 matches everything
+  QueryField orderBy = QueryField::Size;
+  bool ascending = false;
+  size_t limit = 200;
+};
+
+struct QueryParser {
+  const wchar_t* p = nullptr;
+  Query* q = nullptr;
+  wstring err;
+  uint64_t nowFt = 0;
+
+  void SkipWs() { while (*p == L' ' || *p == L'\t') ++p; }
+
+  bool Word(const wchar_t* w) {
+    SkipWs();
+    const size_t n = wcslen(w);
+    if (_wcsnicmp(p, w, n) != 0) return false;
+    const wchar_t c = p[n];
+    if (iswalnum(c) || c == L'_') return false;
+    p += n;
+    return true;
+  }
+
+  bool Peek(const wchar_t* w) {
+    const wchar_t* save = p;
+    const bool ok = Word(w);
+    p = save;
+    return ok;
+  }
+
+  bool Fail(const wstring& msg) {
+    if (err.empty()) err = msg;
+    return false;
+  }
+
+  bool ParseField(QueryField& f) {
+    SkipWs();
+    if (Word(L"size") || Word(L"bytes")) f = QueryField::Size;
+    else if (Word(L"files")) f = QueryField::Files;
+    else if (Word(L"dirs")) f = QueryField::Dirs;
+    else if (Word(L"depth")) f = QueryField::Depth;
+    else if (Word(L"modified") || Word(L"mtime")) f = QueryField::Modified;
+    else if (Word(L"name")) f = QueryField::Name;
+    else return Fail(wstring(L"unknown field at '") + p + L"'");
+    return true;
+  }
+
+  bool ParseOp(QueryOp& op) {
+    SkipWs();
+    if (p[0] == L'>' && p[1] == L'=') { op = QueryOp::Ge; p += 2; }
+    else if (p[0] == L'<' && p[1] == L'=') { op = QueryOp::Le; p += 2; }
+    else if (p[0] == L'!' && p[1] == L'=') { op = QueryOp::Ne; p += 2; }
+    else if (p[0] == L'=' && p[1] == L'=') { op = QueryOp::Eq; p += 2; }
+    else if (p[0] == L'>') { op = QueryOp::Gt; p += 1; }
+    else if (p[0] == L'<') { op = QueryOp::Lt; p += 1; }
+    else if (p[0] == L'=') { op = QueryOp::Eq; p += 1; }
+    else return Fail(wstring(L"expected comparison at '") + p + L"'");
+    return true;
+  }
+
+  // Sizes use binary units (K/KB = 1024); counts use decimal ones (K = 1000);
+  // ages accept h/d/w/y.
+  bool ParseValue(QueryField f, uint64_t& out) {
+    SkipWs();
+    wchar_t* end = nullptr;
+    const double v = wcstod(p, &end);
+    if (end == p || v < 0) return Fail(wstring(L"expected number at '") + p + L"'");
+    p = end;
+
+    wstring unit;
+    while (iswalpha(*p)) unit.push_back((wchar_t)towlower(*p++));
+
+    double mul = 1.0;
+    if (f == QueryField::Size) {
+      if (unit.empty() || unit == L"b") mul = 1.0;
+      else if (unit == L"k" || unit == L"kb") mul = 1024.0;
+      else if (unit == L"m" || unit == L"mb") mul = 1024.0 * 1024;
+      else if (unit == L"g" || unit == L"gb") mul = 1024.0 * 1024 * 1024;
+      else if (unit == L"t" || unit == L"tb") mul = 1024.0 * 1024 * 1024 * 1024;
+      else if (unit == L"p" || unit == L"pb") mul = 1024.0 * 1024 * 1024 * 1024 * 1024;
+      else return Fail(L"unknown size unit '" + unit + L"'");
+    } else if (f == QueryField::Modified) {
+      const double day = (double)FILETIME_TICKS_PER_DAY;
+      if (unit == L"h") mul = day / 24;
+      else if (unit.empty() || unit == L"d") mul = day;
+      else if (unit == L"w") mul = day * 7;
+      else if (unit == L"y") mul = day * 365;
+      else return Fail(L"unknown age unit '" + unit + L"'");
+    } else {
+      if (unit.empty()) mul = 1.0;
+      else if (unit == L"k") mul = 1e3;
+      else if (unit == L"m") mul = 1e6;
+      else if (unit == L"g") mul = 1e9;
+      else return Fail(L"unknown count unit '" + unit + L"'");
+    }
+    out = (uint64_t)(v * mul + 0.5);
+    return true;
+  }
+
+  bool ParsePattern(wstring& out) {
+    SkipWs();
+    if (*p == L'"' || *p == L'\'') {
+      const wchar_t quote = *p++;
+      while (*p && *p != quote) out.push_back(*p++);
+      if (*p != quote) return Fail(L"unterminated string");
+      ++p;
+    } else {
+      while (*p && *p != L' ' && *p != L'\t' && *p != L')') out.push_back(*p++);
+    }
+    if (out.empty()) return Fail(L"expected name pattern");
+    return true;
+  }
+
+  int Add(const QueryExpr& e) {
+    q->exprs.push_back(e);
+    return (int)q->exprs.size() - 1;
+  }
+
+  int ParseCompare() {
+    QueryExpr e{};
+    if (!ParseField(e.field) || !ParseOp(e.op)) return -1;
+    if (e.field == QueryField::Name) {
+      if (e.op != QueryOp::Eq && e.op != QueryOp::Ne) { Fail(L"name supports only = and !="); return -1; }
+      if (!ParsePattern(e.pattern)) return -1;
+      return Add(e);
+    }
+    if (!ParseValue(e.field, e.value)) return -1;
+
+    // "modified < 7d" (younger than) compares the newest write time against now-7d,
+    // so the age comparison flips direction.
+    if (e.field == QueryField::Modified) {
+      e.value = (nowFt > e.value) ? nowFt - e.value : 0;
+      switch (e.op) {
+        case QueryOp::Lt: e.op = QueryOp::Gt; break;
+        case QueryOp::Le: e.op = QueryOp::Ge; break;
+        case QueryOp::Gt: e.op = QueryOp::Lt; break;
+        case QueryOp::Ge: e.op = QueryOp::Le; break;
+        default: break;
+      }
+    }
+    return Add(e);
+  }
+
+  int ParseUnary() {
+    SkipWs();
+    if (Word(L"not")) {
+      const int inner = ParseUnary();
+      if (inner < 0) return -1;
+      QueryExpr e{};
+      e.kind = QueryExpr::Kind::Not;
+      e.lhs = inner;
+      return Add(e);
+    }
+    if (*p == L'(') {
+      ++p;
+      const int inner = ParseOr();
+      SkipWs();
+      if (inner < 0) return -1;
+      if (*p != L')') { Fail(L"expected ')'"); return -1; }
+      ++p;
+      return inner;
+    }
+    return ParseCompare();
+  }
+
+  int ParseAnd() {
+    int lhs = ParseUnary();
+    while (lhs >= 0 && Word(L"and")) {
+      const int rhs = ParseUnary();
+      if (rhs < 0) return -1;
+      QueryExpr e{};
+      e.kind = QueryExpr::Kind::And;
+      e.lhs = lhs;
+      e.rhs = rhs;
+      lhs = Add(e);
+    }
+    return lhs;
+  }
+
+  int ParseOr() {
+    int lhs = ParseAnd();
+    while (lhs >= 0 && Word(L"or")) {
+      const int rhs = ParseAnd();
+      if (rhs < 0) return -1;
+      QueryExpr e{};
+      e.kind = QueryExpr::Kind::Or;
+      e.lhs = lhs;
+      e.rhs = rhs;
+      lhs = Add(e);
+    }
+    return lhs;
+  }
+};
+
+// Grammar: [where] <expr> [order by <field> [asc|desc]] [limit <n>]
+static bool ParseQuery(const wstring& text, Query& q, wstring& err) {
+  FILETIME ft{};
+  GetSystemTimeAsFileTime(&ft);
+
+  QueryParser ps{};
+  ps.p = text.c_str();
+  ps.q = &q;
+  ps.nowFt = FileTimeToU64(ft);
+
+  ps.Word(L"where");
+  ps.SkipWs();
+  if (*ps.p && !ps.Peek(L"order") && !ps.Peek(L"limit")) {
+    q.root = ps.ParseOr();
+    if (q.root < 0) { err = ps.err; return false; }
+  }
+
+  if (ps.Word(L"order")) {
+    if (!ps.Word(L"by")) { err = L"expected 'by' after 'order'"; return false; }
+    if (!ps.ParseField(q.orderBy) || q.orderBy == QueryField::Name) {
+      err = ps.err.empty() ? L"cannot order by name" : ps.err;
+      return false;
+    }
+    if (ps.Word(L"asc")) q.ascending = true;
+    else if (ps.Word(L"desc")) q.ascending = false;
+  }
+  if (ps.Word(L"limit")) {
+    ps.SkipWs();
+    wchar_t* end = nullptr;
+    const unsigned long long n = wcstoull(ps.p, &end, 10);
+    if (end == ps.p) { err = L"expected number after 'limit'"; return false; }
+    q.limit = (size_t)n;
+    ps.p = end;
+  }
+  ps.SkipWs();
+  if (*ps.p) { err = wstring(L"unexpected '") + ps.p + L"'"; return false; }
+  return true;
+}
+
+static const size_t QUERY_BLOCK = 4096;
+
+// Plain loops over contiguous columns; compilers turn these into SIMD compares.
+template <typename T>
+static void EvalCompareBlock(const T* col, size_t n, QueryOp op, uint64_t v, uint8_t* out) {
+  switch (op) {
+    case QueryOp::Lt: for (size_t i = 0; i < n; ++i) out[i] = (uint8_t)(col[i] <  v); break;
+    case QueryOp::Le: for (size_t i = 0; i < n; ++i) out[i] = (uint8_t)(col[i] <= v); break;
+    case QueryOp::Gt: for (size_t i = 0; i < n; ++i) out[i] = (uint8_t)(col[i] >  v); break;
+    case QueryOp::Ge: for (size_t i = 0; i < n; ++i) out[i] = (uint8_t)(col[i] >= v); break;
+    case QueryOp::Eq: for (size_t i = 0; i < n; ++i) out[i] = (uint8_t)(col[i] == v); break;
+    case QueryOp::Ne: for (size_t i = 0; i < n; ++i) out[i] = (uint8_t)(col[i] != v); break;
+  }
+}
+
+static bool AnySet(const uint8_t* m, size_t n) {
+  for (size_t i = 0; i < n; ++i) if (m[i]) return true;
+  return false;
+}
+
+static void EvalExprBlock(const Query& q, int idx, const ColumnIndex& ci, size_t start, size_t n,
+                          std::vector<std::vector<uint8_t>>& scratch, size_t level, uint8_t* out) {
+  const QueryExpr& e = q.exprs[idx];
+  switch (e.kind) {
+    case QueryExpr::Kind::Compare:
+      switch (e.field) {
+        case QueryField::Size:     EvalCompareBlock(ci.bytes.data() + start, n, e.op, e.value, out); break;
+        case QueryField::Files:    EvalCompareBlock(ci.files.data() + start, n, e.op, e.value, out); break;
+        case QueryField::Dirs:     EvalCompareBlock(ci.dirs.data() + start, n, e.op, e.value, out); break;
+        case QueryField::Modified: EvalCompareBlock(ci.newestWrite.data() + start, n, e.op, e.value, out); break;
+        case QueryField::Depth:    EvalCompareBlock(ci.depth.data() + start, n, e.op, e.value, out); break;
+        case QueryField::Name:
+          for (size_t i = 0; i < n; ++i) {
+            const size_t row = start + i;
+            const ScanTree& t = *ci.trees[ci.treeOf[row]];
+            const uint32_t node = (uint32_t)(row - ci.treeBase[ci.treeOf[row]]);
+            const TreeNode& tn = t.nodes[node];
+            const bool m = (node == 0)
+                ? GlobMatchNoCase(t.rootPath.c_str() + t.rootPath.find_last_of(L"\\/") + 1,
+                                  t.rootPath.size() - t.rootPath.find_last_of(L"\\/") - 1, e.pattern.c_str())
+                : GlobMatchNoCase(t.names.data() + tn.nameOff, tn.nameLen, e.pattern.c_str());
+            out[i] = (uint8_t)((e.op == QueryOp::Eq) == m);
+          }
+          break;
+      }
+      return;
+
+    case QueryExpr::Kind::Not:
+      EvalExprBlock(q, e.lhs, ci, start, n, scratch, level, out);
+      for (size_t i = 0; i < n; ++i) out[i] ^= 1;
+      return;
+
+    case QueryExpr::Kind::And:
+    case QueryExpr::Kind::Or: {
+      EvalExprBlock(q, e.lhs, ci, start, n, scratch, level, out);
+      const bool isAnd = (e.kind == QueryExpr::Kind::And);
+      const bool any = AnySet(out, n);
+      if (isAnd && !any) return;
+      if (!isAnd && any && std::all_of(out, out + n, [](uint8_t b) { return b != 0; })) return;
+
+      if (scratch.size() <= level) scratch.resize(level + 1);
+      scratch[level].resize(QUERY_BLOCK);
+      uint8_t* tmp = scratch[level].data();
+      EvalExprBlock(q, e.rhs, ci, start, n, scratch, level + 1, tmp);
+      if (isAnd) for (size_t i = 0; i < n; ++i) out[i] &= tmp[i];
+      else       for (size_t i = 0; i < n; ++i) out[i] |= tmp[i];
+      return;
+    }
+  }
+}
+
+struct QueryResult {
+  std::vector<uint32_t> rows;   // ordered, truncated to the limit
+  uint64_t matched = 0;
+  uint64_t outerBytes = 0;      // bytes of matches without a matching ancestor
+  uint64_t outerFiles = 0;
+  uint64_t scanned = 0;
+};
+
+static uint64_t ColumnValue(const ColumnIndex& ci, QueryField f, uint32_t row) {
+  switch (f) {
+    case QueryField::Size: return ci.bytes[row];
+    case QueryField::Files: return ci.files[row];
+    case QueryField::Dirs: return ci.dirs[row];
+    case QueryField::Depth: return ci.depth[row];
+    case QueryField::Modified: return ci.newestWrite[row];
+    case QueryField::Name: break;
+  }
+  return 0;
+}
+
+static QueryResult RunQuery(const Query& q, const ColumnIndex& ci) {
+  QueryResult r{};
+  const size_t rows = ci.bytes.size();
+  r.scanned = rows;
+
+  std::vector<uint8_t> mask(rows, 1);
+  if (q.root >= 0) {
+    std::vector<std::vector<uint8_t>> scratch;
+    for (size_t start = 0; start < rows; start += QUERY_BLOCK) {
+      const size_t n = std::min(QUERY_BLOCK, rows - start);
+      EvalExprBlock(q, q.root, ci, start, n, scratch, 0, mask.data() + start);
+    }
+  }
+
+  // Parents precede children, so one forward pass knows whether any ancestor matched.
+  std::vector<uint8_t> covered(rows, 0);
+  for (size_t i = 0; i < rows; ++i) {
+    const uint32_t pr = ci.parentRow[i];
+    if (pr != i) covered[i] = (uint8_t)(covered[pr] | mask[pr]);
+    if (!mask[i]) continue;
+    r.matched++;
+    r.rows.push_back((uint32_t)i);
+    if (!covered[i]) {
+      r.outerBytes += ci.bytes[i];
+      r.outerFiles += ci.files[i];
+    }
+  }
+
+  const size_t keep = std::min(q.limit, r.rows.size());
+  auto less = [&](uint32_t a, uint32_t b) {
+    const uint64_t va = ColumnValue(ci, q.orderBy, a);
+    const uint64_t vb = ColumnValue(ci, q.orderBy, b);
+    return q.ascending ? va < vb : va > vb;
+  };
+  std::partial_sort(r.rows.begin(), r.rows.begin() + keep, r.rows.end(), less);
+  r.rows.resize(keep);
+  return r;
+}
+
+static wstring ColumnRowPath(const ColumnIndex& ci, uint32_t row) {
+  const uint32_t ti = ci.treeOf[row];
+  return TreeNodePath(*ci.trees[ti], row - ci.treeBase[ti]);
+}
+
+// Snapshots: a scanned tree laid out breadth-first with each node's children contiguous
+// and sorted by name, so two snapshots diff by merge-joining sibling lists.
+
+static const uint32_t NO_NODE = 0xFFFFFFFFu;
+
+struct SnapNode {
+  uint32_t firstChild = 0;
+  uint32_t childCount = 0;
+  uint32_t nameOff = 0;
+  uint32_t nameLen = 0;
+  uint64_t bytes = 0;
+  uint64_t files = 0;
+  uint64_t dirs = 0;
+  uint64_t newestWrite = 0;
+};
+
+struct Snapshot {
+  wstring rootPath;
+  uint64_t takenAt = 0;      // FILETIME
+  bool incomplete = false;
+  std::vector<SnapNode> nodes;
+  std::vector<wchar_t> names;
+};
+
+static int CompareNames(const wchar_t* a, uint32_t an, const wchar_t* b, uint32_t bn) {
+  return CompareStringOrdinal(a, (int)an, b, (int)bn, TRUE) - CSTR_EQUAL;
+}
+
+static wstring LastPathComponent(const wstring& p) {
+  const wstring s = TrimTrailingSlash(p);
+  const size_t pos = s.find_last_of(L"\\/");
+  return (pos == wstring::npos) ? s : s.substr(pos + 1);
+}
+
+// Lays out rootPath with the given subtrees as its children. Each ScanTree's node 0
+// becomes a child of the snapshot root named after the last component of its path,
+// unless the only tree is rooted at rootPath itself, in which case it is the root.
+static Snapshot BuildSnapshot(const wstring& rootPath,
+                              const std::vector<std::shared_ptr<const ScanTree>>& trees) {
+  struct Ref { int32_t tree; uint32_t node; };  // tree == -1: the synthetic root
+  struct Kids { std::vector<uint32_t> start; std::vector<uint32_t> list; };
+
+  // Child lists per tree (counting sort by parent).
+  std::vector<Kids> kids(trees.size());
+  for (size_t t = 0; t < trees.size(); ++t) {
+    const auto& nodes = trees[t]->nodes;
+    Kids& k = kids[t];
+    k.start.assign(nodes.size() + 1, 0);
+    for (size_t i = 1; i < nodes.size(); ++i) k.start[nodes[i].parent + 1]++;
+    for (size_t i = 1; i <= nodes.size(); ++i) k.start[i] += k.start[i - 1];
+    k.list.resize(nodes.size() > 0 ? nodes.size() - 1 : 0);
+    std::vector<uint32_t> fill(k.start.begin(), k.start.end() - 1);
+    for (size_t i = 1; i < nodes.size(); ++i) k.list[fill[nodes[i].parent]++] = (uint32_t)i;
+  }
+
+  std::vector<wstring> rootNames(trees.size());
+  for (size_t t = 0; t < trees.size(); ++t) rootNames[t] = LastPathComponent(trees[t]->rootPath);
+
+  Snapshot s{};
+  s.rootPath = TrimTrailingSlash(rootPath);
+  FILETIME ft{};
+  GetSystemTimeAsFileTime(&ft);
+  s.takenAt = FileTimeToU64(ft);
+
+  size_t total = 1;
+  for (const auto& t : trees) total += t->nodes.size();
+  s.nodes.reserve(total);
+
+  std::vector<Ref> order;  // snapshot index -> source
+  order.reserve(total);
+  const bool treeIsRoot = trees.size() == 1 && _wcsicmp(trees[0]->rootPath.c_str(), s.rootPath.c_str()) == 0;
+  SnapNode rootNode{};
+  if (treeIsRoot) {
+    const TreeNode& tn = trees[0]->nodes[0];
+    rootNode.bytes = tn.bytes;
+    rootNode.files = tn.files;
+    rootNode.dirs = tn.dirs;
+    rootNode.newestWrite = tn.newestWrite;
+  }
+  order.push_back(treeIsRoot ? Ref{0, 0} : Ref{-1, 0});
+  s.nodes.push_back(rootNode);
+
+  auto nameOf = [&](const Ref& r, const wchar_t*& p, uint32_t& n) {
+    if (r.tree < 0) { p = L""; n = 0; return; }
+    if (r.node == 0) { p = rootNames[r.tree].c_str(); n = (uint32_t)rootNames[r.tree].size(); return; }
+    const ScanTree& t = *trees[r.tree];
+    p = t.names.data() + t.nodes[r.node].nameOff;
+    n = t.nodes[r.node].nameLen;
+  };
+
+  std::vector<Ref> children;
+  for (size_t i = 0; i < order.size(); ++i) {
+    const Ref cur = order[i];
+    children.clear();
+    if (cur.tree < 0) {
+      for (size_t t = 0; t < trees.size(); ++t) children.push_back(Ref{(int32_t)t, 0});
+    } else {
+      const Kids& k = kids[cur.tree];
+      for (uint32_t j = k.start[cur.node]; j < k.start[cur.node + 1]; ++j) children.push_back(Ref{cur.tree, k.list[j]});
+    }
+
+    std::sort(children.begin(), children.end(), [&](const Ref& a, const Ref& b) {
+      const wchar_t* pa; uint32_t na;
+      const wchar_t* pb; uint32_t nb;
+      nameOf(a, pa, na);
+      nameOf(b, pb, nb);
+      return CompareNames(pa, na, pb, nb) < 0;
+    });
+
+    s.nodes[i].firstChild = (uint32_t)s.nodes.size();
+    s.nodes[i].childCount = (uint32_t)children.size();
+
+    for (const Ref& c : children) {
+      const TreeNode& tn = trees[c.tree]->nodes[c.node];
+      SnapNode sn{};
+      const wchar_t* p; uint32_t n;
+      nameOf(c, p, n);
+      sn.nameOff = (uint32_t)s.names.size();
+      sn.nameLen = n;
+      s.names.insert(s.names.end(), p, p + n);
+      sn.bytes = tn.bytes;
+      sn.files = tn.files;
+      sn.dirs = tn.dirs;
+      sn.newestWrite = tn.newestWrite;
+      s.nodes.push_back(sn);
+      order.push_back(c);
+
+      SnapNode& root = s.nodes[0];
+      if (cur.tree < 0) {
+        root.bytes += sn.bytes;
+        root.files += sn.files;
+        root.dirs += sn.dirs + 1;
+        if (sn.newestWrite > root.newestWrite) root.newestWrite = sn.newestWrite;
+      }
+    }
+  }
+  return s;
+}
+
+struct FileWriter {
+  HANDLE h = INVALID_HANDLE_VALUE;
+  std::vector<uint8_t> buf;
+  bool ok = true;
+
+  bool Open(const wstring& path) {
+    h = CreateFileW(ToLongPath(path).c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    buf.reserve(1 << 20);
+    return h != INVALID_HANDLE_VALUE;
+  }
+  void Put(const void* p, size_t n) {
+    const uint8_t* b = (const uint8_t*)p;
+    buf.insert(buf.end(), b, b + n);
+    if (buf.size() >= (1 << 20)) Flush();
+  }
+  template <typename T> void PutPod(const T& v) { Put(&v, sizeof(v)); }
+  void Flush() {
+    if (buf.empty() || h == INVALID_HANDLE_VALUE) return;
+    DWORD n = 0;
+    if (!WriteFile(h, buf.data(), (DWORD)buf.size(), &n, nullptr) || n != buf.size()) ok = false;
+    buf.clear();
+  }
+  bool Close() {
+    Flush();
+    if (h != INVALID_HANDLE_VALUE) CloseHandle(h);
+    h = INVALID_HANDLE_VALUE;
+    return ok;
+  }
+  ~FileWriter() { if (h != INVALID_HANDLE_VALUE) CloseHandle(h); }
+};
+
+struct FileReader {
+  HANDLE h = INVALID_HANDLE_VALUE;
+  std::vector<uint8_t> buf;
+  size_t pos = 0;
+  uint64_t size = 0;    // of the file, for sanity checks on counts read from it
+  uint64_t filled = 0;  // bytes read into buf so far
+  bool ok = true;
+
+  bool Open(const wstring& path) {
+    h = CreateFileW(ToLongPath(path).c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    LARGE_INTEGER sz{};
+    if (h != INVALID_HANDLE_VALUE && GetFileSizeEx(h, &sz)) size = (uint64_t)sz.QuadPart;
+    return h != INVALID_HANDLE_VALUE;
+  }
+  bool Fill() {
+    buf.erase(buf.begin(), buf.begin() + pos);
+    pos = 0;
+    const size_t have = buf.size();
+    buf.resize(have + (1 << 20));
+    DWORD n = 0;
+    if (!ReadFile(h, buf.data() + have, 1 << 20, &n, nullptr)) n = 0;
+    buf.resize(have + n);
+    filled += n;
+    return n > 0;
+  }
+  // Bytes not yet consumed.
+  uint64_t Remaining() const { return (size > filled ? size - filled : 0) + (buf.size() - pos); }
+  bool Get(void* p, size_t n) {
+    while (buf.size() - pos < n) {
+      if (!Fill()) { ok = false; return false; }
+    }
+    memcpy(p, buf.data() + pos, n);
+    pos += n;
+    return true;
+  }
+  template <typename T> bool GetPod(T& v) { return Get(&v, sizeof(v)); }
+  bool GetByte(uint8_t& b) {
+    if (pos == buf.size() && !Fill()) { ok = false; return false; }
+    b = buf[pos++];
+    return true;
+  }
+  ~FileReader() { if (h != INVALID_HANDLE_VALUE) CloseHandle(h); }
+};
+
+static const char SNAPSHOT_MAGIC[8] = {'D', 'P', 'S', 'N', 'A', 'P', 0, 0};
+// Version 2 streams the tree in pre-order: per directory its child count, its name
+// front-coded against the previous sibling (shared prefix length + suffix), then
+// bytes, files, dirs and the age of its newest file, all as LEB128 varints. Name
+// code units are stored UTF-8 style (1-3 bytes each, surrogates kept as-is). The
+// writer keeps only one entry per tree level besides the I/O buffer; the reader
+// builds the full node table the diff and browse views work on, sized by the
+// header's node count once that count is checked against the file size. Version 1
+// (raw node table) is still read.
+static const uint32_t SNAPSHOT_VERSION = 2;
+static const uint32_t SNAPSHOT_VERSION_RAW = 1;
+static const uint64_t SNAPSHOT_RECORD_MIN_BYTES = 8;  // eight one-byte varints
+
+static void PutVarint(FileWriter& w, uint64_t v) {
+  uint8_t b[10];
+  size_t n = 0;
+  while (v >= 0x80) {
+    b[n++] = (uint8_t)(v | 0x80);
+    v >>= 7;
+  }
+  b[n++] = (uint8_t)v;
+  w.Put(b, n);
+}
+
+static bool GetVarint(FileReader& r, uint64_t& v) {
+  v = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    uint8_t b = 0;
+    if (!r.GetByte(b)) return false;
+    v |= (uint64_t)(b & 0x7F) << shift;
+    if (!(b & 0x80)) return true;
+  }
+  r.ok = false;
+  return false;
+}
+
+static void PutUnits(FileWriter& w, const wchar_t* p, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    const uint32_t u = (uint16_t)p[i];
+    uint8_t b[3];
+    if (u < 0x80) {
+      b[0] = (uint8_t)u;
+      w.Put(b, 1);
+    } else if (u < 0x800) {
+      b[0] = (uint8_t)(0xC0 | (u >> 6));
+      b[1] = (uint8_t)(0x80 | (u & 0x3F));
+      w.Put(b, 2);
+    } else {
+      b[0] = (uint8_t)(0xE0 | (u >> 12));
+      b[1] = (uint8_t)(0x80 | ((u >> 6) & 0x3F));
+      b[2] = (uint8_t)(0x80 | (u & 0x3F));
+      w.Put(b, 3);
+    }
+  }
+}
+
+static bool GetUnits(FileReader& r, size_t n, std::vector<wchar_t>& out) {
+  for (size_t i = 0; i < n; ++i) {
+    uint8_t b0 = 0, b1 = 0, b2 = 0;
+    if (!r.GetByte(b0)) return false;
+    if (b0 < 0x80) {
+      out.push_back((wchar_t)b0);
+    } else if ((b0 & 0xE0) == 0xC0) {
+      if (!r.GetByte(b1)) return false;
+      out.push_back((wchar_t)(((b0 & 0x1F) << 6) | (b1 & 0x3F)));
+    } else {
+      if (!r.GetByte(b1) || !r.GetByte(b2)) return false;
+      out.push_back((wchar_t)(((b0 & 0x0F) << 12) | ((b1 & 0x3F) << 6) | (b2 & 0x3F)));
+    }
+  }
+  return true;
+}
+
+static uint64_t ZigZag(int64_t v) { return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63); }
+static int64_t UnZigZag(uint64_t v) { return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+
+static bool WriteSnapshot(const Snapshot& s, const wstring& path) {
+  FileWriter w;
+  if (!w.Open(path)) return false;
+
+  w.Put(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+  w.PutPod(SNAPSHOT_VERSION);
+  w.PutPod((uint32_t)(s.incomplete ? 1 : 0));
+  w.PutPod(s.takenAt);
+  PutVarint(w, s.rootPath.size());
+  PutUnits(w, s.rootPath.data(), s.rootPath.size());
+  PutVarint(w, s.nodes.size());
+
+  auto emit = [&](uint32_t k, uint32_t prevSibling) {
+    const SnapNode& n = s.nodes[k];
+    const wchar_t* name = s.names.data() + n.nameOff;
+    uint32_t prefix = 0;
+    if (prevSibling != NO_NODE) {
+      const SnapNode& p = s.nodes[prevSibling];
+      const wchar_t* prev = s.names.data() + p.nameOff;
+      const uint32_t lim = std::min(p.nameLen, n.nameLen);
+      while (prefix < lim && prev[prefix] == name[prefix]) prefix++;
+    }
+    PutVarint(w, n.childCount);
+    PutVarint(w, prefix);
+    PutVarint(w, n.nameLen - prefix);
+    PutUnits(w, name + prefix, n.nameLen - prefix);
+    PutVarint(w, n.bytes);
+    PutVarint(w, n.files);
+    PutVarint(w, n.dirs);
+    PutVarint(w, ZigZag((int64_t)(s.takenAt - n.newestWrite)));
+  };
+
+  struct Level { uint32_t node; uint32_t next; };
+  std::vector<Level> stack;
+  emit(0, NO_NODE);
+  stack.push_back(Level{0, 0});
+  while (!stack.empty()) {
+    const Level top = stack.back();
+    const SnapNode& n = s.nodes[top.node];
+    if (top.next == n.childCount) {
+      stack.pop_back();
+      continue;
+    }
+    const uint32_t child = n.firstChild + top.next;
+    stack.back().next++;
+    emit(child, top.next > 0 ? child - 1 : NO_NODE);
+    if (s.nodes[child].childCount > 0) stack.push_back(Level{child, 0});
+  }
+  return w.Close();
+}
+
+static bool ReadSnapshotRaw(FileReader& r, Snapshot& s, wstring& err) {
+  uint32_t rootLen = 0;
+  uint64_t nodeCount = 0, nameCount = 0;
+  r.GetPod(rootLen);
+  if (!r.ok || (uint64_t)rootLen * sizeof(wchar_t) > r.Remaining()) { err = L"corrupt snapshot header"; return false; }
+  s.rootPath.resize(rootLen);
+  r.Get(&s.rootPath[0], rootLen * sizeof(wchar_t));
+  r.GetPod(nodeCount);
+  r.GetPod(nameCount);
+  if (!r.ok || nodeCount == 0 || nodeCount > NO_NODE || nameCount > NO_NODE ||
+      nodeCount * sizeof(SnapNode) + nameCount * sizeof(wchar_t) > r.Remaining()) {
+    err = L"corrupt snapshot header";
+    return false;
+  }
+
+  s.nodes.resize((size_t)nodeCount);
+  s.names.resize((size_t)nameCount);
+  r.Get(s.nodes.data(), s.nodes.size() * sizeof(SnapNode));
+  r.Get(s.names.data(), s.names.size() * sizeof(wchar_t));
+  if (!r.ok) { err = L"truncated snapshot"; return false; }
+
+  for (const SnapNode& n : s.nodes) {
+    if ((uint64_t)n.firstChild + n.childCount > nodeCount || (uint64_t)n.nameOff + n.nameLen > nameCount) {
+      err = L"corrupt snapshot node table";
+      return false;
+    }
+  }
+  return true;
+}
+
+// Children are given consecutive slots when their parent's record is read, so the
+// result has the same firstChild/childCount layout as a built snapshot.
+static bool ReadSnapshotStream(FileReader& r, Snapshot& s, wstring& err) {
+  uint64_t rootLen = 0, nodeCount = 0;
+  if (!GetVarint(r, rootLen) || rootLen > 0x7FFF) { err = L"corrupt snapshot header"; return false; }
+  std::vector<wchar_t> root;
+  if (!GetUnits(r, (size_t)rootLen, root)) { err = L"truncated snapshot"; return false; }
+  s.rootPath.assign(root.begin(), root.end());
+  if (!GetVarint(r, nodeCount) || nodeCount == 0 || nodeCount > NO_NODE ||
+      nodeCount > r.Remaining() / SNAPSHOT_RECORD_MIN_BYTES) {
+    err = L"corrupt snapshot header";
+    return false;
+  }
+  s.nodes.reserve((size_t)nodeCount);
+
+  // Reads one record into slot k, front-decoding its name against the previous
+  // sibling's; reserves slots for its children.
+  auto readRecord = [&](uint32_t k, uint32_t prevSibling) -> bool {
+    uint64_t childCount = 0, prefix = 0, suffix = 0, age = 0;
+    SnapNode n{};
+    if (!GetVarint(r, childCount) || !GetVarint(r, prefix) || !GetVarint(r, suffix)) return false;
+    const uint32_t prevLen = prevSibling == NO_NODE ? 0 : s.nodes[prevSibling].nameLen;
+    if (prefix > prevLen || suffix > 0x7FFF) return false;
+    n.nameOff = (uint32_t)s.names.size();
+    n.nameLen = (uint32_t)(prefix + suffix);
+    for (uint64_t i = 0; i < prefix; ++i) {
+      const wchar_t c = s.names[s.nodes[prevSibling].nameOff + i];
+      s.names.push_back(c);
+    }
+    if (!GetUnits(r, (size_t)suffix, s.names)) return false;
+    if (!GetVarint(r, n.bytes) || !GetVarint(r, n.files) || !GetVarint(r, n.dirs) || !GetVarint(r, age)) return false;
+    n.newestWrite = s.takenAt - (uint64_t)UnZigZag(age);
+    if (childCount > nodeCount - s.nodes.size()) return false;
+    n.childCount = (uint32_t)childCount;
+    n.firstChild = (uint32_t)s.nodes.size();
+    s.nodes.resize(s.nodes.size() + (size_t)childCount);
+    s.nodes[k] = n;
+    return true;
+  };
+
+  struct Level { uint32_t first; uint32_t next; uint32_t end; };
+  std::vector<Level> stack;
+  auto pushChildren = [&](uint32_t k) {
+    const SnapNode& n = s.nodes[k];
+    if (n.childCount > 0) stack.push_back(Level{n.firstChild, n.firstChild, n.firstChild + n.childCount});
+  };
+
+  s.nodes.resize(1);
+  if (!readRecord(0, NO_NODE)) { err = L"corrupt snapshot record"; return false; }
+  pushChildren(0);
+  while (!stack.empty()) {
+    Level& top = stack.back();
+    if (top.next == top.end) {
+      stack.pop_back();
+      continue;
+    }
+    const uint32_t k = top.next++;
+    if (!readRecord(k, k > top.first ? k - 1 : NO_NODE)) { err = L"corrupt snapshot record"; return false; }
+    pushChildren(k);
+  }
+  if (s.nodes.size() != nodeCount) { err = L"snapshot node count mismatch"; return false; }
+  return true;
+}
+
+static bool ReadSnapshot(const wstring& path, Snapshot& s, wstring& err) {
+  FileReader r;
+  if (!r.Open(path)) { err = L"cannot open " + path; return false; }
+
+  char magic[8] = {};
+  uint32_t version = 0, flags = 0;
+  if (!r.Get(magic, sizeof(magic)) || memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) != 0) {
+    err = path + L" is not a DirPie snapshot";
+    return false;
+  }
+  r.GetPod(version);
+  if (version != SNAPSHOT_VERSION && version != SNAPSHOT_VERSION_RAW) { err = L"unsupported snapshot version"; return false; }
+  r.GetPod(flags);
+  r.GetPod(s.takenAt);
+  s.incomplete = (flags & 1) != 0;
+  return version == SNAPSHOT_VERSION ? ReadSnapshotStream(r, s, err) : ReadSnapshotRaw(r, s, err);
+}
+
+static const char TRACE_MAGIC[8] = {'D', 'P', 'T', 'R', 'A', 'C', 'E', 0};
+// Directories in key order, each key front-coded against the previous one, then
+// its flags, error, latency and entries. Entry times are varint deltas: the write
+// time against the previous entry's, the access time against the write time.
+static const uint32_t TRACE_VERSION = 1;
+
+static bool WriteTrace(const FsTrace& t, const wstring& path) {
+  FileWriter w;
+  if (!w.Open(path)) return false;
+  w.Put(TRACE_MAGIC, sizeof(TRACE_MAGIC));
+  w.PutPod(TRACE_VERSION);
+
+  std::vector<const std::pair<const wstring, TraceDir>*> order;
+  order.reserve(t.dirs.size());
+  for (const auto& kv : t.dirs) order.push_back(&kv);
+  std::sort(order.begin(), order.end(), [](const auto* a, const auto* b) { return a->first < b->first; });
+
+  PutVarint(w, order.size());
+  const wstring* prev = nullptr;
+  for (const auto* kv : order) {
+    const wstring& key = kv->first;
+    const TraceDir& d = kv->second;
+    size_t prefix = 0;
+    if (prev) {
+      while (prefix < prev->size() && prefix < key.size() && (*prev)[prefix] == key[prefix]) ++prefix;
+    }
+    PutVarint(w, prefix);
+    PutVarint(w, key.size() - prefix);
+    PutUnits(w, key.c_str() + prefix, key.size() - prefix);
+    prev = &key;
+
+    PutVarint(w, d.openFailed ? 1 : 0);
+    PutVarint(w, d.error);
+    PutVarint(w, d.micros);
+    PutVarint(w, d.count);
+    uint64_t lastWrite = 0;
+    for (uint32_t i = 0; i < d.count; ++i) {
+      const TraceEntry& e = t.entries[d.first + i];
+      PutVarint(w, e.nameLen);
+      PutUnits(w, t.names.data() + e.nameOff, e.nameLen);
+      PutVarint(w, e.attributes);
+      PutVarint(w, e.size);
+      PutVarint(w, ZigZag((int64_t)(e.writeTime - lastWrite)));
+      PutVarint(w, ZigZag((int64_t)(e.accessTime - e.writeTime)));
+      lastWrite = e.writeTime;
+    }
+  }
+  return w.Close();
+}
+
+static bool ReadTrace(const wstring& path, FsTrace& t, wstring& err) {
+  FileReader r;
+  if (!r.Open(path)) { err = L"cannot open " + path; return false; }
+
+  char magic[8] = {};
+  uint32_t version = 0;
+  if (!r.Get(magic, sizeof(magic)) || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0) {
+    err = path + L" is not a DirPie trace";
+    return false;
+  }
+  if (!r.GetPod(version) || version != TRACE_VERSION) { err = L"unsupported trace version"; return false; }
+
+  uint64_t dirCount = 0;
+  if (!GetVarint(r, dirCount)) { err = L"corrupt trace header"; return false; }
+  std::vector<wchar_t> key;
+  for (uint64_t k = 0; k < dirCount; ++k) {
+    uint64_t prefix = 0, suffix = 0, openFailed = 0, error = 0, micros = 0, count = 0;
+    if (!GetVarint(r, prefix) || !GetVarint(r, suffix) || prefix > key.size()) { err = L"corrupt trace"; return false; }
+    key.resize((size_t)prefix);
+    if (!GetUnits(r, (size_t)suffix, key)) { err = L"corrupt trace"; return false; }
+    if (!GetVarint(r, openFailed) || !GetVarint(r, error) || !GetVarint(r, micros) || !GetVarint(r, count)) {
+      err = L"corrupt trace";
+      return false;
+    }
+
+    TraceDir d;
+    d.openFailed = openFailed != 0;
+    d.error = (DWORD)error;
+    d.micros = (uint32_t)micros;
+    d.first = (uint32_t)t.entries.size();
+    d.count = (uint32_t)count;
+    uint64_t lastWrite = 0;
+    for (uint64_t i = 0; i < count; ++i) {
+      TraceEntry e;
+      uint64_t nameLen = 0, attributes = 0, write = 0, access = 0;
+      if (!GetVarint(r, nameLen)) { err = L"corrupt trace"; return false; }
+      e.nameOff = (uint32_t)t.names.size();
+      e.nameLen = (uint32_t)nameLen;
+      if (!GetUnits(r, (size_t)nameLen, t.names) || !GetVarint(r, attributes) || !GetVarint(r, e.size) ||
+          !GetVarint(r, write) || !GetVarint(r, access)) {
+        err = L"corrupt trace";
+        return false;
+      }
+      e.attributes = (uint32_t)attributes;
+      e.writeTime = lastWrite + (uint64_t)UnZigZag(write);
+      e.accessTime = e.writeTime + (uint64_t)UnZigZag(access);
+      lastWrite = e.writeTime;
+      t.entries.push_back(e);
+    }
+    t.dirs.emplace(wstring(key.begin(), key.end()), d);
+  }
+  return true;
+}
+
+static wstring g_traceError;  // why the replayed trace could not be loaded
+
+// Loaded on first use. A trace that fails to load replays as empty, so every
+// directory reads as missing rather than silently falling back to the disk.
+static const FsTrace* ReplayTrace() {
+  static const FsTrace* trace = []() -> const FsTrace* {
+    const wstring path = EnvString(L"DIRPIE_TRACE_REPLAY");
+    if (path.empty()) return nullptr;
+    FsTrace* t = new FsTrace();  // lives as long as the process
+    if (!ReadTrace(path, *t, g_traceError)) *t = FsTrace{};
+    return t;
+  }();
+  return trace;
+}
+
+// s as a JSON string literal; control characters become spaces.
+static std::string JsonString(const wstring& s) {
+  std::string out = "\"";
+  for (char c : ToUtf8(s)) {
+    if (c == '"' || c == '\\') out += '\\';
+    if ((unsigned char)c < 0x20) c = ' ';
+    out += c;
+  }
+  return out + "\"";
+}
+
+// Writes every thread's ring to path as Chrome trace-event JSON.
+static bool WriteTimeline(const wstring& path) {
+  FileWriter f;
+  if (!f.Open(path)) return false;
+
+  auto put = [&f](const std::string& s) { f.Put(s.data(), s.size()); };
+
+  char buf[160];
+  bool first = true;
+  auto sep = [&] {
+    put(first ? "\n" : ",\n");
+    first = false;
+  };
+  put("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+  std::lock_guard<std::mutex> lk(g_timelineMu);
+  for (const auto& ring : g_timelineRings) {
+    sep();
+    snprintf(buf, sizeof(buf), "{\"ph\":\"M\",\"pid\":1,\"tid\":%lu,\"name\":\"thread_name\",\"args\":{\"name\":\"%s\"}}",
+             (unsigned long)ring->tid, ring->thread);
+    put(buf);
+
+    const uint64_t written = ring->written.load(std::memory_order_acquire);
+    const uint64_t from = written > TIMELINE_RING_EVENTS ? written - TIMELINE_RING_EVENTS : 0;
+    for (uint64_t i = from; i < written; ++i) {
+      const TimelineEvent& e = ring->events[i % TIMELINE_RING_EVENTS];
+      sep();
+      if (e.dur == TIMELINE_INSTANT) {
+        snprintf(buf, sizeof(buf), "{\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%lu,\"ts\":%llu,\"name\":\"%s\"",
+                 (unsigned long)ring->tid, (unsigned long long)e.start, e.name);
+      } else {
+        snprintf(buf, sizeof(buf), "{\"ph\":\"X\",\"pid\":1,\"tid\":%lu,\"ts\":%llu,\"dur\":%llu,\"name\":\"%s\"",
+                 (unsigned long)ring->tid, (unsigned long long)e.start, (unsigned long long)e.dur, e.name);
+      }
+      put(buf);
+      if (e.argLen) put(",\"args\":{\"path\":" + JsonString(wstring(e.arg, e.argLen)) + "}");
+      put("}");
+    }
+  }
+  put("\n]}\n");
+  return f.Close();
+}
+
+// Writes what DIRPIE_TIMELINE collected. Call once the workers have stopped.
+static bool FinishTimeline(wstring& err) {
+  if (!TimelineOn()) return true;
+  const wstring path = EnvString(L"DIRPIE_TIMELINE");
+  if (WriteTimeline(path)) return true;
+  err = L"cannot write timeline " + path;
+  return false;
+}
+
+// Writes what DIRPIE_TRACE_RECORD collected. Call once the workers have stopped.
+static bool FinishTraceRecording(wstring& err) {
+  if (!TraceRecording()) return true;
+  const wstring path = EnvString(L"DIRPIE_TRACE_RECORD");
+  std::lock_guard<std::mutex> lk(g_traceMu);
+  if (!WriteTrace(g_traceRecord, path)) {
+    err = L"cannot write trace " + path;
+    return false;
+  }
+  return true;
+}
+
+// External listings: ncdu JSON, `find -printf '%s %y %p\n'` and du output, parsed in
+// place from a mapping into the ScanTree a walk produces and browsed as a snapshot.
+
+enum class ListingFormat { Auto, Ncdu, Find, Du, DuBytes };
+
+struct MappedFile {
+  HANDLE file = INVALID_HANDLE_VALUE;
+  HANDLE mapping = nullptr;
+  const char* data = nullptr;
+  size_t size = 0;
+
+  bool Open(const wstring& path) {
+    file = CreateFileW(ToLongPath(path).c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                       FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER sz{};
+    if (!GetFileSizeEx(file, &sz) || sz.QuadPart <= 0) return false;
+    mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping) return false;
+    data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    size = (size_t)sz.QuadPart;
+    return data != nullptr;
+  }
+  ~MappedFile() {
+    if (data) UnmapViewOfFile(data);
+    if (mapping) CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+  }
+};
+
+static int LowestSetBit(uint32_t m) {
+#if defined(_MSC_VER)
+  unsigned long i = 0;
+  _BitScanForward(&i, m);
+  return (int)i;
+#else
+  return __builtin_ctz(m);
+#endif
+}
+
+// First position in [p, end) holding a or b, or end.
+static const char* FindEither(const char* p, const char* end, char a, char b) {
+#ifdef DIRPIE_SSE2
+  const __m128i va = _mm_set1_epi8(a);
+  const __m128i vb = _mm_set1_epi8(b);
+  while (end - p >= 16) {
+    const __m128i v = _mm_loadu_si128((const __m128i*)p);
+    const int m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+    if (m) return p + LowestSetBit((uint32_t)m);
+    p += 16;
+  }
+#endif
+  while (p < end && *p != a && *p != b) ++p;
+  return p;
+}
+
+static void AppendUtf8(std::string_view s, std::vector<wchar_t>& out) {
+  size_t i = 0;
+  while (i < s.size() && (unsigned char)s[i] < 0x80) out.push_back((wchar_t)s[i++]);
+  if (i == s.size()) return;
+  const int n = MultiByteToWideChar(CP_UTF8, 0, s.data() + i, (int)(s.size() - i), nullptr, 0);
+  const size_t at = out.size();
+  out.resize(at + (size_t)n);
+  MultiByteToWideChar(CP_UTF8, 0, s.data() + i, (int)(s.size() - i), out.data() + at, n);
+}
+
+static uint64_t UnixToFileTime(uint64_t secs) {
+  return (secs + 11644473600ULL) * 10000000ULL;
+}
+
+struct ImportStats {
+  uint64_t records = 0;
+  uint64_t skipped = 0;
+  uint64_t files = 0;
+  uint64_t guessed = 0;  // find without %y: leaf lines taken for files; an empty folder looks the same
+  uint64_t linked = 0;   // ncdu: further links to a file whose size was already counted
+};
+
+// Builds a tree from slash-separated paths in any order. Directories are keyed by
+// views into the mapped listing, so parents can be found without copying paths;
+// missing ancestors are created first, which keeps every parent ahead of its
+// children as AggregateTree expects.
+struct PathTreeBuilder {
+  ScanTree& tree;
+  std::unordered_map<std::string_view, uint32_t> dirs;
+  std::vector<wchar_t> wide;
+  std::vector<uint64_t> totals;     // du only: reported subtree size per node
+  std::vector<uint8_t> hasTotal;
+  bool absolute = false;
+
+  explicit PathTreeBuilder(ScanTree& t) : tree(t) {
+    AddTreeNode(tree, 0, L"");
+    dirs.emplace(std::string_view(), 0);
+  }
+
+  static std::string_view Parent(std::string_view path, std::string_view& name) {
+    const size_t slash = path.find_last_of('/');
+    if (slash == std::string_view::npos) {
+      name = path;
+      return std::string_view();
+    }
+    name = path.substr(slash + 1);
+    return path.substr(0, slash);
+  }
+
+  uint32_t Dir(std::string_view path) {
+    while (!path.empty() && path.back() == '/') path.remove_suffix(1);
+    auto it = dirs.find(path);
+    if (it != dirs.end()) return it->second;
+
+    std::string_view name;
+    const uint32_t parent = Dir(Parent(path, name));
+    wide.clear();
+    AppendUtf8(name, wide);
+    const uint32_t node = AddTreeNode(tree, parent, wide.data(), wide.size());
+    dirs.emplace(path, node);
+    return node;
+  }
+
+  void AddFile(std::string_view path, uint64_t size, uint64_t mtime) {
+    std::string_view name;
+    TreeNode& n = tree.nodes[Dir(Parent(path, name))];
+    n.bytes += size;
+    n.files++;
+    if (mtime > n.newestWrite) n.newestWrite = mtime;
+  }
+
+  void SetTotal(std::string_view path, uint64_t size) {
+    const uint32_t node = Dir(path);
+    if (totals.size() < tree.nodes.size()) {
+      totals.resize(tree.nodes.size() * 2);
+      hasTotal.resize(tree.nodes.size() * 2);
+    }
+    totals[node] = size;
+    hasTotal[node] = 1;
+  }
+
+  // du reports subtree sizes; each node keeps what its children do not account
+  // for. Nodes du did not list get the sum of their children.
+  void ResolveTotals() {
+    totals.resize(tree.nodes.size());
+    hasTotal.resize(tree.nodes.size());
+    std::vector<uint64_t> childSum(tree.nodes.size(), 0);
+    for (size_t i = tree.nodes.size(); i-- > 0;) {
+      if (!hasTotal[i]) totals[i] = childSum[i];
+      tree.nodes[i].bytes = totals[i] > childSum[i] ? totals[i] - childSum[i] : 0;
+      if (i > 0) childSum[tree.nodes[i].parent] += totals[i];
+    }
+  }
+
+  // Drops the chain of empty single-child directories above the listed root.
+  void Finish() {
+    std::vector<uint32_t> kids(tree.nodes.size(), 0);
+    std::vector<uint32_t> onlyChild(tree.nodes.size(), 0);
+    for (size_t i = 1; i < tree.nodes.size(); ++i) {
+      kids[tree.nodes[i].parent]++;
+      onlyChild[tree.nodes[i].parent] = (uint32_t)i;
+    }
+    uint32_t root = 0;
+    while (kids[root] == 1 && tree.nodes[root].files == 0 && tree.nodes[root].bytes == 0) root = onlyChild[root];
+
+    wstring path = absolute ? L"/" : L"";
+    std::vector<uint32_t> chain;
+    for (uint32_t k = root; k != 0; k = tree.nodes[k].parent) chain.push_back(k);
+    for (size_t i = chain.size(); i-- > 0;) {
+      if (!path.empty() && path.back() != L'/') path += L'/';
+      path.append(tree.names.data() + tree.nodes[chain[i]].nameOff, tree.nodes[chain[i]].nameLen);
+    }
+
+    if (root != 0) {
+      ScanTree out;
+      std::vector<uint32_t> map(tree.nodes.size(), NO_NODE);
+      map[root] = AddTreeNode(out, 0, L"");
+      out.nodes[0].bytes = tree.nodes[root].bytes;
+      out.nodes[0].files = tree.nodes[root].files;
+      out.nodes[0].newestWrite = tree.nodes[root].newestWrite;
+      for (size_t i = root + 1; i < tree.nodes.size(); ++i) {
+        const TreeNode& n = tree.nodes[i];
+        if (map[n.parent] == NO_NODE) continue;
+        map[i] = AddTreeNode(out, map[n.parent], tree.names.data() + n.nameOff, n.nameLen);
+        TreeNode& m = out.nodes[map[i]];
+        m.bytes = n.bytes;
+        m.files = n.files;
+        m.newestWrite = n.newestWrite;
+      }
+      tree = std::move(out);
+    }
+    tree.rootPath = path.empty() ? L"." : path;
+  }
+};
+
+static bool ParseUint(const char*& p, const char* end, uint64_t& v) {
+  const char* start = p;
+  v = 0;
+  while (p < end && *p >= '0' && *p <= '9') v = v * 10 + (uint64_t)(*p++ - '0');
+  return p != start;
+}
+
+static bool IsFindType(char c) { return c != 0 && strchr("bcdDflps", c) != nullptr; }
+
+// find -printf '%s %y %p\n': the type letter says which lines are directories.
+// find -printf '%s %p\n' (pre-order): a line is a directory when the next line is
+// inside it; everything else counts as a file, empty directories included, so
+// those are reported as guessed. Which of the two is decided by the first line.
+// du: "<size>\t<path>" per directory, in 1 KiB units unless DuBytes (du -b).
+static bool ImportLines(const MappedFile& mf, ListingFormat fmt, ScanTree& tree, ImportStats& st, wstring& err) {
+  PathTreeBuilder b(tree);
+  const char* p = mf.data;
+  const char* end = mf.data + mf.size;
+  const uint64_t unit = (fmt == ListingFormat::Du) ? 1024 : 1;
+
+  std::string_view pending;
+  uint64_t pendingSize = 0;
+  bool havePending = false;
+  bool typed = false;
+
+  while (p < end) {
+    const char* eol = FindEither(p, end, '\n', '\n');
+    const char* line = p;
+    p = (eol < end) ? eol + 1 : end;
+    const char* lineEnd = eol;
+    if (lineEnd > line && lineEnd[-1] == '\r') --lineEnd;
+    if (lineEnd == line) continue;
+
+    uint64_t size = 0;
+    const char* q = line;
+    if (!ParseUint(q, lineEnd, size) || q == lineEnd || (*q != ' ' && *q != '\t')) {
+      st.skipped++;
+      continue;
+    }
+    ++q;
+    char type = 0;
+    if (fmt == ListingFormat::Find) {
+      const bool hasType = lineEnd - q > 2 && IsFindType(q[0]) && (q[1] == ' ' || q[1] == '\t');
+      if (st.records == 0) typed = hasType;
+      if (typed && !hasType) {
+        st.skipped++;
+        continue;
+      }
+      if (typed) {
+        type = q[0];
+        q += 2;
+      }
+    }
+    std::string_view path(q, (size_t)(lineEnd - q));
+    if (st.records == 0) b.absolute = !path.empty() && path[0] == '/';
+    st.records++;
+
+    if (typed) {
+      if (type == 'd') b.Dir(path);
+      else { b.AddFile(path, size, 0); st.files++; }
+    } else if (fmt == ListingFormat::Find) {
+      if (havePending) {
+        std::string_view name;
+        if (PathTreeBuilder::Parent(path, name) == pending) b.Dir(pending);
+        else { b.AddFile(pending, pendingSize, 0); st.files++; st.guessed++; }
+      }
+      pending = path;
+      pendingSize = size;
+      havePending = true;
+    } else {
+      b.SetTotal(path, size * unit);
+    }
+  }
+  if (havePending) {
+    if (st.records == 1) b.Dir(pending);
+    else { b.AddFile(pending, pendingSize, 0); st.files++; st.guessed++; }
+  }
+  if (st.records == 0) { err = L"no size/path lines found"; return false; }
+
+  if (fmt != ListingFormat::Find) b.ResolveTotals();
+  b.Finish();
+  return true;
+}
+
+// Minimal reader for ncdu's export: [major, minor, {meta}, dir] where a dir is
+// [{info}, child...], a file child is {info} and a subdirectory child is a dir.
+struct NcduReader {
+  const char* p;
+  const char* end;
+  std::string unescaped;
+
+  void SkipWs() {
+    while (p < end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t' || *p == ',' || *p == ':')) ++p;
+  }
+
+  // Returns the string body; only strings with escapes are copied.
+  bool String(std::string_view& out) {
+    if (p >= end || *p != '"') return false;
+    const char* start = ++p;
+    const char* q = FindEither(p, end, '"', '\\');
+    if (q < end && *q == '"') {
+      out = std::string_view(start, (size_t)(q - start));
+      p = q + 1;
+      return true;
+    }
+    unescaped.assign(start, q);
+    p = q;
+    while (p < end && *p != '"') {
+      if (*p != '\\') {
+        const char* r = FindEither(p, end, '"', '\\');
+        unescaped.append(p, r);
+        p = r;
+        continue;
+      }
+      if (++p >= end) return false;
+      const char c = *p++;
+      switch (c) {
+        case 'n': unescaped += '\n'; break;
+        case 't': unescaped += '\t'; break;
+        case 'r': unescaped += '\r'; break;
+        case 'b': unescaped += '\b'; break;
+        case 'f': unescaped += '\f'; break;
+        case 'u': {
+          if (end - p < 4) return false;
+          uint32_t cp = (uint32_t)strtoul(std::string(p, 4).c_str(), nullptr, 16);
+          p += 4;
+          // ncdu escapes only control characters, so a 1-3 byte UTF-8 form suffices.
+          if (cp < 0x80) unescaped += (char)cp;
+          else if (cp < 0x800) { unescaped += (char)(0xC0 | (cp >> 6)); unescaped += (char)(0x80 | (cp & 0x3F)); }
+          else {
+            unescaped += (char)(0xE0 | (cp >> 12));
+            unescaped += (char)(0x80 | ((cp >> 6) & 0x3F));
+            unescaped += (char)(0x80 | (cp & 0x3F));
+          }
+          break;
+        }
+        default: unescaped += c; break;
+      }
+    }
+    if (p >= end) return false;
+    ++p;
+    out = unescaped;
+    return true;
+  }
+
+  bool SkipValue() {
+    SkipWs();
+    if (p >= end) return false;
+    if (*p == '"') { std::string_view s; return String(s); }
+    if (*p == '{' || *p == '[') {
+      int depth = 0;
+      while (p < end) {
+        const char c = *p;
+        if (c == '"') { std::string_view s; if (!String(s)) return false; continue; }
+        ++p;
+        if (c == '{' || c == '[') depth++;
+        else if ((c == '}' || c == ']') && --depth == 0) return true;
+      }
+      return false;
+    }
+    while (p < end && *p != ',' && *p != '}' && *p != ']') ++p;
+    return true;
+  }
+
+  struct Info {
+    std::string name;
+    uint64_t asize = 0;
+    uint64_t mtime = 0;
+    uint64_t ino = 0;
+    uint64_t dev = 0;
+    bool hasDev = false;
+    bool hardlink = false;  // hlnkc: the inode has other links in the export
+    bool excluded = false;
+  };
+
+  bool Object(Info& info) {
+    SkipWs();
+    if (p >= end || *p != '{') return false;
+    ++p;
+    info = Info{};
+    for (;;) {
+      SkipWs();
+      if (p >= end) return false;
+      if (*p == '}') { ++p; return true; }
+      std::string_view key;
+      if (!String(key)) return false;
+      SkipWs();
+      if (key == "name") {
+        std::string_view v;
+        if (!String(v)) return false;
+        info.name.assign(v.data(), v.size());
+      } else if (key == "asize" || key == "mtime" || key == "ino" || key == "dev") {
+        uint64_t v = 0;
+        if (!ParseUint(p, end, v)) return false;
+        if (key == "asize") info.asize = v;
+        else if (key == "mtime") info.mtime = v;
+        else if (key == "ino") info.ino = v;
+        else { info.dev = v; info.hasDev = true; }
+      } else {
+        if (key == "excluded") info.excluded = true;
+        if (key == "hlnkc") info.hardlink = end - p >= 4 && memcmp(p, "true", 4) == 0;
+        if (!SkipValue()) return false;
+      }
+    }
+  }
+};
+
+// A hard-linked file shows up once per link; its size is counted at the first one.
+// Directories only carry dev when it differs from their parent's.
+static bool ImportNcdu(const MappedFile& mf, ScanTree& tree, ImportStats& st, wstring& err) {
+  NcduReader r{mf.data, mf.data + mf.size};
+  std::vector<wchar_t> wide;
+  NcduReader::Info info;
+  std::unordered_map<uint64_t, std::unordered_set<uint64_t>> links;  // dev -> inodes seen
+
+  r.SkipWs();
+  if (r.p >= r.end || *r.p != '[') { err = L"not an ncdu export"; return false; }
+  ++r.p;
+  for (int i = 0; i < 3; ++i) {
+    if (!r.SkipValue()) { err = L"bad ncdu header"; return false; }
+  }
+  r.SkipWs();
+  if (r.p >= r.end || *r.p != '[') { err = L"ncdu export has no root directory"; return false; }
+  ++r.p;
+  if (!r.Object(info)) { err = L"bad ncdu root entry"; return false; }
+
+  AddTreeNode(tree, 0, L"");
+  wide.clear();
+  AppendUtf8(info.name, wide);
+  tree.rootPath.assign(wide.begin(), wide.end());
+  st.records++;
+
+  std::vector<uint32_t> stack(1, 0);
+  std::vector<uint64_t> devs(1, info.dev);
+  while (!stack.empty()) {
+    r.SkipWs();
+    if (r.p >= r.end) { err = L"truncated ncdu export"; return false; }
+    const char c = *r.p;
+    if (c == ']') {
+      ++r.p;
+      stack.pop_back();
+      devs.pop_back();
+      continue;
+    }
+    if (c == '[') {
+      ++r.p;
+      if (!r.Object(info)) { err = L"bad ncdu directory entry"; return false; }
+      wide.clear();
+      AppendUtf8(info.name, wide);
+      stack.push_back(AddTreeNode(tree, stack.back(), wide.data(), wide.size()));
+      devs.push_back(info.hasDev ? info.dev : devs.back());
+      st.records++;
+      continue;
+    }
+    if (!r.Object(info)) { err = L"bad ncdu file entry"; return false; }
+    st.records++;
+    if (info.excluded) { st.skipped++; continue; }
+    TreeNode& n = tree.nodes[stack.back()];
+    if (info.hardlink && !links[info.hasDev ? info.dev : devs.back()].insert(info.ino).second) st.linked++;
+    else n.bytes += info.asize;
+    n.files++;
+    const uint64_t ft = info.mtime ? UnixToFileTime(info.mtime) : 0;
+    if (ft > n.newestWrite) n.newestWrite = ft;
+    st.files++;
+  }
+  return true;
+}
+
+static ListingFormat DetectListingFormat(const MappedFile& mf) {
+  const char* p = mf.data;
+  const char* end = mf.data + mf.size;
+  while (p < end && (*p == ' ' || *p == '\r' || *p == '\n' || *p == '\t')) ++p;
+  if (p < end && *p == '[') return ListingFormat::Ncdu;
+  while (p < end && *p >= '0' && *p <= '9') ++p;
+  return (p < end && *p == '\t') ? ListingFormat::Du : ListingFormat::Find;
+}
+
+static bool ImportListing(const wstring& path, ListingFormat fmt, ScanTree& tree, ImportStats& st, wstring& err) {
+  MappedFile mf;
+  if (!mf.Open(path)) {
+    err = L"cannot map " + path;
+    return false;
+  }
+  if (fmt == ListingFormat::Auto) fmt = DetectListingFormat(mf);
+  const bool ok = (fmt == ListingFormat::Ncdu) ? ImportNcdu(mf, tree, st, err) : ImportLines(mf, fmt, tree, st, err);
+  if (ok) AggregateTree(tree);
+  return ok;
+}
+
+// Snapshot browse view: View::browse and the chain of nodes from its root to the
+// folder being shown. Nothing in it touches the live filesystem.
+
+static wstring SnapNodeName(const Snapshot& s, uint32_t k) {
+  return wstring(s.names.data() + s.nodes[k].nameOff, s.nodes[k].nameLen);
+}
+
+static wstring BrowsePathText(View& v) {
+  if (!v.browse) return wstring();
+  wstring p = v.browse->rootPath;
+  for (size_t i = 1; i < v.browsePath.size(); ++i) p = JoinPath(p, SnapNodeName(*v.browse, v.browsePath[i]));
+  return p;
+}
+
+struct DiffRow {
+  uint32_t oldNode = NO_NODE;
+  uint32_t newNode = NO_NODE;
+  uint32_t parent = 0;        // row index; the root row points at itself
+  int64_t delta = 0;          // new bytes - old bytes
+  uint64_t maxChildDelta = 0; // largest |delta| among changed children
+};
+
+struct SnapshotDiff {
+  std::vector<DiffRow> rows;
+  uint64_t compared = 0;      // sibling pairs examined
+  uint64_t pruned = 0;        // matched pairs skipped because nothing changed
+};
+
+static bool SameSnapNode(const SnapNode& a, const SnapNode& b) {
+  return a.bytes == b.bytes && a.files == b.files && a.dirs == b.dirs && a.newestWrite == b.newestWrite;
+}
+
+static uint64_t AbsDelta(int64_t d) { return (uint64_t)(d < 0 ? -d : d); }
+
+// Breadth-first merge-join of sibling lists. Matched children whose aggregates are
+// identical are not descended into; added/removed subtrees become a single row.
+static SnapshotDiff DiffSnapshots(const Snapshot& a, const Snapshot& b) {
+  SnapshotDiff d{};
+  DiffRow root{};
+  root.oldNode = 0;
+  root.newNode = 0;
+  root.delta = (int64_t)b.nodes[0].bytes - (int64_t)a.nodes[0].bytes;
+  d.rows.push_back(root);
+  if (SameSnapNode(a.nodes[0], b.nodes[0])) return d;
+
+  for (size_t i = 0; i < d.rows.size(); ++i) {
+    const DiffRow cur = d.rows[i];
+    if (cur.oldNode == NO_NODE || cur.newNode == NO_NODE) continue;
+
+    const SnapNode& pa = a.nodes[cur.oldNode];
+    const SnapNode& pb = b.nodes[cur.newNode];
+    uint32_t ia = pa.firstChild, ea = pa.firstChild + pa.childCount;
+    uint32_t ib = pb.firstChild, eb = pb.firstChild + pb.childCount;
+
+    while (ia < ea || ib < eb) {
+      int c = 0;
+      if (ia == ea) c = 1;
+      else if (ib == eb) c = -1;
+      else c = CompareNames(a.names.data() + a.nodes[ia].nameOff, a.nodes[ia].nameLen,
+                            b.names.data() + b.nodes[ib].nameOff, b.nodes[ib].nameLen);
+
+      DiffRow row{};
+      row.parent = (uint32_t)i;
+      if (c < 0) {
+        row.oldNode = ia;
+        row.delta = -(int64_t)a.nodes[ia++].bytes;
+      } else if (c > 0) {
+        row.newNode = ib;
+        row.delta = (int64_t)b.nodes[ib++].bytes;
+      } else {
+        d.compared++;
+        if (SameSnapNode(a.nodes[ia], b.nodes[ib])) { d.pruned++; ++ia; ++ib; continue; }
+        row.oldNode = ia;
+        row.newNode = ib;
+        row.delta = (int64_t)b.nodes[ib++].bytes - (int64_t)a.nodes[ia++].bytes;
+      }
+      d.rows.push_back(row);
+    }
+  }
+
+  // Rows are in BFS order, so walking backwards visits children before parents.
+  for (size_t i = d.rows.size(); i-- > 1;) {
+    DiffRow& p = d.rows[d.rows[i].parent];
+    p.maxChildDelta = std::max(p.maxChildDelta, AbsDelta(d.rows[i].delta));
+  }
+  return d;
+}
+
+// Rows whose change is not mostly explained by a single changed child, largest
+// |delta| first: the subtrees where growth (or shrinkage) actually happened.
+static std::vector<uint32_t> RankDiffRows(const SnapshotDiff& d, size_t limit) {
+  std::vector<uint32_t> out;
+  for (uint32_t i = 0; i < (uint32_t)d.rows.size(); ++i) {
+    const DiffRow& r = d.rows[i];
+    const uint64_t ad = AbsDelta(r.delta);
+    if (ad == 0) continue;
+    if (r.maxChildDelta * 10 >= ad * 9) continue;
+    out.push_back(i);
+  }
+  const size_t keep = std::min(limit, out.size());
+  std::partial_sort(out.begin(), out.begin() + keep, out.end(), [&](uint32_t x, uint32_t y) {
+    return AbsDelta(d.rows[x].delta) > AbsDelta(d.rows[y].delta);
+  });
+  out.resize(keep);
+  return out;
+}
+
+static wstring DiffRowRelPath(const SnapshotDiff& d, uint32_t row, const Snapshot& a, const Snapshot& b) {
+  std::vector<uint32_t> chain;
+  while (row != 0) { chain.push_back(row); row = d.rows[row].parent; }
+
+  wstring p;
+  for (size_t i = chain.size(); i-- > 0;) {
+    const DiffRow& r = d.rows[chain[i]];
+    const SnapNode& n = (r.newNode != NO_NODE) ? b.nodes[r.newNode] : a.nodes[r.oldNode];
+    const wchar_t* names = (r.newNode != NO_NODE) ? b.names.data() : a.names.data();
+    if (!p.empty()) p += L"\\";
+    p.append(names + n.nameOff, n.nameLen);
+  }
+  return p;
+}
+
+static wstring FormatDelta(int64_t d) {
+  return (d >= 0 ? L"+" : L"-") + FormatBytes(AbsDelta(d));
+}
+
+static void EnsureListColumns(HWND lv) {
+  if (ListView_GetColumnWidth(lv, 0) > 0) return;
+  while (ListView_DeleteColumn(lv, 0)) {}
+
+  LVCOLUMNW col{};
+  col.mask = LVCF_TEXT | LVCF_WIDTH | LVCF_SUBITEM;
+
+  col.pszText = (LPWSTR)L"Name"; col.cx = 260; col.iSubItem = 0; ListView_InsertColumn(lv, 0, &col);
+  col.pszText = (LPWSTR)L"Size"; col.cx = 170; col.iSubItem = 1; ListView_InsertColumn(lv, 1, &col);
+  col.pszText = (LPWSTR)L"%";    col.cx =  70; col.iSubItem = 2; ListView_InsertColumn(lv, 2, &col);
+  col.pszText = (LPWSTR)L"Files"; col.cx = 80; col.iSubItem = 3; ListView_InsertColumn(lv, 3, &col);
+  col.pszText = (LPWSTR)L"Dirs"; col.cx =  70; col.iSubItem = 4; ListView_InsertColumn(lv, 4, &col);
+  col.pszText = (LPWSTR)L"Cold"; col.cx = 110; col.iSubItem = 5; ListView_InsertColumn(lv, 5, &col);
+}
+
+static wstring RootsText(View& v) {
+  wstring out;
+  for (const wstring& r : v.roots) {
+    if (!out.empty()) out += L"; ";
+    out += r;
+  }
+  return out;
+}
+
+static wstring ViewLabel(View& v) {
+  switch (v.mode) {
+    case ViewMode::Query: return L"? " + v.queryText + L"  (in " + v.currentDir + L")";
+    case ViewMode::Diff: return v.diffLabel;
+    case ViewMode::Roots: return RootsText(v);
+    case ViewMode::Snapshot:
+      return L"snapshot " + BrowsePathText(v) + (v.browse && v.browse->incomplete ? L"  (partial)" : L"");
+    case ViewMode::Directory: break;
+  }
+  return v.currentDir;
+}
+
+struct SliceGeom { float startDeg; float sweepDeg; };
+
+static std::vector<SliceGeom> ComputeSlices(float baseStartDeg,
+                                            const std::vector<uint64_t>& bytes,
+                                            uint64_t sum) {
+  std::vector<SliceGeom> out(bytes.size());
+  float angle = baseStartDeg;
+
+  for (size_t i = 0; i < bytes.size(); ++i) {
+    float sweep = 0.0f;
+    if (sum > 0) sweep = (float)(360.0 * ((double)bytes[i] / (double)sum));
+    out[i] = { angle, sweep };
+    angle += sweep;
+  }
+  return out;
+}
+
+// What the pie shows, built once per refresh and never modified after it is published.
+// Painting and hit testing read only the current frame, not v.entries.
+struct PieFrame {
+  std::vector<SliceGeom> slices;  // one per entry; empty until every entry has a value
+  std::vector<bool> shrink;       // diff view: the entry shrank
+  bool diff = false;
+  wstring center;
+};
+
+static std::shared_ptr<const PieFrame> CurrentPieFrame(const View& v) {
+  return std::atomic_load(&v.frame);
+}
+
+static void PublishPieFrame(View& v, std::shared_ptr<const PieFrame> frame) {
+  std::atomic_store(&v.frame, std::move(frame));
+  InvalidateRect(v.hwndPie, nullptr, FALSE);
+}
+
+// Guesses at the next click once the pie is complete: the largest slices and, for Up,
+// the parent. One round runs at a time; starting one drops the previous round's work.
+static void PrefetchAround(View& v) {
+  if (!Prefetching() || v.mode != ViewMode::Directory || IndexConnected()) return;
+  if (v.prefetched && _wcsicmp(v.prefetchedFor.c_str(), v.currentDir.c_str()) == 0) return;
+  v.prefetched = true;
+  v.prefetchedFor = v.currentDir;
+
+  {
+    std::lock_guard<std::mutex> lk(g_jobMu);
+    for (auto& d : g_devices) DropSpeculative(*d);
+  }
+
+  int slices = 0;
+  for (const Entry& e : v.entries) {  // sorted largest first
+    if (slices >= PREFETCH_SLICES) break;
+    if (!e.has_value || e.bytes == 0) continue;
+    QueueSpeculative(e.path, JobKind::Prefetch, DeviceForPath(e.path));
+    slices++;
+  }
+  const wstring parent = ParentDir(v.currentDir);
+  if (_wcsicmp(parent.c_str(), v.currentDir.c_str()) != 0) {
+    QueueSpeculative(parent, JobKind::Prefetch, DeviceForPath(parent), v.currentDir);
+  }
+}
+
+// Fills the list control from v.entries and their formatted v.rows.
+static void ShowRows(View& v) {
+  SendMessageW(v.hwndList, WM_SETREDRAW, FALSE, 0);
+  ListView_DeleteAllItems(v.hwndList);
+
+  LVITEMW it{};
+  it.mask = LVIF_TEXT | LVIF_PARAM;
+
+  for (int i = 0; i < (int)v.entries.size(); ++i) {
+    it.iItem = i;
+    it.iSubItem = 0;
+    it.pszText = (LPWSTR)v.entries[i].name.c_str();
+    it.lParam = (LPARAM)i;
+    ListView_InsertItem(v.hwndList, &it);
+  }
+
+  for (int i = 0; i < (int)v.rows.size(); ++i) {
+    const ListRow& r = v.rows[i];
+    ListView_SetItemText(v.hwndList, i, 1, (LPWSTR)r.size.c_str());
+    ListView_SetItemText(v.hwndList, i, 2, (LPWSTR)r.pct.c_str());
+    ListView_SetItemText(v.hwndList, i, 3, (LPWSTR)r.files.c_str());
+    ListView_SetItemText(v.hwndList, i, 4, (LPWSTR)r.dirs.c_str());
+    ListView_SetItemText(v.hwndList, i, 5, (LPWSTR)r.cold.c_str());
+  }
+
+  SendMessageW(v.hwndList, WM_SETREDRAW, TRUE, 0);
+}
+
+static void RefreshUIFromCache(View& v) {
+  TimelineSpan span("refresh", v.currentDir);
+  const uint64_t version = g_cacheVersion.load();
+  uint64_t sum = 0;
+  uint64_t coldSum = 0;
+  WalkStats totals{};
+  ContentStats totalContent{};
+  int totalEntries = 0;
+  int knownEntries = 0;
+  int exactEntries = 0;
+  int incompleteEntries = 0;
+
+  {
+    std::lock_guard<std::mutex> lk(g_mu);
+    totalEntries = (int)v.entries.size();
+    for (auto& e : v.entries) {
+      const bool live = v.mode != ViewMode::Diff && v.mode != ViewMode::Snapshot;
+      auto it = live ? g_cache.find(e.path) : g_cache.end();
+      if (it != g_cache.end()) {
+        const SizeInfo& si = it->second;
+        e.bytes = si.bytes;
+        e.has_value = true;
+        e.exact = si.exact;
+        e.estimate = si.estimate;
+        e.margin = si.margin;
+        e.incomplete = si.incomplete;
+        e.stats = si.stats;
+        e.content = si.content;
+      }
+
+      if (e.has_value) {
+        sum += PieValue(v, e);
+        AddContent(totalContent, e.content);
+        knownEntries++;
+        if (e.exact && !e.incomplete) exactEntries++;
+        if (e.incomplete || !e.exact) incompleteEntries++;
+      } else {
+        incompleteEntries++;
+      }
+
+      totals.skipped_access += e.stats.skipped_access;
+      totals.skipped_path   += e.stats.skipped_path;
+      totals.skipped_other  += e.stats.skipped_other;
+      totals.skipped_reparse+= e.stats.skipped_reparse;
+      totals.skipped_excluded += e.stats.skipped_excluded;
+      totals.skipped_stalled += e.stats.skipped_stalled;
+      totals.dup_links += e.stats.dup_links;
+      totals.skipped_loop += e.stats.skipped_loop;
+      totals.followed += e.stats.followed;
+      totals.incomplete = totals.incomplete || e.stats.incomplete;
+    }
+  }
+
+  coldSum = ColdBytes(v, totalContent.ages);
+
+  // Query and diff results keep the order they were ranked in.
+  if (v.mode == ViewMode::Directory || v.mode == ViewMode::Roots || v.mode == ViewMode::Snapshot) {
+    std::stable_sort(v.entries.begin(), v.entries.end(),
+                     [&v](const Entry& a, const Entry& b) {
+                       const uint64_t ax = a.has_value ? PieValue(v, a) : 0;
+                       const uint64_t bx = b.has_value ? PieValue(v, b) : 0;
+                       return ax > bx;
+                     });
+  }
+
+  v.rows.assign(v.entries.size(), ListRow{});
+  for (int i = 0; i < (int)v.entries.size(); ++i) {
+    const Entry& e = v.entries[i];
+    wstring& sSize = v.rows[i].size;
+    wstring& sPct = v.rows[i].pct;
+    wstring& sFiles = v.rows[i].files;
+    wstring& sDirs = v.rows[i].dirs;
+    wstring& sCold = v.rows[i].cold;
 
-  SendMessageW(g_hwndList, WM_SETREDRAW, TRUE, 0);
+    if (!e.has_value) {
+      sSize = L"...";
+    } else {
+      bool approx = (!e.exact) || e.incomplete;
+      const uint64_t shown = v.pieMetric == PieMetric::Allocated ? PieValue(v, e) : e.bytes;
+      sSize = (approx ? L"~ " : L"") + (v.mode == ViewMode::Diff ? FormatDelta(e.delta) : FormatBytes(shown));
+      if (e.estimate && e.margin > 0) sSize += L" \x00B1 " + FormatBytes(e.margin);
+      if (e.incomplete) sSize += L"  +";
+      sFiles = (approx ? L"~ " : L"") + FormatCount(e.content.files);
+      sDirs = (approx ? L"~ " : L"") + FormatCount(e.content.dirs);
+      sCold = (approx ? L"~ " : L"") + FormatBytes(ColdBytes(v, e.content.ages));
+      if (sum > 0) {
+        const double pct = (double)PieValue(v, e) * 100.0 / (double)sum;
+        wchar_t buf[32];
+        swprintf(buf, 32, L"%.1f", pct);
+        sPct = buf;
+      }
+    }
+  }
+  ShowRows(v);
 
-  const uint32_t totalJobs = g_jobs_total.load();
-  const uint32_t doneJobs = g_jobs_done.load();
-  const uint32_t activeJobs = g_jobs_active.load();
-  const uint32_t queuedJobs = g_jobs_queued.load();
+  const ViewProgress progress = GetViewProgress(v);
 
-  const uint32_t doneJobsClamped = (totalJobs > 0 && doneJobs > totalJobs) ? totalJobs : doneJobs;
-  const uint32_t exactTotal = g_jobs_exact_total.load();
-  const uint32_t exactDone = g_jobs_exact_done.load();
-  const uint32_t exactDoneClamped = (exactTotal > 0 && exactDone > exactTotal) ? exactTotal : exactDone;
+  const wstring viewLabel = ViewLabel(v);
+  const wstring coldText = L"files " + FormatCount(totalContent.files) + L"  " + ColdLabel(v) + L" " + FormatBytes(coldSum);
 
-  wchar_t sbuf[512];
-  if (activeJobs + queuedJobs > 0 && totalJobs > 0) {
-    swprintf(sbuf, 512,
-             L"%s  |  scanning %u/%u (active=%u queued=%u exact=%u/%u)  |  known %d/%d  |  skipped access=%u path=%u other=%u reparse=%u%s",
-             g_currentDir.c_str(),
-             doneJobsClamped, totalJobs, activeJobs, queuedJobs, exactDoneClamped, exactTotal,
+  wchar_t sbuf[768];
+  if (progress.Scanning()) {
+    swprintf(sbuf, 768,
+             L"%s  |  scanning %u/%u (engine active=%u queued=%u)  |  %s  |  known %d/%d  |  %s  |  skipped access=%u path=%u other=%u reparse=%u loop=%u stalled=%u excluded=%u linked=%u followed=%u%s",
+             viewLabel.c_str(),
+             progress.done, progress.total, g_jobs_active.load(), g_jobs_queued.load(),
+             DeviceSummaryText().c_str(),
              knownEntries, totalEntries,
+             coldText.c_str(),
              totals.skipped_access, totals.skipped_path, totals.skipped_other, totals.skipped_reparse,
+             totals.skipped_loop, totals.skipped_stalled, totals.skipped_excluded, totals.dup_links, totals.followed,
              totals.incomplete ? L"  (incomplete)" : L"");
   } else {
-    swprintf(sbuf, 512,
-             L"%s  |  done  |  known %d/%d  |  skipped access=%u path=%u other=%u reparse=%u%s",
-             g_currentDir.c_str(),
+    swprintf(sbuf, 768,
+             L"%s  |  done  |  known %d/%d  |  %s  |  skipped access=%u path=%u other=%u reparse=%u loop=%u stalled=%u excluded=%u linked=%u followed=%u%s",
+             viewLabel.c_str(),
              knownEntries, totalEntries,
+             coldText.c_str(),
              totals.skipped_access, totals.skipped_path, totals.skipped_other, totals.skipped_reparse,
+             totals.skipped_loop, totals.skipped_stalled, totals.skipped_excluded, totals.dup_links, totals.followed,
              totals.incomplete ? L"  (incomplete)" : L"");
   }
-  SetStatusText(sbuf);
-  UpdateWindowTitleProgress();
+  v.statusLine = sbuf;
+  SetStatusText(v, v.statusLine);
+  UpdateWindowTitleProgress(v);
+
+  auto frame = std::make_shared<PieFrame>();
+  frame->diff = v.mode == ViewMode::Diff;
+  const bool allKnown = knownEntries == totalEntries;
+  if (allKnown && sum > 0) {
+    std::vector<uint64_t> bs;
+    for (const Entry& e : v.entries) {
+      bs.push_back(PieValue(v, e));
+      frame->shrink.push_back(e.delta < 0);
+    }
+    frame->slices = ComputeSlices(0.0f, bs, sum);
+  }
 
-  InvalidateRect(g_hwndPie, nullptr, FALSE);
-}
+  const bool anyApprox = incompleteEntries > 0;
+  if (progress.Scanning()) {
+    wchar_t buf[96];
+    swprintf(buf, 96, L"Scanning %u/%u", progress.done, progress.total);
+    frame->center = buf;
+  } else if (allKnown && sum > 0) {
+    if (v.mode == ViewMode::Diff) {
+      frame->center = L"changed " + FormatBytes(sum);
+    } else if (v.pieMetric == PieMetric::Files) {
+      frame->center = (anyApprox ? L"~ " : L"") + FormatCount(sum) + L" files";
+    } else {
+      frame->center = (anyApprox ? L"~ " : L"") + FormatBytes(sum);
+      if (v.pieMetric == PieMetric::ColdBytes) frame->center += L" cold";
+      if (v.pieMetric == PieMetric::Allocated) frame->center += L" on disk";
+    }
+  } else {
+    wchar_t buf[96];
+    swprintf(buf, 96, L"Scanning %d/%d", knownEntries, totalEntries);
+    frame->center = buf;
+  }
+  PublishPieFrame(v, std::move(frame));
 
-struct SliceGeom { float startDeg; float sweepDeg; };
+  v.shownVersion = version;
+  v.lastRefresh = NowTick();
 
-static std::vector<SliceGeom> ComputeSlices(float baseStartDeg,
-                                            const std::vector<uint64_t>& bytes,
-                                            uint64_t sum) {
-  std::vector<SliceGeom> out(bytes.size());
-  float angle = baseStartDeg;
+  if (allKnown && !progress.Scanning()) PrefetchAround(v);
+}
 
-  for (size_t i = 0; i < bytes.size(); ++i) {
-    float sweep = 0.0f;
-    if (sum > 0) sweep = (float)(360.0 * ((double)bytes[i] / (double)sum));
-    out[i] = { angle, sweep };
-    angle += sweep;
+// WM_APP_REFRESH and the frame timer land here. The list and pie are rebuilt at most once
+// per REFRESH_FRAME_MS, and not at all when the cache has not moved since the last rebuild.
+static void RefreshWhenDue(View& v) {
+  v.refreshPosted.store(false);
+  if (v.refreshTimer || g_cacheVersion.load() == v.shownVersion) return;
+  const uint64_t since = NowTick() - v.lastRefresh;
+  if (since < REFRESH_FRAME_MS) {
+    v.refreshTimer = true;
+    SetTimer(v.hwndMain, REFRESH_TIMER_ID, (UINT)(REFRESH_FRAME_MS - since), nullptr);
+    return;
   }
-  return out;
+  RefreshUIFromCache(v);
+  RequestMemoryBudget(v.currentDir);
 }
 
 static Gdiplus::Color SliceColor(int i) {
@@ -598,9 +5590,16 @@ static Gdiplus::Color SliceColor(int i) {
   return Gdiplus::Color(palette[i % (int)(sizeof(palette) / sizeof(palette[0]))]);
 }
 
-static int HitTestPie(POINT ptClient) {
+// Growth in warm shades, shrinkage in cool ones.
+static Gdiplus::Color DiffSliceColor(int i, bool shrink) {
+  static const uint32_t grow[] = {0xFFE15759, 0xFFF28E2B, 0xFFEDC948, 0xFFFF9DA7, 0xFFB6992D};
+  static const uint32_t cool[] = {0xFF4E79A7, 0xFF76B7B2, 0xFF59A14F, 0xFF86BCB6, 0xFF2E5EAA};
+  return Gdiplus::Color(shrink ? cool[i % 5] : grow[i % 5]);
+}
+
+static int HitTestPie(View& v, POINT ptClient) {
   RECT rc{};
-  GetClientRect(g_hwndPie, &rc);
+  GetClientRect(v.hwndPie, &rc);
 
   const int w = rc.right - rc.left;
   const int h = rc.bottom - rc.top;
@@ -619,19 +5618,13 @@ static int HitTestPie(POINT ptClient) {
   const int hole = (int)(r * 0.55);
   if (dist2 < (double)hole * hole) return -1;
 
-  std::vector<uint64_t> bs;
-  uint64_t sum = 0;
-  for (auto& e : g_entries) {
-    if (!e.has_value) return -1;
-    bs.push_back(e.bytes);
-    sum += e.bytes;
-  }
-  if (sum == 0) return -1;
+  const auto frame = CurrentPieFrame(v);
+  if (!frame || frame->slices.empty()) return -1;
 
   double ang = atan2((double)dy, (double)dx) * 180.0 / 3.141592653589793;
   if (ang < 0) ang += 360.0;
 
-  const auto slices = ComputeSlices(0.0f, bs, sum);
+  const auto& slices = frame->slices;
   for (int i = 0; i < (int)slices.size(); ++i) {
     const float a0 = slices[i].startDeg;
     const float a1 = a0 + slices[i].sweepDeg;
@@ -640,7 +5633,7 @@ static int HitTestPie(POINT ptClient) {
   return -1;
 }
 
-static void PiePaint(HWND hwnd, HDC hdc) {
+static void PiePaint(View& v, HWND hwnd, HDC hdc) {
   RECT rc{};
   GetClientRect(hwnd, &rc);
 
@@ -665,30 +5658,14 @@ static void PiePaint(HWND hwnd, HDC hdc) {
   const int hole = (int)(r * 0.55);
   Gdiplus::Rect pieRect(cx - r, cy - r, 2 * r, 2 * r);
 
-  std::vector<uint64_t> bs;
-  uint64_t sum = 0;
-  bool allKnown = true;
-  bool anyApprox = false;
-
-  int totalEntries = 0;
-  int knownEntries = 0;
-
-  for (auto& e : g_entries) {
-    totalEntries++;
-    if (!e.has_value) { allKnown = false; break; }
-    knownEntries++;
-    bs.push_back(e.bytes);
-    sum += e.bytes;
-    anyApprox = anyApprox || (!e.exact) || e.incomplete;
-  }
-
-  if (!allKnown || sum == 0) {
+  const auto frame = CurrentPieFrame(v);
+  if (!frame || frame->slices.empty()) {
     Gdiplus::SolidBrush br(Gdiplus::Color(255, 220, 220, 220));
     g.FillPie(&br, pieRect, 180.0f, 180.0f);
   } else {
-    const auto slices = ComputeSlices(0.0f, bs, sum);
+    const auto& slices = frame->slices;
     for (int i = 0; i < (int)slices.size(); ++i) {
-      Gdiplus::SolidBrush br(SliceColor(i));
+      Gdiplus::SolidBrush br(frame->diff ? DiffSliceColor(i, frame->shrink[i]) : SliceColor(i));
       g.FillPie(&br, pieRect, slices[i].startDeg, slices[i].sweepDeg);
     }
   }
@@ -709,131 +5686,676 @@ static void PiePaint(HWND hwnd, HDC hdc) {
   sf.SetAlignment(Gdiplus::StringAlignmentCenter);
   sf.SetLineAlignment(Gdiplus::StringAlignmentCenter);
 
-  wstring center;
-  const uint32_t totalJobs = g_jobs_total.load();
-  const uint32_t doneJobs = g_jobs_done.load();
-  const uint32_t activeJobs = g_jobs_active.load();
-  const uint32_t queuedJobs = g_jobs_queued.load();
-
-  const uint32_t doneJobsClamped = (totalJobs > 0 && doneJobs > totalJobs) ? totalJobs : doneJobs;
-
-  if (activeJobs + queuedJobs > 0 && totalJobs > 0) {
-    wchar_t buf[96];
-    swprintf(buf, 96, L"Scanning %u/%u", doneJobsClamped, totalJobs);
-    center = buf;
-  } else if (allKnown && sum > 0) {
-    center = (anyApprox ? L"~ " : L"") + FormatBytes(sum);
-  } else {
-    wchar_t buf[96];
-    swprintf(buf, 96, L"Scanning %d/%d", knownEntries, totalEntries);
-    center = buf;
-  }
-
-  g.DrawString(center.c_str(), -1, &f, rcf, &sf, &txt);
+  if (frame) g.DrawString(frame->center.c_str(), -1, &f, rcf, &sf, &txt);
 
   Gdiplus::Graphics out(hdc);
   out.DrawImage(&back, 0, 0);
 }
 
-static void SetListHover(int idx) {
-  if (!g_hwndList) return;
+static void SetListHover(View& v, int idx) {
+  if (!v.hwndList) return;
 
-  if (g_hoverIndex >= 0) {
+  if (v.hoverIndex >= 0) {
     LVITEMW it{};
     it.mask = LVIF_STATE;
-    it.iItem = g_hoverIndex;
+    it.iItem = v.hoverIndex;
     it.stateMask = LVIS_DROPHILITED;
     it.state = 0;
-    ListView_SetItem(g_hwndList, &it);
+    ListView_SetItem(v.hwndList, &it);
   }
 
-  g_hoverIndex = idx;
+  v.hoverIndex = idx;
 
-  if (g_hoverIndex >= 0) {
+  if (v.hoverIndex >= 0) {
     LVITEMW it{};
     it.mask = LVIF_STATE;
-    it.iItem = g_hoverIndex;
+    it.iItem = v.hoverIndex;
     it.stateMask = LVIS_DROPHILITED;
     it.state = LVIS_DROPHILITED;
-    ListView_SetItem(g_hwndList, &it);
+    ListView_SetItem(v.hwndList, &it);
   }
 }
 
-static void EnumerateChildrenAndSchedule(uint64_t gen, uint64_t epoch, const wstring& dirAbs) {
-  std::vector<Entry> found;
+// Lists the immediate subdirectories of dir. Sizes of the files directly inside it
+// are added to fileBytes when requested. Returns false with err set on failure.
+static bool ListChildDirs(const wstring& dir, std::vector<Entry>& found, DWORD& err,
+                          uint64_t* fileBytes) {
+  DirReader rd;
+  if (!rd.Open(dir)) {
+    err = rd.error;
+    return false;
+  }
 
-  const wstring dir = TrimTrailingSlash(dirAbs);
-  const wstring pattern = EnsureBackslash(dir) + L"*";
-  const wstring patternLong = ToLongPath(pattern);
-
-  WIN32_FIND_DATAW fdat{};
-  HANDLE h = FindFirstFileExW(patternLong.c_str(),
-                             FindExInfoBasic,
-                             &fdat,
-                             FindExSearchNameMatch,
-                             nullptr,
-                             FIND_FIRST_EX_LARGE_FETCH);
-  if (h == INVALID_HANDLE_VALUE) {
-    wchar_t buf[256];
-    swprintf(buf, 256, L"%s  |  enumerate failed: %lu", dirAbs.c_str(), GetLastError());
-    SetStatusText(buf);
-    return;
+  while (rd.Next()) {
+    if (rd.attributes & FILE_ATTRIBUTE_DIRECTORY) {
+      Entry e{};
+      e.name.assign(rd.name, rd.nameLen);
+      e.path = JoinPath(dir, e.name);
+      found.push_back(std::move(e));
+    } else if (fileBytes) {
+      *fileBytes += rd.size;
+    }
+  }
+  return true;
+}
+
+// Lister thread: lists the folders windows navigate to, off the UI thread, publishing
+// children every LIST_BATCH entries or REFRESH_FRAME_MS so big folders fill in as read.
+
+static const size_t LIST_BATCH = 1024;
+
+static std::mutex g_listMu;
+static std::condition_variable g_listCv;
+static std::deque<std::shared_ptr<Listing>> g_listQueue;  // guarded by g_listMu
+
+static void PublishListed(Listing& l, std::vector<Entry>& batch, bool done, DWORD err) {
+  {
+    std::lock_guard<std::mutex> lk(g_mu);
+    for (Entry& e : batch) l.pending.push_back(std::move(e));
+    l.done = done;
+    l.error = err;
   }
+  batch.clear();
+  if (!l.posted.exchange(true)) PostMessageW(l.hwnd, WM_APP_LISTING, 0, 0);
+}
 
-  for (;;) {
-    if (g_generation.load() != gen) { FindClose(h); return; }
+static void ReadListing(Listing& l) {
+  TimelineSpan span("list", l.dir);
+  std::vector<Entry> batch;
+  DirReader rd;
+  if (!rd.Open(l.dir)) {
+    PublishListed(l, batch, true, rd.error);
+    return;
+  }
 
-    if (!IsDots(fdat.cFileName)) {
-      const bool isDir = (fdat.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
-      if (isDir) {
-        Entry e{};
-        e.name = fdat.cFileName;
-        e.path = JoinPath(dir, e.name);
-        found.push_back(std::move(e));
-      }
+  uint64_t lastPublish = NowTick();
+  while (!l.cancelled.load() && rd.Next()) {
+    if (!(rd.attributes & FILE_ATTRIBUTE_DIRECTORY)) continue;
+    Entry e{};
+    e.name.assign(rd.name, rd.nameLen);
+    e.path = JoinPath(l.dir, e.name);
+    batch.push_back(std::move(e));
+    if (batch.size() >= LIST_BATCH || NowTick() - lastPublish >= REFRESH_FRAME_MS) {
+      PublishListed(l, batch, false, 0);
+      lastPublish = NowTick();
     }
+  }
+  PublishListed(l, batch, true, 0);
+}
 
-    if (!FindNextFileW(h, &fdat)) break;
+static void ListerThreadMain() {
+  NameThread("lister");
+  // Not a worker: the stall guard cancels a hung read here but never replaces the thread.
+  StallSlot* slot = RegisterStallSlot(false);
+  for (;;) {
+    std::shared_ptr<Listing> l;
+    {
+      std::unique_lock<std::mutex> lk(g_listMu);
+      g_listCv.wait(lk, [] { return g_quit.load() || !g_listQueue.empty(); });
+      if (g_quit.load()) break;
+      l = std::move(g_listQueue.front());
+      g_listQueue.pop_front();
+    }
+    if (l->cancelled.load()) continue;
+    SetThreadJob("list", l->dir);
+    ReadListing(*l);
+    SetThreadJob(nullptr, wstring());
   }
-  FindClose(h);
 
-  { std::lock_guard<std::mutex> lk(g_mu); g_entries = std::move(found); }
+  std::lock_guard<std::mutex> lk(g_slotMu);
+  if (slot->thread) CloseHandle(slot->thread);
+  slot->thread = nullptr;
+}
 
-  for (auto& e : g_entries) {
+// Sizes v.entries from index first on; earlier entries were scheduled with an earlier batch.
+static void ScheduleEntries(View& v, int device, size_t first = 0) {
+  TimelineSpan span("schedule", v.currentDir);
+  const bool remote = IndexConnected();
+  for (size_t i = first; i < v.entries.size(); ++i) {
+    const Entry& e = v.entries[i];
     bool need = true;
     {
       std::lock_guard<std::mutex> lk(g_mu);
       auto it = g_cache.find(e.path);
       if (it != g_cache.end() && IsFresh(it->second)) need = false;
     }
-    if (need) EnqueueJob(Job{gen, epoch, e.path, JobKind::Capped});
+    if (!need) continue;
+    if (remote) WatchViaIndex(v, e.path);
+    else RequestSize(v, e.path, device >= 0 ? device : DeviceForPath(e.path));
+  }
+
+  v.shownVersion = 0;  // new listing: rebuild even if nothing in the cache changed
+  if (!v.refreshPosted.exchange(true)) PostMessageW(v.hwndMain, WM_APP_REFRESH, 0, 0);
+}
+
+// Hands dirAbs to the lister thread; its children reach the view in batches, or all
+// at once when they replace the entries of a restored view.
+static void EnumerateChildrenAndSchedule(View& v, const wstring& dirAbs, bool replace = false) {
+  TimelineSpan span("enumerate", dirAbs);
+  auto l = std::make_shared<Listing>();
+  l->dir = TrimTrailingSlash(dirAbs);
+  l->replace = replace;
+  l->hwnd = v.hwndMain;
+  // Children share the parent's device; mount points are reparse points and are not walked.
+  l->device = DeviceForPath(l->dir);
+  v.listing = l;
+  {
+    std::lock_guard<std::mutex> lk(g_listMu);
+    g_listQueue.push_back(std::move(l));
+  }
+  g_listCv.notify_one();
+}
+
+// Swaps a restored view's entries for a fresh listing. Children still there keep their
+// entries and order; new ones go last. Returns the index of the first new child, or
+// npos when nothing changed.
+static size_t MergeListing(View& v, std::vector<Entry>& listed) {
+  std::unordered_set<wstring> listedPaths;
+  for (const Entry& e : listed) listedPaths.insert(e.path);
+  std::unordered_set<wstring> shown;
+  for (const Entry& e : v.entries) shown.insert(e.path);
+
+  std::vector<Entry> next;
+  for (Entry& e : v.entries) {
+    if (listedPaths.count(e.path)) next.push_back(std::move(e));
+  }
+  const size_t first = next.size();
+  for (Entry& e : listed) {
+    if (!shown.count(e.path)) next.push_back(std::move(e));
+  }
+  const bool changed = first != shown.size() || next.size() != first;
+  { std::lock_guard<std::mutex> lk(g_mu); v.entries = std::move(next); }
+  if (!changed) return wstring::npos;
+  v.rows.clear();
+  return first;
+}
+
+// WM_APP_LISTING: appends the children listed since the last batch and sizes them.
+static void TakeListedChildren(View& v) {
+  const std::shared_ptr<Listing> l = v.listing;
+  if (!l) return;  // a listing the view has since navigated away from
+  l->posted.store(false);
+
+  std::vector<Entry> batch;
+  bool done = false;
+  DWORD err = 0;
+  {
+    std::lock_guard<std::mutex> lk(g_mu);
+    if (l->replace && !l->done) return;  // the restored entries stay up until the listing is whole
+    batch.swap(l->pending);
+    done = l->done;
+    err = l->error;
+  }
+  if (done) v.listing.reset();
+
+  if (err) {
+    if (l->replace) {
+      { std::lock_guard<std::mutex> lk(g_mu); v.entries.clear(); }
+      v.rows.clear();
+      ListView_DeleteAllItems(v.hwndList);
+      PublishPieFrame(v, nullptr);
+    }
+    wchar_t buf[256];
+    swprintf(buf, 256, L"%s  |  enumerate failed: %lu", l->dir.c_str(), err);
+    SetStatusText(v, buf);
+    return;
+  }
+
+  size_t first = 0;
+  if (l->replace) {
+    first = MergeListing(v, batch);
+    if (first == wstring::npos) {
+      UpdateWindowTitleProgress(v);
+      return;
+    }
+  } else {
+    std::lock_guard<std::mutex> lk(g_mu);
+    first = v.entries.size();
+    for (Entry& e : batch) v.entries.push_back(std::move(e));
+  }
+  ScheduleEntries(v, l->device, first);
+}
+
+// Keeps the folder view being left so coming back to it redraws at once.
+static void RememberView(View& v) {
+  if (v.mode != ViewMode::Directory || v.currentDir.empty() || v.listing) return;
+  if (v.entries.empty() || v.rows.size() != v.entries.size()) return;
+
+  CachedView c;
+  c.dir = v.currentDir;
+  c.rows = std::move(v.rows);
+  c.frame = CurrentPieFrame(v);
+  c.status = v.statusLine;
+  c.version = v.shownVersion;
+  c.pieMetric = v.pieMetric;
+  c.coldBucket = v.coldBucket;
+  c.coldByAccess = v.coldByAccess;
+  { std::lock_guard<std::mutex> lk(g_mu); c.entries = std::move(v.entries); }
+  v.rows.clear();
+
+  v.recent.erase(std::remove_if(v.recent.begin(), v.recent.end(),
+                                [&](const CachedView& o) { return _wcsicmp(o.dir.c_str(), c.dir.c_str()) == 0; }),
+                 v.recent.end());
+  v.recent.insert(v.recent.begin(), std::move(c));
+
+  size_t total = 0;
+  size_t keep = 0;
+  while (keep < v.recent.size() && keep < VIEW_CACHE_MAX) {
+    total += v.recent[keep].entries.size();
+    if (total > VIEW_CACHE_MAX_ENTRIES) break;
+    keep++;
+  }
+  v.recent.resize(keep);
+}
+
+// Takes dir's cached view out of the window's cache. Views drawn with other pie
+// settings are dropped rather than shown.
+static bool TakeCachedView(View& v, const wstring& dir, CachedView& out) {
+  for (auto it = v.recent.begin(); it != v.recent.end(); ++it) {
+    if (_wcsicmp(it->dir.c_str(), dir.c_str()) != 0) continue;
+    const bool same = it->pieMetric == v.pieMetric && it->coldBucket == v.coldBucket &&
+                      it->coldByAccess == v.coldByAccess;
+    if (same) out = std::move(*it);
+    v.recent.erase(it);
+    return same;
+  }
+  return false;
+}
+
+static void StartAnalyze(View& v, const wstring& dirAbs, bool history = true) {
+  const wstring dir = TrimTrailingSlash(dirAbs);
+  if (history && v.mode == ViewMode::Directory && !v.currentDir.empty() &&
+      _wcsicmp(dir.c_str(), v.currentDir.c_str()) != 0) {
+    v.backDirs.push_back(v.currentDir);
+    if (v.backDirs.size() > HISTORY_MAX) v.backDirs.erase(v.backDirs.begin());
+    v.forwardDirs.clear();
+  }
+  RememberView(v);
+  ReleaseRequests(v);
+  SetListHover(v, -1);
+
+  v.currentDir = dir;
+  v.mode = ViewMode::Directory;
+  v.queryText.clear();
+  SetWindowTextW(v.hwndEdit, v.currentDir.c_str());
+
+  CachedView cached;
+  const bool hit = TakeCachedView(v, v.currentDir, cached);
+  {
+    std::lock_guard<std::mutex> lk(g_mu);
+    v.entries = std::move(cached.entries);
+  }
+  RequestPageIn(v.currentDir);
+
+  EnsureListColumns(v.hwndList);
+  v.rows = std::move(cached.rows);
+  if (hit) {
+    ShowRows(v);
+    PublishPieFrame(v, std::move(cached.frame));
+    v.statusLine = cached.status;
+    SetStatusText(v, v.statusLine);
+  } else {
+    ListView_DeleteAllItems(v.hwndList);
+    PublishPieFrame(v, nullptr);
+  }
+
+  EnumerateChildrenAndSchedule(v, v.currentDir, hit);
+  UpdateWindowTitleProgress(v);
+  if (hit) {
+    // Revalidate in the background: sizes now, membership once the listing is whole.
+    ScheduleEntries(v, DeviceForPath(v.currentDir));
+    v.shownVersion = cached.version;
+  }
+}
+
+// Multi-root session overview: one entry per root, each sized by a job on its own
+// device queue so different volumes are walked in parallel.
+static void StartRootsView(View& v) {
+  ReleaseRequests(v);
+  SetListHover(v, -1);
+
+  v.currentDir.clear();
+  v.mode = ViewMode::Roots;
+  v.queryText.clear();
+  SetWindowTextW(v.hwndEdit, RootsText(v).c_str());
+
+  std::vector<Entry> found;
+  for (const wstring& r : v.roots) {
+    Entry e{};
+    e.name = r;
+    e.path = r;
+    found.push_back(std::move(e));
+  }
+  { std::lock_guard<std::mutex> lk(g_mu); v.entries = std::move(found); }
+
+  EnsureListColumns(v.hwndList);
+  ListView_DeleteAllItems(v.hwndList);
+  PublishPieFrame(v, nullptr);
+
+  UpdateWindowTitleProgress(v);
+  ScheduleEntries(v, -1);
+}
+
+static void OpenRoots(View& v, const std::vector<wstring>& roots) {
+  v.roots.clear();
+  for (const wstring& r : roots) v.roots.push_back(TrimTrailingSlash(r));
+  if (v.roots.size() == 1) StartAnalyze(v, v.roots[0]);
+  else if (!v.roots.empty()) StartRootsView(v);
+}
+
+static std::vector<wstring> SplitRoots(const wstring& text) {
+  std::vector<wstring> out;
+  size_t start = 0;
+  while (start <= text.size()) {
+    size_t end = text.find(L';', start);
+    if (end == wstring::npos) end = text.size();
+    wstring part = text.substr(start, end - start);
+    while (!part.empty() && part.front() == L' ') part.erase(part.begin());
+    while (!part.empty() && part.back() == L' ') part.pop_back();
+    if (!part.empty()) out.push_back(part);
+    start = end + 1;
+  }
+  return out;
+}
+
+// Lists the children of the last node in v.browsePath.
+static void ShowSnapshotNode(View& v) {
+  const Snapshot& s = *v.browse;
+  const SnapNode& cur = s.nodes[v.browsePath.back()];
+  const wstring base = BrowsePathText(v);
+
+  std::vector<Entry> found;
+  found.reserve(cur.childCount);
+  for (uint32_t i = 0; i < cur.childCount; ++i) {
+    const uint32_t k = cur.firstChild + i;
+    const SnapNode& n = s.nodes[k];
+    Entry e{};
+    e.name = SnapNodeName(s, k);
+    e.path = JoinPath(base, e.name);
+    e.bytes = n.bytes;
+    e.has_value = true;
+    e.exact = !s.incomplete;
+    e.content.files = n.files;
+    e.content.dirs = n.dirs;
+    e.snapNode = k;
+    found.push_back(std::move(e));
+  }
+
+  SetListHover(v, -1);
+  { std::lock_guard<std::mutex> lk(g_mu); v.entries = std::move(found); }
+  v.mode = ViewMode::Snapshot;
+  SetWindowTextW(v.hwndEdit, base.c_str());
+  RefreshUIFromCache(v);
+}
+
+static void BrowseSnapshot(View& v, std::shared_ptr<const Snapshot> s, uint64_t ms) {
+  v.browse = std::move(s);
+  v.browsePath.assign(1, 0);
+  ShowSnapshotNode(v);
+
+  wchar_t buf[128];
+  swprintf(buf, 128, L"  |  %llu dirs loaded in %llu ms", (unsigned long long)v.browse->nodes.size(),
+           (unsigned long long)ms);
+  SetStatusText(v, ViewLabel(v) + buf);
+}
+
+static void OpenSnapshotFile(View& v, const wstring& path) {
+  auto s = std::make_shared<Snapshot>();
+  wstring err;
+  const uint64_t t0 = NowTick();
+  if (!ReadSnapshot(path, *s, err)) {
+    SetStatusText(v, L"snapshot: " + err);
+    return;
+  }
+  BrowseSnapshot(v, std::move(s), NowTick() - t0);
+}
+
+static void ImportListingFile(View& v, HWND owner) {
+  const COMDLG_FILTERSPEC types[] = {{L"Listings (*.json;*.txt;*.lst;*.du)", L"*.json;*.txt;*.lst;*.du"},
+                                     {L"All Files (*.*)", L"*.*"}};
+  const wstring path = PickFile(owner, false, L"Import Listing (ncdu JSON, find -printf, du)", types, 2, nullptr);
+  if (path.empty()) return;
+
+  const uint64_t t0 = NowTick();
+  auto tree = std::make_shared<ScanTree>();
+  ImportStats st{};
+  wstring err;
+  if (!ImportListing(path, ListingFormat::Auto, *tree, st, err)) {
+    SetStatusText(v, L"import: " + err);
+    return;
+  }
+  auto s = std::make_shared<Snapshot>(BuildSnapshot(tree->rootPath, {tree}));
+  BrowseSnapshot(v, std::move(s), NowTick() - t0);
+}
+
+// Back and Forward step through the folders this window showed.
+static void GoBack(View& v) {
+  if (v.backDirs.empty()) return;
+  const wstring dir = v.backDirs.back();
+  v.backDirs.pop_back();
+  if (v.mode == ViewMode::Directory && !v.currentDir.empty()) v.forwardDirs.push_back(v.currentDir);
+  StartAnalyze(v, dir, false);
+}
+
+static void GoForward(View& v) {
+  if (v.forwardDirs.empty()) return;
+  const wstring dir = v.forwardDirs.back();
+  v.forwardDirs.pop_back();
+  if (v.mode == ViewMode::Directory && !v.currentDir.empty()) v.backDirs.push_back(v.currentDir);
+  StartAnalyze(v, dir, false);
+}
+
+static void GoUp(View& v) {
+  if (v.mode == ViewMode::Roots) return;
+  if (v.mode == ViewMode::Snapshot && v.browsePath.size() > 1) {
+    v.browsePath.pop_back();
+    ShowSnapshotNode(v);
+    return;
+  }
+  if (v.mode != ViewMode::Directory) {
+    if (v.currentDir.empty()) StartRootsView(v);
+    else StartAnalyze(v, v.currentDir);
+    return;
+  }
+  if (v.roots.size() > 1) {
+    for (const wstring& r : v.roots) {
+      if (_wcsicmp(r.c_str(), v.currentDir.c_str()) == 0) { StartRootsView(v); return; }
+    }
+  }
+  StartAnalyze(v, ParentDir(v.currentDir));
+}
+
+// Shows query results in place of the directory listing. Scans keep running; the
+// results refresh from the cache like normal entries.
+static void RunQueryInView(View& v, const wstring& text) {
+  Query q{};
+  wstring err;
+  if (!ParseQuery(text, q, err)) {
+    SetStatusText(v, L"query error: " + err);
+    return;
+  }
+
+  const uint64_t t0 = NowTick();
+  const auto ci = GetColumnIndex(v.currentDir);
+  const QueryResult r = RunQuery(q, *ci);
+  const uint64_t ms = NowTick() - t0;
+
+  const wstring base = EnsureBackslash(v.currentDir);
+  std::vector<Entry> found;
+  found.reserve(r.rows.size());
+  for (uint32_t row : r.rows) {
+    Entry e{};
+    e.path = ColumnRowPath(*ci, row);
+    e.name = StartsWithNoCase(e.path, base.c_str()) ? e.path.substr(base.size()) : e.path;
+    e.bytes = ci->bytes[row];
+    e.content.files = ci->files[row];
+    e.content.dirs = ci->dirs[row];
+    e.has_value = true;
+    e.exact = true;
+    found.push_back(std::move(e));
+  }
+
+  SetListHover(v, -1);
+  { std::lock_guard<std::mutex> lk(g_mu); v.entries = std::move(found); }
+  v.mode = ViewMode::Query;
+  v.queryText = text;
+
+  RefreshUIFromCache(v);
+
+  wchar_t buf[256];
+  swprintf(buf, 256, L"  |  %llu matches of %llu dirs in %llu ms  |  outer total %s",
+           (unsigned long long)r.matched, (unsigned long long)r.scanned, (unsigned long long)ms,
+           FormatBytes(r.outerBytes).c_str());
+  SetStatusText(v, ViewLabel(v) + buf);
+}
+
+// The path box doubles as the query box: "?<query>" runs a query over the cached
+// trees below the current directory, "a; b; c" opens a multi-root session, and
+// anything else navigates.
+static void SubmitEditText(View& v) {
+  const int len = GetWindowTextLengthW(v.hwndEdit);
+  wstring text(len + 1, L'\0');
+  GetWindowTextW(v.hwndEdit, &text[0], len + 1);
+  text.resize(len);
+
+  while (!text.empty() && (text.front() == L' ' || text.front() == L'\t')) text.erase(text.begin());
+  while (!text.empty() && (text.back() == L' ' || text.back() == L'\t')) text.pop_back();
+  if (text.empty()) return;
+
+  if (text.front() == L'?') RunQueryInView(v, text.substr(1));
+  else if (text.find(L';') != wstring::npos) OpenRoots(v, SplitRoots(text));
+  else StartAnalyze(v, text);
+}
+
+// Snapshot of what is currently known below v.currentDir: complete trees where the
+// walk finished, size-only leaves for children still scanning or capped.
+static Snapshot SnapshotCurrentView(View& v) {
+  std::vector<std::shared_ptr<const ScanTree>> trees;
+  bool incomplete = false;
+  {
+    std::lock_guard<std::mutex> lk(g_mu);
+    for (const Entry& e : v.entries) {
+      auto it = g_trees.find(e.path);
+      if (it != g_trees.end()) { trees.push_back(it->second); continue; }
+
+      auto leaf = std::make_shared<ScanTree>();
+      leaf->rootPath = e.path;
+      AddTreeNode(*leaf, 0, L"");
+      auto ci = g_cache.find(e.path);
+      if (ci != g_cache.end()) {
+        leaf->nodes[0].bytes = ci->second.bytes;
+        leaf->nodes[0].files = ci->second.content.files;
+        leaf->nodes[0].dirs = ci->second.content.dirs;
+      }
+      trees.push_back(leaf);
+      incomplete = true;
+    }
   }
+  Snapshot s = BuildSnapshot(v.currentDir, trees);
+  s.incomplete = incomplete;
+  return s;
+}
 
-  PostMessageW(g_hwndMain, WM_APP_REFRESH, (WPARAM)gen, 0);
+// In the snapshot browse view this re-exports the loaded snapshot, which also
+// converts older files to the current format.
+static void SaveSnapshotFromView(View& v, HWND owner) {
+  if (v.mode != ViewMode::Directory && v.mode != ViewMode::Snapshot) {
+    SetStatusText(v, L"snapshot: return to a folder view first");
+    return;
+  }
+  const wstring path = PickSnapshotFile(owner, true, L"Save Snapshot");
+  if (path.empty()) return;
+
+  const Snapshot s = (v.mode == ViewMode::Snapshot) ? *v.browse : SnapshotCurrentView(v);
+  wchar_t buf[256];
+  if (WriteSnapshot(s, path)) {
+    swprintf(buf, 256, L"saved %llu dirs%s to ", (unsigned long long)s.nodes.size(),
+             s.incomplete ? L" (scan incomplete)" : L"");
+    SetStatusText(v, buf + path);
+  } else {
+    swprintf(buf, 256, L"snapshot save failed: %lu  ", GetLastError());
+    SetStatusText(v, buf + path);
+  }
 }
 
-static void StartAnalyze(const wstring& dirAbs) {
-  const uint64_t gen = g_generation.fetch_add(1) + 1;
-  const uint64_t epoch = g_progressEpoch.fetch_add(1) + 1;
+static const size_t DIFF_VIEW_ROWS = 200;
+
+// Ranked growth view: the most-changed subtrees between a saved snapshot of this
+// folder and what is cached now, with the pie sized by |delta|.
+static void CompareWithSnapshot(View& v, HWND owner) {
+  const wstring path = PickSnapshotFile(owner, false, L"Compare With Snapshot");
+  if (path.empty()) return;
+
+  Snapshot before{};
+  wstring err;
+  if (!ReadSnapshot(path, before, err)) {
+    SetStatusText(v, L"snapshot: " + err);
+    return;
+  }
+  const wstring dir = v.currentDir;
+  if (_wcsicmp(before.rootPath.c_str(), dir.c_str()) != 0) {
+    SetStatusText(v, L"snapshot is of " + before.rootPath + L", not " + dir);
+    return;
+  }
+
+  const uint64_t t0 = NowTick();
+  const Snapshot now = SnapshotCurrentView(v);
+  const SnapshotDiff d = DiffSnapshots(before, now);
+  const std::vector<uint32_t> ranked = RankDiffRows(d, DIFF_VIEW_ROWS);
+  const uint64_t ms = NowTick() - t0;
+
+  std::vector<Entry> found;
+  for (uint32_t row : ranked) {
+    const DiffRow& r = d.rows[row];
+    Entry e{};
+    const wstring rel = DiffRowRelPath(d, row, before, now);
+    e.name = rel.empty() ? L"." : rel;
+    if (r.oldNode == NO_NODE) e.name += L"  (new)";
+    if (r.newNode == NO_NODE) e.name += L"  (removed)";
+    e.path = rel.empty() ? dir : JoinPath(dir, rel);
+    e.delta = r.delta;
+    e.bytes = AbsDelta(r.delta);
+    if (r.newNode != NO_NODE) {
+      e.content.files = now.nodes[r.newNode].files;
+      e.content.dirs = now.nodes[r.newNode].dirs;
+    }
+    e.has_value = true;
+    e.exact = !before.incomplete && !now.incomplete;
+    found.push_back(std::move(e));
+  }
 
-  ClearJobs();
-  ResetProgressCounters();
-  SetListHover(-1);
+  SetListHover(v, -1);
+  { std::lock_guard<std::mutex> lk(g_mu); v.entries = std::move(found); }
+  v.mode = ViewMode::Diff;
 
-  g_currentDir = TrimTrailingSlash(dirAbs);
-  SetWindowTextW(g_hwndEdit, g_currentDir.c_str());
+  wchar_t buf[256];
+  swprintf(buf, 256, L"diff vs %s  |  total %s  |  %llu changed, %llu pruned, %llu ms",
+           LastPathComponent(path).c_str(), FormatDelta(d.rows[0].delta).c_str(),
+           (unsigned long long)(d.rows.size() - 1), (unsigned long long)d.pruned, (unsigned long long)ms);
+  v.diffLabel = buf;
+  RefreshUIFromCache(v);
+}
 
-  { std::lock_guard<std::mutex> lk(g_mu); g_entries.clear(); }
+static WNDPROC g_editPrevProc = nullptr;
 
-  EnsureListColumns(g_hwndList);
-  ListView_DeleteAllItems(g_hwndList);
-  InvalidateRect(g_hwndPie, nullptr, TRUE);
+static LRESULT CALLBACK EditWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
+  View* view = ViewFromWindow(GetParent(hwnd));
+  if (!view) return CallWindowProcW(g_editPrevProc, hwnd, msg, wParam, lParam);
+  View& v = *view;
 
-  UpdateWindowTitleProgress();
-  EnumerateChildrenAndSchedule(gen, epoch, g_currentDir);
+  if (msg == WM_KEYDOWN && wParam == VK_RETURN) { SubmitEditText(v); return 0; }
+  if (msg == WM_KEYDOWN && wParam == VK_ESCAPE) {
+    const wstring text = (v.mode == ViewMode::Query) ? L"?" + v.queryText
+                       : (v.mode == ViewMode::Snapshot) ? BrowsePathText(v)
+                       : v.currentDir;
+    SetWindowTextW(hwnd, text.c_str());
+    return 0;
+  }
+  if (msg == WM_CHAR && (wParam == L'\r' || wParam == 27)) return 0;  // no beep
+  return CallWindowProcW(g_editPrevProc, hwnd, msg, wParam, lParam);
 }
 
-static void Layout(HWND hwnd) {
+static void Layout(View& v, HWND hwnd) {
   RECT rc{};
   GetClientRect(hwnd, &rc);
 
@@ -846,19 +6368,23 @@ static void Layout(HWND hwnd) {
   int contentH = H - topH - statusH;
   if (contentH < 50) contentH = 50;
 
-  MoveWindow(g_hwndUp,   8, 6, 60, 22, TRUE);
-  MoveWindow(g_hwndEdit, 76, 6, W - 88, 22, TRUE);
+  MoveWindow(v.hwndUp,   8, 6, 60, 22, TRUE);
+  MoveWindow(v.hwndEdit, 76, 6, W - 88, 22, TRUE);
 
   int split = (int)(W * 0.45);
   if (split < 220) split = 220;
   if (split > W - 220) split = W - 220;
 
-  MoveWindow(g_hwndList,   0,      topH, split,     contentH, TRUE);
-  MoveWindow(g_hwndPie,    split,  topH, W - split, contentH, TRUE);
-  MoveWindow(g_hwndStatus, 0, topH + contentH, W,   statusH,  TRUE);
+  MoveWindow(v.hwndList,   0,      topH, split,     contentH, TRUE);
+  MoveWindow(v.hwndPie,    split,  topH, W - split, contentH, TRUE);
+  MoveWindow(v.hwndStatus, 0, topH + contentH, W,   statusH,  TRUE);
 }
 
 static LRESULT CALLBACK PieWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
+  View* view = ViewFromWindow(GetParent(hwnd));
+  if (!view) return DefWindowProcW(hwnd, msg, wParam, lParam);
+  View& v = *view;
+
   switch (msg) {
     case WM_ERASEBKGND:
       return 1;
@@ -868,25 +6394,29 @@ static LRESULT CALLBACK PieWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lP
       TrackMouseEvent(&tme);
 
       POINT pt{ GET_X_LPARAM(lParam), GET_Y_LPARAM(lParam) };
-      SetListHover(HitTestPie(pt));
+      const int idx = HitTestPie(v, pt);
+      if (idx != v.hoverIndex && idx >= 0 && idx < (int)v.entries.size()) {
+        SetStatusText(v, v.entries[idx].name + L"  |  " + SizeHistogramText(v.entries[idx].content));
+      }
+      SetListHover(v, idx);
       return 0;
     }
 
     case WM_MOUSELEAVE:
-      SetListHover(-1);
+      SetListHover(v, -1);
       return 0;
 
     case WM_LBUTTONDOWN: {
       POINT pt{ GET_X_LPARAM(lParam), GET_Y_LPARAM(lParam) };
-      const int idx = HitTestPie(pt);
-      if (idx >= 0 && idx < (int)g_entries.size()) StartAnalyze(g_entries[idx].path);
+      const int idx = HitTestPie(v, pt);
+      if (idx >= 0 && idx < (int)v.entries.size()) StartAnalyze(v, v.entries[idx].path);
       return 0;
     }
 
     case WM_PAINT: {
       PAINTSTRUCT ps{};
       HDC hdc = BeginPaint(hwnd, &ps);
-      PiePaint(hwnd, hdc);
+      PiePaint(v, hwnd, hdc);
       EndPaint(hwnd, &ps);
       return 0;
     }
@@ -895,85 +6425,177 @@ static LRESULT CALLBACK PieWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lP
   return DefWindowProcW(hwnd, msg, wParam, lParam);
 }
 
+static void UpdateViewMenuChecks(View& v, HMENU menu) {
+  if (!menu) return;
+  const int pieId = (v.pieMetric == PieMetric::ColdBytes) ? IDM_PIE_BY_COLD
+                  : (v.pieMetric == PieMetric::Files) ? IDM_PIE_BY_FILES
+                  : (v.pieMetric == PieMetric::Allocated) ? IDM_PIE_BY_ALLOCATED
+                  : IDM_PIE_BY_SIZE;
+  CheckMenuRadioItem(menu, IDM_PIE_BY_SIZE, IDM_PIE_BY_ALLOCATED, pieId, MF_BYCOMMAND);
+  CheckMenuRadioItem(menu, IDM_COLD_30D, IDM_COLD_365D, IDM_COLD_30D + (v.coldBucket - 1), MF_BYCOMMAND);
+  CheckMenuRadioItem(menu, IDM_AGE_BY_MODIFIED, IDM_AGE_BY_ACCESSED,
+                     v.coldByAccess ? IDM_AGE_BY_ACCESSED : IDM_AGE_BY_MODIFIED, MF_BYCOMMAND);
+}
+
+static void OpenViewWindow(const std::vector<wstring>& roots, const wstring& snapshot);
+
 static LRESULT CALLBACK MainWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
+  if (msg == WM_CREATE) {
+    View* created = (View*)((CREATESTRUCTW*)lParam)->lpCreateParams;
+    created->hwndMain = hwnd;
+    SetWindowLongPtrW(hwnd, GWLP_USERDATA, (LONG_PTR)created);
+  }
+  View* view = ViewFromWindow(hwnd);
+  if (!view) return DefWindowProcW(hwnd, msg, wParam, lParam);
+  View& v = *view;
+
   switch (msg) {
     case WM_CREATE: {
       InitCommonControls();
 
       HMENU hMenuBar = CreateMenu();
       HMENU hFile = CreatePopupMenu();
-      AppendMenuW(hFile, MF_STRING, IDM_OPEN_FOLDER, L"&Open Folder...\tCtrl+O");
+      AppendMenuW(hFile, MF_STRING, IDM_OPEN_FOLDER, L"&Open Folders...\tCtrl+O");
+      AppendMenuW(hFile, MF_STRING, IDM_SAVE_SNAPSHOT, L"&Save Snapshot...");
+      AppendMenuW(hFile, MF_STRING, IDM_COMPARE_SNAPSHOT, L"&Compare With Snapshot...");
+      AppendMenuW(hFile, MF_STRING, IDM_OPEN_SNAPSHOT, L"&Browse Snapshot...");
+      AppendMenuW(hFile, MF_STRING, IDM_IMPORT_LISTING, L"&Import Listing...");
       AppendMenuW(hFile, MF_SEPARATOR, 0, nullptr);
       AppendMenuW(hFile, MF_STRING, IDM_NEW_WINDOW_BLANK, L"&New Window\tCtrl+N");
       AppendMenuW(hFile, MF_STRING, IDM_NEW_WINDOW_PICK, L"New Window From Folder...");
       AppendMenuW(hFile, MF_SEPARATOR, 0, nullptr);
       AppendMenuW(hFile, MF_STRING, IDM_EXIT_APP, L"E&xit");
       AppendMenuW(hMenuBar, MF_POPUP, (UINT_PTR)hFile, L"&File");
+
+      HMENU hView = CreatePopupMenu();
+      AppendMenuW(hView, MF_STRING, IDM_NAV_BACK, L"&Back\tAlt+Left");
+      AppendMenuW(hView, MF_STRING, IDM_NAV_FORWARD, L"&Forward\tAlt+Right");
+      AppendMenuW(hView, MF_SEPARATOR, 0, nullptr);
+      AppendMenuW(hView, MF_STRING, IDM_PIE_BY_SIZE, L"Pie by &Size");
+      AppendMenuW(hView, MF_STRING, IDM_PIE_BY_COLD, L"Pie by &Cold Bytes");
+      AppendMenuW(hView, MF_STRING, IDM_PIE_BY_FILES, L"Pie by &File Count");
+      AppendMenuW(hView, MF_STRING, IDM_PIE_BY_ALLOCATED, L"Pie by Size on &Disk");
+      AppendMenuW(hView, MF_SEPARATOR, 0, nullptr);
+      AppendMenuW(hView, MF_STRING, IDM_COLD_30D, L"Cold After 30 Days");
+      AppendMenuW(hView, MF_STRING, IDM_COLD_90D, L"Cold After 90 Days");
+      AppendMenuW(hView, MF_STRING, IDM_COLD_365D, L"Cold After 365 Days");
+      AppendMenuW(hView, MF_SEPARATOR, 0, nullptr);
+      AppendMenuW(hView, MF_STRING, IDM_AGE_BY_MODIFIED, L"Age by Last &Modified");
+      AppendMenuW(hView, MF_STRING, IDM_AGE_BY_ACCESSED, L"Age by Last &Accessed");
+      AppendMenuW(hMenuBar, MF_POPUP, (UINT_PTR)hView, L"&View");
       SetMenu(hwnd, hMenuBar);
+      UpdateViewMenuChecks(v, hMenuBar);
 
-      g_hwndUp = CreateWindowExW(0, L"BUTTON", L"Up",
+      v.hwndUp = CreateWindowExW(0, L"BUTTON", L"Up",
                                 WS_CHILD | WS_VISIBLE | BS_PUSHBUTTON,
                                 0, 0, 0, 0,
                                 hwnd, (HMENU)1001, g_hInst, nullptr);
 
-      g_hwndEdit = CreateWindowExW(WS_EX_CLIENTEDGE, L"EDIT", L"",
+      v.hwndEdit = CreateWindowExW(WS_EX_CLIENTEDGE, L"EDIT", L"",
                                   WS_CHILD | WS_VISIBLE | ES_AUTOHSCROLL,
                                   0, 0, 0, 0,
                                   hwnd, (HMENU)1002, g_hInst, nullptr);
+      g_editPrevProc = (WNDPROC)SetWindowLongPtrW(v.hwndEdit, GWLP_WNDPROC, (LONG_PTR)EditWndProc);
 
-      g_hwndList = CreateWindowExW(WS_EX_CLIENTEDGE, WC_LISTVIEWW, L"",
+      v.hwndList = CreateWindowExW(WS_EX_CLIENTEDGE, WC_LISTVIEWW, L"",
                                   WS_CHILD | WS_VISIBLE | LVS_REPORT |
                                   LVS_SINGLESEL | LVS_SHOWSELALWAYS,
                                   0, 0, 0, 0,
                                   hwnd, (HMENU)1003, g_hInst, nullptr);
 
       ListView_SetExtendedListViewStyle(
-          g_hwndList,
+          v.hwndList,
           LVS_EX_FULLROWSELECT | LVS_EX_DOUBLEBUFFER | LVS_EX_INFOTIP | LVS_EX_TRACKSELECT);
 
-      EnsureListColumns(g_hwndList);
+      EnsureListColumns(v.hwndList);
 
-      g_hwndPie = CreateWindowExW(0, kPieClass, L"",
+      v.hwndPie = CreateWindowExW(0, kPieClass, L"",
                                  WS_CHILD | WS_VISIBLE,
                                  0, 0, 0, 0,
                                  hwnd, (HMENU)1004, g_hInst, nullptr);
 
-      g_hwndStatus = CreateWindowExW(0, STATUSCLASSNAMEW, L"",
+      v.hwndStatus = CreateWindowExW(0, STATUSCLASSNAMEW, L"",
                                     WS_CHILD | WS_VISIBLE,
                                     0, 0, 0, 0,
                                     hwnd, (HMENU)1005, g_hInst, nullptr);
 
-      SetWindowTextW(g_hwndEdit, g_currentDir.c_str());
-      Layout(hwnd);
+      SetWindowTextW(v.hwndEdit, v.currentDir.c_str());
+      Layout(v, hwnd);
 
-      StartAnalyze(g_currentDir);
+      if (v.roots.size() > 1) StartRootsView(v);
+      else StartAnalyze(v, v.currentDir);
       return 0;
     }
 
     case WM_SIZE:
-      Layout(hwnd);
+      Layout(v, hwnd);
       return 0;
 
     case WM_COMMAND: {
       const int id = LOWORD(wParam);
-      if (id == 1001) { StartAnalyze(ParentDir(g_currentDir)); return 0; }
+      if (id == 1001) { GoUp(v); return 0; }
+      if (id == IDM_NAV_BACK) { GoBack(v); return 0; }
+      if (id == IDM_NAV_FORWARD) { GoForward(v); return 0; }
 
       if (id == IDM_OPEN_FOLDER) {
-        std::wstring p = PickFolder(hwnd);
-        if (!p.empty()) StartAnalyze(p);
+        const std::vector<std::wstring> picked = PickFolders(hwnd);
+        if (!picked.empty()) OpenRoots(v, picked);
+        return 0;
+      }
+      if (id == IDM_SAVE_SNAPSHOT) {
+        SaveSnapshotFromView(v, hwnd);
+        return 0;
+      }
+      if (id == IDM_COMPARE_SNAPSHOT) {
+        CompareWithSnapshot(v, hwnd);
+        return 0;
+      }
+      if (id == IDM_IMPORT_LISTING) {
+        ImportListingFile(v, hwnd);
+        return 0;
+      }
+      if (id == IDM_OPEN_SNAPSHOT) {
+        const wstring path = PickSnapshotFile(hwnd, false, L"Browse Snapshot");
+        if (!path.empty()) OpenSnapshotFile(v, path);
         return 0;
       }
       if (id == IDM_NEW_WINDOW_BLANK) {
-        LaunchNewInstance(L"C:\\");
+        OpenViewWindow({}, L"");
         return 0;
       }
       if (id == IDM_NEW_WINDOW_PICK) {
         std::wstring p = PickFolder(hwnd);
-        if (!p.empty()) LaunchNewInstance(p);
+        if (!p.empty()) OpenViewWindow({ p }, L"");
+        return 0;
+      }
+      if (id >= IDM_PIE_BY_SIZE && id <= IDM_PIE_BY_ALLOCATED) {
+        v.pieMetric = (id == IDM_PIE_BY_COLD) ? PieMetric::ColdBytes
+                    : (id == IDM_PIE_BY_FILES) ? PieMetric::Files
+                    : (id == IDM_PIE_BY_ALLOCATED) ? PieMetric::Allocated
+                    : PieMetric::Bytes;
+        UpdateViewMenuChecks(v, GetMenu(hwnd));
+        RefreshUIFromCache(v);
+        return 0;
+      }
+      if (id >= IDM_COLD_30D && id <= IDM_COLD_365D) {
+        v.coldBucket = 1 + (id - IDM_COLD_30D);
+        UpdateViewMenuChecks(v, GetMenu(hwnd));
+        RefreshUIFromCache(v);
+        return 0;
+      }
+      if (id == IDM_AGE_BY_MODIFIED || id == IDM_AGE_BY_ACCESSED) {
+        v.coldByAccess = (id == IDM_AGE_BY_ACCESSED);
+        UpdateViewMenuChecks(v, GetMenu(hwnd));
+        RefreshUIFromCache(v);
         return 0;
       }
       if (id == IDM_EXIT_APP) {
-        DestroyWindow(hwnd);
+        std::vector<HWND> all;
+        {
+          std::lock_guard<std::mutex> lk(g_mu);
+          for (const auto& o : g_views) all.push_back(o->hwndMain);
+        }
+        for (HWND w : all) DestroyWindow(w);
         return 0;
       }
       return 0;
@@ -981,59 +6603,939 @@ static LRESULT CALLBACK MainWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM l
 
     case WM_NOTIFY: {
       LPNMHDR hdr = (LPNMHDR)lParam;
-      if (hdr->hwndFrom == g_hwndList && hdr->code == NM_DBLCLK) {
-        const int sel = ListView_GetNextItem(g_hwndList, -1, LVNI_SELECTED);
-        if (sel >= 0 && sel < (int)g_entries.size()) StartAnalyze(g_entries[sel].path);
+      if (hdr->hwndFrom == v.hwndList && hdr->code == NM_DBLCLK) {
+        const int sel = ListView_GetNextItem(v.hwndList, -1, LVNI_SELECTED);
+        if (sel < 0 || sel >= (int)v.entries.size()) return 0;
+        if (v.mode == ViewMode::Snapshot) {
+          v.browsePath.push_back(v.entries[sel].snapNode);
+          ShowSnapshotNode(v);
+        } else {
+          StartAnalyze(v, v.entries[sel].path);
+        }
         return 0;
       }
       return 0;
     }
 
     case WM_APP_REFRESH:
-      RefreshUIFromCache((uint64_t)wParam);
+      RefreshWhenDue(v);
+      return 0;
+
+    case WM_APP_LISTING:
+      TakeListedChildren(v);
+      return 0;
+
+    case WM_APPCOMMAND:
+      // Mouse back/forward buttons.
+      if (GET_APPCOMMAND_LPARAM(lParam) == APPCOMMAND_BROWSER_BACKWARD) { GoBack(v); return TRUE; }
+      if (GET_APPCOMMAND_LPARAM(lParam) == APPCOMMAND_BROWSER_FORWARD) { GoForward(v); return TRUE; }
+      break;
+
+    case WM_TIMER:
+      if (wParam != REFRESH_TIMER_ID) break;
+      KillTimer(hwnd, REFRESH_TIMER_ID);
+      v.refreshTimer = false;
+      RefreshWhenDue(v);
+      return 0;
+
+    case WM_APP_INDEX_CHANGED:
+      // Connected to a service or lost it: size the live view again through whichever engine is current.
+      if (v.mode == ViewMode::Directory) StartAnalyze(v, v.currentDir);
+      else if (v.mode == ViewMode::Roots) StartRootsView(v);
+      if (!IndexConnected()) SetStatusText(v, L"index service unavailable; scanning in this window");
       return 0;
 
-    case WM_DESTROY:
-      PostQuitMessage(0);
+    case WM_DESTROY: {
+      // Jobs only this window asked for are cancelled; ones another window shares keep running.
+      ReleaseRequests(v);
+      SetWindowLongPtrW(hwnd, GWLP_USERDATA, 0);
+      bool last = false;
+      {
+        std::lock_guard<std::mutex> lk(g_mu);
+        g_views.erase(std::remove_if(g_views.begin(), g_views.end(),
+                                     [&](const std::unique_ptr<View>& o) { return o.get() == &v; }),
+                      g_views.end());
+        last = g_views.empty();
+      }
+      if (last) PostQuitMessage(0);
       return 0;
+    }
   }
 
   return DefWindowProcW(hwnd, msg, wParam, lParam);
 }
 
+// Opens another top-level window on the shared cache and worker pool. With no roots
+// it starts in the folder containing this executable (scanning C:\ at startup can be heavy).
+static void OpenViewWindow(const std::vector<wstring>& roots, const wstring& snapshot) {
+  std::unique_ptr<View> owned(new View());
+  View* view = owned.get();
+  view->roots = roots;
+  if (!roots.empty()) {
+    view->currentDir = roots[0];
+  } else {
+    wchar_t mod[MAX_PATH]{};
+    const DWORD n = GetModuleFileNameW(nullptr, mod, MAX_PATH);
+    if (n > 0 && n < MAX_PATH) view->currentDir = ParentDir(mod);
+  }
+  {
+    std::lock_guard<std::mutex> lk(g_mu);
+    g_views.push_back(std::move(owned));
+  }
+
+  HWND hwnd = CreateWindowExW(0, kAppClass, L"DirPie4",
+                              WS_OVERLAPPEDWINDOW | WS_VISIBLE,
+                              CW_USEDEFAULT, CW_USEDEFAULT, 980, 620,
+                              nullptr, nullptr, g_hInst, view);
+  if (!hwnd) {
+    std::lock_guard<std::mutex> lk(g_mu);
+    g_views.erase(std::remove_if(g_views.begin(), g_views.end(),
+                                 [&](const std::unique_ptr<View>& o) { return o.get() == view; }),
+                  g_views.end());
+    return;
+  }
+  if (!snapshot.empty()) OpenSnapshotFile(*view, snapshot);
+}
+
+// Command line modes. Output goes to the parent console, if any, or to redirected handles.
+
+static void CliWrite(DWORD which, const wstring& s) {
+  HANDLE h = GetStdHandle(which);
+  if (!h || h == INVALID_HANDLE_VALUE) return;
+
+  DWORD n = 0;
+  DWORD mode = 0;
+  if (GetConsoleMode(h, &mode)) {
+    WriteConsoleW(h, s.c_str(), (DWORD)s.size(), &n, nullptr);
+    return;
+  }
+  const int len = WideCharToMultiByte(CP_UTF8, 0, s.c_str(), (int)s.size(), nullptr, 0, nullptr, nullptr);
+  if (len <= 0) return;
+  std::string utf8((size_t)len, '\0');
+  WideCharToMultiByte(CP_UTF8, 0, s.c_str(), (int)s.size(), &utf8[0], len, nullptr, nullptr);
+  WriteFile(h, utf8.data(), (DWORD)utf8.size(), &n, nullptr);
+}
+
+static void CliOut(const wstring& s) { CliWrite(STD_OUTPUT_HANDLE, s); }
+static void CliErr(const wstring& s) { CliWrite(STD_ERROR_HANDLE, s); }
+
+static void CliUsage() {
+  CliErr(L"usage:\n"
+         L"  DirPie.exe [folder]\n"
+         L"  DirPie.exe --query \"<query>\" <folder>\n"
+         L"  DirPie.exe --scan <folder> [folder...]\n"
+         L"  DirPie.exe --snapshot <folder> <out.dps>\n"
+         L"  DirPie.exe --import <listing> <out.dps> [ncdu|find|du|du-b]\n"
+         L"  DirPie.exe --diff <old.dps> <new.dps> [limit]\n"
+         L"  DirPie.exe --serve [--idle-exit]\n"
+         L"  DirPie.exe --ask SIZE|LIST|WATCH|UNWATCH|STATS|SHUTDOWN [path]\n"
+         L"\n"
+         L"query: [where] <expr> [order by <field> [asc|desc]] [limit <n>]\n"
+         L"  expr:   <field> <op> <value> | not expr | expr and expr | expr or expr | (expr)\n"
+         L"  fields: size (KB/MB/GB/TB), files, dirs (K/M), depth, modified (h/d/w/y), name (glob)\n"
+         L"\n"
+         L"DIRPIE_EXCLUDE=<pattern>[;<pattern>...] or @<file> prunes matching directories:\n"
+         L"  node_modules;.git/objects;*.snapshot;C:/Users/*/AppData/**/Cache;!keep-this\n"
+         L"DIRPIE_TRACE_RECORD=<file> records the directory listings walks read; DIRPIE_TRACE_REPLAY=<file>\n"
+         L"  serves them instead of the disk (DIRPIE_TRACE_LATENCY=on replays recorded read times,\n"
+         L"  DIRPIE_TRACE_STALL=<glob> makes matching folders hang to exercise the stall guard)\n");
+}
+
+// Metrics: DIRPIE_METRICS=<port> serves GET /metrics (Prometheus) and GET /status (JSON)
+// on 127.0.0.1, and DIRPIE_METRICS_FILE=<file> rewrites either every METRICS_INTERVAL_MS.
+
+static const uint64_t METRICS_INTERVAL_MS = 1000;
+static const uint64_t METRICS_POLL_MS = 200;   // how soon the exporter notices shutdown
+static const DWORD METRICS_RECV_TIMEOUT_MS = 1000;
+static const DWORD METRICS_SEND_TIMEOUT_MS = 1000;  // a scraper that stops reading can't hold up sampling
+
+struct MetricsSample {
+  uint64_t tick = 0;
+  uint64_t entries = 0;
+  uint64_t dirs = 0;
+  uint64_t bytes = 0;
+  uint64_t skipped[SKIP_REASONS] = {};
+  double entriesPerSec = 0;
+  double bytesPerSec = 0;
+};
+
+struct ThreadJob {
+  const char* thread;
+  DWORD tid;
+  const char* job;
+  wstring path;
+  uint64_t ms;
+};
+
+static uint16_t MetricsPort() {
+  static const uint16_t port = [] {
+    const unsigned long long p = wcstoull(EnvString(L"DIRPIE_METRICS").c_str(), nullptr, 10);
+    return (uint16_t)(p < 65536 ? p : 0);
+  }();
+  return port;
+}
+
+static const wstring& MetricsFile() {
+  static const wstring path = EnvString(L"DIRPIE_METRICS_FILE");
+  return path;
+}
+
+static MetricsSample SampleMetrics(const MetricsSample& prev, std::vector<ThreadJob>& jobs) {
+  MetricsSample m;
+  m.tick = NowTick();
+  jobs.clear();
+  {
+    std::lock_guard<std::mutex> lk(g_metricsMu);
+    for (const auto& t : g_threadMetrics) {
+      m.entries += t->entries.load(std::memory_order_relaxed);
+      m.dirs += t->dirs.load(std::memory_order_relaxed);
+      m.bytes += t->bytes.load(std::memory_order_relaxed);
+      for (int i = 0; i < SKIP_REASONS; ++i) m.skipped[i] += t->skipped[i].load(std::memory_order_relaxed);
+      std::lock_guard<std::mutex> jl(t->jobMu);
+      if (t->job) jobs.push_back(ThreadJob{t->thread, t->tid, t->job, t->path, m.tick - t->since});
+    }
+  }
+  if (prev.tick && m.tick > prev.tick) {
+    const double secs = (double)(m.tick - prev.tick) / 1000.0;
+    m.entriesPerSec = (double)(m.entries - prev.entries) / secs;
+    m.bytesPerSec = (double)(m.bytes - prev.bytes) / secs;
+  }
+  return m;
+}
+
+struct CacheFigures {
+  size_t entries = 0;
+  uint64_t treeBytes = 0;
+  size_t spilled = 0;
+};
+
+static CacheFigures SampleCache() {
+  CacheFigures c;
+  std::lock_guard<std::mutex> lk(g_mu);
+  c.entries = g_cache.size();
+  c.treeBytes = g_treeBytes;
+  c.spilled = g_spilled.size();
+  return c;
+}
+
+static std::string MetricsText(const MetricsSample& m, const std::vector<ThreadJob>& jobs) {
+  const CacheFigures c = SampleCache();
+  std::string out;
+  char buf[256];
+  auto metric = [&](const char* name, const char* type, const char* help, double value) {
+    snprintf(buf, sizeof(buf), "# HELP %s %s\n# TYPE %s %s\n%s %.17g\n", name, help, name, type, name, value);
+    out += buf;
+  };
+  metric("dirpie_entries_total", "counter", "Directory entries read by walks.", (double)m.entries);
+  metric("dirpie_directories_total", "counter", "Directories read by walks.", (double)m.dirs);
+  metric("dirpie_bytes_total", "counter", "File bytes counted by walks.", (double)m.bytes);
+  metric("dirpie_entries_per_second", "gauge", "Entries read per second over the last interval.", m.entriesPerSec);
+  metric("dirpie_bytes_per_second", "gauge", "Bytes counted per second over the last interval.", m.bytesPerSec);
+  metric("dirpie_jobs_queued", "gauge", "Jobs waiting for a worker.", (double)g_jobs_queued.load());
+  metric("dirpie_jobs_active", "gauge", "Jobs being run.", (double)g_jobs_active.load());
+  metric("dirpie_jobs_done_total", "counter", "Jobs finished or dropped.", (double)g_jobs_done.load());
+  metric("dirpie_cache_entries", "gauge", "Folders with a cached size.", (double)c.entries);
+  metric("dirpie_tree_memory_bytes", "gauge", "Memory held by cached trees.", (double)c.treeBytes);
+  metric("dirpie_trees_spilled", "gauge", "Cached trees moved out of memory.", (double)c.spilled);
+  if (MemoryBudget() > 0) metric("dirpie_memory_budget_bytes", "gauge", "DIRPIE_MEMORY_MB.", (double)MemoryBudget());
+
+  out += "# HELP dirpie_skipped_total Directories a walk could not or would not enter, by reason.\n"
+         "# TYPE dirpie_skipped_total counter\n";
+  for (int i = 0; i < SKIP_REASONS; ++i) {
+    snprintf(buf, sizeof(buf), "dirpie_skipped_total{reason=\"%s\"} %llu\n", SKIP_REASON_NAMES[i],
+             (unsigned long long)m.skipped[i]);
+    out += buf;
+  }
+
+  int busyWorkers = 0;
+  for (const ThreadJob& j : jobs) busyWorkers += strcmp(j.thread, "worker") == 0;
+  metric("dirpie_workers_busy", "gauge", "Workers running a job.", (double)busyWorkers);
+  out += "# HELP dirpie_thread_job_seconds How long each busy thread has been on its current job.\n"
+         "# TYPE dirpie_thread_job_seconds gauge\n";
+  for (const ThreadJob& j : jobs) {
+    snprintf(buf, sizeof(buf), "dirpie_thread_job_seconds{thread=\"%s\",tid=\"%lu\",job=\"%s\",path=", j.thread,
+             (unsigned long)j.tid, j.job);
+    out += buf;
+    snprintf(buf, sizeof(buf), "} %.3f\n", (double)j.ms / 1000.0);
+    out += JsonString(j.path) + buf;
+  }
+  return out;
+}
+
+static std::string StatusJson(const MetricsSample& m, const std::vector<ThreadJob>& jobs) {
+  const CacheFigures c = SampleCache();
+  char buf[512];
+  snprintf(buf, sizeof(buf),
+           "{\"entries\":%llu,\"directories\":%llu,\"bytes\":%llu,\"entries_per_second\":%.1f,"
+           "\"bytes_per_second\":%.1f,\"jobs\":{\"queued\":%u,\"active\":%u,\"done\":%u,\"total\":%u},"
+           "\"cache\":{\"entries\":%zu,\"tree_bytes\":%llu,\"spilled\":%zu},\"skipped\":{",
+           (unsigned long long)m.entries, (unsigned long long)m.dirs, (unsigned long long)m.bytes, m.entriesPerSec,
+           m.bytesPerSec, g_jobs_queued.load(), g_jobs_active.load(), g_jobs_done.load(), g_jobs_total.load(),
+           c.entries, (unsigned long long)c.treeBytes, c.spilled);
+  std::string out = buf;
+  for (int i = 0; i < SKIP_REASONS; ++i) {
+    snprintf(buf, sizeof(buf), "%s\"%s\":%llu", i ? "," : "", SKIP_REASON_NAMES[i], (unsigned long long)m.skipped[i]);
+    out += buf;
+  }
+  out += "},\"threads\":[";
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    const ThreadJob& j = jobs[i];
+    snprintf(buf, sizeof(buf), "%s{\"thread\":\"%s\",\"tid\":%lu,\"job\":\"%s\",\"ms\":%llu,\"path\":", i ? "," : "",
+             j.thread, (unsigned long)j.tid, j.job, (unsigned long long)j.ms);
+    out += buf + JsonString(j.path) + "}";
+  }
+  return out + "]}\n";
+}
+
+// Replaces path whole, so a reader never sees half a file.
+static void WriteMetricsFile(const wstring& path, const std::string& text) {
+  const wstring tmp = path + L".tmp";
+  FileWriter f;
+  if (!f.Open(tmp)) return;
+  f.Put(text.data(), text.size());
+  if (f.Close()) MoveFileExW(ToLongPath(tmp).c_str(), ToLongPath(path).c_str(), MOVEFILE_REPLACE_EXISTING);
+}
+
+// One request per connection: GET /metrics or GET /status.
+static void ServeMetricsRequest(SOCKET s, const MetricsSample& m, const std::vector<ThreadJob>& jobs) {
+  const DWORD timeout = METRICS_RECV_TIMEOUT_MS;
+  setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+  const DWORD sendTimeout = METRICS_SEND_TIMEOUT_MS;
+  setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, (const char*)&sendTimeout, sizeof(sendTimeout));
+  std::string req;
+  char buf[1024];
+  while (req.find("\r\n") == std::string::npos && req.size() < sizeof(buf)) {
+    const int n = recv(s, buf, sizeof(buf), 0);
+    if (n <= 0) break;
+    req.append(buf, n);
+  }
+
+  const char* status = "200 OK";
+  const char* type = "text/plain; version=0.0.4";
+  std::string body;
+  if (req.rfind("GET /metrics ", 0) == 0) {
+    body = MetricsText(m, jobs);
+  } else if (req.rfind("GET /status ", 0) == 0) {
+    type = "application/json";
+    body = StatusJson(m, jobs);
+  } else {
+    status = "404 Not Found";
+    type = "text/plain";
+    body = "try /metrics or /status\n";
+  }
+  snprintf(buf, sizeof(buf), "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+           status, type, body.size());
+  SendAll(s, buf + body);
+}
+
+static void MetricsThreadMain() {
+  NameThread("metrics");
+  SOCKET ls = INVALID_SOCKET;
+  WSADATA wsa{};
+  const bool winsock = MetricsPort() && WSAStartup(MAKEWORD(2, 2), &wsa) == 0;
+  if (winsock) {
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(MetricsPort());
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ls = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (ls != INVALID_SOCKET &&
+        (bind(ls, (const sockaddr*)&addr, sizeof(addr)) != 0 || listen(ls, SOMAXCONN) != 0)) {
+      closesocket(ls);
+      ls = INVALID_SOCKET;
+    }
+  }
+
+  MetricsSample sample;
+  std::vector<ThreadJob> jobs;
+  uint64_t next = 0;
+  while (!g_quit.load()) {
+    if (NowTick() >= next) {
+      sample = SampleMetrics(sample, jobs);
+      next = sample.tick + METRICS_INTERVAL_MS;
+      const wstring& file = MetricsFile();
+      if (!file.empty()) {
+        const bool json = file.size() >= 5 && _wcsicmp(file.c_str() + file.size() - 5, L".json") == 0;
+        WriteMetricsFile(file, json ? StatusJson(sample, jobs) : MetricsText(sample, jobs));
+      }
+    }
+    if (ls == INVALID_SOCKET) {
+      Sleep((DWORD)METRICS_POLL_MS);
+      continue;
+    }
+    fd_set rd;
+    FD_ZERO(&rd);
+    FD_SET(ls, &rd);
+    timeval tv{0, (long)(METRICS_POLL_MS * 1000)};
+    if (select((int)ls + 1, &rd, nullptr, nullptr, &tv) <= 0) continue;
+    const SOCKET s = accept(ls, nullptr, nullptr);
+    if (s == INVALID_SOCKET) continue;
+    // Scrapes see the present counts; rates stay those of the last whole interval.
+    MetricsSample now = SampleMetrics(MetricsSample{}, jobs);
+    now.entriesPerSec = sample.entriesPerSec;
+    now.bytesPerSec = sample.bytesPerSec;
+    ServeMetricsRequest(s, now, jobs);
+    closesocket(s);
+  }
+
+  if (ls != INVALID_SOCKET) closesocket(ls);
+  if (winsock) WSACleanup();
+}
+
+// Starts the helper threads; scan workers follow as jobs are queued.
+static void StartWorkers(std::vector<std::thread>& workers) {
+  workers.reserve(3);
+  workers.emplace_back(TunerThreadMain);
+  workers.emplace_back(ListerThreadMain);
+  if (MetricsPort() || !MetricsFile().empty()) workers.emplace_back(MetricsThreadMain);
+}
+
+static void StopWorkers(std::vector<std::thread>& workers) {
+  g_quit.store(true);
+  g_jobCv.notify_all();
+  g_listCv.notify_all();
+  std::vector<std::thread> pool;
+  {
+    std::lock_guard<std::mutex> lk(g_jobMu);
+    pool.swap(g_poolWorkers);
+  }
+  const std::vector<std::thread::id> stuck = CancelReadsForExit();
+  bool lost = false;
+  {
+    std::lock_guard<std::mutex> lk(g_slotMu);
+    // A written-off worker may never return from its read; don't wait for it.
+    lost = g_lostWorkers > 0;
+  }
+  for (auto* list : { &workers, &pool }) {
+    for (auto& t : *list) {
+      if (!t.joinable()) continue;
+      if (lost || std::find(stuck.begin(), stuck.end(), t.get_id()) != stuck.end()) t.detach();
+      else t.join();
+    }
+    list->clear();
+  }
+}
+
+// Sizes several roots in one session. Each root's subdirectories become Exact jobs
+// on the root's device queue, so volumes proceed in parallel and each device runs
+// at its own concurrency limit.
+static int CliScan(const std::vector<wstring>& roots) {
+  const uint64_t t0 = NowTick();
+
+  struct RootInfo { wstring path; uint64_t fileBytes = 0; std::vector<Entry> children; bool failed = false; };
+  std::vector<RootInfo> infos(roots.size());
+
+  std::vector<std::thread> workers;
+  StartWorkers(workers);
+
+  for (size_t i = 0; i < roots.size(); ++i) {
+    RootInfo& ri = infos[i];
+    ri.path = TrimTrailingSlash(roots[i]);
+    DWORD err = 0;
+    if (!ListChildDirs(ri.path, ri.children, err, &ri.fileBytes)) {
+      ri.failed = true;
+      wchar_t buf[64];
+      swprintf(buf, 64, L"  enumerate failed: %lu\n", err);
+      CliErr(ri.path + buf);
+      continue;
+    }
+    const int device = DeviceForPath(ri.path);
+    for (const Entry& e : ri.children) EnqueueJob(Job{nullptr, e.path, JobKind::Exact, device});
+  }
+
+  while (g_jobs_done.load() < g_jobs_total.load()) Sleep(50);
+  StopWorkers(workers);
+
+  wstring out;
+  for (const RootInfo& ri : infos) {
+    if (ri.failed) continue;
+    uint64_t bytes = ri.fileBytes;
+    uint64_t files = 0;
+    uint64_t dirs = ri.children.size();
+    bool incomplete = false;
+    {
+      std::lock_guard<std::mutex> lk(g_mu);
+      for (const Entry& e : ri.children) {
+        auto it = g_cache.find(e.path);
+        if (it == g_cache.end()) { incomplete = true; continue; }
+        bytes += it->second.bytes;
+        files += it->second.content.files;
+        dirs += it->second.content.dirs;
+        incomplete = incomplete || it->second.incomplete;
+      }
+    }
+    wchar_t buf[128];
+    swprintf(buf, 128, L"%llu\t%llu\t%llu\t", (unsigned long long)bytes, (unsigned long long)files,
+             (unsigned long long)dirs);
+    out += buf;
+    out += ri.path;
+    out += incomplete ? L"\t(incomplete)\n" : L"\n";
+  }
+  CliOut(out);
+
+  wstring devs;
+  {
+    std::lock_guard<std::mutex> lk(g_jobMu);
+    for (const auto& d : g_devices) {
+      wchar_t buf[160];
+      swprintf(buf, 160, L"#   %s (%s) %s limit %d -> %d, %llu entries\n", d->label.c_str(), d->key.c_str(),
+               DeviceKindName(d->kind), d->startLimit, d->limit, (unsigned long long)d->io.entries.load());
+      devs += buf;
+      if (const uint64_t follows = d->io.follows.load()) {
+        swprintf(buf, 160, L"#     %llu links checked in %llu ms\n", (unsigned long long)follows,
+                 (unsigned long long)(d->io.followMicros.load() / 1000));
+        devs += buf;
+      }
+    }
+  }
+  wchar_t sum[128];
+  swprintf(sum, 128, L"# %u jobs on %u devices in %llu ms\n", g_jobs_done.load(), (unsigned)g_devices.size(),
+           (unsigned long long)(NowTick() - t0));
+  if (MemoryBudget() > 0) {
+    wchar_t mem[160];
+    std::lock_guard<std::mutex> lk(g_mu);
+    swprintf(mem, 160, L"# trees: %s in memory, %u spilled, collapse below %s\n", FormatBytes(g_treeBytes).c_str(),
+             (unsigned)g_spilled.size(), FormatBytes(g_collapseBelow.load()).c_str());
+    devs += mem;
+  }
+#ifdef DIRPIE_ALLOC_STATS
+  wchar_t heap[128];
+  swprintf(heap, 128, L"# heap: %llu allocations, %llu bytes\n", (unsigned long long)g_allocCalls.load(),
+           (unsigned long long)g_allocBytes.load());
+  devs += heap;
+#endif
+  CliErr(sum + devs);
+  return 0;
+}
+
+static ScanTree ScanForCli(const wstring& dir, WalkStats& st) {
+  ScanTree tree{};
+  ContentStats cs{};
+  WalkDirLogicalSize(dir, 0, nullptr, st, cs, &tree);
+  AggregateTree(tree);
+  return tree;
+}
+
+static int CliQuery(const wstring& text, const wstring& dir) {
+  Query q{};
+  wstring err;
+  if (!ParseQuery(text, q, err)) {
+    CliErr(L"query error: " + err + L"\n");
+    return 2;
+  }
+
+  const uint64_t t0 = NowTick();
+  auto tree = std::make_shared<ScanTree>();
+  WalkStats st{};
+  *tree = ScanForCli(dir, st);
+  const uint64_t t1 = NowTick();
+
+  ColumnIndex ci{};
+  AppendTreeColumns(ci, tree, 0);
+  const QueryResult r = RunQuery(q, ci);
+  const uint64_t t2 = NowTick();
+
+  wstring out;
+  for (uint32_t row : r.rows) {
+    wchar_t buf[96];
+    swprintf(buf, 96, L"%llu\t%llu\t%llu\t",
+             (unsigned long long)ci.bytes[row], (unsigned long long)ci.files[row], (unsigned long long)ci.dirs[row]);
+    out += buf;
+    out += ColumnRowPath(ci, row);
+    out += L"\n";
+  }
+  CliOut(out);
+
+  wchar_t sum[256];
+  swprintf(sum, 256, L"# %llu matches of %llu dirs (outer total %s, %u excluded)  scan %llu ms  query %llu ms%s\n",
+           (unsigned long long)r.matched, (unsigned long long)r.scanned, FormatBytes(r.outerBytes).c_str(),
+           st.skipped_excluded, (unsigned long long)(t1 - t0), (unsigned long long)(t2 - t1),
+           st.incomplete ? L"  (incomplete)" : L"");
+  CliErr(sum);
+  return 0;
+}
+
+static int CliSnapshot(const wstring& dir, const wstring& out) {
+  WalkStats st{};
+  auto tree = std::make_shared<ScanTree>(ScanForCli(dir, st));
+  Snapshot s = BuildSnapshot(dir, {tree});
+  s.incomplete = st.incomplete;
+
+  if (!WriteSnapshot(s, out)) {
+    CliErr(L"cannot write " + out + L"\n");
+    return 1;
+  }
+  wchar_t buf[128];
+  swprintf(buf, 128, L"# %llu dirs, %s, %u excluded%s\n", (unsigned long long)s.nodes.size(),
+           FormatBytes(s.nodes[0].bytes).c_str(), st.skipped_excluded, st.incomplete ? L" (incomplete)" : L"");
+  CliErr(buf);
+  return 0;
+}
+
+static int CliImport(const wstring& listing, const wstring& out, const wstring& format) {
+  ListingFormat fmt = ListingFormat::Auto;
+  if (format == L"ncdu") fmt = ListingFormat::Ncdu;
+  else if (format == L"find") fmt = ListingFormat::Find;
+  else if (format == L"du") fmt = ListingFormat::Du;
+  else if (format == L"du-b") fmt = ListingFormat::DuBytes;
+  else if (!format.empty()) {
+    CliErr(L"unknown listing format: " + format + L"\n");
+    return 2;
+  }
+
+  const uint64_t t0 = NowTick();
+  auto tree = std::make_shared<ScanTree>();
+  ImportStats st{};
+  wstring err;
+  if (!ImportListing(listing, fmt, *tree, st, err)) {
+    CliErr(L"import: " + err + L"\n");
+    return 1;
+  }
+  const uint64_t parseMs = NowTick() - t0;
+  const Snapshot s = BuildSnapshot(tree->rootPath, {tree});
+  if (!WriteSnapshot(s, out)) {
+    CliErr(L"cannot write " + out + L"\n");
+    return 1;
+  }
+  wchar_t buf[256];
+  swprintf(buf, 256, L"# %s: %llu records, %llu dirs, %llu files, %s, %llu skipped; parsed in %llu ms\n",
+           tree->rootPath.c_str(), (unsigned long long)st.records, (unsigned long long)s.nodes.size(),
+           (unsigned long long)st.files, FormatBytes(s.nodes[0].bytes).c_str(), (unsigned long long)st.skipped,
+           (unsigned long long)parseMs);
+  CliErr(buf);
+  if (st.linked) {
+    swprintf(buf, 256, L"# %llu further hard links to files already counted were not added to the size\n",
+             (unsigned long long)st.linked);
+    CliErr(buf);
+  }
+  if (st.guessed) {
+    swprintf(buf, 256, L"# %llu leaf entries were taken for files; empty folders among them are counted as "
+                       L"files (use find -printf '%%s %%y %%p\\n' to tell them apart)\n",
+             (unsigned long long)st.guessed);
+    CliErr(buf);
+  }
+  return 0;
+}
+
+static int CliDiff(const wstring& oldPath, const wstring& newPath, size_t limit) {
+  Snapshot a{}, b{};
+  wstring err;
+  if (!ReadSnapshot(oldPath, a, err) || !ReadSnapshot(newPath, b, err)) {
+    CliErr(err + L"\n");
+    return 1;
+  }
+
+  const uint64_t t0 = NowTick();
+  const SnapshotDiff d = DiffSnapshots(a, b);
+  const std::vector<uint32_t> ranked = RankDiffRows(d, limit);
+  const uint64_t ms = NowTick() - t0;
+
+  wstring out;
+  for (uint32_t row : ranked) {
+    const DiffRow& r = d.rows[row];
+    const uint64_t ob = (r.oldNode != NO_NODE) ? a.nodes[r.oldNode].bytes : 0;
+    const uint64_t nb = (r.newNode != NO_NODE) ? b.nodes[r.newNode].bytes : 0;
+    wchar_t buf[128];
+    swprintf(buf, 128, L"%lld\t%llu\t%llu\t", (long long)r.delta, (unsigned long long)ob, (unsigned long long)nb);
+    out += buf;
+    out += JoinPath(b.rootPath, DiffRowRelPath(d, row, a, b));
+    out += L"\n";
+  }
+  CliOut(out);
+
+  wchar_t sum[256];
+  swprintf(sum, 256, L"# total %s  |  %llu vs %llu dirs, %llu changed, %llu pruned  |  %llu ms\n",
+           FormatDelta(d.rows[0].delta).c_str(), (unsigned long long)a.nodes.size(), (unsigned long long)b.nodes.size(),
+           (unsigned long long)(d.rows.size() - 1), (unsigned long long)d.pruned, (unsigned long long)ms);
+  CliErr(sum);
+  return 0;
+}
+
+// Queues a walk for the service's clients unless a fresh size is cached or one
+// is already queued. Returns whether any size is cached.
+static bool IndexLookup(const wstring& path, SizeInfo& si) {
+  bool have = false;
+  bool fresh = false;
+  {
+    std::lock_guard<std::mutex> lk(g_mu);
+    auto it = g_cache.find(path);
+    if (it != g_cache.end()) {
+      si = it->second;
+      have = true;
+      fresh = IsFresh(si);
+    }
+  }
+  if (!fresh) {
+    bool queue = false;
+    { std::lock_guard<std::mutex> lk(g_indexMu); queue = g_indexQueued.insert(path).second; }
+    if (queue) EnqueueJob(Job{nullptr, path, EstimateFirst() ? JobKind::Estimate : JobKind::Capped, DeviceForPath(path)});
+  }
+  return have;
+}
+
+// SIZE queues a walk unless the size is fresh; LIST replies "OK <n> <loose file bytes>"
+// and a record per child folder; WATCH pushes UPDATE records for the path and below.
+static std::string IndexReply(IndexClient& c, const std::string& verb, const wstring& arg) {
+  SizeInfo si{};
+  if (verb == "PING") return "OK";
+  if (verb == "SIZE" && !arg.empty()) return "OK " + IndexRecord(arg, IndexLookup(arg, si) ? &si : nullptr);
+  if (verb == "LIST" && !arg.empty()) {
+    std::vector<Entry> found;
+    DWORD err = 0;
+    uint64_t fileBytes = 0;
+    if (!ListChildDirs(arg, found, err, &fileBytes)) return "ERR enumerate failed: " + std::to_string(err);
+    std::string out = "OK " + std::to_string(found.size()) + " " + std::to_string(fileBytes);
+    for (const Entry& e : found) out += "\n" + IndexRecord(e.path, IndexLookup(e.path, si) ? &si : nullptr);
+    return out;
+  }
+  if (verb == "WATCH" && !arg.empty()) {
+    { std::lock_guard<std::mutex> lk(g_indexMu); c.watches.push_back(arg); }
+    if (IndexLookup(arg, si)) IndexSendLine(c, "UPDATE " + IndexRecord(arg, &si));
+    return "OK";
+  }
+  if (verb == "UNWATCH") {
+    std::lock_guard<std::mutex> lk(g_indexMu);
+    auto& w = c.watches;
+    w.erase(std::remove_if(w.begin(), w.end(), [&](const wstring& x) { return arg.empty() || _wcsicmp(x.c_str(), arg.c_str()) == 0; }),
+            w.end());
+    return "OK";
+  }
+  if (verb == "STATS") {
+    size_t cached = 0;
+    size_t clients = 0;
+    { std::lock_guard<std::mutex> lk(g_mu); cached = g_cache.size(); }
+    { std::lock_guard<std::mutex> lk(g_indexMu); clients = g_indexClients.size(); }
+    char buf[160];
+    snprintf(buf, sizeof(buf), "OK %u/%u jobs, %zu sizes cached, %zu clients", g_jobs_done.load(), g_jobs_total.load(),
+             cached, clients);
+    const wstring devs = DeviceSummaryText();
+    return devs.empty() ? std::string(buf) : buf + ("; " + ToUtf8(devs));
+  }
+  if (verb == "SHUTDOWN") {
+    g_indexStop.store(true);
+    return "OK";
+  }
+  return "ERR unknown request";
+}
+
+static void ServeIndexClient(std::shared_ptr<IndexClient> c) {
+  SocketLineReader r;
+  r.sock = c->sock;
+  std::string line;
+  while (r.ReadLine(line)) {
+    const size_t sp = line.find(' ');
+    const std::string verb = line.substr(0, sp);
+    const wstring arg = (sp == std::string::npos) ? wstring() : TrimTrailingSlash(FromUtf8(std::string_view(line).substr(sp + 1)));
+    if (!IndexSendLine(*c, IndexReply(*c, verb, arg))) break;
+  }
+
+  {
+    std::lock_guard<std::mutex> lk(g_indexMu);
+    g_indexClients.erase(std::remove(g_indexClients.begin(), g_indexClients.end(), c), g_indexClients.end());
+  }
+  closesocket(c->sock);
+  g_indexThreads.fetch_sub(1);
+}
+
+static int CliServe(bool idleExit) {
+  WSADATA wsa{};
+  if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+    CliErr(L"serve: winsock unavailable\n");
+    return 1;
+  }
+  const wstring path = IndexSocketPath();
+  const SOCKET running = ConnectIndex(path);
+  if (running != INVALID_SOCKET) {
+    closesocket(running);
+    CliErr(L"serve: already running on " + path + L"\n");
+    WSACleanup();
+    return 1;
+  }
+
+  sockaddr_un addr{};
+  SOCKET ls = UnixAddress(path, addr) ? socket(AF_UNIX, SOCK_STREAM, 0) : INVALID_SOCKET;
+  DeleteFileW(path.c_str());  // a socket file left by a crashed service blocks bind
+  if (ls == INVALID_SOCKET || bind(ls, (const sockaddr*)&addr, sizeof(addr)) != 0 || listen(ls, SOMAXCONN) != 0) {
+    if (ls != INVALID_SOCKET) closesocket(ls);
+    CliErr(L"serve: cannot listen on " + path + L"\n");
+    WSACleanup();
+    return 1;
+  }
+
+  std::vector<std::thread> workers;
+  StartWorkers(workers);
+  g_serving.store(true);
+  CliErr(L"# serving on " + path + L"\n");
+
+  uint64_t idleSince = NowTick();
+  while (!g_indexStop.load()) {
+    fd_set rd;
+    FD_ZERO(&rd);
+    FD_SET(ls, &rd);
+    timeval tv{1, 0};
+    const int ready = select((int)ls + 1, &rd, nullptr, nullptr, &tv);
+    if (ready < 0) break;
+    if (ready > 0) {
+      const SOCKET s = accept(ls, nullptr, nullptr);
+      if (s != INVALID_SOCKET) {
+        const DWORD timeout = INDEX_SEND_TIMEOUT_MS;
+        setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout, sizeof(timeout));
+        auto c = std::make_shared<IndexClient>();
+        c->sock = s;
+        { std::lock_guard<std::mutex> lk(g_indexMu); g_indexClients.push_back(c); }
+        g_indexThreads.fetch_add(1);
+        std::thread(ServeIndexClient, c).detach();
+      }
+    }
+
+    bool idle = g_jobs_done.load() >= g_jobs_total.load();
+    { std::lock_guard<std::mutex> lk(g_indexMu); idle = idle && g_indexClients.empty(); }
+    if (!idle) idleSince = NowTick();
+    else if (idleExit && NowTick() - idleSince > INDEX_IDLE_EXIT_MS) break;
+  }
+
+  closesocket(ls);
+  DeleteFileW(path.c_str());
+  {
+    std::lock_guard<std::mutex> lk(g_indexMu);
+    for (const auto& c : g_indexClients) shutdown(c->sock, SD_BOTH);
+  }
+  while (g_indexThreads.load() > 0) Sleep(10);
+  g_serving.store(false);
+  StopWorkers(workers);
+  WSACleanup();
+  return 0;
+}
+
+// One request to a running service. LIST prints its records; WATCH keeps
+// printing updates until the service goes away.
+static int CliAsk(const std::vector<wstring>& words) {
+  WSADATA wsa{};
+  if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) return 1;
+  const SOCKET s = ConnectIndex(IndexSocketPath());
+  if (s == INVALID_SOCKET) {
+    CliErr(L"ask: no index service running (start one with --serve)\n");
+    WSACleanup();
+    return 1;
+  }
+
+  wstring request;
+  for (const wstring& w : words) request += (request.empty() ? L"" : L" ") + w;
+  const std::string verb = ToUtf8(words[0]);
+  int exitCode = 1;
+  if (SendAll(s, ToUtf8(request) + "\n")) {
+    SocketLineReader r;
+    r.sock = s;
+    std::string line;
+    size_t more = 0;
+    bool replied = false;
+    while ((!replied || more > 0 || verb == "WATCH") && r.ReadLine(line)) {
+      CliOut(FromUtf8(line) + L"\n");
+      if (replied) {
+        if (more > 0) more--;
+        continue;
+      }
+      if (line.compare(0, 7, "UPDATE ") == 0) continue;
+      replied = true;
+      exitCode = (line.compare(0, 2, "OK") == 0) ? 0 : 1;
+      if (verb == "LIST" && exitCode == 0) more = (size_t)strtoull(line.c_str() + 3, nullptr, 10);
+    }
+  }
+  closesocket(s);
+  WSACleanup();
+  return exitCode;
+}
+
+// Returns true when argv selected a console mode; exitCode receives its result.
+static bool RunCommandLine(int argc, LPWSTR* argv, int& exitCode) {
+  if (argc < 2 || wcsncmp(argv[1], L"--", 2) != 0) return false;
+  AttachConsole(ATTACH_PARENT_PROCESS);
+  if (ReplayTrace() && !g_traceError.empty()) CliErr(L"trace replay: " + g_traceError + L"\n");
+
+  const wstring cmd = argv[1];
+  if (cmd == L"--query" && argc == 4) {
+    exitCode = CliQuery(argv[2], TrimTrailingSlash(argv[3]));
+    return true;
+  }
+
+  if (cmd == L"--scan" && argc >= 3) {
+    exitCode = CliScan(std::vector<wstring>(argv + 2, argv + argc));
+    return true;
+  }
+  if (cmd == L"--snapshot" && argc == 4) {
+    exitCode = CliSnapshot(TrimTrailingSlash(argv[2]), argv[3]);
+    return true;
+  }
+  if (cmd == L"--import" && (argc == 4 || argc == 5)) {
+    exitCode = CliImport(argv[2], argv[3], argc == 5 ? argv[4] : L"");
+    return true;
+  }
+  if (cmd == L"--serve" && (argc == 2 || (argc == 3 && wcscmp(argv[2], L"--idle-exit") == 0))) {
+    exitCode = CliServe(argc == 3);
+    return true;
+  }
+  if (cmd == L"--ask" && argc >= 3) {
+    exitCode = CliAsk(std::vector<wstring>(argv + 2, argv + argc));
+    return true;
+  }
+  if (cmd == L"--diff" && (argc == 4 || argc == 5)) {
+    exitCode = CliDiff(argv[2], argv[3], argc == 5 ? (size_t)wcstoull(argv[4], nullptr, 10) : 50);
+    return true;
+  }
+
+  CliUsage();
+  exitCode = (cmd == L"--help") ? 0 : 2;
+  return true;
+}
+
 int APIENTRY wWinMain(
     HINSTANCE hInst,
     HINSTANCE,
-    LPWSTR lpCmdLine,
+    LPWSTR,
     int
 ){
   g_hInst = hInst;
+  NameThread("main");
+  RegisterStallSlot(false);  // folder listings on this thread get the stall guard too
+
+  // Folder arguments: one opens that folder, several open a multi-root session. A
+  // .dps argument opens that snapshot for browsing.
+  std::vector<wstring> startRoots;
+  wstring startSnapshot;
+  {
+    int argc = 0;
+    LPWSTR* argv = CommandLineToArgvW(GetCommandLineW(), &argc);
+    int exitCode = 0;
+    const bool handled = argv && RunCommandLine(argc, argv, exitCode);
+    if (argv && !handled) {
+      for (int i = 1; i < argc; ++i) {
+        const size_t n = wcslen(argv[i]);
+        if (n > 4 && _wcsicmp(argv[i] + n - 4, L".dps") == 0) startSnapshot = argv[i];
+        else if (n > 0) startRoots.push_back(TrimTrailingSlash(argv[i]));
+      }
+    }
+    if (argv) LocalFree(argv);
+    if (handled) {
+      wstring err;
+      const bool traced = FinishTraceRecording(err);
+      if (!FinishTimeline(err) || !traced) {
+        CliErr(err + L"\n");
+        if (exitCode == 0) exitCode = 1;
+      }
+      return exitCode;
+    }
+  }
 
   CoInitializeEx(nullptr, COINIT_APARTMENTTHREADED);
 
+  // Size folders through a running index service when there is one.
+  WSADATA wsa{};
+  const bool winsock = WSAStartup(MAKEWORD(2, 2), &wsa) == 0;
+  if (winsock) AttachIndex();
+
   Gdiplus::GdiplusStartupInput gdiSI;
   Gdiplus::GdiplusStartup(&g_gdiplusToken, &gdiSI, nullptr);
 
-  if (lpCmdLine && lpCmdLine[0]) {
-    std::wstring p = lpCmdLine;
-    while (!p.empty() && (p.front() == L' ' || p.front() == L'\t')) p.erase(p.begin());
-    if (!p.empty() && p.front() == L'"') {
-      size_t q = p.find(L'"', 1);
-      if (q != std::wstring::npos) p = p.substr(1, q - 1);
-    }
-    if (!p.empty()) g_currentDir = p;
-  }
-
-  // Default startup directory: the folder containing this executable.
-  // (Scanning C:\ at startup can be heavy.)
-  if (g_currentDir == L"C:\\") {
-    wchar_t mod[MAX_PATH]{};
-    const DWORD n = GetModuleFileNameW(nullptr, mod, MAX_PATH);
-    if (n > 0 && n < MAX_PATH) {
-      g_currentDir = ParentDir(mod);
-    }
-  }
-
   WNDCLASSEXW wc{};
   wc.cbSize = sizeof(wc);
   wc.hInstance = hInst;
@@ -1053,36 +7555,43 @@ int APIENTRY wWinMain(
   wc.lpszClassName = kAppClass;
   RegisterClassExW(&wc);
 
-  g_hwndMain = CreateWindowExW(0, kAppClass, L"DirPie4",
-                              WS_OVERLAPPEDWINDOW | WS_VISIBLE,
-                              CW_USEDEFAULT, CW_USEDEFAULT, 980, 620,
-                              nullptr, nullptr, hInst, nullptr);
+  OpenViewWindow(startRoots, startSnapshot);
 
   std::vector<std::thread> workers;
-  workers.reserve(WORKER_COUNT);
-  for (int i = 0; i < WORKER_COUNT; ++i) workers.emplace_back(WorkerThreadMain);
+  StartWorkers(workers);
 
-  ACCEL accels[2]{};
+  ACCEL accels[4]{};
   accels[0].fVirt = FCONTROL | FVIRTKEY;
   accels[0].key = 'O';
   accels[0].cmd = IDM_OPEN_FOLDER;
   accels[1].fVirt = FCONTROL | FVIRTKEY;
   accels[1].key = 'N';
   accels[1].cmd = IDM_NEW_WINDOW_BLANK;
-  HACCEL hAccel = CreateAcceleratorTableW(accels, 2);
+  accels[2].fVirt = FALT | FVIRTKEY;
+  accels[2].key = VK_LEFT;
+  accels[2].cmd = IDM_NAV_BACK;
+  accels[3].fVirt = FALT | FVIRTKEY;
+  accels[3].key = VK_RIGHT;
+  accels[3].cmd = IDM_NAV_FORWARD;
+  HACCEL hAccel = CreateAcceleratorTableW(accels, 4);
 
   MSG msg{};
   while (GetMessageW(&msg, nullptr, 0, 0)) {
-    if (!TranslateAcceleratorW(g_hwndMain, hAccel, &msg)) {
+    if (!TranslateAcceleratorW(GetAncestor(msg.hwnd, GA_ROOT), hAccel, &msg)) {
       TranslateMessage(&msg);
       DispatchMessageW(&msg);
     }
   }
   if (hAccel) DestroyAcceleratorTable(hAccel);
 
-  g_quit.store(true);
-  g_jobCv.notify_all();
-  for (auto& t : workers) if (t.joinable()) t.join();
+  StopWorkers(workers);
+  wstring traceErr;
+  const bool traced = FinishTraceRecording(traceErr);
+  if (!FinishTimeline(traceErr) || !traced) {
+    MessageBoxW(nullptr, traceErr.c_str(), L"DirPie4", MB_OK | MB_ICONWARNING);
+  }
+  DetachIndex();
+  if (winsock) WSACleanup();
 
   Gdiplus::GdiplusShutdown(g_gdiplusToken);
   CoUninitialize();
@@ -0,0 +1,1424 @@
+// Unit tests for DirPie4's engine: queries, snapshots, imports, the scheduler, walks
+// of small trees under the temp folder, and the exporters. No window is created. The
+// program is compiled in, so the tests see its static functions directly.
+//
+//   g++ -O2 -std=c++17 -municode tests/DirPie4_tests.cpp -o DirPie4_tests.exe ...
+//
+// See scripts/test.ps1 for the full command line.
+
+#include "../src/DirPie4.cpp"
+
+#include <cstdio>
+
+static int g_failures = 0;
+static int g_checks = 0;
+
+#define CHECK(cond)                                                      \
+  do {                                                                   \
+    ++g_checks;                                                          \
+    if (!(cond)) {                                                       \
+      ++g_failures;                                                      \
+      std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+    }                                                                    \
+  } while (0)
+
+// ---------------------------------------------------------------------------
+// Fixtures
+// ---------------------------------------------------------------------------
+
+struct TestDir {
+  uint32_t parent;
+  const wchar_t* name;
+  uint64_t bytes;  // own files only; subtree totals are filled in by MakeTree
+  uint64_t files;
+};
+
+// Builds a finished walk's tree from directories listed parent-first, the way
+// the walker appends them. Entry 0 is the root and its name is ignored.
+static std::shared_ptr<ScanTree> MakeTree(const wstring& root, const std::vector<TestDir>& dirs) {
+  auto t = std::make_shared<ScanTree>();
+  t->rootPath = root;
+  for (size_t i = 0; i < dirs.size(); ++i) {
+    TreeNode n{};
+    n.parent = i == 0 ? 0 : dirs[i].parent;
+    n.depth = i == 0 ? 0 : (uint16_t)(t->nodes[n.parent].depth + 1);
+    n.nameOff = (uint32_t)t->names.size();
+    n.nameLen = i == 0 ? 0 : (uint32_t)wcslen(dirs[i].name);
+    if (i != 0) t->names.insert(t->names.end(), dirs[i].name, dirs[i].name + n.nameLen);
+    n.bytes = dirs[i].bytes;
+    n.files = dirs[i].files;
+    t->nodes.push_back(n);
+  }
+  for (size_t i = t->nodes.size(); i-- > 1;) {
+    TreeNode& p = t->nodes[t->nodes[i].parent];
+    p.bytes += t->nodes[i].bytes;
+    p.files += t->nodes[i].files;
+    p.dirs += t->nodes[i].dirs + 1;
+  }
+  return t;
+}
+
+static void CacheTree(const std::shared_ptr<ScanTree>& t) {
+  std::lock_guard<std::mutex> lk(g_mu);
+  g_trees[t->rootPath] = t;
+  g_treesVersion++;
+}
+
+static void ClearTrees() {
+  std::lock_guard<std::mutex> lk(g_mu);
+  g_trees.clear();
+  g_treesVersion++;
+  g_columns.reset();
+}
+
+// ---------------------------------------------------------------------------
+// Size histogram
+// ---------------------------------------------------------------------------
+
+static void TestSizeHistogram() {
+  CHECK(SizeBucket(0) == 0);
+  CHECK(SizeBucket(1) == 1);
+  CHECK(SizeBucket(1023) == 10);
+  CHECK(SizeBucket(1024) == 11);
+  CHECK(SizeBucket((1ULL << 40) - 1) == 40);
+  CHECK(SizeBucket(1ULL << 40) == SIZE_BUCKETS - 1);
+  CHECK(SizeBucket(~0ULL) == SIZE_BUCKETS - 1);
+
+  ContentStats cs;
+  for (uint64_t sz : {0ULL, 1000ULL, 1024ULL, 1ULL << 30, (1ULL << 40) - 1, 1ULL << 40, 5ULL << 40}) {
+    AddFileSize(sz, cs);
+  }
+  CHECK(cs.files == 7);
+  CHECK(SizeHistogramText(cs) == L"files 7  dirs 0  |  <1K:2  <1M:1  <1T:2  >=1T:2");
+}
+
+// ---------------------------------------------------------------------------
+// Queries
+// ---------------------------------------------------------------------------
+
+static void TestParseQuery() {
+  Query q;
+  wstring err;
+  CHECK(ParseQuery(L"where size > 1.5k and not (files < 2 or name = tmp*) order by files asc limit 5", q, err));
+  CHECK(err.empty());
+  CHECK(q.root >= 0);
+  CHECK(q.orderBy == QueryField::Files);
+  CHECK(q.ascending);
+  CHECK(q.limit == 5);
+  CHECK(q.exprs[0].field == QueryField::Size && q.exprs[0].op == QueryOp::Gt && q.exprs[0].value == 1536);
+  CHECK(q.exprs[q.root].kind == QueryExpr::Kind::And);
+
+  Query counts;
+  CHECK(ParseQuery(L"files >= 2k", counts, err));
+  CHECK(counts.exprs[0].value == 2000);
+
+  Query all;
+  CHECK(ParseQuery(L"order by size", all, err));
+  CHECK(all.root == -1);
+
+  const wchar_t* bad[] = {L"size >", L"colour = red", L"name > x", L"size > 3 zb", L"(size > 1", L"name = 'open"};
+  for (const wchar_t* text : bad) {
+    Query b;
+    wstring e;
+    CHECK(!ParseQuery(text, b, e));
+    CHECK(!e.empty());
+  }
+}
+
+static void TestRunQuery() {
+  ClearTrees();
+  CacheTree(MakeTree(L"C:\\data", {
+      {0, L"", 10, 1},
+      {0, L"big", 1000, 4},
+      {1, L"bigger", 5000, 2},
+      {0, L"small", 20, 3},
+  }));
+
+  auto ci = GetColumnIndex(L"C:\\data");
+  CHECK(ci->bytes.size() == 4);
+  CHECK(ci->bytes[0] == 6030);
+
+  Query q;
+  wstring err;
+  CHECK(ParseQuery(L"size > 500 order by size asc", q, err));
+  QueryResult r = RunQuery(q, *ci);
+  CHECK(r.matched == 3);
+  CHECK(r.rows.size() == 3);
+  CHECK(ColumnRowPath(*ci, r.rows[0]) == L"C:\\data\\big\\bigger");
+  CHECK(ColumnRowPath(*ci, r.rows[2]) == L"C:\\data");
+  // Matches below a matching ancestor are already inside its total.
+  CHECK(r.outerBytes == 6030);
+  CHECK(r.outerFiles == 10);
+
+  Query named;
+  CHECK(ParseQuery(L"name = SMALL", named, err));
+  r = RunQuery(named, *ci);
+  CHECK(r.matched == 1 && ColumnRowPath(*ci, r.rows[0]) == L"C:\\data\\small");
+  ClearTrees();
+}
+
+// A walk of a parent already holds the directories of walks cached below it.
+static void TestQuerySkipsNestedTrees() {
+  ClearTrees();
+  CacheTree(MakeTree(L"C:\\data", {{0, L"", 0, 0}, {0, L"big", 1000, 4}, {0, L"small", 20, 3}}));
+  CacheTree(MakeTree(L"C:\\data\\big", {{0, L"", 1000, 4}}));
+  CacheTree(MakeTree(L"C:\\DATA\\small", {{0, L"", 20, 3}}));
+  CacheTree(MakeTree(L"C:\\database", {{0, L"", 7, 1}}));
+
+  auto ci = GetColumnIndex(L"C:\\");
+  CHECK(ci->trees.size() == 2);
+  CHECK(ci->bytes.size() == 4);
+
+  Query q;
+  wstring err;
+  CHECK(ParseQuery(L"size > 0", q, err));
+  QueryResult r = RunQuery(q, *ci);
+  CHECK(r.matched == 4);
+  CHECK(r.outerBytes == 1027);
+  CHECK(r.outerFiles == 8);
+
+  // Scoped below the parent, the nested walk is the outermost one again.
+  ci = GetColumnIndex(L"C:\\data\\big");
+  CHECK(ci->trees.size() == 1 && ci->bytes.size() == 1);
+  ClearTrees();
+}
+
+// ---------------------------------------------------------------------------
+// Snapshots
+// ---------------------------------------------------------------------------
+
+static wstring TempFile(const wchar_t* name) {
+  wchar_t dir[MAX_PATH]{};
+  GetTempPathW(MAX_PATH, dir);
+  return wstring(dir) + name;
+}
+
+static bool WriteBytes(const wstring& path, const std::vector<uint8_t>& bytes) {
+  FileWriter w;
+  if (!w.Open(path)) return false;
+  w.Put(bytes.data(), bytes.size());
+  return w.Close();
+}
+
+static std::vector<uint8_t> ReadBytes(const wstring& path) {
+  std::vector<uint8_t> out;
+  FileReader r;
+  if (!r.Open(path)) return out;
+  uint8_t b = 0;
+  while (r.GetByte(b)) out.push_back(b);
+  return out;
+}
+
+static Snapshot SampleSnapshot() {
+  auto t = MakeTree(L"C:\\data", {
+      {0, L"", 10, 1},
+      {0, L"photos", 1000, 4},
+      {1, L"2023", 5000, 2},
+      {1, L"2024", 7000, 3},
+      {0, L"photos-old", 300, 1},
+      {0, L"\x00e9t\x00e9 \x65e5\x672c", 20, 3},  // two- and three-byte code units
+  });
+  t->nodes[2].newestWrite = 133000000000000000ULL;
+  Snapshot s = BuildSnapshot(L"C:\\data", {t});
+  s.takenAt = 133500000000000000ULL;
+  return s;
+}
+
+static bool SameSnapshot(const Snapshot& a, const Snapshot& b) {
+  if (a.rootPath != b.rootPath || a.takenAt != b.takenAt || a.incomplete != b.incomplete) return false;
+  if (a.nodes.size() != b.nodes.size()) return false;
+  for (size_t i = 0; i < a.nodes.size(); ++i) {
+    const SnapNode& x = a.nodes[i];
+    const SnapNode& y = b.nodes[i];
+    if (x.firstChild != y.firstChild || x.childCount != y.childCount || !SameSnapNode(x, y)) return false;
+    if (SnapNodeName(a, (uint32_t)i) != SnapNodeName(b, (uint32_t)i)) return false;
+  }
+  return true;
+}
+
+static void TestSnapshotRoundTrip() {
+  const wstring path = TempFile(L"DirPie4_tests.snap");
+  Snapshot s = SampleSnapshot();
+  s.incomplete = true;
+  CHECK(s.nodes.size() == 6);
+  CHECK(WriteSnapshot(s, path));
+
+  Snapshot back;
+  wstring err;
+  CHECK(ReadSnapshot(path, back, err));
+  CHECK(err.empty());
+  CHECK(SameSnapshot(s, back));
+  DeleteFileW(path.c_str());
+}
+
+static void TestSnapshotRejectsCorruptInput() {
+  const wstring path = TempFile(L"DirPie4_tests.snap");
+  CHECK(WriteSnapshot(SampleSnapshot(), path));
+  const std::vector<uint8_t> good = ReadBytes(path);
+  CHECK(good.size() > 24);
+
+  auto rejects = [&](const std::vector<uint8_t>& bytes) {
+    Snapshot s;
+    wstring err;
+    if (!WriteBytes(path, bytes)) return false;
+    return !ReadSnapshot(path, s, err) && !err.empty();
+  };
+
+  // Every truncation fails cleanly.
+  for (size_t n = 0; n < good.size(); ++n) CHECK(rejects(std::vector<uint8_t>(good.begin(), good.begin() + n)));
+
+  // A node count far beyond what the file could hold is refused before anything is
+  // allocated for it. The header is magic, version, flags and time (24 bytes), then
+  // the root path length and its units.
+  const size_t countAt = 24 + 1 + good[24];
+  std::vector<uint8_t> huge(good.begin(), good.begin() + countAt);
+  for (uint8_t b : {0xFF, 0xFF, 0xFF, 0xFF, 0x0F}) huge.push_back(b);
+  huge.insert(huge.end(), good.begin() + countAt + 1, good.end());
+  CHECK(rejects(huge));
+
+  // Same for a child count in the root record.
+  std::vector<uint8_t> kids(good.begin(), good.begin() + countAt + 1);
+  for (uint8_t b : {0xFF, 0xFF, 0xFF, 0xFF, 0x0F}) kids.push_back(b);
+  kids.insert(kids.end(), good.begin() + countAt + 2, good.end());
+  CHECK(rejects(kids));
+
+  // Version 1 stores the node table raw; its counts are checked the same way.
+  std::vector<uint8_t> raw(good.begin(), good.begin() + 24);
+  raw[8] = (uint8_t)SNAPSHOT_VERSION_RAW;
+  const uint32_t rootLen = 0x40000000;
+  const uint64_t nodeCount = 0xFFFFFFFF, nameCount = 2;
+  raw.insert(raw.end(), (const uint8_t*)&rootLen, (const uint8_t*)&rootLen + sizeof(rootLen));
+  CHECK(rejects(raw));
+  raw.resize(24);
+  const uint32_t shortRoot = 1;
+  raw.insert(raw.end(), (const uint8_t*)&shortRoot, (const uint8_t*)&shortRoot + sizeof(shortRoot));
+  raw.push_back('C');
+  raw.push_back(0);
+  raw.insert(raw.end(), (const uint8_t*)&nodeCount, (const uint8_t*)&nodeCount + sizeof(nodeCount));
+  raw.insert(raw.end(), (const uint8_t*)&nameCount, (const uint8_t*)&nameCount + sizeof(nameCount));
+  CHECK(rejects(raw));
+
+  std::vector<uint8_t> magic = good;
+  magic[0] = 'X';
+  CHECK(rejects(magic));
+  DeleteFileW(path.c_str());
+}
+
+static void TestDiffSnapshots() {
+  const Snapshot a = BuildSnapshot(L"C:\\data", {MakeTree(L"C:\\data", {
+      {0, L"", 10, 1},
+      {0, L"photos", 1000, 4},
+      {1, L"2023", 5000, 2},
+      {1, L"2024", 7000, 3},
+      {0, L"old", 300, 1},
+      {0, L"same", 20, 3},
+  })});
+  const Snapshot b = BuildSnapshot(L"C:\\data", {MakeTree(L"C:\\data", {
+      {0, L"", 10, 1},
+      {0, L"photos", 1000, 4},
+      {1, L"2023", 5000, 2},
+      {1, L"2024", 9000, 3},
+      {1, L"2025", 400, 1},
+      {0, L"same", 20, 3},
+      {0, L"new", 50, 1},
+  })});
+
+  const SnapshotDiff d = DiffSnapshots(a, b);
+  CHECK(d.rows[0].delta == 2150);
+  CHECK(d.rows.size() == 6);  // root, photos, old, new, photos\2024, photos\2025
+  CHECK(d.compared == 4);     // photos, same, 2023, 2024
+  CHECK(d.pruned == 2);       // same, 2023
+  CHECK(d.rows[0].maxChildDelta == 2400);
+
+  std::vector<wstring> paths;
+  for (uint32_t row : RankDiffRows(d, 10)) paths.push_back(DiffRowRelPath(d, row, a, b));
+  // The root's change is nearly all photos', so the root itself is not listed.
+  const std::vector<wstring> want = {L"photos", L"photos\\2024", L"photos\\2025", L"old", L"new"};
+  CHECK(paths == want);
+  CHECK(RankDiffRows(d, 2).size() == 2);
+
+  for (size_t i = 1; i < d.rows.size(); ++i) {
+    const DiffRow& r = d.rows[i];
+    const wstring p = DiffRowRelPath(d, (uint32_t)i, a, b);
+    if (p == L"old") CHECK(r.newNode == NO_NODE && r.delta == -300);
+    if (p == L"new") CHECK(r.oldNode == NO_NODE && r.delta == 50);
+  }
+
+  const SnapshotDiff same = DiffSnapshots(a, a);
+  CHECK(same.rows.size() == 1 && same.rows[0].delta == 0);
+  CHECK(RankDiffRows(same, 10).empty());
+}
+
+// ---------------------------------------------------------------------------
+// Exclusion rules
+// ---------------------------------------------------------------------------
+
+// Whether a walk started at path's drive would skip path: each directory on the
+// way is matched against its parent's states, and an excluded one is not entered.
+static bool WalkExcluded(const ExcludeRules& x, const wstring& path) {
+  size_t cut = path.find(L'\\');
+  std::vector<uint32_t> states;
+  if (MatchExcludedRoot(x, path.substr(0, cut), states)) return true;
+  size_t off = 0, len = states.size();
+  while (cut != wstring::npos) {
+    const size_t i = cut + 1;
+    cut = path.find(L'\\', i);
+    const size_t j = cut == wstring::npos ? path.size() : cut;
+    const size_t next = states.size();
+    if (MatchExcluded(x, states, off, len, path.c_str() + i, j - i)) return true;
+    off = next;
+    len = states.size() - next;
+  }
+  return false;
+}
+
+static void TestExcludeRules() {
+  const ExcludeRules x = CompileExcludes(
+      L"node_modules;.git/objects;*.snapshot\n"
+      L"# a comment\r\n"
+      L"\n"
+      L"  C:\\Windows/WinSxS  \n"
+      L"C:/Users/*/AppData/**/Cache;!keep.snapshot;!");
+  CHECK(x.rules.size() == 6);
+  CHECK(x.anchored.size() == 2 && x.globs.size() == 1 && x.multi.size() == 1);
+
+  struct Case { const wchar_t* path; bool excluded; };
+  const Case cases[] = {
+      {L"C:\\proj\\node_modules", true},
+      {L"C:\\proj\\NODE_MODULES\\lib", true},
+      {L"C:\\proj\\node_modules2", false},
+      {L"C:\\repo\\.git\\objects", true},
+      {L"C:\\repo\\.git", false},
+      {L"C:\\repo\\objects", false},
+      {L"D:\\vol\\daily.snapshot", true},
+      {L"D:\\vol\\keep.snapshot", false},
+      {L"C:\\Windows\\WinSxS", true},
+      {L"C:\\Windows\\System32", false},
+      {L"D:\\Windows\\WinSxS", false},
+      {L"C:\\x\\Windows\\WinSxS", false},
+      {L"C:\\Users\\sam\\AppData\\Cache", true},
+      {L"C:\\Users\\sam\\AppData\\Local\\Google\\Chrome\\Cache", true},
+      {L"C:\\Users\\sam\\Documents\\Cache", false},
+      {L"C:\\Users\\AppData\\Cache", false},
+  };
+  for (const Case& c : cases) {
+    const bool got = WalkExcluded(x, c.path);
+    CHECK(got == c.excluded);
+    if (got != c.excluded) std::fprintf(stderr, "  path: %ls\n", c.path);
+  }
+
+  // A walk rooted inside an excluded folder is allowed; only the root itself counts.
+  std::vector<uint32_t> states;
+  CHECK(MatchExcludedRoot(x, L"C:\\proj\\node_modules", states));
+  CHECK(!MatchExcludedRoot(x, L"C:\\proj\\node_modules\\lib", states));
+  CHECK(MatchExcludedRoot(x, L"\\\\?\\C:\\Windows\\WinSxS", states));
+
+  // Enough literals to outgrow the initial hash table.
+  wstring spec;
+  for (int i = 0; i < 100; ++i) spec += L"dir" + std::to_wstring(i) + L";";
+  const ExcludeRules many = CompileExcludes(spec);
+  CHECK(many.literalSlots.size() >= 200);
+  bool all = true;
+  for (int i = 0; i < 100; ++i) all = all && WalkExcluded(many, L"C:\\a\\DIR" + std::to_wstring(i));
+  CHECK(all);
+  CHECK(!WalkExcluded(many, L"C:\\a\\dir100"));
+
+  const ExcludeRules none = CompileExcludes(L"");
+  CHECK(none.Empty());
+  CHECK(!WalkExcluded(none, L"C:\\a\\b"));
+}
+
+// ---------------------------------------------------------------------------
+// Listing imports
+// ---------------------------------------------------------------------------
+
+// Runs the import on text in memory, as ImportListing does on a mapped file.
+static bool ImportText(const std::string& text, ListingFormat fmt, ScanTree& tree, ImportStats& st, wstring& err) {
+  MappedFile mf;
+  mf.data = text.data();
+  mf.size = text.size();
+  if (fmt == ListingFormat::Auto) fmt = DetectListingFormat(mf);
+  const bool ok = (fmt == ListingFormat::Ncdu) ? ImportNcdu(mf, tree, st, err) : ImportLines(mf, fmt, tree, st, err);
+  if (ok) AggregateTree(tree);
+  mf.data = nullptr;  // not a mapping
+  return ok;
+}
+
+static uint32_t ChildNamed(const ScanTree& t, uint32_t parent, const wstring& name) {
+  for (uint32_t i = 1; i < (uint32_t)t.nodes.size(); ++i) {
+    if (t.nodes[i].parent == parent && TreeNodeName(t, i) == name) return i;
+  }
+  return NO_NODE;
+}
+
+static void TestFindEither() {
+  char buf[80];
+  for (size_t len = 0; len <= 48; ++len) {
+    for (size_t at = 0; at <= len; ++at) {
+      memset(buf, 'x', sizeof(buf));
+      if (at < len) buf[at] = (at & 1) ? '"' : '\\';
+      buf[len] = '"';  // past the end; must not be found
+      CHECK(FindEither(buf, buf + len, '"', '\\') == buf + at);
+    }
+  }
+}
+
+static void TestImportFind() {
+  const std::string typed =
+      "4096 d /data\n"
+      "4096 d /data/empty\n"
+      "100 f /data/a.txt\r\n"
+      "4096 d /data/sub\n"
+      "50 f /data/sub/b\n"
+      "7 l /data/sub/link\n"
+      "garbage\n";
+  ScanTree t;
+  ImportStats st{};
+  wstring err;
+  CHECK(ImportText(typed, ListingFormat::Auto, t, st, err));
+  CHECK(t.rootPath == L"/data");
+  CHECK(st.records == 6 && st.skipped == 1);
+  CHECK(st.files == 3 && st.guessed == 0);
+  CHECK(t.nodes[0].bytes == 157 && t.nodes[0].files == 3 && t.nodes[0].dirs == 2);
+  const uint32_t empty = ChildNamed(t, 0, L"empty");
+  CHECK(empty != NO_NODE && t.nodes[empty].bytes == 0 && t.nodes[empty].files == 0);
+
+  // Without %y an empty directory is indistinguishable from a file.
+  const std::string plain =
+      "4096 /data\n"
+      "4096 /data/empty\n"
+      "100 /data/a.txt\n"
+      "4096 /data/sub\n"
+      "50 /data/sub/b\n";
+  ScanTree u;
+  ImportStats su{};
+  CHECK(ImportText(plain, ListingFormat::Auto, u, su, err));
+  CHECK(u.rootPath == L"/data");
+  CHECK(su.files == 3 && su.guessed == 3);
+  CHECK(u.nodes[0].bytes == 4246);
+  CHECK(ChildNamed(u, 0, L"empty") == NO_NODE);
+  CHECK(ChildNamed(u, 0, L"sub") != NO_NODE);
+}
+
+static void TestImportDu() {
+  ScanTree t;
+  ImportStats st{};
+  wstring err;
+  CHECK(ImportText("8\t./a/b\n12\t./a\n20\t.\n", ListingFormat::Auto, t, st, err));
+  CHECK(t.nodes[0].bytes == 20 * 1024);
+  const uint32_t a = ChildNamed(t, 0, L"a");
+  CHECK(a != NO_NODE && t.nodes[a].bytes == 12 * 1024);
+
+  ScanTree none;
+  ImportStats sn{};
+  CHECK(!ImportText("\n\n", ListingFormat::Du, none, sn, err));
+}
+
+static void TestImportNcdu() {
+  // A file with three links (two on one device, one under a mount), an excluded
+  // entry, and names long enough that escapes straddle 16-byte blocks.
+  const std::string json =
+      "[1,2,{\"progname\":\"ncdu\",\"timestamp\":1700000000},\n"
+      "[{\"name\":\"/data\",\"dev\":1,\"asize\":4096},\n"
+      " {\"name\":\"a\",\"asize\":100,\"ino\":5,\"hlnkc\":true,\"nlink\":3},\n"
+      " [{\"name\":\"sub\",\"asize\":4096,\"ino\":9},\n"
+      "  {\"name\":\"b\",\"asize\":100,\"ino\":5,\"hlnkc\":true},\n"
+      "  {\"name\":\"c\",\"asize\":30,\"ino\":5,\"mtime\":1700000000}],\n"
+      " [{\"name\":\"mnt\",\"dev\":2},\n"
+      "  {\"name\":\"x\",\"asize\":9,\"ino\":5,\"hlnkc\":true}],\n"
+      " {\"name\":\"skip\",\"asize\":1000,\"excluded\":\"pattern\"},\n"
+      " {\"name\":\"a-rather-long-\\\"quoted\\\"-name\\\\with\\u00e9escapes\",\"asize\":1}\n"
+      "]]\n";
+  ScanTree t;
+  ImportStats st{};
+  wstring err;
+  CHECK(ImportText(json, ListingFormat::Auto, t, st, err));
+  CHECK(err.empty());
+  CHECK(t.rootPath == L"/data");
+  CHECK(st.linked == 1 && st.skipped == 1);
+  CHECK(t.nodes[0].files == 5);
+  CHECK(t.nodes[0].bytes == 140);
+  const uint32_t sub = ChildNamed(t, 0, L"sub");
+  CHECK(sub != NO_NODE && t.nodes[sub].bytes == 30 && t.nodes[sub].files == 2);
+  CHECK(t.nodes[sub].newestWrite == UnixToFileTime(1700000000));
+  const uint32_t mnt = ChildNamed(t, 0, L"mnt");
+  CHECK(mnt != NO_NODE && t.nodes[mnt].bytes == 9);
+
+  ScanTree bad;
+  ImportStats sb{};
+  CHECK(!ImportText("[1,2,{},[{\"name\":\"/x\"},{\"name\":\"unterminated", ListingFormat::Ncdu, bad, sb, err));
+}
+
+// ---------------------------------------------------------------------------
+// Device tuning
+// ---------------------------------------------------------------------------
+
+// One tuner sample of a saturated device: a second of reads at the given rate and
+// mean read latency.
+static int TuneSample(Device& d, uint64_t entriesPerSec, uint64_t latencyMicros = 100) {
+  d.active = d.limit;
+  d.io.entries += entriesPerSec;
+  d.io.dirReads += 10;
+  d.io.readMicros += 10 * latencyMicros;
+  TuneDevice(d, 1000);
+  return d.limit;
+}
+
+static void TestTuneDevice() {
+  Device d;
+  d.limit = 4;
+  d.jobs.emplace_back();
+
+  // Probe up while throughput keeps improving.
+  CHECK(TuneSample(d, 1000) == 5);
+  CHECK(TuneSample(d, 1200) == 6);
+  // A step that bought nothing is taken back.
+  CHECK(TuneSample(d, 1210) == 5);
+  CHECK(d.step == -1);
+  // Flat at the new limit: hold, then probe again after TUNE_PROBE_EVERY samples.
+  for (int i = 1; i < TUNE_PROBE_EVERY; ++i) CHECK(TuneSample(d, 1200) == 5);
+  CHECK(TuneSample(d, 1200) == 6);
+  CHECK(TuneSample(d, 1200) == 5);
+  // Latency well above the best seen backs off by one even at a flat rate.
+  CHECK(TuneSample(d, 1200, 200) == 4);
+
+  // A collapse while probing up cuts the limit by a quarter.
+  Device big;
+  big.limit = 16;
+  big.jobs.emplace_back();
+  CHECK(TuneSample(big, 1000) == 17);
+  CHECK(TuneSample(big, 400) == 13);
+  CHECK(big.step == -1);
+
+  // Nothing is learned from a device that is not saturated.
+  big.active = 0;
+  big.io.entries += 5000;
+  TuneDevice(big, 1000);
+  CHECK(big.limit == 13 && big.lastRate == 0 && big.lastMove == 0);
+
+  // Limits stay within [1, WORKER_COUNT].
+  Device one;
+  one.limit = 1;
+  one.lastRate = 1000;
+  one.jobs.emplace_back();
+  CHECK(TuneSample(one, 100) == 1);
+  Device top;
+  top.limit = WORKER_COUNT;
+  top.jobs.emplace_back();
+  CHECK(TuneSample(top, 1000) == WORKER_COUNT);
+}
+
+// ---------------------------------------------------------------------------
+// Walks
+// ---------------------------------------------------------------------------
+
+struct DiskEntry {
+  const wchar_t* path;  // relative, '\\'-separated; parents first
+  int64_t bytes;        // -1: a directory
+};
+
+static void MakeDiskTree(const wstring& base, const std::vector<DiskEntry>& entries) {
+  CreateDirectoryW(base.c_str(), nullptr);
+  for (const DiskEntry& e : entries) {
+    const wstring path = base + L"\\" + e.path;
+    if (e.bytes < 0) CreateDirectoryW(path.c_str(), nullptr);
+    else CHECK(WriteBytes(path, std::vector<uint8_t>((size_t)e.bytes, 'x')));
+  }
+}
+
+static void RemoveDiskTree(const wstring& base, const std::vector<DiskEntry>& entries) {
+  for (size_t i = entries.size(); i-- > 0;) {
+    const wstring path = base + L"\\" + entries[i].path;
+    if (entries[i].bytes < 0) RemoveDirectoryW(path.c_str());
+    else DeleteFileW(path.c_str());
+  }
+  RemoveDirectoryW(base.c_str());
+}
+
+static uint32_t NodeAt(const ScanTree& t, const wstring& rel) {
+  uint32_t node = 0;
+  size_t i = 0;
+  while (node != NO_NODE && i < rel.size()) {
+    const size_t j = std::min(rel.find(L'\\', i), rel.size());
+    node = ChildNamed(t, node, rel.substr(i, j - i));
+    i = j + 1;
+  }
+  return node;
+}
+
+static const std::vector<DiskEntry> WALK_TREE = {
+    {L"a.txt", 100},
+    {L"sub1", -1},
+    {L"sub1\\b", 200},
+    {L"sub1\\c", 300},
+    {L"sub1\\deep", -1},
+    {L"sub1\\deep\\d", 50},
+    {L"sub2", -1},
+};
+
+// Whichever backend DIRPIE_WALK selects builds the same tree.
+static void TestWalkTree() {
+  const wstring base = TempFile(L"DirPie4_tests_walk");
+  MakeDiskTree(base, WALK_TREE);
+
+  WalkStats st{};
+  ContentStats cs{};
+  ScanTree t;
+  CHECK(WalkDirLogicalSize(base, 0, nullptr, st, cs, &t) == 650);
+  AggregateTree(t);
+  CHECK(!st.reached_cap && !st.incomplete);
+  CHECK(cs.files == 4 && cs.dirs == 3);
+  CHECK(t.nodes.size() == 4);
+  CHECK(t.nodes[0].bytes == 650 && t.nodes[0].files == 4 && t.nodes[0].dirs == 3);
+  const uint32_t sub1 = NodeAt(t, L"sub1");
+  const uint32_t deep = NodeAt(t, L"sub1\\deep");
+  const uint32_t sub2 = NodeAt(t, L"sub2");
+  CHECK(sub1 != NO_NODE && t.nodes[sub1].bytes == 550 && t.nodes[sub1].files == 3 && t.nodes[sub1].dirs == 1);
+  CHECK(deep != NO_NODE && t.nodes[deep].bytes == 50 && t.nodes[deep].depth == 2);
+  CHECK(sub2 != NO_NODE && t.nodes[sub2].bytes == 0 && t.nodes[sub2].files == 0);
+  if (deep != NO_NODE) CHECK(TreeNodePath(t, deep) == base + L"\\sub1\\deep");
+
+  // A capped walk stops once it has counted the cap.
+  WalkStats capped{};
+  ContentStats ccs{};
+  CHECK(WalkDirLogicalSize(base, 300, nullptr, capped, ccs, nullptr) >= 300);
+  CHECK(capped.reached_cap);
+
+  WalkStats missing{};
+  ContentStats mcs{};
+  CHECK(WalkDirLogicalSize(base + L"\\none", 0, nullptr, missing, mcs, nullptr) == 0);
+  CHECK(missing.skipped_access + missing.skipped_path + missing.skipped_other == 1);
+
+  RemoveDiskTree(base, WALK_TREE);
+}
+
+// A worker's scratch carries over from walk to walk: a second walk with it builds the
+// same tree, and once warmed up the handle-relative walker allocates nothing per folder.
+static void TestWalkScratchReuse() {
+  const wstring base = TempFile(L"DirPie4_tests_scratch");
+  std::vector<wstring> names;
+  std::vector<DiskEntry> entries;
+  for (int i = 0; i < 40; ++i) names.push_back(L"d" + std::to_wstring(i));
+  for (int i = 0; i < 40; ++i) names.push_back(names[i] + L"\\f");
+  for (size_t i = 0; i < names.size(); ++i) entries.push_back({names[i].c_str(), i < 40 ? -1 : 10});
+  MakeDiskTree(base, entries);
+
+  WalkScratch scratch;
+  auto walk = [&](uint64_t& allocs) {
+    WalkStats st{};
+    ContentStats cs{};
+    scratch.tree.nodes.clear();
+    scratch.tree.names.clear();
+#ifdef DIRPIE_ALLOC_STATS
+    const uint64_t before = g_allocCalls.load();
+#endif
+    const uint64_t bytes = WalkDirLogicalSize(base, 0, nullptr, st, cs, &scratch.tree, nullptr, &scratch);
+#ifdef DIRPIE_ALLOC_STATS
+    allocs = g_allocCalls.load() - before;
+#else
+    allocs = 0;
+#endif
+    return bytes;
+  };
+  uint64_t first = 0, second = 0;
+  CHECK(walk(first) == 400);
+  const size_t nodes = scratch.tree.nodes.size();
+  const std::vector<wchar_t> pool = scratch.tree.names;
+  CHECK(nodes == 41);
+  CHECK(walk(second) == 400);
+  CHECK(scratch.tree.nodes.size() == nodes && scratch.tree.names == pool);
+#ifdef DIRPIE_ALLOC_STATS
+  if (ConfiguredWalkBackend() == WalkBackend::HandleRelative) CHECK(second < 40 && second < first);
+#endif
+
+  CHECK(scratch.Bytes() > 0);
+  scratch.Release();
+  CHECK(scratch.Bytes() == 0);
+  RemoveDiskTree(base, entries);
+}
+
+// ---------------------------------------------------------------------------
+// Sampling estimator
+// ---------------------------------------------------------------------------
+
+static void TestFrontierEstimate() {
+  double margin = -1;
+  CHECK(FrontierEstimate({10, 10, 10}, 4, margin) == 40 && margin == 0);
+  // Guesses 0 and 20: mean 10, sample variance 200, standard error 10.
+  CHECK(FrontierEstimate({0, 20}, 3, margin) == 30);
+  CHECK(std::fabs(margin - ESTIMATE_Z95 * 3 * 10) < 1e-9);
+}
+
+// A tree that fits in the breadth-first half of the budget comes out exact.
+static void TestEstimateSmallTree() {
+  const wstring base = TempFile(L"DirPie4_tests_estimate");
+  MakeDiskTree(base, WALK_TREE);
+  SizeInfo si{};
+  CHECK(EstimateDirSize(base, nullptr, si));
+  CHECK(si.estimate && si.margin == 0);
+  CHECK(si.bytes == 650 && si.content.files == 4 && si.content.dirs == 3);
+  RemoveDiskTree(base, WALK_TREE);
+}
+
+// ---------------------------------------------------------------------------
+// Filesystem traces
+// ---------------------------------------------------------------------------
+
+static void AddTraceDir(FsTrace& t, const wstring& key,
+                        const std::vector<std::pair<const wchar_t*, TraceEntry>>& entries) {
+  TraceDir d;
+  d.first = (uint32_t)t.entries.size();
+  d.count = (uint32_t)entries.size();
+  d.micros = 1234;
+  for (auto e : entries) {
+    e.second.nameOff = (uint32_t)t.names.size();
+    e.second.nameLen = (uint32_t)wcslen(e.first);
+    t.names.insert(t.names.end(), e.first, e.first + e.second.nameLen);
+    t.entries.push_back(e.second);
+  }
+  t.dirs.emplace(key, d);
+}
+
+static void TestTraceRoundTrip() {
+  FsTrace t;
+  // Write times go backwards and access times precede them, so both deltas go negative.
+  AddTraceDir(t, L"c:\\data", {{L"sub", {0, 0, FILE_ATTRIBUTE_DIRECTORY, 0, 500, 400}},
+                               {L"a.txt", {0, 0, FILE_ATTRIBUTE_SPARSE_FILE, 1ull << 40, 300, 900}}});
+  AddTraceDir(t, L"c:\\data\\sub", {});
+  t.dirs[L"c:\\data\\sub"].error = ERROR_ACCESS_DENIED;
+  t.dirs.emplace(L"c:\\gone", TraceDir{});
+  t.dirs[L"c:\\gone"].openFailed = true;
+
+  const wstring path = TempFile(L"DirPie4_tests.trace");
+  CHECK(WriteTrace(t, path));
+  FsTrace back;
+  wstring err;
+  CHECK(ReadTrace(path, back, err));
+  CHECK(back.dirs.size() == 3);
+  const TraceDir& d = back.dirs[L"c:\\data"];
+  CHECK(d.count == 2 && d.micros == 1234 && !d.openFailed && d.error == 0);
+  for (uint32_t i = 0; i < d.count && d.count == 2; ++i) {
+    const TraceEntry& got = back.entries[d.first + i];
+    const TraceEntry& want = t.entries[t.dirs[L"c:\\data"].first + i];
+    const wstring name(back.names.data() + got.nameOff, got.nameLen);
+    CHECK(name == wstring(t.names.data() + want.nameOff, want.nameLen));
+    CHECK(got.attributes == want.attributes && got.size == want.size);
+    CHECK(got.writeTime == want.writeTime && got.accessTime == want.accessTime);
+  }
+  CHECK(back.dirs[L"c:\\data\\sub"].count == 0 && back.dirs[L"c:\\data\\sub"].error == ERROR_ACCESS_DENIED);
+  CHECK(back.dirs[L"c:\\gone"].openFailed);
+
+  // Truncated or foreign files are rejected with a reason.
+  std::vector<uint8_t> bytes = ReadBytes(path);
+  CHECK(bytes.size() > 20);
+  bytes.resize(bytes.size() - 3);
+  CHECK(WriteBytes(path, bytes));
+  FsTrace cut;
+  err.clear();
+  CHECK(!ReadTrace(path, cut, err) && !err.empty());
+  bytes[0] = 'X';
+  CHECK(WriteBytes(path, bytes));
+  CHECK(!ReadTrace(path, cut, err) && err.find(L"not a DirPie trace") != wstring::npos);
+  DeleteFileW(path.c_str());
+}
+
+// ---------------------------------------------------------------------------
+// Stall guard
+// ---------------------------------------------------------------------------
+
+static StallSlot* AddStallSlot(bool worker, uint64_t since, std::thread::id id = std::thread::id()) {
+  std::unique_ptr<StallSlot> slot(new StallSlot());
+  slot->worker = worker;
+  slot->id = id;
+  slot->since.store(since);
+  std::lock_guard<std::mutex> lk(g_slotMu);
+  g_slots.push_back(std::move(slot));
+  return g_slots.back().get();
+}
+
+static void RemoveStallSlots(size_t keep) {
+  std::lock_guard<std::mutex> lk(g_slotMu);
+  g_slots.resize(keep);
+}
+
+// A read past DIR_STALL_MS is cancelled; a worker still stuck at twice that is written
+// off, giving back its device slot and its place in the pool.
+static void TestCheckStalls() {
+  g_quit.store(true);  // no replacement workers
+  size_t keep = 0;
+  { std::lock_guard<std::mutex> lk(g_slotMu); keep = g_slots.size(); }
+  const uint64_t now = NowTick();
+  StallSlot* fresh = AddStallSlot(true, now);
+  StallSlot* lister = AddStallSlot(false, now - 3 * DIR_STALL_MS);
+  StallSlot* worker = AddStallSlot(true, now - 3 * DIR_STALL_MS);
+  worker->job.store((int)SlotJob::Running);
+  const int device = DeviceForPath(L"C:\\stalled");
+  {
+    std::lock_guard<std::mutex> lk(g_jobMu);
+    g_devices[device]->active++;
+    g_poolSize++;
+    g_busyWorkers++;
+  }
+
+  CheckStalls();
+  CHECK(!fresh->cancelled.load() && lister->cancelled.load() && worker->cancelled.load());
+  CHECK(worker->job.load() == (int)SlotJob::Running);
+  CheckStalls();
+  CHECK(lister->job.load() == (int)SlotJob::Idle);
+  CHECK(worker->job.load() == (int)SlotJob::Lost && worker->replaced);
+  {
+    std::lock_guard<std::mutex> lk(g_jobMu);
+    CHECK(g_devices[device]->active == 0 && g_poolSize == 0 && g_busyWorkers == 0);
+  }
+  {
+    std::lock_guard<std::mutex> lk(g_slotMu);
+    CHECK(g_lostWorkers == 1);
+    g_lostWorkers = 0;
+  }
+  RemoveStallSlots(keep);
+  g_quit.store(false);
+}
+
+// At exit every read in flight is cut short, and only threads already past the guard
+// are left unjoined.
+static void TestCancelReadsForExit() {
+  std::thread a([] {}), b([] {});
+  const std::thread::id hungId = a.get_id(), busyId = b.get_id();
+  a.join();
+  b.join();
+  size_t keep = 0;
+  { std::lock_guard<std::mutex> lk(g_slotMu); keep = g_slots.size(); }
+  const uint64_t now = NowTick();
+  StallSlot* idle = AddStallSlot(false, 0);
+  StallSlot* busy = AddStallSlot(true, now, busyId);
+  StallSlot* hung = AddStallSlot(false, now - DIR_STALL_MS, hungId);
+
+  const std::vector<std::thread::id> stuck = CancelReadsForExit();
+  CHECK(stuck.size() == 1 && stuck[0] == hungId);
+  CHECK(!idle->cancelled.load() && busy->cancelled.load() && hung->cancelled.load());
+  RemoveStallSlots(keep);
+}
+
+// ---------------------------------------------------------------------------
+// Refresh coalescing
+// ---------------------------------------------------------------------------
+
+static void TestComputeSlices() {
+  const std::vector<SliceGeom> s = ComputeSlices(90, {300, 100, 0}, 400);
+  CHECK(s.size() == 3);
+  CHECK(s[0].startDeg == 90 && s[0].sweepDeg == 270);
+  CHECK(s[1].startDeg == 360 && s[1].sweepDeg == 90);
+  CHECK(s[2].sweepDeg == 0);
+  for (const SliceGeom& g : ComputeSlices(0, {0, 0}, 0)) CHECK(g.sweepDeg == 0);
+}
+
+// Cache writes post one refresh per window until it is handled, and a window rebuilds
+// at most once per frame: a refresh inside the frame waits for the frame timer.
+static void TestRefreshCoalescing() {
+  View* v = nullptr;
+  {
+    std::lock_guard<std::mutex> lk(g_mu);
+    g_views.emplace_back(new View());
+    v = g_views.back().get();
+    v->hwndMain = (HWND)1;  // no real window; posts go nowhere
+  }
+  const uint64_t version = g_cacheVersion.load();
+  NotifyRefresh();
+  NotifyRefresh();
+  CHECK(g_cacheVersion.load() == version + 2 && v->refreshPosted.load());
+
+  v->shownVersion = g_cacheVersion.load();
+  RefreshWhenDue(*v);
+  CHECK(!v->refreshPosted.load() && !v->refreshTimer);
+
+  NotifyRefresh();
+  v->lastRefresh = NowTick();
+  RefreshWhenDue(*v);
+  CHECK(v->refreshTimer && v->shownVersion != g_cacheVersion.load());
+  RefreshWhenDue(*v);  // the timer is already set
+  CHECK(v->refreshTimer && !v->refreshPosted.load());
+
+  std::lock_guard<std::mutex> lk(g_mu);
+  g_views.pop_back();
+}
+
+// ---------------------------------------------------------------------------
+// Folder listings
+// ---------------------------------------------------------------------------
+
+static Entry Listed(const wchar_t* name, uint64_t bytes = 0) {
+  Entry e{};
+  e.name = name;
+  e.path = wstring(L"C:\\data\\") + name;
+  e.bytes = bytes;
+  e.has_value = bytes != 0;
+  return e;
+}
+
+static std::vector<wstring> EntryNames(const View& v) {
+  std::vector<wstring> names;
+  for (const Entry& e : v.entries) names.push_back(e.name);
+  return names;
+}
+
+// A restored view keeps surviving children in place, with their sizes, and appends new ones.
+static void TestMergeListing() {
+  View v;
+  v.entries = {Listed(L"big", 900), Listed(L"gone", 500), Listed(L"small", 10)};
+  v.rows.resize(3);
+  std::vector<Entry> listed = {Listed(L"new"), Listed(L"small"), Listed(L"big")};
+  CHECK(MergeListing(v, listed) == 2);
+  CHECK(EntryNames(v) == std::vector<wstring>({L"big", L"small", L"new"}));
+  CHECK(v.entries[0].bytes == 900 && v.entries[1].bytes == 10 && !v.entries[2].has_value);
+  CHECK(v.rows.empty());
+
+  v.rows.resize(3);
+  listed = {Listed(L"small"), Listed(L"new"), Listed(L"big")};
+  CHECK(MergeListing(v, listed) == wstring::npos);
+  CHECK(EntryNames(v) == std::vector<wstring>({L"big", L"small", L"new"}) && v.rows.size() == 3);
+
+  // Only removals still count as a change; nothing new is left to size.
+  listed = {Listed(L"new")};
+  CHECK(MergeListing(v, listed) == 1);
+  CHECK(EntryNames(v) == std::vector<wstring>({L"new"}));
+}
+
+// The lister publishes a folder's subdirectories, and only those, then marks it done.
+static void TestReadListing() {
+  const wstring base = TempFile(L"DirPie4_tests_list");
+  MakeDiskTree(base, WALK_TREE);
+  Listing l;
+  l.dir = base;
+  ReadListing(l);
+  std::vector<wstring> names;
+  {
+    std::lock_guard<std::mutex> lk(g_mu);
+    for (const Entry& e : l.pending) names.push_back(e.name);
+    CHECK(l.done && l.error == 0);
+  }
+  std::sort(names.begin(), names.end());
+  CHECK(names == std::vector<wstring>({L"sub1", L"sub2"}));
+
+  Listing missing;
+  missing.dir = base + L"\\nowhere";
+  ReadListing(missing);
+  CHECK(missing.done && missing.error != 0 && missing.pending.empty());
+  RemoveDiskTree(base, WALK_TREE);
+}
+
+// ---------------------------------------------------------------------------
+// Prefetch
+// ---------------------------------------------------------------------------
+
+// Prefetch walks wait in the idle queue, become real work when a view asks for the same
+// folder, and are cancelled when real work is waiting on a full device.
+static void TestPrefetchYields() {
+  g_quit.store(true);  // queue jobs without starting workers
+  const int device = DeviceForPath(L"C:\\prefetch");
+  const uint32_t queued = g_jobs_queued.load();
+  const uint32_t done = g_jobs_done.load();
+  QueueSpeculative(L"C:\\prefetch\\a", JobKind::Capped, device);
+  QueueSpeculative(L"C:\\prefetch\\a", JobKind::Capped, device);
+  std::shared_ptr<JobTicket> a;
+  {
+    std::lock_guard<std::mutex> lk(g_jobMu);
+    const Device& d = *g_devices[device];
+    CHECK(d.idleJobs.size() == 1 && d.jobs.empty());
+    a = g_tickets[L"C:\\prefetch\\a"];
+  }
+  CHECK(a && a->speculative.load());
+
+  View v;
+  RequestSize(v, L"C:\\prefetch\\a", device);
+  CHECK(v.tickets.size() == 1 && v.tickets[0] == a && !a->speculative.load());
+
+  QueueSpeculative(L"C:\\prefetch\\b", JobKind::Capped, device);
+  {
+    std::lock_guard<std::mutex> lk(g_jobMu);
+    Device& d = *g_devices[device];
+    CHECK(d.jobs.size() == 1 && d.idleJobs.size() == 1);
+    const std::shared_ptr<JobTicket> b = g_tickets[L"C:\\prefetch\\b"];
+    const int active = d.active;
+    d.active = d.limit;
+    Job j;
+    CHECK(!TakeJob(j));
+    CHECK(b && b->cancelled.load() && !a->cancelled.load());
+    CHECK(d.idleJobs.empty() && d.speculative.empty() && g_tickets.count(L"C:\\prefetch\\b") == 0);
+    d.active = active;
+    CHECK(TakeJob(j) && j.path == L"C:\\prefetch\\a");
+    d.active = active;
+  }
+  ReleaseRequests(v);
+  g_jobs_queued.store(queued);
+  g_jobs_done.store(done);
+  g_quit.store(false);
+}
+
+// ---------------------------------------------------------------------------
+// View cache
+// ---------------------------------------------------------------------------
+
+// Leaves the folder dir with n shown children, as StartAnalyze does before navigating.
+static void LeaveFolder(View& v, const wstring& dir, size_t n) {
+  v.currentDir = dir;
+  v.entries.assign(n, Entry{});
+  v.rows.assign(n, ListRow{});
+  RememberView(v);
+}
+
+static void TestViewCache() {
+  View v;
+  // Most recent first; coming back to a folder moves it to the front.
+  LeaveFolder(v, L"C:\\a", 1);
+  LeaveFolder(v, L"C:\\b", 2);
+  LeaveFolder(v, L"C:\\A", 3);
+  CHECK(v.recent.size() == 2 && v.recent[0].dir == L"C:\\A" && v.recent[0].entries.size() == 3);
+  CHECK(v.entries.empty() && v.rows.empty());
+
+  // A view still listing, or with rows out of step with its entries, is not kept.
+  v.currentDir = L"C:\\c";
+  v.entries.assign(2, Entry{});
+  RememberView(v);
+  CHECK(v.recent.size() == 2);
+  v.entries.clear();
+
+  // At most VIEW_CACHE_MAX folders, and the oldest go first.
+  for (size_t i = 0; i < VIEW_CACHE_MAX + 4; ++i) LeaveFolder(v, L"C:\\n" + std::to_wstring(i), 1);
+  CHECK(v.recent.size() == VIEW_CACHE_MAX);
+  CHECK(v.recent.back().dir == L"C:\\n4");
+
+  // ...and at most VIEW_CACHE_MAX_ENTRIES children across them, so a bigger folder is not kept.
+  LeaveFolder(v, L"C:\\huge", VIEW_CACHE_MAX_ENTRIES - 1);
+  CHECK(v.recent.size() == 2 && v.recent[0].dir == L"C:\\huge");
+  LeaveFolder(v, L"C:\\bigger", VIEW_CACHE_MAX_ENTRIES + 1);
+  CHECK(v.recent.empty());
+
+  // Taking a view removes it; one drawn with other pie settings is dropped, not shown.
+  CachedView c;
+  LeaveFolder(v, L"C:\\x", 1);
+  LeaveFolder(v, L"C:\\y", 1);
+  CHECK(TakeCachedView(v, L"c:\\X", c) && c.dir == L"C:\\x" && v.recent.size() == 1);
+  CHECK(!TakeCachedView(v, L"C:\\x", c));
+  v.coldBucket++;
+  CHECK(!TakeCachedView(v, L"C:\\y", c) && v.recent.empty());
+}
+
+// ---------------------------------------------------------------------------
+// Hard links
+// ---------------------------------------------------------------------------
+
+// Runs an exact walk of dir as a worker would and returns what it cached.
+static SizeInfo WalkJob(const wstring& dir, WalkScratch& scratch) {
+  g_jobs_queued.fetch_add(1);
+  RunJob(Job{nullptr, dir, JobKind::Exact, DeviceForPath(dir)}, scratch);
+  std::lock_guard<std::mutex> lk(g_mu);
+  return g_cache[dir];
+}
+
+// Two backup folders sharing a file, walked as sibling jobs the way a view sizes the
+// children of their parent.
+static void TestLinksAcrossSiblingJobs() {
+  const wstring base = TempFile(L"DirPie4_tests_links");
+  const wstring a = base + L"\\daily.0";
+  const wstring b = base + L"\\daily.1";
+  const std::vector<uint8_t> data(64 * 1024, 'x');
+  CreateDirectoryW(base.c_str(), nullptr);
+  CreateDirectoryW(a.c_str(), nullptr);
+  CreateDirectoryW(b.c_str(), nullptr);
+  CHECK(WriteBytes(a + L"\\shared", data));
+  CHECK(WriteBytes(a + L"\\own", data));
+  CHECK(WriteBytes(b + L"\\own", data));
+  const bool linked = CreateHardLinkW((b + L"\\shared").c_str(), (a + L"\\shared").c_str(), nullptr) != 0;
+
+  if (!linked || !ProbeLinkVolume(base).links || !GetNtApi().queryByName) {
+    std::fprintf(stderr, "hard links: not supported under %ls, skipped\n", base.c_str());
+  } else {
+    WalkScratch scratch;
+    const SizeInfo s0 = WalkJob(a, scratch);
+    const SizeInfo s1 = WalkJob(b, scratch);
+    const uint64_t file = s0.content.allocated / 2;
+    CHECK(file >= data.size());
+    CHECK(s0.bytes == 2 * data.size() && s1.bytes == 2 * data.size());
+    CHECK(s0.stats.dup_links == 0);
+    CHECK(s1.content.allocated == file && s1.stats.dup_links == 1);
+
+    // The sibling walked again still leaves the shared file to the first one.
+    CHECK(WalkJob(b, scratch).content.allocated == file);
+    // A walk of the parent counts it once, and one of a folder it covers counts it again.
+    const SizeInfo all = WalkJob(base, scratch);
+    CHECK(all.bytes == 4 * data.size());
+    CHECK(all.content.allocated == 3 * file && all.stats.dup_links == 1);
+    CHECK(WalkJob(a, scratch).content.allocated == 2 * file);
+  }
+
+  for (const wstring& f : {a + L"\\shared", a + L"\\own", b + L"\\shared", b + L"\\own"}) DeleteFileW(f.c_str());
+  RemoveDirectoryW(a.c_str());
+  RemoveDirectoryW(b.c_str());
+  RemoveDirectoryW(base.c_str());
+  ClearTrees();
+  std::lock_guard<std::mutex> lk(g_mu);
+  g_cache.clear();
+}
+
+// ---------------------------------------------------------------------------
+// Directory links
+// ---------------------------------------------------------------------------
+
+static DirId Dir(DWORD volume, uint64_t file) {
+  DirId id;
+  id.volume = volume;
+  id.file = file;
+  return id;
+}
+
+// A link target is entered once, and never when it lies inside or around the root or a
+// target already entered, so links cannot make a walk loop or count a tree twice.
+static void TestAdmitLinkTarget() {
+  FollowedDirs f;
+  CHECK(AdmitLinkTarget(f, Dir(1, 10), L"c:\\data"));  // the root, as EnterLink seeds it
+  CHECK(!AdmitLinkTarget(f, Dir(1, 11), L"c:\\data\\sub"));
+  CHECK(!AdmitLinkTarget(f, Dir(1, 12), L"c:\\"));
+  CHECK(AdmitLinkTarget(f, Dir(1, 13), L"c:\\other"));
+  CHECK(!AdmitLinkTarget(f, Dir(1, 13), L"c:\\other"));
+  CHECK(!AdmitLinkTarget(f, Dir(1, 14), L"c:\\other\\deep"));
+  CHECK(AdmitLinkTarget(f, Dir(1, 15), L"c:\\database"));
+  // Shares have no final path; the file ID alone decides, per volume.
+  CHECK(AdmitLinkTarget(f, Dir(2, 10), wstring()));
+  CHECK(!AdmitLinkTarget(f, Dir(2, 10), wstring()));
+  CHECK(f.paths.size() == 3);
+}
+
+// ---------------------------------------------------------------------------
+// Timeline
+// ---------------------------------------------------------------------------
+
+static size_t CountOf(const std::string& s, const std::string& what) {
+  size_t n = 0;
+  for (size_t at = s.find(what); at != std::string::npos; at = s.find(what, at + 1)) n++;
+  return n;
+}
+
+// A thread's ring keeps its last TIMELINE_RING_EVENTS events, written out as Chrome
+// trace-event JSON with the thread named and each path's tail as an argument.
+static void TestTimelineJson() {
+  const wstring longPath = L"C:\\Users\\someone\\AppData\\Local\\Packages\\a-long-package-name\\LocalState";
+  std::thread([&] {
+    NameThread("timeline-test");
+    for (uint64_t i = 0; i < TIMELINE_RING_EVENTS + 2; ++i) {
+      TimelineRecord("walk", TimelineStart() + i, 5, L"C:\\a\"b");
+    }
+    TimelineRecord("stalled", TimelineStart() + 7, TIMELINE_INSTANT, longPath);
+  }).join();
+
+  const wstring path = TempFile(L"DirPie4_tests_timeline.json");
+  CHECK(WriteTimeline(path));
+  const std::vector<uint8_t> bytes = ReadBytes(path);
+  const std::string json(bytes.begin(), bytes.end());
+  CHECK(json.compare(0, 39, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[") == 0);
+  CHECK(json.size() > 4 && json.compare(json.size() - 4, 4, "\n]}\n") == 0);
+  CHECK(CountOf(json, "\"name\":\"thread_name\",\"args\":{\"name\":\"timeline-test\"}") == 1);
+  // Two walks and the mark pushed the three oldest walks out.
+  CHECK(CountOf(json, "\"name\":\"walk\"") == TIMELINE_RING_EVENTS - 1);
+  CHECK(CountOf(json, "\"ts\":2,\"dur\":5,") == 0 && CountOf(json, "\"ts\":3,\"dur\":5,") == 1);
+  CHECK(CountOf(json, "\"args\":{\"path\":\"C:\\\\a\\\"b\"}") == TIMELINE_RING_EVENTS - 1);
+  const std::string tail = ToUtf8(longPath.substr(longPath.size() - TIMELINE_ARG_CHARS));
+  CHECK(CountOf(json, "{\"ph\":\"i\",\"s\":\"t\",\"pid\":1,") == 1);
+  CHECK(CountOf(json, "\"ts\":7,\"name\":\"stalled\",\"args\":{\"path\":" + JsonString(FromUtf8(tail)) + "}}") == 1);
+  DeleteFileW(path.c_str());
+
+  std::lock_guard<std::mutex> lk(g_timelineMu);
+  g_timelineRings.clear();
+}
+
+// ---------------------------------------------------------------------------
+// Metrics
+// ---------------------------------------------------------------------------
+
+static bool Contains(const std::string& s, const std::string& what) {
+  return s.find(what) != std::string::npos;
+}
+
+static void TestMetricsExport() {
+  MetricsSample m;
+  m.entries = 1500;
+  m.dirs = 40;
+  m.bytes = 1ull << 40;
+  m.entriesPerSec = 250;
+  m.skipped[0] = 3;                 // access
+  m.skipped[SKIP_REASONS - 1] = 1;  // stalled
+  const std::vector<ThreadJob> jobs = {{"worker", 7, "exact walk", L"C:\\a \"b\"", 1500},
+                                       {"lister", 9, "list", L"D:\\", 20}};
+
+  const std::string text = MetricsText(m, jobs);
+  CHECK(Contains(text, "# TYPE dirpie_entries_total counter\ndirpie_entries_total 1500\n"));
+  CHECK(Contains(text, "\ndirpie_bytes_total 1099511627776\n"));
+  CHECK(Contains(text, "\ndirpie_entries_per_second 250\n"));
+  CHECK(Contains(text, "dirpie_skipped_total{reason=\"access\"} 3\n"));
+  CHECK(Contains(text, "dirpie_skipped_total{reason=\"stalled\"} 1\n"));
+  CHECK(Contains(text, "\ndirpie_workers_busy 1\n"));
+  CHECK(Contains(text, "dirpie_thread_job_seconds{thread=\"worker\",tid=\"7\",job=\"exact walk\","
+                       "path=\"C:\\\\a \\\"b\\\"\"} 1.500\n"));
+  CHECK(Contains(text, "dirpie_thread_job_seconds{thread=\"lister\",tid=\"9\",job=\"list\","
+                       "path=\"D:\\\\\"} 0.020\n"));
+  CHECK(text.back() == '\n');
+
+  const std::string json = StatusJson(m, jobs);
+  CHECK(json.rfind("{\"entries\":1500,\"directories\":40,\"bytes\":1099511627776,", 0) == 0);
+  CHECK(Contains(json, ",\"entries_per_second\":250.0,"));
+  CHECK(Contains(json, "\"skipped\":{\"access\":3,\"path\":0,"));
+  CHECK(Contains(json, ",\"stalled\":1},\"threads\":[{\"thread\":\"worker\",\"tid\":7,\"job\":\"exact walk\","
+                       "\"ms\":1500,\"path\":\"C:\\\\a \\\"b\\\"\"},{\"thread\":\"lister\""));
+  CHECK(json.size() > 4 && json.compare(json.size() - 4, 4, "}]}\n") == 0);
+  CHECK(CountOf(json, "{") == CountOf(json, "}"));
+  CHECK(Contains(StatusJson(MetricsSample{}, {}), "\"threads\":[]}\n"));
+}
+
+// ---------------------------------------------------------------------------
+// Index service
+// ---------------------------------------------------------------------------
+
+static SizeInfo Sized(uint64_t bytes, bool exact, bool estimate, bool capped, bool incomplete, uint64_t tick) {
+  SizeInfo si{};
+  si.bytes = bytes;
+  si.exact = exact;
+  si.estimate = estimate;
+  si.incomplete = incomplete;
+  si.stats.reached_cap = capped;
+  si.stats.incomplete = incomplete;
+  si.tick = tick;
+  return si;
+}
+
+// Exact beats capped beats estimate, and among equals the newer result wins.
+static void TestCachePrecedence() {
+  const SizeInfo exact = Sized(500, true, false, false, false, 10);
+  const SizeInfo capped = Sized(300, false, false, true, false, 20);
+  const SizeInfo estimate = Sized(400, false, true, false, false, 20);
+  const SizeInfo walked = Sized(450, false, false, false, false, 20);  // a capped job that finished
+
+  CHECK(!ReplacesCached(exact, capped));
+  CHECK(!ReplacesCached(exact, estimate));
+  CHECK(!ReplacesCached(exact, Sized(500, false, false, false, true, 20)));
+  CHECK(ReplacesCached(exact, walked));
+  CHECK(ReplacesCached(exact, Sized(520, true, false, false, false, 20)));
+  CHECK(!ReplacesCached(exact, Sized(520, true, false, false, false, 5)));
+
+  CHECK(!ReplacesCached(capped, estimate));
+  CHECK(ReplacesCached(capped, Sized(310, false, false, true, false, 30)));
+  CHECK(ReplacesCached(estimate, Sized(410, false, true, false, false, 30)));
+  CHECK(ReplacesCached(estimate, walked));
+  // A capped walk that stopped below the estimate keeps the estimate up.
+  CHECK(!ReplacesCached(estimate, capped));
+  CHECK(ReplacesCached(estimate, Sized(400, false, false, true, false, 30)));
+  // An exact walk that hit errors is not final and gives way to anything newer.
+  CHECK(ReplacesCached(Sized(500, true, false, false, true, 10), capped));
+}
+
+// What a window reads back from an UPDATE line keeps the flags precedence needs.
+static void TestIndexRecord() {
+  const SizeInfo capped = Sized(300, false, false, true, false, 20);
+  wstring path;
+  SizeInfo si{};
+  bool final = true, pending = true;
+  CHECK(ParseIndexRecord(IndexRecord(L"C:\\data", &capped), path, si, final, pending));
+  CHECK(path == L"C:\\data" && si.bytes == 300 && si.stats.reached_cap && !si.exact && !si.estimate);
+  CHECK(!final && !pending);
+
+  const SizeInfo exact = Sized(500, true, false, false, false, 10);
+  CHECK(ParseIndexRecord(IndexRecord(L"C:\\data", &exact), path, si, final, pending));
+  CHECK(si.exact && !si.stats.reached_cap && final && !pending);
+
+  CHECK(ParseIndexRecord(IndexRecord(L"C:\\data", nullptr), path, si, final, pending));
+  CHECK(pending);
+  CHECK(!ParseIndexRecord("12\t3", path, si, final, pending));
+}
+
+// ---------------------------------------------------------------------------
+// Shared engine
+// ---------------------------------------------------------------------------
+
+static size_t QueuedFor(const wstring& path) {
+  std::lock_guard<std::mutex> lk(g_jobMu);
+  size_t n = 0;
+  for (const auto& d : g_devices) {
+    for (const Job& j : d->jobs) n += j.path == path;
+    for (const Job& j : d->idleJobs) n += j.path == path;
+  }
+  return n;
+}
+
+// Two windows asking for the same folder share one walk, which is cancelled only
+// when the last of them leaves.
+static void TestViewsShareWalks() {
+  g_quit.store(true);  // queue jobs without starting workers
+  const wstring path = L"C:\\shared";
+  const int device = DeviceForPath(path);
+  const uint32_t queued = g_jobs_queued.load();
+  View a, b;
+  RequestSize(a, path, device);
+  RequestSize(b, path, device);
+  CHECK(QueuedFor(path) == 1);
+  CHECK(a.tickets.size() == 1 && a.tickets[0] == b.tickets[0] && a.tickets[0]->refs.load() == 2);
+
+  const std::shared_ptr<JobTicket> t = a.tickets[0];
+  ReleaseRequests(a);
+  CHECK(!t->cancelled.load() && t->refs.load() == 1 && QueuedFor(path) == 1);
+  ReleaseRequests(b);
+  CHECK(t->cancelled.load() && QueuedFor(path) == 0);
+  CHECK(g_jobs_queued.load() == queued);
+  {
+    std::lock_guard<std::mutex> lk(g_jobMu);
+    CHECK(g_tickets.count(path) == 0);
+  }
+  g_quit.store(false);
+}
+
+int wmain() {
+  TestSizeHistogram();
+  TestParseQuery();
+  TestRunQuery();
+  TestQuerySkipsNestedTrees();
+  TestSnapshotRoundTrip();
+  TestSnapshotRejectsCorruptInput();
+  TestDiffSnapshots();
+  TestExcludeRules();
+  TestFindEither();
+  TestImportFind();
+  TestImportDu();
+  TestImportNcdu();
+  TestTuneDevice();
+  TestWalkTree();
+  TestWalkScratchReuse();
+  TestFrontierEstimate();
+  TestEstimateSmallTree();
+  TestTraceRoundTrip();
+  TestCheckStalls();
+  TestCancelReadsForExit();
+  TestComputeSlices();
+  TestRefreshCoalescing();
+  TestMergeListing();
+  TestReadListing();
+  TestPrefetchYields();
+  TestViewCache();
+  TestLinksAcrossSiblingJobs();
+  TestAdmitLinkTarget();
+  TestTimelineJson();
+  TestMetricsExport();
+  TestCachePrecedence();
+  TestIndexRecord();
+  TestViewsShareWalks();
+
+#ifdef DIRPIE_SSE2
+  const char* variant = "SSE2";
+#else
+  const char* variant = "scalar";
+#endif
+#ifdef DIRPIE_ALLOC_STATS
+  const char* counting = " counting allocations";
+#else
+  const char* counting = "";
+#endif
+  const char* walker = ConfiguredWalkBackend() == WalkBackend::HandleRelative ? "handle-relative" : "path-based";
+  std::fprintf(stderr, "%s%s, %s walker: %d checks, %d failed\n", variant, counting, walker, g_checks, g_failures);
+  return g_failures ? 1 : 0;
+}